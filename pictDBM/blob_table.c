@@ -0,0 +1,220 @@
+/**
+ * @file blob_table.c
+ * @brief pictDB library: table of the contents shared by the pictures
+ *
+ * The pictures with the same SHA reference the same blob, which counts its
+ * references: a deleted picture only frees the images of its blob when it
+ * was its last reference, and a resized image is recorded once for all of
+ * them. The bitset of the used blobs is stored in the index of the IDs, so
+ * that do_open_lazy does not read the table. The table is followed by the
+ * free extents (see free_extents.c) and by the resolutions (see
+ * resolutions.c).
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+/**
+ * @brief Allocates the content of the blob table and the free extents.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+static int alloc_blob_table(struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    //The pages of the blobs and of the extents are only touched when used
+    db_file->blobs = calloc(max_files + 1, sizeof(struct pict_blob));
+    db_file->used_blobs = calloc(NB_VALID_WORDS(max_files) + 1, sizeof(uint64_t));
+    db_file->extents = calloc(EXTENT_TABLE_CAPACITY(max_files), sizeof(struct pict_extent));
+    if((NULL == db_file->blobs) || (NULL == db_file->used_blobs) || (NULL == db_file->extents)) {
+        free_blob_table(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Allocates an empty blob table located right after the index of the IDs.
+ */
+int init_blob_table(struct pictdb_file* db_file)
+{
+    if(NULL == db_file) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const int errorCode = alloc_blob_table(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    const size_t max_files = db_file->header.max_files;
+    db_file->blob_table.offset = ID_INDEX_OFFSET(max_files) + ID_INDEX_SIZE(max_files);
+    db_file->blob_table.nb_blobs = 0;
+    db_file->blob_table.nb_extents = 0;
+    return 0;
+}
+
+/********************************************************************//**
+ * Reads the location of the blob table and, unless lazy, all its blobs.
+ */
+int read_blob_table(struct pictdb_file* db_file, int lazy)
+{
+    const size_t max_files = db_file->header.max_files;
+    if(1 != fread(&db_file->blob_table, sizeof(struct pict_blob_table), 1, db_file->fpdb)) {
+        return ERR_IO;
+    }
+    if((db_file->blob_table.nb_blobs > max_files) ||
+       (db_file->blob_table.nb_extents > EXTENT_TABLE_CAPACITY(max_files))) {
+        return ERR_IO;
+    }
+    int errorCode = alloc_blob_table(db_file);
+    if(0 == errorCode) {
+        errorCode = read_free_extents(db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = read_resolution_table(db_file);
+    }
+    if((0 != errorCode) || lazy) {
+        return errorCode;
+    }
+
+    const long position = ftell(db_file->fpdb);
+    if((-1 == position) || (0 != fseek(db_file->fpdb, db_file->blob_table.offset, SEEK_SET)) ||
+       (fread(db_file->blobs, sizeof(struct pict_blob), max_files, db_file->fpdb) != max_files) ||
+       (0 != fseek(db_file->fpdb, position, SEEK_SET))) {
+        free_blob_table(db_file);
+        return ERR_IO;
+    }
+    //The references are checked against the metadata by check_pict_blob
+    size_t nb_blobs = 0;
+    for(size_t blob = 0; blob < max_files; ++blob) {
+        if(0 != db_file->blobs[blob].refcount) {
+            db_file->used_blobs[blob / VALID_WORD_BITS] |= UINT64_C(1) << (blob % VALID_WORD_BITS);
+            ++nb_blobs;
+        }
+    }
+    db_file->blob_table.nb_blobs = nb_blobs;
+    return 0;
+}
+
+/********************************************************************//**
+ * Frees the content of the blob table.
+ */
+void free_blob_table(struct pictdb_file* db_file)
+{
+    free(db_file->blobs);
+    db_file->blobs = NULL;
+    free(db_file->used_blobs);
+    db_file->used_blobs = NULL;
+    free(db_file->extents);
+    db_file->extents = NULL;
+}
+
+/********************************************************************//**
+ * Tests if a valid metadata references a used blob.
+ */
+int check_pict_blob(const struct pictdb_file* db_file, const struct pict_metadata* metadata)
+{
+    if((NON_EMPTY == metadata->is_valid) &&
+       ((metadata->blob >= db_file->header.max_files) || !IS_USED_BLOB(db_file, metadata->blob))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Takes the first free blob.
+ */
+int new_blob(struct pictdb_file* db_file, size_t* blob)
+{
+    const size_t max_files = db_file->header.max_files;
+    const size_t nb_words = NB_VALID_WORDS(max_files);
+    size_t free_blob = max_files;
+    for(size_t word = 0; (word < nb_words) && (free_blob == max_files); ++word) {
+        const uint64_t unused = ~db_file->used_blobs[word];
+        if(0 != unused) {
+            const size_t index = word * VALID_WORD_BITS + __builtin_ctzll(unused);
+            free_blob = index < max_files ? index : max_files;
+        }
+    }
+    if(free_blob >= max_files) {
+        return ERR_FULL_DATABASE;
+    }
+    memset(&db_file->blobs[free_blob], 0, sizeof(struct pict_blob));
+    db_file->blobs[free_blob].refcount = 1;
+    db_file->used_blobs[free_blob / VALID_WORD_BITS] |= UINT64_C(1) << (free_blob % VALID_WORD_BITS);
+    ++db_file->blob_table.nb_blobs;
+    //A blob not read from the file yet would be overwritten by load_blob
+    if(NULL != db_file->pager) {
+        db_file->pager->loaded_blobs[free_blob / VALID_WORD_BITS] |= UINT64_C(1) << (free_blob % VALID_WORD_BITS);
+    }
+    *blob = free_blob;
+    return 0;
+}
+
+/********************************************************************//**
+ * Removes a reference to a blob.
+ */
+void release_blob(struct pictdb_file* db_file, size_t blob)
+{
+    struct pict_blob* content = &db_file->blobs[blob];
+    if(0 == content->refcount) {
+        return;
+    }
+    --content->refcount;
+    if(0 == content->refcount) {
+        db_file->used_blobs[blob / VALID_WORD_BITS] &= ~(UINT64_C(1) << (blob % VALID_WORD_BITS));
+        --db_file->blob_table.nb_blobs;
+        //The images of the freed blob are dead until they are written again
+        for(size_t res = 0; res < NB_RES; ++res) {
+            const uint64_t size = content->size[res];
+            db_file->header.live_bytes -= (size < db_file->header.live_bytes) ? size : db_file->header.live_bytes;
+            db_file->header.dead_bytes += size;
+        }
+    }
+}
+
+/********************************************************************//**
+ * Writes the location of the blob table.
+ */
+int write_blob_table_location(const struct pictdb_file* db_file)
+{
+    if((0 != fseek(db_file->fpdb, sizeof(struct pictdb_header) + sizeof(struct pict_id_heap), SEEK_SET)) ||
+       (1 != fwrite(&db_file->blob_table, sizeof(struct pict_blob_table), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the location and all the blobs of the blob table.
+ */
+int write_blob_table(const struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    if((0 != fseek(db_file->fpdb, db_file->blob_table.offset, SEEK_SET)) ||
+       (fwrite(db_file->blobs, sizeof(struct pict_blob), max_files, db_file->fpdb) != max_files)) {
+        return ERR_IO;
+    }
+    int errorCode = write_free_extents(db_file);
+    if(0 == errorCode) {
+        errorCode = write_resolution_table(db_file);
+    }
+    return (0 != errorCode) ? errorCode : write_blob_table_location(db_file);
+}
+
+/********************************************************************//**
+ * Writes one blob and its bit of the used blobs.
+ */
+int write_db_file_blob(const struct pictdb_file* db_file, size_t blob)
+{
+    const size_t word = blob / VALID_WORD_BITS;
+    if((0 != fseek(db_file->fpdb, db_file->blob_table.offset + blob * sizeof(struct pict_blob), SEEK_SET)) ||
+       (1 != fwrite(&db_file->blobs[blob], sizeof(struct pict_blob), 1, db_file->fpdb)) ||
+       (0 != fseek(db_file->fpdb, USED_BLOBS_OFFSET(db_file->header.max_files) + word * sizeof(uint64_t), SEEK_SET)) ||
+       (1 != fwrite(&db_file->used_blobs[word], sizeof(uint64_t), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return write_blob_table_location(db_file);
+}
@@ -12,8 +12,12 @@
 #include "pictDB.h"
 
 /********************************************************************//**
- * Creates the database called db_filename. Writes the header and the
- * preallocated empty metadata array to database file.
+ * Creates the database called db_filename. Writes the header, the
+ * preallocated empty metadata array, the index of the IDs, the blob table
+ * with the resolutions, the location of the empty region of the
+ * thumbnails, the string heap and the hash tables to database file, and
+ * creates the empty cache file of the resized images if the database has a
+ * derivative cache.
  */
 int do_create(const char* db_filename, struct pictdb_file* db_file)
 {
@@ -26,13 +30,30 @@ int do_create(const char* db_filename, struct pictdb_file* db_file)
     if((NULL == db_filename) || (NULL == db_file)) {
         return ERR_INVALID_ARGUMENT;
     }
+    if((db_file->resolutions.nb_res < NB_DEFAULT_RES) || (db_file->resolutions.nb_res > NB_RES)) {
+        return ERR_RESOLUTIONS;
+    }
     //Initialise the DB header
     strncpy(db_file->header.db_name, CAT_TXT,  MAX_DB_NAME);
     db_file->header.db_name[MAX_DB_NAME] = '\0';
     db_file->header.db_version = 0;
     db_file->header.num_files = 0;
-    db_file->header.unused_32 = 0;
-    db_file->header.unused_64 = 0;
+    db_file->header.format_version = PICTDB_FORMAT_VERSION;
+    db_file->header.live_bytes = 0;
+    db_file->header.dead_bytes = 0;
+
+    db_file->ids = NULL;
+    db_file->blobs = NULL;
+    db_file->used_blobs = NULL;
+    db_file->extents = NULL;
+    db_file->direct_fd = -1;
+    db_file->cache = NULL;
+    //The region of the thumbnails is reserved with the first thumbnail
+    memset(&db_file->thumbs, 0, sizeof(struct pict_thumb_region));
+    memset(&db_file->columns, 0, sizeof(struct metadata_columns));
+    db_file->pager = NULL;
+    db_file->nb_buckets = 0;
+    db_file->buckets = NULL;
 
     //Allocating dynamiclly the DB metadata
     db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
@@ -44,6 +65,16 @@ int do_create(const char* db_filename, struct pictdb_file* db_file)
     for(size_t i = 0; i < db_file->header.max_files; ++i) {
         db_file->metadata[i].is_valid = EMPTY;
     }
+    if((0 != init_blob_table(db_file)) ||
+       (0 != init_pict_id_heap(db_file, 1 + db_file->header.max_files * DEFAULT_ID_HEAP_SIZE)) ||
+       (0 != build_metadata_columns(db_file)) || (0 != build_hash_index(db_file))) {
+        free(db_file->metadata);
+        db_file->metadata = NULL;
+        free_pict_id_heap(db_file);
+        free_blob_table(db_file);
+        free_metadata_columns(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
 
     //Initialise the DB fpdb
     db_file->fpdb = NULL;
@@ -59,11 +90,61 @@ int do_create(const char* db_filename, struct pictdb_file* db_file)
             do_close(db_file);
             return ERR_IO;
         }
+        if((0 != write_pict_id_heap(db_file)) || (0 != write_blob_table(db_file)) ||
+           (0 != write_thumb_region_location(db_file)) || (0 != fseek(db_file->fpdb, METADATA_OFFSET, SEEK_SET))) {
+            do_close(db_file);
+            return ERR_IO;
+        }
         if(fwrite(db_file->metadata, sizeof(struct pict_metadata), db_file->header.max_files, db_file->fpdb) != db_file->header.max_files) {
             //error with fwrite
             do_close(db_file);
             return ERR_IO;
         }
-        return 0;
+        if((0 != write_id_index(db_file)) || (0 != write_hash_index(db_file))) {
+            do_close(db_file);
+            return ERR_IO;
+        }
+        //The cache file of the resized images starts empty
+        const int errorCode = open_derivative_cache(db_file, db_filename, "wb+");
+        if(0 != errorCode) {
+            do_close(db_file);
+        }
+        return errorCode;
+    }
+}
+
+/********************************************************************//**
+ * Sets the alignment of the images of a database to create.
+ */
+int set_alignment(struct pictdb_header* header, uint32_t alignment)
+{
+    if((NULL == header) || (alignment < MIN_ALIGNMENT) || (alignment > MAX_ALIGNMENT) ||
+       (0 != (alignment & (alignment - 1)))) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    uint64_t shift = 0;
+    while((UINT32_C(1) << shift) < alignment) {
+        ++shift;
+    }
+    header->features = (header->features & ~PICTDB_ALIGNMENT_MASK) | PICTDB_FEATURE_ALIGNED |
+                       (shift << PICTDB_ALIGNMENT_SHIFT);
+    return 0;
+}
+
+/********************************************************************//**
+ * Sets the budget of the derivative cache of a database to create.
+ */
+int set_derivative_cache(struct pictdb_header* header, uint64_t budget)
+{
+    if((NULL == header) || (budget < MIN_CACHE_SIZE) || (budget > MAX_CACHE_SIZE) ||
+       (0 != (budget & (budget - 1)))) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    uint64_t shift = 0;
+    while((UINT64_C(1) << shift) < budget) {
+        ++shift;
     }
+    header->features = (header->features & ~PICTDB_CACHE_MASK) | PICTDB_FEATURE_DERIVATIVE_CACHE |
+                       (shift << PICTDB_CACHE_SHIFT);
+    return 0;
 }
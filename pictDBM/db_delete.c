@@ -6,12 +6,13 @@
  */
 
 #include "pictDB.h"
+#include "metrics.h"
+#include "trace.h"
 
-/********************************************************************//**
- * Deletes the picture referenced by pict_id in the database db_file.
- *
+/**
+ * @brief Deletes the picture referenced by pict_id, see do_delete.
  */
-int do_delete(const char* pictID, struct pictdb_file* db_file)
+static int delete_image(const char* pictID, struct pictdb_file* db_file)
 {
     //In this project, pictDBM, we made the decision to return the error
     //ERR_INVALID_ARGUMENT because we did not found a better one and
@@ -45,6 +46,17 @@ int do_delete(const char* pictID, struct pictdb_file* db_file)
         return ERR_IO;
     }
 
+    //The images are freed when the blob is no more referenced
+    const size_t blob = pict_to_delete->blob;
+    release_blob(db_file, blob);
+    if(0 != write_db_file_blob(db_file, blob)) {
+        return ERR_IO;
+    }
+    if((0 == db_file->blobs[blob].refcount) &&
+       ((0 != free_blob_images(db_file, blob)) || (0 != drop_cached_images(db_file, blob)))) {
+        return ERR_IO;
+    }
+
     //Modifiy header
     db_file->header.db_version += 1;
     db_file->header.num_files -= 1;
@@ -53,5 +65,19 @@ int do_delete(const char* pictID, struct pictdb_file* db_file)
     if(0 != write_db_file_header(db_file)) {
         return ERR_IO;
     }
-    return 0;
+    return remove_from_hash_index(db_file, i);
+}
+
+/********************************************************************//**
+ * Deletes the picture referenced by pict_id in the database db_file.
+ *
+ */
+int do_delete(const char* pictID, struct pictdb_file* db_file)
+{
+    const double start = metrics_now();
+    TRACE_BEGIN(span, "do_delete");
+    const int errorCode = delete_image(pictID, db_file);
+    TRACE_END(span);
+    metrics_observe(OP_DO_DELETE, start);
+    return errorCode;
 }
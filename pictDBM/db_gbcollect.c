@@ -6,17 +6,157 @@
  */
 
 #include "image_content.h"
+#include "metrics.h"
+#include "trace.h"
 
-/********************************************************************//**
- * Create a new database file without the deleted image
+/**
+ * @brief Copies one image of a blob at the end of the temporary database.
+ *
+ * @param db_file The database
+ * @param blob The index of the blob in db_file
+ * @param res The resolution of the image
+ * @param tmpdb_file The temporary database
+ * @param new_blob The index of the copy of the blob in tmpdb_file
+ *
+ * @return Returns 0 in case of success
  */
-int do_gbcollect(struct pictdb_file* db_file, const char* db_filename, const char* tmpdb_filename)
+static int copy_blob_image(const struct pictdb_file* db_file, size_t blob, size_t res,
+                           struct pictdb_file* tmpdb_file, size_t new_blob)
+{
+    const struct pict_blob* content = &db_file->blobs[blob];
+    if(0 != fseek(db_file->fpdb, content->offset[res], SEEK_SET)) {
+        return ERR_IO;
+    }
+    char* image_buffer = NULL;
+    int errorCode = read_disk_image(&image_buffer, content->size[res], db_file->fpdb);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    long offset = 0;
+    if(RES_THUMB == res) {
+        errorCode = write_db_file_thumb(image_buffer, content->size[res], &offset, tmpdb_file);
+    } else {
+        errorCode = write_db_file_image(image_buffer, content->size[res], &offset, tmpdb_file);
+    }
+    free(image_buffer);
+    if(0 == errorCode) {
+        tmpdb_file->blobs[new_blob].offset[res] = offset;
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Copies the valid pictures at the beginning of the metadata of the
+ * temporary database, and each blob they reference once with its images
+ * (the resized images are copied, not computed again, to the derivative
+ * cache of the temporary database if there is one). The thumbnails are
+ * packed in their region in the order of the pictures. The header, the
+ * blob table, the metadata and the indexes are written at the end.
+ *
+ * @param db_file The database, with all its metadata loaded
+ * @param tmpdb_file The temporary database, just created
+ *
+ * @return Returns 0 in case of success
+ */
+static int transfer_pictures(const struct pictdb_file* db_file, struct pictdb_file* tmpdb_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    //Index of the copy of each blob, max_files if it is not copied yet
+    size_t* new_blobs = calloc(max_files, sizeof(size_t));
+    if(NULL == new_blobs) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    uint64_t thumbs_size = 0;
+    for(size_t blob = 0; blob < max_files; ++blob) {
+        new_blobs[blob] = max_files;
+        if(IS_USED_BLOB(db_file, blob)) {
+            thumbs_size += db_file->blobs[blob].size[RES_THUMB];
+        }
+    }
+
+    //The region is reserved once for all the thumbnails
+    int errorCode = (0 != thumbs_size) ? reserve_thumb_region(tmpdb_file, thumbs_size) : 0;
+    size_t newIndex = 0;
+    for(size_t index = next_valid_index(db_file, 0); (index < max_files) && (0 == errorCode);
+        index = next_valid_index(db_file, index + 1)) {
+        const size_t blob = db_file->metadata[index].blob;
+        if(new_blobs[blob] < max_files) {
+            ++tmpdb_file->blobs[new_blobs[blob]].refcount;
+        } else {
+            errorCode = new_blob(tmpdb_file, &new_blobs[blob]);
+            if(0 == errorCode) {
+                struct pict_blob* content = &tmpdb_file->blobs[new_blobs[blob]];
+                memcpy(content->SHA, db_file->blobs[blob].SHA, SHA256_DIGEST_LENGTH);
+                memcpy(content->res_orig, db_file->blobs[blob].res_orig, sizeof(content->res_orig));
+                memcpy(content->size, db_file->blobs[blob].size, sizeof(content->size));
+            }
+            //The original image first, as in the files written by do_insert
+            for(size_t i = 0; (i < db_file->resolutions.nb_res) && (0 == errorCode); ++i) {
+                const size_t res = (i <= RES_ORIG) ? RES_ORIG - i : i;
+                if(0 != db_file->blobs[blob].size[res]) {
+                    errorCode = copy_blob_image(db_file, blob, res, tmpdb_file, new_blobs[blob]);
+                }
+            }
+        }
+        if(0 == errorCode) {
+            errorCode = set_pict_id(tmpdb_file, newIndex, get_pict_id(db_file, index));
+        }
+        if(0 == errorCode) {
+            tmpdb_file->metadata[newIndex].is_valid = NON_EMPTY;
+            tmpdb_file->metadata[newIndex].blob = new_blobs[blob];
+            update_metadata_columns(tmpdb_file, newIndex);
+            ++newIndex;
+        }
+    }
+    //The resized images of the cache are copied once all the blobs are, in
+    //the order of their last use
+    if(0 == errorCode) {
+        errorCode = copy_cached_images(db_file, tmpdb_file, new_blobs);
+    }
+    free(new_blobs);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    tmpdb_file->header.num_files = newIndex;
+    tmpdb_file->header.db_version = newIndex;
+    if((0 != write_pict_id_heap(tmpdb_file)) || (0 != write_blob_table(tmpdb_file)) ||
+       (0 != fseek(tmpdb_file->fpdb, METADATA_OFFSET, SEEK_SET)) ||
+       (fwrite(tmpdb_file->metadata, sizeof(struct pict_metadata), max_files, tmpdb_file->fpdb) != max_files) ||
+       (0 != write_id_index(tmpdb_file))) {
+        return ERR_IO;
+    }
+    errorCode = build_hash_index(tmpdb_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    //The header is written last, with the version of the hash tables
+    if(0 != write_hash_index(tmpdb_file)) {
+        return ERR_IO;
+    }
+    errorCode = count_db_usage(tmpdb_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    return (0 != write_db_file_header(tmpdb_file)) ? ERR_IO : 0;
+}
+
+/**
+ * @brief Creates a new database file without the deleted images, see
+ * do_gbcollect.
+ */
+static int collect_garbage(struct pictdb_file* db_file, const char* db_filename, const char* tmpdb_filename)
 {
     //Testing arguments
     if((NULL == db_filename) || (NULL == tmpdb_filename) || (NULL == db_file)) {
         return ERR_INVALID_ARGUMENT;
     }
 
+    int errorCode = load_metadata(db_file);
+    if(errorCode != 0) {
+        return errorCode;
+    }
+
     //Opening and creating a temporary db_file
     struct pictdb_file tmpdb_file;
     tmpdb_file.header.max_files = db_file->header.max_files;
@@ -24,58 +164,20 @@ int do_gbcollect(struct pictdb_file* db_file, const char* db_filename, const cha
     tmpdb_file.header.res_resized[DIM_Y_THUMB] = db_file->header.res_resized[DIM_Y_THUMB];
     tmpdb_file.header.res_resized[DIM_X_SMALL] = db_file->header.res_resized[DIM_X_SMALL];
     tmpdb_file.header.res_resized[DIM_Y_SMALL] = db_file->header.res_resized[DIM_Y_SMALL];
+    tmpdb_file.resolutions = db_file->resolutions;
+    //The images of the copy are aligned and cached like those of the database
+    tmpdb_file.header.features = db_file->header.features;
 
-    int errorCode = 0; //0 means no error
     errorCode = do_create(tmpdb_filename, &tmpdb_file);
     if(errorCode != 0) {
         return errorCode;
     }
 
-    //Transfering image to the temporary database
-    size_t newIndex = 0;
-    for(size_t index = 0; index < db_file->header.max_files; ++index) {
-        if(NON_EMPTY == db_file->metadata[index].is_valid) {
-            const char* pictID = db_file->metadata[index].pict_id;
-
-            //Adds image in original format
-            char* image_buffer = NULL;
-            uint32_t image_size = 0;
-
-            //read the image in original format
-            errorCode = do_read(pictID, RES_ORIG, &image_buffer, &image_size, db_file);
-            if(0 != errorCode) {
-                do_close(&tmpdb_file);
-                return errorCode;
-            }
-
-            //insert the image
-            errorCode = do_insert(image_buffer, image_size, pictID, &tmpdb_file);
-            free(image_buffer);
-            image_buffer = NULL;
-            if(0 != errorCode) {
-                do_close(&tmpdb_file);
-                return errorCode;
-            }
-
-            //Adds image in small format if it exists in original db_file
-            if(0 != db_file->metadata[index].size[RES_SMALL]) {
-                errorCode = lazily_resize(RES_SMALL, &tmpdb_file, newIndex);
-                if(0 != errorCode) {
-                    do_close(&tmpdb_file);
-                    return errorCode;
-                }
-            }
-
-            //Adds image in thumb format if it exists in original db_file
-            if(0 != db_file->metadata[index].size[RES_THUMB]) {
-                errorCode = lazily_resize(RES_THUMB, &tmpdb_file, newIndex);
-                if(0 != errorCode) {
-                    do_close(&tmpdb_file);
-                    return errorCode;
-                }
-            }
-            newIndex++;
-        }
+    //Transfering the pictures to the temporary database
+    errorCode = transfer_pictures(db_file, &tmpdb_file);
+    if(0 != errorCode) {
+        do_close(&tmpdb_file);
+        return errorCode;
     }
 
     do_close(&tmpdb_file);
@@ -85,6 +187,36 @@ int do_gbcollect(struct pictdb_file* db_file, const char* db_filename, const cha
     } else if(rename(tmpdb_filename, db_filename) != 0) {
         return ERR_IO;
     }
+    //The resized images of the derivative cache follow the new blobs
+    if(0 != DB_CACHE_BUDGET(&db_file->header)) {
+        return replace_derivative_cache(db_filename, tmpdb_filename);
+    }
 
     return 0;
 }
+
+/********************************************************************//**
+ * Create a new database file without the deleted image
+ */
+int do_gbcollect(struct pictdb_file* db_file, const char* db_filename, const char* tmpdb_filename)
+{
+    const double start = metrics_now();
+    TRACE_BEGIN(span, "do_gbcollect");
+    const int errorCode = collect_garbage(db_file, db_filename, tmpdb_filename);
+    TRACE_END(span);
+    metrics_observe(OP_DO_GBCOLLECT, start);
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Tells if the dead bytes of the database are worth a garbage collection.
+ */
+int needs_gbcollect(const struct pictdb_file* db_file, double dead_ratio, uint64_t min_dead_bytes)
+{
+    uint64_t file_size = 0;
+    uint64_t dead_bytes = 0;
+    if((NULL == db_file) || (0 != get_db_usage(db_file, &file_size, &dead_bytes))) {
+        return 0;
+    }
+    return (dead_bytes >= min_dead_bytes) && (dead_bytes >= dead_ratio * file_size);
+}
@@ -8,11 +8,60 @@
 #include "pictDB.h"
 #include "dedup.h"
 #include "image_content.h"
+#include "metrics.h"
+#include "trace.h"
 
-/********************************************************************//**
- * Adds the image to the database db_file.
+/**
+ * @brief Adds the image to the metadata at index, whose ID is already set:
+ * references the blob with the same content, or a new blob.
+ *
+ * @return Returns 0 if addition went well or error code otherwise
  */
-int do_insert(const char* image, size_t im_size, const char* id, struct pictdb_file* db_file)
+static int add_image(const char* image, size_t im_size, uint32_t index, struct pictdb_file* db_file)
+{
+    // Compute image's SHA value
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    (void) SHA256((unsigned char *)image, im_size, SHA);
+    // Test deduplication and write if no duplication
+    size_t blob = db_file->header.max_files;
+    int error_code = do_name_and_content_dedup(db_file, index, SHA, &blob);
+    if(error_code != 0) {
+        return error_code;
+    }
+    // Test if image isn't there yet.
+    if(blob >= db_file->header.max_files) {
+        uint32_t height = 0;
+        uint32_t width = 0;
+        error_code = get_resolution(&height, &width, image, im_size);
+        if(error_code != 0) {
+            return error_code;
+        }
+        long offset = 0;
+        if(0 != write_db_file_image(image, im_size, &offset, db_file)) {
+            return ERR_IO;
+        }
+        error_code = new_blob(db_file, &blob);
+        if(error_code != 0) {
+            return error_code;
+        }
+        db_file->header.live_bytes += im_size;
+        struct pict_blob* content = &db_file->blobs[blob];
+        memcpy(content->SHA, SHA, SHA256_DIGEST_LENGTH);
+        content->size[RES_ORIG] = im_size;
+        content->offset[RES_ORIG] = offset;
+        content->res_orig[DIM_X_ORIG] = width;
+        content->res_orig[DIM_Y_ORIG] = height;
+    } else {
+        ++db_file->blobs[blob].refcount;
+    }
+    db_file->metadata[index].blob = blob;
+    return 0;
+}
+
+/**
+ * @brief Adds the image to the database db_file, see do_insert.
+ */
+static int insert_image(const char* image, size_t im_size, const char* id, struct pictdb_file* db_file)
 {
     //In this project, pictDBM, we made the decision to return the error
     //ERR_INVALID_ARGUMENT because we did not found a better one and
@@ -22,55 +71,56 @@ int do_insert(const char* image, size_t im_size, const char* id, struct pictdb_f
     if((NULL == image) || (NULL == id) || (NULL == db_file)) {
         return ERR_INVALID_ARGUMENT;
     } else if(db_file->header.num_files < db_file->header.max_files) {
-        uint32_t index = 0;
-        while(db_file->metadata[index].is_valid != EMPTY) {
-            index += 1;
+        const uint32_t index = first_empty_index(db_file);
+        if(index >= db_file->header.max_files) {
+            return ERR_FULL_DATABASE;
         }
-        // Add image's SHA value
-        (void) SHA256((unsigned char *)image, im_size, db_file->metadata[index].SHA);
-        // Add image's id
-        strncpy(db_file->metadata[index].pict_id, id, MAX_PIC_ID);
-        db_file->metadata[index].pict_id[MAX_PIC_ID] = '\0';
-        // Add image's original size and initialise others to 0.
-        db_file->metadata[index].size[RES_ORIG] = im_size;
-        // Test deduplication and write if no duplication
-        int error_code = do_name_and_content_dedup(db_file, index);
+        int error_code = load_one_metadata(db_file, index);
         if(error_code != 0) {
             return error_code;
-        } else {
-            // Test if image isn't there yet.
-            if(db_file->metadata[index].offset[RES_ORIG] == 0) {
-                uint32_t height = 0;
-                uint32_t width = 0;
-                error_code = get_resolution(&height, &width, image, im_size);
-                if(error_code != 0) {
-                    return error_code;
-                }
-                long offset = 0;
-                if(0 != write_db_file_image(image, im_size, &offset, db_file)) {
-                    return ERR_IO;
-                }
-                db_file->metadata[index].size[RES_THUMB] = 0;
-                db_file->metadata[index].size[RES_SMALL] = 0;
-                db_file->metadata[index].offset[RES_ORIG] = offset;
-                db_file->metadata[index].offset[RES_THUMB] = 0;
-                db_file->metadata[index].offset[RES_SMALL] = 0;
-                db_file->metadata[index].res_orig[DIM_X_ORIG] = width;
-                db_file->metadata[index].res_orig[DIM_Y_ORIG] = height;
-            }
-            db_file->metadata[index].is_valid = NON_EMPTY;
-            db_file->header.db_version += 1;
-            db_file->header.num_files += 1;
-            //Updates header on disk
-            if(0 != write_db_file_header(db_file)) {
-                return ERR_IO;
-            }
-            if(0 != write_db_file_one_metadata(db_file, index)) {
-                return ERR_IO;
-            }
-            return 0;
         }
+        // Add image's id in the string heap
+        error_code = set_pict_id(db_file, index, id);
+        if(error_code != 0) {
+            return error_code;
+        }
+        error_code = add_image(image, im_size, index, db_file);
+        if(error_code != 0) {
+            // The ID of a picture not inserted does not stay in the heap
+            cancel_pict_id(db_file, index);
+            return error_code;
+        }
+        db_file->metadata[index].is_valid = NON_EMPTY;
+        db_file->header.db_version += 1;
+        db_file->header.num_files += 1;
+        //Updates header on disk
+        if(0 != write_db_file_header(db_file)) {
+            return ERR_IO;
+        }
+        if(0 != write_pict_id(db_file, index)) {
+            return ERR_IO;
+        }
+        if(0 != write_db_file_one_metadata(db_file, index)) {
+            return ERR_IO;
+        }
+        if(0 != write_db_file_blob(db_file, db_file->metadata[index].blob)) {
+            return ERR_IO;
+        }
+        return add_to_hash_index(db_file, index);
     } else {
         return ERR_FULL_DATABASE;
     }
 }
+
+/********************************************************************//**
+ * Adds the image to the database db_file.
+ */
+int do_insert(const char* image, size_t im_size, const char* id, struct pictdb_file* db_file)
+{
+    const double start = metrics_now();
+    TRACE_BEGIN(span, "do_insert");
+    const int error_code = insert_image(image, im_size, id, db_file);
+    TRACE_END(span);
+    metrics_observe(OP_DO_INSERT, start);
+    return error_code;
+}
@@ -17,15 +17,18 @@
  ********************************************************************** */
 const char* do_list(const struct pictdb_file* myfile, enum do_list_mode mode)
 {
+    //The IDs are referenced by the metadata
+    if(0 != load_metadata(myfile)) {
+        return NULL;
+    }
     if(mode == STDOUT) {
-        print_header(&myfile->header);
+        print_header(&myfile->header, &myfile->resolutions);
         if(myfile->header.num_files == 0) {
             puts(EMPTY_DATABASE_MSG);
         } else {
-            for(size_t i = 0; i < myfile->header.max_files; ++i) {
-                if(myfile->metadata[i].is_valid == NON_EMPTY) {
-                    print_metadata(&myfile->metadata[i]);
-                }
+            for(size_t i = next_valid_index(myfile, 0); i < myfile->header.max_files; i = next_valid_index(myfile, i + 1)) {
+                print_metadata(&myfile->metadata[i], get_pict_blob(myfile, i), get_pict_id(myfile, i),
+                               &myfile->resolutions);
             }
         }
         return NULL;
@@ -39,12 +42,23 @@ const char* do_list(const struct pictdb_file* myfile, enum do_list_mode mode)
         } else {
             json_object* jobj = json_object_new_object();
             json_object* pic_array = json_object_new_array();
-            for(size_t i = 0; i < myfile->header.max_files; ++i) {
-                if(myfile->metadata[i].is_valid == NON_EMPTY) {
-                    json_object_array_add(pic_array, json_object_new_string(myfile->metadata[i].pict_id));
-                }
+            for(size_t i = next_valid_index(myfile, 0); i < myfile->header.max_files; i = next_valid_index(myfile, i + 1)) {
+                json_object_array_add(pic_array, json_object_new_string(get_pict_id(myfile, i)));
             }
             json_object_object_add(jobj, "Pictures", pic_array);
+            //The clients read the smallest resolution filling their display
+            json_object* res_array = json_object_new_array();
+            for(size_t res = 0; res < myfile->resolutions.nb_res; ++res) {
+                const struct pict_resolution* resolution = &myfile->resolutions.resolutions[res];
+                json_object* res_object = json_object_new_object();
+                json_object_object_add(res_object, "name", json_object_new_string(resolution->name));
+                json_object_object_add(res_object, "width", json_object_new_int(resolution->res[DIM_X_ORIG]));
+                json_object_object_add(res_object, "height", json_object_new_int(resolution->res[DIM_Y_ORIG]));
+                json_object_array_add(res_array, res_object);
+            }
+            json_object_object_add(jobj, "Resolutions", res_array);
+            json_object_object_add(jobj, "LiveBytes", json_object_new_int64(myfile->header.live_bytes));
+            json_object_object_add(jobj, "DeadBytes", json_object_new_int64(myfile->header.dead_bytes));
             const char* s = json_object_to_json_string(jobj);
             //copy the string bound to the json object in an other string
             char* res = calloc(strlen(s)+1, sizeof(char));
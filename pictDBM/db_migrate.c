@@ -0,0 +1,902 @@
+/**
+ * @file db_migrate.c
+ * @brief pictDB library: conversion of the databases of an older format version.
+ *
+ * Each layout of the metadata of the older format versions has an entry in
+ * MIGRATIONS. The metadata are converted by chunks to the current format, in
+ * memory for the files opened read-only and in place otherwise, and the
+ * contents of the pictures with the same SHA are gathered in one blob. The
+ * live and dead bytes of the header are counted once converted.
+ *
+ * The beginning of the file overwritten in place (the header, the metadata
+ * and the index of the IDs) is first saved in a journal, removed once the
+ * header of the new format is written: an interrupted migration is undone by
+ * recover_migration when the database is opened again.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, fsync and ftruncate
+
+#include "pictDB.h"
+#include <unistd.h>
+
+#define MIGRATION_CHUNK 1024 // Number of metadata converted at once
+#define OLD_HEADER_SIZE 64 // Size of the header of the format versions 1 to 5
+#define JOURNAL_CHUNK (1 << 20) // Number of bytes copied at once to or from the journal
+
+struct conversion;
+
+/**
+ * @brief Conversion of the format versions with the same metadata
+ *
+ * version The last format version converted
+ * header_size Size of the header
+ * metadata_offset Position of the metadata in the file
+ * metadata_size Size of one metadata
+ * read_ids Reads the string heap, or allocates it for the IDs of the metadata
+ * convert Converts one metadata and the content of its picture, adding its ID
+ * to the string heap if needed
+ */
+struct migration_step {
+    uint32_t version;
+    size_t header_size;
+    uint64_t metadata_offset;
+    size_t metadata_size;
+    int (*read_ids)(struct pictdb_file* db_file, struct conversion* conversion);
+    int (*convert)(struct pictdb_file* db_file, const struct conversion* conversion, const void* old_metadata,
+                   struct pict_metadata* metadata, struct pict_blob* content);
+};
+
+/**
+ * @brief State of the conversion of a database
+ *
+ * step The conversion of its format version
+ * old_blobs The blob table of format versions 5 to 8, NULL for the other formats
+ * old_blobs_v9 The blob table of format version 9, NULL for the other formats
+ */
+struct conversion {
+    const struct migration_step* step;
+    struct pict_blob_v5* old_blobs;
+    struct pict_blob* old_blobs_v9;
+};
+
+/**
+ * @brief Header of the journal of a migration, followed by the saved bytes
+ *
+ * file_size Size of the database before the migration
+ * size Number of bytes saved from the beginning of the database, 0 until they
+ * are all written (the database is then not modified yet)
+ */
+struct migration_journal {
+    uint64_t file_size;
+    uint64_t size;
+};
+
+/**
+ * @brief Allocates the string heap for the IDs of the metadata of format
+ * version 1, read by chunks.
+ *
+ * @param db_file The database
+ * @param conversion The conversion of format version 1
+ *
+ * @return Returns 0 in case of success
+ */
+static int alloc_ids_v1(struct pictdb_file* db_file, struct conversion* conversion)
+{
+    const size_t max_files = db_file->header.max_files;
+    struct pict_metadata_v1* metadata_v1 = calloc(MIGRATION_CHUNK, sizeof(struct pict_metadata_v1));
+    if(NULL == metadata_v1) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int errorCode = 0;
+    uint64_t heap_size = 1;
+    if(0 != fseek(db_file->fpdb, conversion->step->metadata_offset, SEEK_SET)) {
+        errorCode = ERR_IO;
+    }
+    for(size_t start = 0; (start < max_files) && (0 == errorCode); start += MIGRATION_CHUNK) {
+        const size_t nb_metadata = max_files - start < MIGRATION_CHUNK ? max_files - start : MIGRATION_CHUNK;
+        if(fread(metadata_v1, sizeof(struct pict_metadata_v1), nb_metadata, db_file->fpdb) != nb_metadata) {
+            errorCode = ERR_IO;
+        }
+        //The IDs are not always terminated: append_pict_id truncates them the same way
+        for(size_t i = 0; (i < nb_metadata) && (0 == errorCode); ++i) {
+            if(NON_EMPTY == metadata_v1[i].is_valid) {
+                size_t length = 0;
+                while((length < MAX_PIC_ID) && ('\0' != metadata_v1[i].pict_id[length])) {
+                    ++length;
+                }
+                heap_size += length + 1;
+            }
+        }
+    }
+    free(metadata_v1);
+    if((0 == errorCode) && (heap_size > UINT32_MAX / 2)) {
+        errorCode = ERR_FULL_DATABASE;
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    return init_pict_id_heap(db_file, 2 * heap_size);
+}
+
+/**
+ * @brief Converts a metadata of format version 1, adding its ID to the
+ * string heap.
+ *
+ * @param db_file The database, with a string heap big enough for the IDs
+ * @param conversion The conversion of format version 1
+ * @param old_metadata The metadata of format version 1
+ * @param metadata The converted metadata, filled with zeros
+ * @param content The content of the picture, filled with zeros
+ *
+ * @return Returns 0 in case of success
+ */
+static int convert_metadata_v1(struct pictdb_file* db_file, const struct conversion* conversion,
+                               const void* old_metadata, struct pict_metadata* metadata, struct pict_blob* content)
+{
+    (void) conversion;
+    const struct pict_metadata_v1* metadata_v1 = old_metadata;
+    metadata->is_valid = metadata_v1->is_valid;
+    memcpy(content->SHA, metadata_v1->SHA, SHA256_DIGEST_LENGTH);
+    memcpy(content->res_orig, metadata_v1->res_orig, sizeof(content->res_orig));
+    memcpy(content->size, metadata_v1->size, sizeof(metadata_v1->size));
+    memcpy(content->offset, metadata_v1->offset, sizeof(metadata_v1->offset));
+    if(NON_EMPTY == metadata->is_valid) {
+        return append_pict_id(db_file, metadata_v1->pict_id, metadata);
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the string heap of a database of format versions 2 to 4.
+ *
+ * @param db_file The database
+ * @param conversion The conversion of format versions 2 to 4
+ *
+ * @return Returns 0 in case of success
+ */
+static int read_ids_v2(struct pictdb_file* db_file, struct conversion* conversion)
+{
+    (void) conversion;
+    return read_pict_id_heap(db_file);
+}
+
+/**
+ * @brief Converts a metadata of format versions 2 to 4, whose ID is
+ * already in the string heap.
+ *
+ * @param db_file The database, with its string heap loaded
+ * @param conversion The conversion of format versions 2 to 4
+ * @param old_metadata The metadata of format versions 2 to 4
+ * @param metadata The converted metadata, filled with zeros
+ * @param content The content of the picture, filled with zeros
+ *
+ * @return Returns 0 in case of success
+ */
+static int convert_metadata_v2(struct pictdb_file* db_file, const struct conversion* conversion,
+                               const void* old_metadata, struct pict_metadata* metadata, struct pict_blob* content)
+{
+    (void) conversion;
+    const struct pict_metadata_v2* metadata_v2 = old_metadata;
+    metadata->id_offset = metadata_v2->id_offset;
+    metadata->id_length = metadata_v2->id_length;
+    metadata->is_valid = metadata_v2->is_valid;
+    memcpy(content->SHA, metadata_v2->SHA, SHA256_DIGEST_LENGTH);
+    memcpy(content->res_orig, metadata_v2->res_orig, sizeof(content->res_orig));
+    memcpy(content->size, metadata_v2->size, sizeof(metadata_v2->size));
+    memcpy(content->offset, metadata_v2->offset, sizeof(metadata_v2->offset));
+    return check_pict_id(db_file, metadata);
+}
+
+/**
+ * @brief Reads the string heap and the blob table of a database of format
+ * versions 5 to 8, and the location of the region of the thumbnails of
+ * format version 8.
+ *
+ * @param db_file The database
+ * @param conversion The conversion of format versions 5 to 8, keeping the blob table
+ *
+ * @return Returns 0 in case of success
+ */
+static int read_ids_v5(struct pictdb_file* db_file, struct conversion* conversion)
+{
+    const size_t max_files = db_file->header.max_files;
+    int errorCode = read_pict_id_heap(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    struct pict_blob_table blob_table;
+    if(1 != fread(&blob_table, sizeof(struct pict_blob_table), 1, db_file->fpdb)) {
+        return ERR_IO;
+    }
+    if(PICTDB_FORMAT_V8 == conversion->step->version) {
+        errorCode = read_thumb_region(db_file);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+    }
+    conversion->old_blobs = calloc(max_files, sizeof(struct pict_blob_v5));
+    if(NULL == conversion->old_blobs) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if((0 != fseek(db_file->fpdb, blob_table.offset, SEEK_SET)) ||
+       (fread(conversion->old_blobs, sizeof(struct pict_blob_v5), max_files, db_file->fpdb) != max_files)) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a metadata of format versions 5 to 8, whose ID is
+ * already in the string heap, with the content of its blob.
+ *
+ * @param db_file The database, with its string heap loaded
+ * @param conversion The conversion of format versions 5 to 8, with its blob table
+ * @param old_metadata The metadata of format versions 5 to 8
+ * @param metadata The converted metadata, filled with zeros
+ * @param content The content of the picture, filled with zeros
+ *
+ * @return Returns 0 in case of success
+ */
+static int convert_metadata_v5(struct pictdb_file* db_file, const struct conversion* conversion,
+                               const void* old_metadata, struct pict_metadata* metadata, struct pict_blob* content)
+{
+    const struct pict_metadata* metadata_v5 = old_metadata;
+    metadata->id_offset = metadata_v5->id_offset;
+    metadata->id_length = metadata_v5->id_length;
+    metadata->is_valid = metadata_v5->is_valid;
+    if(NON_EMPTY == metadata->is_valid) {
+        if((metadata_v5->blob >= db_file->header.max_files) ||
+           (0 == conversion->old_blobs[metadata_v5->blob].refcount)) {
+            return ERR_IO;
+        }
+        //The references are counted again by convert_metadata
+        const struct pict_blob_v5* old_blob = &conversion->old_blobs[metadata_v5->blob];
+        memcpy(content->SHA, old_blob->SHA, SHA256_DIGEST_LENGTH);
+        memcpy(content->res_orig, old_blob->res_orig, sizeof(content->res_orig));
+        memcpy(content->size, old_blob->size, sizeof(old_blob->size));
+        memcpy(content->offset, old_blob->offset, sizeof(old_blob->offset));
+    }
+    return check_pict_id(db_file, metadata);
+}
+
+/**
+ * @brief Reads the string heap, the blob table, the location of the region
+ * of the thumbnails and the resolutions of a database of format version 9.
+ * The resolutions keep the default encoding.
+ *
+ * @param db_file The database, with the default resolutions
+ * @param conversion The conversion of format version 9, keeping the blob table
+ *
+ * @return Returns 0 in case of success
+ */
+static int read_ids_v9(struct pictdb_file* db_file, struct conversion* conversion)
+{
+    const size_t max_files = db_file->header.max_files;
+    int errorCode = read_pict_id_heap(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    struct pict_blob_table blob_table;
+    if(1 != fread(&blob_table, sizeof(struct pict_blob_table), 1, db_file->fpdb)) {
+        return ERR_IO;
+    }
+    errorCode = read_thumb_region(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    conversion->old_blobs_v9 = calloc(max_files, sizeof(struct pict_blob));
+    if(NULL == conversion->old_blobs_v9) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    //The resolutions follow the free extents, as in the current format
+    struct pict_resolution_table_v9 resolutions;
+    if((0 != fseek(db_file->fpdb, blob_table.offset, SEEK_SET)) ||
+       (fread(conversion->old_blobs_v9, sizeof(struct pict_blob), max_files, db_file->fpdb) != max_files) ||
+       (0 != fseek(db_file->fpdb, blob_table.offset + BLOB_TABLE_SIZE(max_files) + EXTENT_TABLE_SIZE(max_files),
+                   SEEK_SET)) ||
+       (1 != fread(&resolutions, sizeof(struct pict_resolution_table_v9), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    if((resolutions.nb_res < NB_DEFAULT_RES) || (resolutions.nb_res > NB_RES)) {
+        return ERR_IO;
+    }
+    db_file->resolutions.nb_res = resolutions.nb_res;
+    for(size_t res = 0; res < NB_RES; ++res) {
+        struct pict_resolution* resolution = &db_file->resolutions.resolutions[res];
+        memcpy(resolution->name, resolutions.resolutions[res].name, sizeof(resolution->name));
+        resolution->name[MAX_RES_NAME] = '\0';
+        memcpy(resolution->res, resolutions.resolutions[res].res, sizeof(resolution->res));
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a metadata of format version 9, whose ID is already in
+ * the string heap, with the content of its blob.
+ *
+ * @param db_file The database, with its string heap loaded
+ * @param conversion The conversion of format version 9, with its blob table
+ * @param old_metadata The metadata of format version 9
+ * @param metadata The converted metadata, filled with zeros
+ * @param content The content of the picture, filled with zeros
+ *
+ * @return Returns 0 in case of success
+ */
+static int convert_metadata_v9(struct pictdb_file* db_file, const struct conversion* conversion,
+                               const void* old_metadata, struct pict_metadata* metadata, struct pict_blob* content)
+{
+    const struct pict_metadata* metadata_v9 = old_metadata;
+    metadata->id_offset = metadata_v9->id_offset;
+    metadata->id_length = metadata_v9->id_length;
+    metadata->is_valid = metadata_v9->is_valid;
+    if(NON_EMPTY == metadata->is_valid) {
+        if((metadata_v9->blob >= db_file->header.max_files) ||
+           (0 == conversion->old_blobs_v9[metadata_v9->blob].refcount)) {
+            return ERR_IO;
+        }
+        //The references are counted again by convert_metadata
+        *content = conversion->old_blobs_v9[metadata_v9->blob];
+        content->refcount = 0;
+    }
+    return check_pict_id(db_file, metadata);
+}
+
+static const struct migration_step MIGRATIONS[] = {
+    {PICTDB_FORMAT_V1, OLD_HEADER_SIZE, OLD_HEADER_SIZE, sizeof(struct pict_metadata_v1), alloc_ids_v1,
+     convert_metadata_v1},
+    {PICTDB_FORMAT_V4, OLD_HEADER_SIZE, OLD_HEADER_SIZE + sizeof(struct pict_id_heap), sizeof(struct pict_metadata_v2),
+     read_ids_v2, convert_metadata_v2},
+    {PICTDB_FORMAT_V5, OLD_HEADER_SIZE, OLD_HEADER_SIZE + sizeof(struct pict_id_heap) + sizeof(struct pict_blob_table),
+     sizeof(struct pict_metadata), read_ids_v5, convert_metadata_v5},
+    //Format versions 6 and 7 have no region of the thumbnails before their metadata
+    {PICTDB_FORMAT_V7, sizeof(struct pictdb_header),
+     sizeof(struct pictdb_header) + sizeof(struct pict_id_heap) + sizeof(struct pict_blob_table),
+     sizeof(struct pict_metadata), read_ids_v5, convert_metadata_v5},
+    //Format version 8 has blobs without the images of the named resolutions
+    {PICTDB_FORMAT_V8, sizeof(struct pictdb_header), METADATA_OFFSET, sizeof(struct pict_metadata), read_ids_v5,
+     convert_metadata_v5},
+    //Format version 9 has resolutions without the encoding of their images
+    {PICTDB_FORMAT_V9, sizeof(struct pictdb_header), METADATA_OFFSET, sizeof(struct pict_metadata), read_ids_v9,
+     convert_metadata_v9}
+};
+
+#define NB_MIGRATIONS (sizeof(MIGRATIONS) / sizeof(MIGRATIONS[0]))
+
+/**
+ * @brief Finds the conversion of the format version of a database.
+ *
+ * @param header The header of the database
+ *
+ * @return Returns the conversion, or NULL if there is none
+ */
+static const struct migration_step* find_migration(const struct pictdb_header* header)
+{
+    //The files created before the version existed are of format version 1
+    const uint32_t version = (0 == header->format_version) ? PICTDB_FORMAT_V1 : header->format_version;
+    for(size_t i = 0; i < NB_MIGRATIONS; ++i) {
+        if(MIGRATIONS[i].version >= version) {
+            return &MIGRATIONS[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocates the string heap, an empty blob table, the metadata
+ * columns and empty hash tables before converting the metadata.
+ *
+ * @param db_file The database
+ * @param conversion The conversion of its format version
+ *
+ * @return Returns 0 in case of success
+ */
+static int prepare_conversion(struct pictdb_file* db_file, struct conversion* conversion)
+{
+    if(0 != fseek(db_file->fpdb, conversion->step->header_size, SEEK_SET)) {
+        return ERR_IO;
+    }
+    //The thumbnails of the formats older than version 8 are not in a region
+    memset(&db_file->thumbs, 0, sizeof(struct pict_thumb_region));
+    //The formats older than version 9 only have the resolutions of every database
+    init_resolution_table(db_file);
+    //The heap of format version 1 is located after the blob table
+    int errorCode = init_blob_table(db_file);
+    if(0 == errorCode) {
+        errorCode = conversion->step->read_ids(db_file, conversion);
+    }
+    if(0 == errorCode) {
+        errorCode = alloc_metadata_columns(db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = build_hash_index(db_file);
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Converts one metadata and references the blob of its content: the
+ * pictures with the same SHA share one blob, which keeps the resized images
+ * of all of them.
+ *
+ * @param db_file The database
+ * @param conversion The conversion of its format version
+ * @param old_metadata The metadata to convert
+ * @param index The index of the metadata
+ * @param metadata The converted metadata
+ *
+ * @return Returns 0 in case of success
+ */
+static int convert_metadata(struct pictdb_file* db_file, const struct conversion* conversion,
+                            const void* old_metadata, size_t index, struct pict_metadata* metadata)
+{
+    struct pict_blob content;
+    memset(metadata, 0, sizeof(struct pict_metadata));
+    memset(&content, 0, sizeof(struct pict_blob));
+    int errorCode = conversion->step->convert(db_file, conversion, old_metadata, metadata, &content);
+    if((0 != errorCode) || (NON_EMPTY != metadata->is_valid)) {
+        return errorCode;
+    }
+
+    size_t blob = 0;
+    errorCode = find_blob(db_file, content.SHA, &blob);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    if(blob >= db_file->header.max_files) {
+        errorCode = new_blob(db_file, &blob);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+        content.refcount = 1;
+        db_file->blobs[blob] = content;
+        insert_blob_SHA(db_file, blob);
+    } else {
+        struct pict_blob* shared = &db_file->blobs[blob];
+        ++shared->refcount;
+        for(size_t res = 0; res < NB_RES; ++res) {
+            if((0 == shared->size[res]) && (0 != content.size[res])) {
+                shared->size[res] = content.size[res];
+                shared->offset[res] = content.offset[res];
+            }
+        }
+    }
+    metadata->blob = blob;
+
+    struct metadata_columns* columns = &db_file->columns;
+    columns->valid[index / VALID_WORD_BITS] |= UINT64_C(1) << (index % VALID_WORD_BITS);
+    columns->id_hash[index] = hash_pict_id(&db_file->ids[metadata->id_offset]);
+    return 0;
+}
+
+/**
+ * @brief Converts the metadata by chunks, in db_file->metadata or in place.
+ * A converted chunk of the format versions 1 to 4 is smaller than the chunk
+ * it comes from by more than the offset between their first metadata, so the
+ * chunks are converted from the first one. A converted chunk of format
+ * versions 5 to 9 has the same size but starts after it or at the same
+ * position, so the chunks are converted from the last one. Writing a chunk
+ * thus never overwrites a metadata not converted yet.
+ *
+ * @param db_file The database
+ * @param conversion The conversion of its format version
+ * @param progress The function called after each chunk (can be NULL)
+ * @param in_place Tells if the converted metadata are written in the file
+ *
+ * @return Returns 0 in case of success
+ */
+static int convert_chunks(struct pictdb_file* db_file, const struct conversion* conversion,
+                          migration_progress progress, int in_place)
+{
+    const struct migration_step* step = conversion->step;
+    const size_t max_files = db_file->header.max_files;
+    const uint32_t from_version = (0 == db_file->header.format_version) ? PICTDB_FORMAT_V1 :
+                                  db_file->header.format_version;
+    const int from_last = step->metadata_size <= sizeof(struct pict_metadata);
+    unsigned char* old_chunk = calloc(MIGRATION_CHUNK, step->metadata_size);
+    struct pict_metadata* chunk = in_place ? calloc(MIGRATION_CHUNK, sizeof(struct pict_metadata)) : NULL;
+    if((NULL == old_chunk) || (in_place && (NULL == chunk))) {
+        free(old_chunk);
+        free(chunk);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int errorCode = 0;
+    for(size_t done = 0; (done < max_files) && (0 == errorCode); done += MIGRATION_CHUNK) {
+        const size_t nb_metadata = max_files - done < MIGRATION_CHUNK ? max_files - done : MIGRATION_CHUNK;
+        const size_t start = from_last ? max_files - done - nb_metadata : done;
+        struct pict_metadata* metadata = in_place ? chunk : &db_file->metadata[start];
+        if((0 != fseek(db_file->fpdb, step->metadata_offset + start * step->metadata_size, SEEK_SET)) ||
+           (fread(old_chunk, step->metadata_size, nb_metadata, db_file->fpdb) != nb_metadata)) {
+            errorCode = ERR_IO;
+        }
+        for(size_t i = 0; (i < nb_metadata) && (0 == errorCode); ++i) {
+            errorCode = convert_metadata(db_file, conversion, &old_chunk[i * step->metadata_size], start + i,
+                                         &metadata[i]);
+        }
+        if((0 == errorCode) && in_place &&
+           ((0 != fseek(db_file->fpdb, METADATA_OFFSET + start * sizeof(struct pict_metadata), SEEK_SET)) ||
+            (fwrite(chunk, sizeof(struct pict_metadata), nb_metadata, db_file->fpdb) != nb_metadata))) {
+            errorCode = ERR_IO;
+        }
+        if((0 == errorCode) && (NULL != progress)) {
+            progress(from_version, PICTDB_FORMAT_VERSION, done + nb_metadata, max_files);
+        }
+    }
+    free(old_chunk);
+    free(chunk);
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Tells if the library can open a database.
+ */
+int check_format(const struct pictdb_header* header)
+{
+    if((header->format_version > PICTDB_FORMAT_VERSION) ||
+       (0 != (header->features & ~(uint64_t) PICTDB_KNOWN_FEATURES))) {
+        return ERR_VERSION;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Reads the metadata of a database of an older format version.
+ */
+int read_old_metadata(struct pictdb_file* db_file)
+{
+    struct conversion conversion = {find_migration(&db_file->header), NULL, NULL};
+    if(NULL == conversion.step) {
+        return ERR_VERSION;
+    }
+    int errorCode = prepare_conversion(db_file, &conversion);
+    if(0 == errorCode) {
+        db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
+        if(NULL == db_file->metadata) {
+            errorCode = ERR_OUT_OF_MEMORY;
+        }
+    }
+    if(0 == errorCode) {
+        errorCode = convert_chunks(db_file, &conversion, NULL, 0);
+    }
+    //The header of an older format does not count the bytes: they are
+    //counted as if the file had the current format
+    if(0 == errorCode) {
+        errorCode = count_db_usage(db_file);
+    }
+    free(conversion.old_blobs);
+    free(conversion.old_blobs_v9);
+    //The columns and the hash tables are built again by open_db_file
+    free_metadata_columns(db_file);
+    free_hash_index(db_file);
+    return errorCode;
+}
+
+/**
+ * @brief Writes the index of the IDs of the converted metadata, then the blob
+ * table, the free extents, the resolutions, the string heap and the hash
+ * tables at the end of the file, since the regions after the metadata of the
+ * older format may be used by the pictures.
+ *
+ * @param db_file The database, with its metadata converted in place
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_converted_tables(struct pictdb_file* db_file)
+{
+    //The index ends before the end of the metadata of the format versions 1
+    //to 4, or in the blob table of the format versions 5 to 9, already read
+    int errorCode = write_id_index(db_file);
+    long offset = 0;
+    if((0 == errorCode) && ((0 != fseek(db_file->fpdb, 0L, SEEK_END)) || (-1 == (offset = ftell(db_file->fpdb))))) {
+        errorCode = ERR_IO;
+    }
+    if(0 == errorCode) {
+        db_file->blob_table.offset = offset;
+        db_file->heap.offset = offset + BLOB_TABLE_AREA_SIZE(db_file->header.max_files);
+        errorCode = build_hash_index(db_file);
+    }
+    //The regions of the older tables and of the unreferenced images are free
+    if(0 == errorCode) {
+        errorCode = build_free_extents(db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = write_blob_table(db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = write_thumb_region_location(db_file);
+    }
+    //The tables are written before the location of the heap
+    if(0 == errorCode) {
+        errorCode = write_hash_index(db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = write_pict_id_heap(db_file);
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Builds the name of the journal of the migration of a database.
+ *
+ * @param db_filename The name of the database
+ * @param journal_filename The buffer of FILENAME_MAX chars for the name
+ *
+ * @return Returns 0 in case of success
+ */
+static int get_journal_filename(const char* db_filename, char* journal_filename)
+{
+    if(snprintf(journal_filename, FILENAME_MAX, "%s%s", db_filename, JOURNAL_FILE_SUFFIX) >= FILENAME_MAX) {
+        return ERR_INVALID_FILENAME;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies bytes from the current position of a file to the current
+ * position of another one.
+ *
+ * @param from The file read
+ * @param to The file written
+ * @param size The number of bytes to copy
+ *
+ * @return Returns 0 in case of success
+ */
+static int copy_file_bytes(FILE* from, FILE* to, uint64_t size)
+{
+    char* buffer = malloc(JOURNAL_CHUNK);
+    if(NULL == buffer) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int errorCode = 0;
+    while((0 == errorCode) && (size > 0)) {
+        const size_t chunk = (size < JOURNAL_CHUNK) ? (size_t) size : JOURNAL_CHUNK;
+        if((chunk != fread(buffer, 1, chunk, from)) || (chunk != fwrite(buffer, 1, chunk, to))) {
+            errorCode = ERR_IO;
+        }
+        size -= chunk;
+    }
+    free(buffer);
+    return errorCode;
+}
+
+/**
+ * @brief Writes a file and its buffers to the disk.
+ *
+ * @param file The file
+ *
+ * @return Returns 0 in case of success
+ */
+static int sync_file(FILE* file)
+{
+    return ((0 != fflush(file)) || (0 != fsync(fileno(file)))) ? ERR_IO : 0;
+}
+
+/**
+ * @brief Saves in the journal the beginning of the database overwritten in
+ * place by its migration: the header, the metadata and the index of the IDs.
+ * The rest of the current format is appended to the file.
+ *
+ * @param db_file The database
+ * @param journal_filename The name of the journal
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_migration_journal(struct pictdb_file* db_file, const char* journal_filename)
+{
+    struct migration_journal journal = {0, 0};
+    if(0 != fseek(db_file->fpdb, 0L, SEEK_END)) {
+        return ERR_IO;
+    }
+    const long file_size = ftell(db_file->fpdb);
+    const uint64_t overwritten = ID_INDEX_OFFSET(db_file->header.max_files) + ID_INDEX_SIZE(db_file->header.max_files);
+    if((file_size < 0) || (0 != fseek(db_file->fpdb, 0L, SEEK_SET))) {
+        return ERR_IO;
+    }
+    journal.file_size = (uint64_t) file_size;
+
+    FILE* file = fopen(journal_filename, "wb");
+    if(NULL == file) {
+        return ERR_IO;
+    }
+    //The size is written once the bytes are on the disk: a journal of size 0
+    //is the one of a migration that has not modified the database yet
+    int errorCode = (1 != fwrite(&journal, sizeof(struct migration_journal), 1, file)) ? ERR_IO : 0;
+    journal.size = (overwritten < journal.file_size) ? overwritten : journal.file_size;
+    errorCode = (0 != errorCode) ? errorCode : copy_file_bytes(db_file->fpdb, file, journal.size);
+    errorCode = (0 != errorCode) ? errorCode : sync_file(file);
+    if((0 == errorCode) && ((0 != fseek(file, 0L, SEEK_SET)) ||
+                            (1 != fwrite(&journal, sizeof(struct migration_journal), 1, file)))) {
+        errorCode = ERR_IO;
+    }
+    errorCode = (0 != errorCode) ? errorCode : sync_file(file);
+    if((0 != fclose(file)) && (0 == errorCode)) {
+        errorCode = ERR_IO;
+    }
+    if(0 != errorCode) {
+        remove(journal_filename);
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Copies back to the database the bytes saved in the journal of its
+ * migration, restores its size and removes the journal.
+ *
+ * @param db The database file, opened for writing
+ * @param journal_filename The name of the journal
+ *
+ * @return Returns 0 in case of success
+ */
+static int undo_migration(FILE* db, const char* journal_filename)
+{
+    FILE* journal = fopen(journal_filename, "rb");
+    if(NULL == journal) {
+        return ERR_IO;
+    }
+    //An incomplete journal was left before any modification of the database
+    struct migration_journal header = {0, 0};
+    if(1 != fread(&header, sizeof(struct migration_journal), 1, journal)) {
+        header.size = 0;
+    }
+    int errorCode = 0;
+    if(0 != header.size) {
+        if((0 != fflush(db)) || (0 != fseek(db, 0L, SEEK_SET)) || (header.file_size > INT64_MAX)) {
+            errorCode = ERR_IO;
+        }
+        errorCode = (0 != errorCode) ? errorCode : copy_file_bytes(journal, db, header.size);
+        if((0 == errorCode) && ((0 != fflush(db)) || (0 != ftruncate(fileno(db), (off_t) header.file_size)))) {
+            errorCode = ERR_IO;
+        }
+        errorCode = (0 != errorCode) ? errorCode : sync_file(db);
+    }
+    fclose(journal);
+    if((0 == errorCode) && (0 != remove(journal_filename))) {
+        errorCode = ERR_IO;
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Tells whether the journal of a migration has saved bytes, i.e.
+ * whether the database may have been modified.
+ *
+ * @param journal_filename The name of the journal
+ *
+ * @return Returns 1 if the journal is complete, 0 otherwise
+ */
+static int is_journal_complete(const char* journal_filename)
+{
+    struct migration_journal header = {0, 0};
+    FILE* journal = fopen(journal_filename, "rb");
+    if(NULL != journal) {
+        if(1 != fread(&header, sizeof(struct migration_journal), 1, journal)) {
+            header.size = 0;
+        }
+        fclose(journal);
+    }
+    return 0 != header.size;
+}
+
+/********************************************************************//**
+ * Undoes the interrupted migration of a database.
+ */
+int recover_migration(const char* db_filename, const char* open_mode)
+{
+    //Test the pointers
+    if((NULL == db_filename) || (NULL == open_mode)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    char journal_filename[FILENAME_MAX];
+    int errorCode = get_journal_filename(db_filename, journal_filename);
+    if((0 != errorCode) || (0 != access(journal_filename, F_OK))) {
+        return errorCode;
+    }
+    //A database opened read-only cannot be restored
+    if(NULL == strchr(open_mode, '+')) {
+        return is_journal_complete(journal_filename) ? ERR_IO : 0;
+    }
+    FILE* db = fopen(db_filename, "rb+");
+    if(NULL == db) {
+        return (ENOENT == errno) ? ERR_FILE_NOT_FOUND : ERR_IO;
+    }
+    errorCode = undo_migration(db, journal_filename);
+    if((0 != fclose(db)) && (0 == errorCode)) {
+        errorCode = ERR_IO;
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Upgrades an opened database in place to the current format version.
+ */
+int migrate_db_file(struct pictdb_file* db_file, const char* db_filename, migration_progress progress)
+{
+    int errorCode = check_format(&db_file->header);
+    if((0 != errorCode) || (PICTDB_FORMAT_VERSION == db_file->header.format_version)) {
+        return errorCode;
+    }
+    struct conversion conversion = {find_migration(&db_file->header), NULL, NULL};
+    if(NULL == conversion.step) {
+        return ERR_VERSION;
+    }
+    char journal_filename[FILENAME_MAX];
+    errorCode = get_journal_filename(db_filename, journal_filename);
+    errorCode = (0 != errorCode) ? errorCode : write_migration_journal(db_file, journal_filename);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    errorCode = prepare_conversion(db_file, &conversion);
+    if(0 == errorCode) {
+        errorCode = convert_chunks(db_file, &conversion, progress, 1);
+    }
+    if(0 == errorCode) {
+        errorCode = write_converted_tables(db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = count_db_usage(db_file);
+    }
+    free(conversion.old_blobs);
+    free(conversion.old_blobs_v9);
+    //The database is read again in the current format
+    free_pict_id_heap(db_file);
+    free_blob_table(db_file);
+    free_metadata_columns(db_file);
+    free_hash_index(db_file);
+
+    //The header of the new format is written last, then the journal is
+    //removed: until then, the journal undoes the migration
+    if(0 == errorCode) {
+        db_file->header.format_version = PICTDB_FORMAT_VERSION;
+        errorCode = write_db_file_header(db_file);
+    }
+    errorCode = (0 != errorCode) ? errorCode : sync_file(db_file->fpdb);
+    if(0 != errorCode) {
+        //If the journal cannot be copied back, the next opening will retry
+        undo_migration(db_file->fpdb, journal_filename);
+        return errorCode;
+    }
+    if((0 != remove(journal_filename)) || (0 != fseek(db_file->fpdb, sizeof(struct pictdb_header), SEEK_SET))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Upgrades a database in place to the current format version.
+ */
+int do_migrate(const char* db_filename, migration_progress progress, uint32_t* from_version)
+{
+    //Test the pointer
+    //In this project, pictDBM, we made the decision to return the error
+    //ERR_INVALID_ARGUMENT because we did not found a better one and
+    //because this error should not occur since the argument are already
+    //tested before the call of this function. But if this function is used
+    //in an other library, the argument should be tested
+    if((NULL == db_filename) || (NULL == from_version)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    //Only the header is loaded: the metadata are streamed by the migrations
+    struct pictdb_file db_file;
+    memset(&db_file, 0, sizeof(struct pictdb_file));
+    int errorCode = recover_migration(db_filename, "rb+");
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    db_file.fpdb = fopen(db_filename, "rb+");
+    if(NULL == db_file.fpdb) {
+        return (ENOENT == errno) ? ERR_FILE_NOT_FOUND : ERR_IO;
+    }
+    if(1 != fread(&db_file.header, sizeof(struct pictdb_header), 1, db_file.fpdb)) {
+        errorCode = ERR_IO;
+    } else if(db_file.header.max_files > MAX_MAX_FILES) {
+        errorCode = ERR_MAX_FILES;
+    } else {
+        *from_version = db_file.header.format_version;
+        errorCode = migrate_db_file(&db_file, db_filename, progress);
+    }
+    do_close(&db_file);
+    return errorCode;
+}
@@ -6,17 +6,17 @@
  */
 
 #include "image_content.h"
+#include "metrics.h"
+#include "trace.h"
 
-/********************************************************************//**
- * Read an image from the pictDB and save it to the buffer if it exists.
- * If the image does not exist in the given dimension, call lazily_resize
- * to create the image.
+/**
+ * @brief Read an image from the pictDB, see do_read.
  */
-int do_read(const char* pictID,
-            size_t dim,
-            char** image_buffer,
-            uint32_t* image_size,
-            struct pictdb_file* db_file)
+static int read_image(const char* pictID,
+                      size_t dim,
+                      char** image_buffer,
+                      uint32_t* image_size,
+                      struct pictdb_file* db_file)
 {
     //Test argument
     //In this project, pictDBM, we made the decision to return the error
@@ -28,7 +28,7 @@ int do_read(const char* pictID,
         return ERR_INVALID_ARGUMENT;
     }
     //Test dimension argument
-    if((RES_THUMB != dim) && (RES_SMALL != dim) && (RES_ORIG != dim)) {
+    if(!IS_DB_RES(db_file, dim)) {
         return ERR_RESOLUTIONS;
     }
     //Search pictID in metadata
@@ -47,6 +47,25 @@ int do_read(const char* pictID,
 
     //We know the size and the position in file -> dynamic allocation of buffer and load the image in it
     //Load the size in the image_size
-    *image_size = db_file->metadata[i].size[dim];
+    *image_size = get_pict_image_size(db_file, i, dim);
     return read_db_file_image(image_buffer, i, dim, db_file);
 }
+
+/********************************************************************//**
+ * Read an image from the pictDB and save it to the buffer if it exists.
+ * If the image does not exist in the given dimension, call lazily_resize
+ * to create the image.
+ */
+int do_read(const char* pictID,
+            size_t dim,
+            char** image_buffer,
+            uint32_t* image_size,
+            struct pictdb_file* db_file)
+{
+    const double start = metrics_now();
+    TRACE_BEGIN(span, "do_read");
+    const int errorCode = read_image(pictID, dim, image_buffer, image_size, db_file);
+    TRACE_END(span);
+    metrics_observe(OP_DO_READ, start);
+    return errorCode;
+}
@@ -0,0 +1,224 @@
+/**
+ * @file db_read_batch.c
+ * @brief pictDB library: do_read_batch implementation
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "image_content.h"
+
+/**
+ * @brief One requested picture of a batch
+ *
+ * pictID The requested picture ID
+ * pos Position of the request in the caller's arrays
+ * index Index of the picture in the metadata (max_files if not found)
+ * offset Offset of the picture in the wanted dimension
+ */
+struct batch_entry {
+    const char* pictID;
+    size_t pos;
+    size_t index;
+    uint64_t offset;
+};
+
+/**
+ * @brief qsort/bsearch comparator ordering batch entries by picture ID
+ */
+static int cmp_entry_id(const void* a, const void* b)
+{
+    return strcmp(((const struct batch_entry*) a)->pictID, ((const struct batch_entry*) b)->pictID);
+}
+
+/**
+ * @brief qsort comparator ordering batch entries by offset in the file
+ */
+static int cmp_entry_offset(const void* a, const void* b)
+{
+    const uint64_t offset_a = ((const struct batch_entry*) a)->offset;
+    const uint64_t offset_b = ((const struct batch_entry*) b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/**
+ * @brief Frees every buffer already read and resets the outputs
+ */
+static void free_batch_buffers(char* image_buffers[], uint32_t image_sizes[], size_t nb_ids)
+{
+    for(size_t i = 0; i < nb_ids; ++i) {
+        free(image_buffers[i]);
+        image_buffers[i] = NULL;
+        image_sizes[i] = 0;
+    }
+}
+
+/**
+ * @brief Reads the images of a batch in a resolution of the derivative
+ * cache, each one right after it is resized if it is missing: resizing the
+ * next ones may evict it or move it in the cache file.
+ *
+ * @param entries The requested pictures, with their index
+ * @param nb_ids Number of requested pictures
+ * @param dim Internal code corresponding to the dimension we want
+ * @param image_buffers Array of nb_ids byte arrays that will contain the pictures
+ * @param image_sizes Array of nb_ids sizes
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 in case of success
+ */
+static int read_cached_batch(const struct batch_entry entries[], size_t nb_ids, size_t dim,
+                             char* image_buffers[], uint32_t image_sizes[], struct pictdb_file* db_file)
+{
+    for(size_t i = 0; i < nb_ids; ++i) {
+        const struct batch_entry* entry = &entries[i];
+        if(entry->index >= db_file->header.max_files) {
+            continue;
+        }
+        int errorCode = lazily_resize(dim, db_file, entry->index);
+        if(0 == errorCode) {
+            errorCode = read_db_file_image(&image_buffers[entry->pos], entry->index, dim, db_file);
+        }
+        if(0 != errorCode) {
+            image_buffers[entry->pos] = NULL;
+            free_batch_buffers(image_buffers, image_sizes, nb_ids);
+            return errorCode;
+        }
+        image_sizes[entry->pos] = get_pict_image_size(db_file, entry->index, dim);
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Read several images of the same resolution from the pictDB.
+ * The metadata are walked only once to resolve every ID, then the images
+ * are read in the order of their offset in the file, but those of the
+ * derivative cache (see read_cached_batch).
+ */
+int do_read_batch(const char* pictIDs[],
+                  size_t nb_ids,
+                  size_t dim,
+                  char* image_buffers[],
+                  uint32_t image_sizes[],
+                  struct pictdb_file* db_file)
+{
+    //In this project, pictDBM, we made the decision to return the error
+    //ERR_INVALID_ARGUMENT because we did not found a better one and
+    //because this error should not occur since the argument are already
+    //tested before the call of this function. But if this function is used
+    //in an other library, the argument should be tested
+    if((NULL == pictIDs) || (NULL == image_buffers) || (NULL == image_sizes) || (NULL == db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    //Test dimension argument
+    if(!IS_DB_RES(db_file, dim)) {
+        return ERR_RESOLUTIONS;
+    }
+
+    for(size_t i = 0; i < nb_ids; ++i) {
+        image_buffers[i] = NULL;
+        image_sizes[i] = 0;
+    }
+    if(0 == nb_ids) {
+        return 0;
+    }
+
+    struct batch_entry* entries = calloc(nb_ids, sizeof(struct batch_entry));
+    if(NULL == entries) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(size_t i = 0; i < nb_ids; ++i) {
+        if(NULL == pictIDs[i]) {
+            free(entries);
+            return ERR_INVALID_ARGUMENT;
+        }
+        entries[i].pictID = pictIDs[i];
+        entries[i].pos = i;
+        entries[i].index = db_file->header.max_files;
+    }
+
+    int errorCode = 0;
+    if((NULL != db_file->pager) && !db_file->pager->complete) {
+        //Not all the metadata are read: each ID is found with the hash table instead
+        for(size_t i = 0; (i < nb_ids) && (0 == errorCode); ++i) {
+            errorCode = get_image_index(entries[i].pictID, &entries[i].index, db_file);
+            if(ERR_FILE_NOT_FOUND == errorCode) {
+                entries[i].index = db_file->header.max_files;
+                errorCode = 0;
+            }
+        }
+        if(0 != errorCode) {
+            free(entries);
+            return errorCode;
+        }
+    } else {
+        //Resolves all the IDs in a single pass over the metadata
+        qsort(entries, nb_ids, sizeof(struct batch_entry), cmp_entry_id);
+        for(size_t i = next_valid_index(db_file, 0); i < db_file->header.max_files; i = next_valid_index(db_file, i + 1)) {
+            struct batch_entry key;
+            key.pictID = get_pict_id(db_file, i);
+            struct batch_entry* found = bsearch(&key, entries, nb_ids, sizeof(struct batch_entry), cmp_entry_id);
+            if(NULL != found) {
+                //The same ID may have been requested several times
+                while((found > entries) && (0 == cmp_entry_id(found - 1, &key))) {
+                    --found;
+                }
+                for(; (found < entries + nb_ids) && (0 == cmp_entry_id(found, &key)); ++found) {
+                    found->index = i;
+                }
+            }
+        }
+    }
+
+    if(IS_CACHED_RES(db_file, dim)) {
+        errorCode = read_cached_batch(entries, nb_ids, dim, image_buffers, image_sizes, db_file);
+        free(entries);
+        return errorCode;
+    }
+
+    //Creates the missing resized images before reading anything
+    for(size_t i = 0; i < nb_ids; ++i) {
+        if(entries[i].index < db_file->header.max_files) {
+            errorCode = lazily_resize(dim, db_file, entries[i].index);
+            if(0 != errorCode) {
+                free(entries);
+                return errorCode;
+            }
+            entries[i].offset = get_pict_image_offset(db_file, entries[i].index, dim);
+        }
+    }
+
+    //Reads the images sequentially in the file
+    qsort(entries, nb_ids, sizeof(struct batch_entry), cmp_entry_offset);
+    const struct batch_entry* previous = NULL;
+    for(size_t i = 0; i < nb_ids; ++i) {
+        const struct batch_entry* entry = &entries[i];
+        if(entry->index >= db_file->header.max_files) {
+            continue;
+        }
+        const uint32_t size = get_pict_image_size(db_file, entry->index, dim);
+        if((NULL != previous) && (previous->offset == entry->offset)) {
+            //Same content (duplicate request or deduplicated image): no need to read it again
+            image_buffers[entry->pos] = calloc(size, sizeof(char));
+            if(NULL == image_buffers[entry->pos]) {
+                errorCode = ERR_OUT_OF_MEMORY;
+            } else {
+                memcpy(image_buffers[entry->pos], image_buffers[previous->pos], size);
+            }
+        } else {
+            errorCode = read_db_file_image(&image_buffers[entry->pos], entry->index, dim, db_file);
+            if(0 != errorCode) {
+                image_buffers[entry->pos] = NULL;
+            }
+        }
+        if(0 != errorCode) {
+            free(entries);
+            free_batch_buffers(image_buffers, image_sizes, nb_ids);
+            return errorCode;
+        }
+        image_sizes[entry->pos] = size;
+        previous = entry;
+    }
+
+    free(entries);
+    return 0;
+}
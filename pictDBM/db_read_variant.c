@@ -0,0 +1,241 @@
+/**
+ * @file db_read_variant.c
+ * @brief pictDB library: do_read_variant implementation
+ *
+ * The variants are the pictures resized on demand to the box asked by a
+ * client instead of one of the resolutions of the database. The boxes are
+ * rounded up to a few sizes, so that a variant is shared by the close
+ * requests and the few entries of each blob in the derivative cache hold
+ * the sizes actually displayed. The images of the resolutions in the other
+ * formats than JPEG are kept as variants too, in the box of their resolution.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "image_content.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define NB_VARIANT_SIZES 13
+
+// Sizes of the boxes of the variants, about sqrt(2) apart
+static const uint32_t VARIANT_SIZES[NB_VARIANT_SIZES] = {
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, MAX_VARIANT_RES
+};
+
+// Names of the fits, indexed by their codes
+static const char* const FIT_NAMES[NB_FIT] = {"contain", "cover", "fill"};
+
+/********************************************************************//**
+ * Converts a string into the wanted fit.
+ */
+int fit_atoi(const char* fit)
+{
+    for(int i = 0; (NULL != fit) && (i < NB_FIT); ++i) {
+        if(strcmp(fit, FIT_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Rounds a dimension of a box up to the next size of the variants.
+ *
+ * @param size The dimension, between 1 and MAX_VARIANT_RES
+ *
+ * @return Returns the rounded dimension
+ */
+static uint32_t quantize_size(uint32_t size)
+{
+    size_t i = 0;
+    while(VARIANT_SIZES[i] < size) {
+        ++i;
+    }
+    return VARIANT_SIZES[i];
+}
+
+/********************************************************************//**
+ * Rounds the box of a variant up to the next sizes.
+ */
+int quantize_variant(uint32_t* width, uint32_t* height, int fit)
+{
+    if((NULL == width) || (NULL == height) || (fit < 0) || (fit >= NB_FIT) ||
+       (*width > MAX_VARIANT_RES) || (*height > MAX_VARIANT_RES)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    //Only a contained picture can be bounded in one dimension
+    if(((0 == *width) && (0 == *height)) || ((FIT_CONTAIN != fit) && ((0 == *width) || (0 == *height)))) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *width = (0 != *width) ? quantize_size(*width) : MAX_VARIANT_RES;
+    *height = (0 != *height) ? quantize_size(*height) : MAX_VARIANT_RES;
+    return 0;
+}
+
+/**
+ * @brief Resizes an original image to the box of a variant and saves it in
+ * a buffer.
+ *
+ * @param original The original image
+ * @param original_size The size of the original image
+ * @param width The width of the box
+ * @param height The height of the box
+ * @param fit FIT_CONTAIN, FIT_COVER or FIT_FILL
+ * @param format FORMAT_JPEG, FORMAT_WEBP or FORMAT_AVIF
+ * @param encoding The encoding of the resized image
+ * @param image_buffer Pointer to the resized image, allocated by VIPS
+ * @param image_size Pointer to the size of the resized image
+ *
+ * @return Returns 0 in case of success
+ */
+static int resize_variant(char* original, uint32_t original_size, uint32_t width, uint32_t height, int fit,
+                          int format, const struct pict_encoding* encoding, void** image_buffer, size_t* image_size)
+{
+    VipsImage* image = NULL;
+    //The originals are never enlarged, but to be stretched to the box
+    const VipsSize size = (FIT_FILL == fit) ? VIPS_SIZE_FORCE : VIPS_SIZE_DOWN;
+    const VipsInteresting crop = (FIT_COVER == fit) ? VIPS_INTERESTING_CENTRE : VIPS_INTERESTING_NONE;
+
+    //The thumbnail operation shrinks the JPEG while decoding it
+    TRACE_BEGIN(resize_span, "vips_thumbnail_buffer");
+    const int resize_result = vips_thumbnail_buffer(original, original_size, &image, (int) width,
+                              "height", (int) height, "size", size, "crop", crop, NULL);
+    TRACE_END(resize_span);
+    if(0 != resize_result) {
+        return ERR_VIPS;
+    }
+
+    const int errorCode = save_image_buffer(image, format, encoding, image_buffer, image_size);
+    g_object_unref(image);
+    return errorCode;
+}
+
+/**
+ * @brief Reads a variant of a picture from the derivative cache, or resizes
+ * it from the original and writes it in the cache if it can. The variant is
+ * encoded as the smallest resolution filling its box (see fit_resolution).
+ *
+ * @param index The index of the picture's metadata
+ * @param width The width of the box
+ * @param height The height of the box
+ * @param fit FIT_CONTAIN, FIT_COVER or FIT_FILL
+ * @param format FORMAT_JPEG, FORMAT_WEBP or FORMAT_AVIF
+ * @param image_buffer address of a byte array (that will contain the picture)
+ * @param image_size address of a unsigned 32bit int that will containe the picture's size
+ * @param db_file The database, with the picture's metadata and blob loaded
+ *
+ * @return Returns 0 in case of success
+ */
+static int get_variant(size_t index, uint32_t width, uint32_t height, int fit, int format,
+                       char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file)
+{
+    const size_t blob = db_file->metadata[index].blob;
+    const uint32_t variant = VARIANT_KEY(width, height, fit, format);
+    int errorCode = 0;
+    if(NULL != db_file->cache) {
+        errorCode = read_cached_variant(image_buffer, image_size, blob, variant, db_file);
+        if(ERR_FILE_NOT_FOUND != errorCode) {
+            return errorCode;
+        }
+    }
+
+    //Only the actual resizes are recorded in the metrics
+    const double start = metrics_now();
+    char* original = NULL;
+    errorCode = read_db_file_image(&original, index, RES_ORIG, db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    void* resized = NULL;
+    size_t resized_size = 0;
+    const size_t res = fit_resolution(db_file, width, height);
+    errorCode = resize_variant(original, get_pict_image_size(db_file, index, RES_ORIG), width, height, fit,
+                               format, &db_file->resolutions.resolutions[res].encoding, &resized, &resized_size);
+    free(original);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    //The variants are only kept in the cache of a database opened for writing
+    if(CAN_CACHE_VARIANTS(db_file)) {
+        errorCode = write_cached_variant(resized, resized_size, blob, variant, db_file);
+    }
+    if(0 == errorCode) {
+        *image_buffer = malloc(resized_size);
+        errorCode = (NULL == *image_buffer) ? ERR_OUT_OF_MEMORY : 0;
+    }
+    if(0 == errorCode) {
+        memcpy(*image_buffer, resized, resized_size);
+        *image_size = resized_size;
+        metrics_observe(OP_LAZILY_RESIZE, start);
+    }
+    g_free(resized);
+    return errorCode;
+}
+
+/**
+ * @brief Read a variant of a picture from the pictDB, see do_read_variant.
+ */
+static int read_variant(const char* pictID, uint32_t width, uint32_t height, int fit, int format,
+                        char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file)
+{
+    if((NULL == pictID) || (NULL == image_buffer) || (NULL == image_size) || (NULL == db_file) ||
+       (format < 0) || (format >= NB_FORMATS)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int errorCode = quantize_variant(&width, &height, fit);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    size_t index = 0;
+    errorCode = get_image_index(pictID, &index, db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    return get_variant(index, width, height, fit, format, image_buffer, image_size, db_file);
+}
+
+/********************************************************************//**
+ * Read a picture resized to a box from the pictDB, from the derivative
+ * cache if it was already resized so.
+ */
+int do_read_variant(const char* pictID, uint32_t width, uint32_t height, int fit, int format,
+                    char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file)
+{
+    const double start = metrics_now();
+    TRACE_BEGIN(span, "do_read_variant");
+    const int errorCode = read_variant(pictID, width, height, fit, format, image_buffer, image_size, db_file);
+    TRACE_END(span);
+    metrics_observe(OP_DO_READ_VARIANT, start);
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Read a picture in a resolution of the pictDB and in another format.
+ */
+int do_read_format(const char* pictID, size_t dim, int format,
+                   char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file)
+{
+    if((FORMAT_JPEG == format) || (RES_ORIG == dim)) {
+        return do_read(pictID, dim, image_buffer, image_size, db_file);
+    }
+    if((NULL == pictID) || (NULL == image_buffer) || (NULL == image_size) || (NULL == db_file) ||
+       (format < 0) || (format >= NB_FORMATS) || !CAN_CACHE_VARIANTS(db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(!IS_DB_RES(db_file, dim)) {
+        return ERR_RESOLUTIONS;
+    }
+    const double start = metrics_now();
+    TRACE_BEGIN(span, "do_read_format");
+    size_t index = 0;
+    int errorCode = get_image_index(pictID, &index, db_file);
+    if(0 == errorCode) {
+        const uint16_t* res = db_file->resolutions.resolutions[dim].res;
+        errorCode = get_variant(index, res[DIM_X_ORIG], res[DIM_Y_ORIG], FIT_CONTAIN, format,
+                                image_buffer, image_size, db_file);
+    }
+    TRACE_END(span);
+    metrics_observe(OP_DO_READ_VARIANT, start);
+    return errorCode;
+}
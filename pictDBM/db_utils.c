@@ -10,6 +10,10 @@
  */
 
 #include "pictDB.h"
+#include "trace.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
 
 /********************************************************************//**
  * Human-readable SHA
@@ -29,15 +33,39 @@ static void sha_to_string(const unsigned char* SHA, char* sha_string)
 /********************************************************************//**
  * pictDB header display.
  */
-void print_header(const struct pictdb_header* header)
+void print_header(const struct pictdb_header* header, const struct pict_resolution_table* resolutions)
 {
     printf("*****************************************\n");
     printf("**********DATABASE HEADER START**********\n");
     printf("DB NAME: %31s\n", header->db_name);
     printf("VERSION: %" PRIu32 "\n", header->db_version);
     printf("IMAGE COUNT: %" PRIu32 "\t\tMAX IMAGES: %" PRIu32 "\n", header->num_files, header->max_files);
+    printf("LIVE BYTES: %" PRIu64 "\t\tDEAD BYTES: %" PRIu64 "\n", header->live_bytes, header->dead_bytes);
+    if(0 != (header->features & PICTDB_FEATURE_ALIGNED)) {
+        printf("IMAGE ALIGNMENT: %" PRIu64 "\n", DB_ALIGNMENT(header));
+    }
+    if(0 != (header->features & PICTDB_FEATURE_DERIVATIVE_CACHE)) {
+        printf("DERIVATIVE CACHE: %" PRIu64 "\n", DB_CACHE_BUDGET(header));
+    }
     printf("THUMBNAIL: %" PRIu16 " x %" PRIu16 "\tSMALL: %" PRIu16 " x %" PRIu16 "\n", header->res_resized[DIM_X_THUMB],
            header->res_resized[DIM_Y_THUMB], header->res_resized[DIM_X_SMALL], header->res_resized[DIM_Y_SMALL]);
+    for(size_t res = NB_DEFAULT_RES; res < resolutions->nb_res; ++res) {
+        printf("%s: %" PRIu16 " x %" PRIu16 "\n", resolutions->resolutions[res].name,
+               resolutions->resolutions[res].res[DIM_X_ORIG], resolutions->resolutions[res].res[DIM_Y_ORIG]);
+    }
+    //Only the encodings set when the database was created are displayed
+    for(size_t res = 0; res < resolutions->nb_res; ++res) {
+        const struct pict_encoding* encoding = &resolutions->resolutions[res].encoding;
+        if((DEFAULT_QUALITY != encoding->quality) || (DEFAULT_ENCODING_FLAGS != encoding->flags) ||
+           (SUBSAMPLE_AUTO != encoding->subsample)) {
+            printf("JPEG %s: QUALITY %" PRIu8 "%s%s%s%s\n", resolutions->resolutions[res].name, encoding->quality,
+                   (0 != (encoding->flags & ENCODING_PROGRESSIVE)) ? " PROGRESSIVE" : "",
+                   (0 != (encoding->flags & ENCODING_STRIP)) ? " STRIP" : "",
+                   (0 != (encoding->flags & ENCODING_OPTIMIZE)) ? " OPTIMIZE" : "",
+                   (SUBSAMPLE_ON == encoding->subsample) ? " 4:2:0" :
+                   (SUBSAMPLE_OFF == encoding->subsample) ? " 4:4:4" : "");
+        }
+    }
     printf("***********DATABASE HEADER END***********\n");
     printf("*****************************************\n");
 }
@@ -45,26 +73,79 @@ void print_header(const struct pictdb_header* header)
 /********************************************************************//**
  * Metadata display.
  */
-void print_metadata(const struct pict_metadata* metadata)
+void print_metadata(const struct pict_metadata* metadata, const struct pict_blob* blob, const char* pict_id,
+                    const struct pict_resolution_table* resolutions)
 {
     char sha_printable[2*SHA256_DIGEST_LENGTH+1];
-    sha_to_string(metadata->SHA, sha_printable);
+    sha_to_string(blob->SHA, sha_printable);
 
-    printf("PICTURE ID: %s\n", metadata->pict_id);
+    printf("PICTURE ID: %s\n", pict_id);
     printf("SHA: %s\n", sha_printable);
     printf("VALID: %" PRIu16 "\n", metadata->is_valid);
-    printf("UNUSED: %" PRIu16 "\n", metadata->unused_16);
-    printf("OFFSET ORIG. : %" PRIu64 "\t\tSIZE ORIG. : %" PRIu32 "\n", metadata->offset[RES_ORIG], metadata->size[RES_ORIG]);
-    printf("OFFSET THUMB.: %" PRIu64 "\t\tSIZE THUMB.: %" PRIu32 "\n", metadata->offset[RES_THUMB], metadata->size[RES_THUMB]);
-    printf("OFFSET SMALL : %" PRIu64 "\t\tSIZE SMALL : %" PRIu32 "\n", metadata->offset[RES_SMALL], metadata->size[RES_SMALL]);
-    printf("ORIGINAL: %" PRIu32 " x %" PRIu32 "\n", metadata->res_orig[DIM_X_ORIG], metadata->res_orig[DIM_Y_ORIG]);
+    printf("BLOB: %" PRIu32 "\t\tREFERENCES: %" PRIu32 "\n", metadata->blob, blob->refcount);
+    printf("OFFSET ORIG. : %" PRIu64 "\t\tSIZE ORIG. : %" PRIu32 "\n", blob->offset[RES_ORIG], blob->size[RES_ORIG]);
+    printf("OFFSET THUMB.: %" PRIu64 "\t\tSIZE THUMB.: %" PRIu32 "\n", blob->offset[RES_THUMB], blob->size[RES_THUMB]);
+    printf("OFFSET SMALL : %" PRIu64 "\t\tSIZE SMALL : %" PRIu32 "\n", blob->offset[RES_SMALL], blob->size[RES_SMALL]);
+    for(size_t res = NB_DEFAULT_RES; res < resolutions->nb_res; ++res) {
+        printf("OFFSET %s: %" PRIu64 "\t\tSIZE %s: %" PRIu32 "\n", resolutions->resolutions[res].name,
+               blob->offset[res], resolutions->resolutions[res].name, blob->size[res]);
+    }
+    printf("ORIGINAL: %" PRIu32 " x %" PRIu32 "\n", blob->res_orig[DIM_X_ORIG], blob->res_orig[DIM_Y_ORIG]);
     printf("*****************************************\n");
 }
 
 /********************************************************************//**
- * Open the database file and load its content in memory.
+ * Reads the string heap, the blob table and all the metadata of a database.
  */
-int do_open(const char* db_filename, const char* open_mode, struct pictdb_file* db_file)
+int read_db_file_metadata(struct pictdb_file* db_file)
+{
+    int errorCode = read_pict_id_heap(db_file);
+    if(0 == errorCode) {
+        errorCode = read_blob_table(db_file, 0);
+    }
+    if(0 == errorCode) {
+        errorCode = read_thumb_region(db_file);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    //Allocating dynamiclly the metadata
+    db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
+    if(db_file->metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    //Read and load metadata
+    TRACE_BEGIN(span, "do_open:fread metadata");
+    const size_t nb_read = fread(db_file->metadata, sizeof(struct pict_metadata), db_file->header.max_files, db_file->fpdb);
+    TRACE_END(span);
+    if(nb_read != db_file->header.max_files) {
+        return ERR_IO;
+    }
+
+    //Test if the IDs are in the heap and the blobs are used
+    for(size_t i = 0; (i < db_file->header.max_files) && (0 == errorCode); ++i) {
+        errorCode = check_pict_id(db_file, &db_file->metadata[i]);
+        if(0 == errorCode) {
+            errorCode = check_pict_blob(db_file, &db_file->metadata[i]);
+        }
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Opens the database file and loads its content in memory, see
+ * do_open and do_open_lazy.
+ *
+ * @param db_filename The name of the file to read.
+ * @param open_mode The type of opening on the file.
+ * @param db_file In memory structure with header and metadata
+ * @param lazy Tells if the metadata are read when first used
+ *
+ * @return Returns 0 if it succeded or a corresponding error code
+ */
+static int open_db_file(const char* db_filename, const char* open_mode, struct pictdb_file* db_file, int lazy)
 {
     //Test if the pointer are not NULL
     //In this project, pictDBM, we made the decision to return the error
@@ -80,6 +161,23 @@ int do_open(const char* db_filename, const char* open_mode, struct pictdb_file*
     if(strlen(db_filename) > FILENAME_MAX && strlen(db_filename) != 0) {
         return ERR_INVALID_FILENAME;
     }
+    db_file->metadata = NULL;
+    db_file->ids = NULL;
+    db_file->blobs = NULL;
+    db_file->used_blobs = NULL;
+    db_file->extents = NULL;
+    db_file->direct_fd = -1;
+    db_file->cache = NULL;
+    memset(&db_file->columns, 0, sizeof(struct metadata_columns));
+    db_file->pager = NULL;
+    db_file->nb_buckets = 0;
+    db_file->buckets = NULL;
+
+    //An interrupted migration is undone before reading the file
+    int errorCode = recover_migration(db_filename, open_mode);
+    if(0 != errorCode) {
+        return errorCode;
+    }
 
     //Opening the file in the specify mode
     db_file->fpdb = fopen(db_filename, open_mode);
@@ -112,22 +210,66 @@ int do_open(const char* db_filename, const char* open_mode, struct pictdb_file*
         }
     }
 
-    //Allocating dynamiclly the metadata
-    db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
-    if(db_file->metadata == NULL) {
-        do_close(db_file);
-        return ERR_OUT_OF_MEMORY;
+    //Read and load metadata, in the format of the file
+    errorCode = check_format(&db_file->header);
+    if((0 == errorCode) && (PICTDB_FORMAT_VERSION != db_file->header.format_version)) {
+        if(NULL != strchr(open_mode, '+')) {
+            errorCode = migrate_db_file(db_file, db_filename, NULL);
+        } else {
+            errorCode = read_old_metadata(db_file);
+        }
     }
-
-    //Read and load metadata
-    if(fread(db_file->metadata, sizeof(struct pict_metadata), db_file->header.max_files, db_file->fpdb) != db_file->header.max_files) {
+    if((0 == errorCode) && lazy && (NULL == db_file->metadata)) {
+        errorCode = init_metadata_pager(db_file);
+        //The index does not match the header: all the metadata are read
+        if((0 == errorCode) && (NULL == db_file->pager) &&
+           (0 != fseek(db_file->fpdb, sizeof(struct pictdb_header), SEEK_SET))) {
+            errorCode = ERR_IO;
+        }
+    }
+    if((0 == errorCode) && (NULL == db_file->metadata)) {
+        errorCode = read_db_file_metadata(db_file);
+    }
+    if((0 == errorCode) && (NULL == db_file->pager)) {
+        errorCode = build_metadata_columns(db_file);
+    }
+    const int current_format = (PICTDB_FORMAT_VERSION == db_file->header.format_version);
+    if((0 == errorCode) && current_format && (NULL == db_file->buckets)) {
+        errorCode = read_hash_index(db_file);
+    }
+    //The hash tables of an older format or not matching the header are rebuilt
+    if((0 == errorCode) && (NULL == db_file->buckets)) {
+        errorCode = build_hash_index(db_file);
+        if((0 == errorCode) && current_format && (NULL != strchr(open_mode, '+'))) {
+            errorCode = write_hash_index(db_file);
+        }
+    }
+    if(0 == errorCode) {
+        errorCode = open_derivative_cache(db_file, db_filename, open_mode);
+    }
+    if(0 != errorCode) {
         do_close(db_file);
-        return ERR_IO;
+        return errorCode;
     }
-
     return 0;
 }
 
+/********************************************************************//**
+ * Open the database file and load its content in memory.
+ */
+int do_open(const char* db_filename, const char* open_mode, struct pictdb_file* db_file)
+{
+    return open_db_file(db_filename, open_mode, db_file, 0);
+}
+
+/********************************************************************//**
+ * Open the database file and load its index in memory.
+ */
+int do_open_lazy(const char* db_filename, const char* open_mode, struct pictdb_file* db_file)
+{
+    return open_db_file(db_filename, open_mode, db_file, 1);
+}
+
 /********************************************************************//**
  * Close the database's file and free the metadatas pointer
  */
@@ -141,23 +283,13 @@ void do_close(struct pictdb_file* db_file)
         free(db_file->metadata);
         db_file->metadata = NULL;
     }
-}
-
-/********************************************************************//**
- * Converts a string into the wanted resolution.
- */
-int resolution_atoi(const char* resolution)
-{
-    if(resolution != NULL) {
-        if(strcmp(resolution, "thumb") == 0 || strcmp(resolution, "thumbnail") == 0) {
-            return RES_THUMB;
-        } else if(strcmp(resolution, "small") == 0) {
-            return RES_SMALL;
-        } else if(strcmp(resolution, "orig") == 0 || strcmp(resolution, "original") == 0) {
-            return RES_ORIG;
-        }
-    }
-    return -1;
+    free_pict_id_heap(db_file);
+    free_blob_table(db_file);
+    free_metadata_columns(db_file);
+    free_metadata_pager(db_file);
+    free_hash_index(db_file);
+    close_direct_reads(db_file);
+    close_derivative_cache(db_file);
 }
 
 /********************************************************************//**
@@ -182,11 +314,33 @@ int read_disk_image(char** image_buffer, const uint32_t image_size, FILE* f)
  */
 int read_db_file_image(char** image_buffer, const size_t index, const size_t dim, const struct pictdb_file* db_file)
 {
-    if(0 != fseek(db_file->fpdb, db_file->metadata[index].offset[dim], SEEK_SET)) {
+    if(IS_CACHED_RES(db_file, dim)) {
+        TRACE_BEGIN(cache_span, "read_db_file_image:cache");
+        const int errorCode = read_cached_image(image_buffer, db_file->metadata[index].blob, dim, db_file);
+        TRACE_END(cache_span);
+        return errorCode;
+    }
+    const struct pict_blob* blob = get_pict_blob(db_file, index);
+    if((RES_ORIG == dim) && (-1 != db_file->direct_fd) && (0 != blob->size[dim])) {
+        TRACE_BEGIN(direct_span, "read_db_file_image:pread");
+        const int errorCode = read_direct_image(image_buffer, blob->offset[dim], blob->size[dim], db_file);
+        TRACE_END(direct_span);
+        //The image is read through fpdb if the device refuses the alignment
+        if(ERR_IO != errorCode) {
+            return errorCode;
+        }
+    }
+    TRACE_BEGIN(seek_span, "read_db_file_image:fseek");
+    const int seek_result = fseek(db_file->fpdb, blob->offset[dim], SEEK_SET);
+    TRACE_END(seek_span);
+    if(0 != seek_result) {
         return ERR_IO;
     }
-    size_t size = db_file->metadata[index].size[dim];
-    return read_disk_image(image_buffer, size, db_file->fpdb);
+    size_t size = blob->size[dim];
+    TRACE_BEGIN(read_span, "read_db_file_image:fread");
+    const int errorCode = read_disk_image(image_buffer, size, db_file->fpdb);
+    TRACE_END(read_span);
+    return errorCode;
 }
 
 /********************************************************************//**
@@ -205,14 +359,41 @@ int write_disk_image(const char* image_buffer, const uint32_t image_size, FILE*
  */
 int write_db_file_image(const char* image_buffer, const uint32_t image_size, long* offset, struct pictdb_file* db_file)
 {
-    if(0 != fseek(db_file->fpdb, 0L, SEEK_END)) {
-        return ERR_IO;
+    //The image is written in a free extent, or at the end of the file
+    const uint64_t alignment = DB_ALIGNMENT(&db_file->header);
+    const uint64_t padded_size = ALIGN_UP((uint64_t) image_size, alignment);
+    uint64_t free_offset = 0;
+    int errorCode = take_free_extent(db_file, padded_size, &free_offset);
+    if(0 == errorCode) {
+        *offset = free_offset;
+    } else if(ERR_FULL_DATABASE != errorCode) {
+        return errorCode;
+    } else {
+        if(0 != fseek(db_file->fpdb, 0L, SEEK_END)) {
+            return ERR_IO;
+        }
+        const long end = ftell(db_file->fpdb);
+        if(-1 == end) {
+            return ERR_IO;
+        }
+        //The bytes skipped to align the image are not used
+        *offset = ALIGN_UP((uint64_t) end, alignment);
+        db_file->header.dead_bytes += *offset - end;
     }
-    *offset = ftell(db_file->fpdb);
-    if(-1 == *offset) {
+    if(0 != fseek(db_file->fpdb, *offset, SEEK_SET)) {
         return ERR_IO;
     }
-    return write_disk_image(image_buffer, image_size, db_file->fpdb);
+    TRACE_BEGIN(span, "write_db_file_image:fwrite");
+    errorCode = write_disk_image(image_buffer, image_size, db_file->fpdb);
+    TRACE_END(span);
+    //The padding ends the file at a multiple of the alignment
+    if((0 == errorCode) && (padded_size > image_size)) {
+        db_file->header.dead_bytes += padded_size - image_size;
+        if((0 != fseek(db_file->fpdb, *offset + padded_size - 1, SEEK_SET)) || (EOF == fputc('\0', db_file->fpdb))) {
+            errorCode = ERR_IO;
+        }
+    }
+    return errorCode;
 }
 
 
@@ -241,20 +422,11 @@ int get_image_size(FILE* image, long* size)
  */
 int get_image_index(const char* pictID, size_t* index, const struct pictdb_file* db_file)
 {
-    *index = 0;
-    int found = 0;
-    while((*index < db_file->header.max_files) && (0 == found)) {
-        if((NON_EMPTY == db_file->metadata[*index].is_valid) && (0 == strcmp(db_file->metadata[*index].pict_id, pictID))) {
-            found = 1;
-        }
-        ++(*index);
-    }
-    if(0 == found) {
-        return ERR_FILE_NOT_FOUND;
-    }
-    //If found = 1, the index was the previous value of i
-    --(*index);
-    return 0;
+    TRACE_BEGIN(span, "get_image_index");
+    //Only the pictures of the probe sequence of the ID are compared
+    const int errorCode = find_pict_id(db_file, pictID, index);
+    TRACE_END(span);
+    return errorCode;
 }
 
 /********************************************************************//**
@@ -276,13 +448,14 @@ int write_db_file_header(const struct pictdb_file* db_file)
  */
 int write_db_file_one_metadata(const struct pictdb_file* db_file, size_t index)
 {
-    if(0 != fseek(db_file->fpdb, sizeof(struct pictdb_header) + index * sizeof(struct pict_metadata), SEEK_SET)) {
+    if(0 != fseek(db_file->fpdb, METADATA_OFFSET + index * sizeof(struct pict_metadata), SEEK_SET)) {
         return ERR_IO;
     }
+    update_metadata_columns(db_file, index);
     if(1 != fwrite(&db_file->metadata[index], sizeof(struct pict_metadata), 1, db_file->fpdb)) {
         return ERR_IO;
     }
-    return 0;
+    return write_id_index_entry(db_file, index);
 }
 
 /********************************************************************//**
@@ -296,3 +469,163 @@ int cmp_SHA(const unsigned char* SHA_1, const unsigned char* SHA_2)
         return memcmp(SHA_1, SHA_2, SHA256_DIGEST_LENGTH);
     }
 }
+
+/********************************************************************//**
+ * Gets the size of the db_file and the bytes used by no valid picture.
+ */
+int get_db_usage(const struct pictdb_file* db_file, uint64_t* file_size, uint64_t* dead_bytes)
+{
+    if((NULL == db_file) || (NULL == file_size) || (NULL == dead_bytes)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    long size = 0;
+    if(0 != get_image_size(db_file->fpdb, &size)) {
+        return ERR_IO;
+    }
+    *file_size = size;
+    *dead_bytes = db_file->header.dead_bytes;
+    return 0;
+}
+
+/********************************************************************//**
+ * Counts the live and dead bytes of the header from the used blobs.
+ */
+int count_db_usage(struct pictdb_file* db_file)
+{
+    if(NULL == db_file) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const int errorCode = load_metadata(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    long size = 0;
+    if(0 != get_image_size(db_file->fpdb, &size)) {
+        return ERR_IO;
+    }
+
+    //Deduplicated pictures share their blob: each image is counted once
+    const size_t max_files = db_file->header.max_files;
+    uint64_t live = 0;
+    uint64_t live_thumbs = 0;
+    for(size_t blob = 0; blob < max_files; ++blob) {
+        if(IS_USED_BLOB(db_file, blob)) {
+            for(size_t res = 0; res < NB_RES; ++res) {
+                live += db_file->blobs[blob].size[res];
+            }
+            if(IS_IN_THUMB_REGION(db_file, db_file->blobs[blob].offset[RES_THUMB])) {
+                live_thumbs += db_file->blobs[blob].size[RES_THUMB];
+            }
+        }
+    }
+    //The region of the thumbnails is used but for the thumbnails of the freed blobs
+    const struct pict_thumb_region* thumbs = &db_file->thumbs;
+    const uint64_t used = ID_INDEX_OFFSET(max_files) + ID_INDEX_SIZE(max_files) + BLOB_TABLE_AREA_SIZE(max_files) +
+                          db_file->heap.capacity + HASH_INDEX_SIZE(db_file->nb_buckets) +
+                          thumbs->capacity + live - live_thumbs;
+    db_file->header.live_bytes = live;
+    db_file->header.dead_bytes = ((uint64_t) size > used ? (uint64_t) size - used : 0) +
+                                 thumbs->size - live_thumbs;
+    return 0;
+}
+
+/********************************************************************//**
+ * Allocates the metadata columns.
+ */
+int alloc_metadata_columns(struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    struct metadata_columns* columns = &db_file->columns;
+    memset(columns, 0, sizeof(struct metadata_columns));
+
+    int errorCode = 0;
+    columns->valid = calloc(NB_VALID_WORDS(max_files) + 1, sizeof(uint64_t));
+    columns->id_hash = calloc(max_files + 1, sizeof(uint32_t));
+    if((NULL == columns->valid) || (NULL == columns->id_hash)) {
+        errorCode = ERR_OUT_OF_MEMORY;
+    }
+    if(0 != errorCode) {
+        free_metadata_columns(db_file);
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Allocates and fills the metadata columns.
+ */
+int build_metadata_columns(struct pictdb_file* db_file)
+{
+    if((NULL == db_file) || (NULL == db_file->metadata)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const int errorCode = alloc_metadata_columns(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    for(size_t i = 0; i < db_file->header.max_files; ++i) {
+        update_metadata_columns(db_file, i);
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Frees the metadata columns.
+ */
+void free_metadata_columns(struct pictdb_file* db_file)
+{
+    struct metadata_columns* columns = &db_file->columns;
+    free(columns->valid);
+    free(columns->id_hash);
+    memset(columns, 0, sizeof(struct metadata_columns));
+}
+
+/********************************************************************//**
+ * Copies one metadata into the metadata columns.
+ */
+void update_metadata_columns(const struct pictdb_file* db_file, size_t index)
+{
+    const struct metadata_columns* columns = &db_file->columns;
+    if((NULL == columns->valid) || (index >= db_file->header.max_files)) {
+        return;
+    }
+    const struct pict_metadata* metadata = &db_file->metadata[index];
+    const uint64_t bit = UINT64_C(1) << (index % VALID_WORD_BITS);
+    if(NON_EMPTY == metadata->is_valid) {
+        columns->valid[index / VALID_WORD_BITS] |= bit;
+        columns->id_hash[index] = hash_pict_id(get_pict_id(db_file, index));
+    } else {
+        //The ID of an empty metadata is not always initialised
+        columns->valid[index / VALID_WORD_BITS] &= ~bit;
+        columns->id_hash[index] = 0;
+    }
+}
+
+/********************************************************************//**
+ * Index of the first empty metadata.
+ */
+size_t first_empty_index(const struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    const size_t nb_words = NB_VALID_WORDS(max_files);
+    for(size_t word = 0; word < nb_words; ++word) {
+        const uint64_t empty = ~db_file->columns.valid[word];
+        if(0 != empty) {
+            const size_t index = word * VALID_WORD_BITS + __builtin_ctzll(empty);
+            return index < max_files ? index : max_files;
+        }
+    }
+    return max_files;
+}
+
+/********************************************************************//**
+ * 32 bits FNV-1a hash of a picture ID.
+ */
+uint32_t hash_pict_id(const char* pictID)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for(size_t i = 0; (i < MAX_PIC_ID) && ('\0' != pictID[i]); ++i) {
+        hash ^= (unsigned char) pictID[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
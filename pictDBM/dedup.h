@@ -12,13 +12,16 @@
 
 /**
  * @brief Checks that no two images have the same name (pictID)
- *        or the same SHA.
+ *        and finds the blob of the images with the same SHA.
  *
  * @param file The file in which we want to check (already opened).
  * @param index Specify the position of an image in the metadatas.
+ * @param SHA The SHA of the image.
+ * @param blob Pointer to store the index of the blob with the same SHA,
+ *        max_files if there is none.
  *
  * @return Returns 0 if no duplications or dedup succesful.
  */
-int do_name_and_content_dedup(struct pictdb_file* db_file, uint32_t index);
+int do_name_and_content_dedup(struct pictdb_file* db_file, uint32_t index, const unsigned char* SHA, size_t* blob);
 
 #endif //PICTDBPRJ_DEDUP_H
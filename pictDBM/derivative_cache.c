@@ -0,0 +1,866 @@
+/**
+ * @file derivative_cache.c
+ * @brief pictDB library: cache file of the resized images
+ *
+ * The resized images of a database created with a derivative cache are
+ * written in a file next to the database instead of in it, so that the
+ * database file only grows with the originals. The image of each blob and
+ * resolution has a fixed entry in the table of the cache file, checked with
+ * the SHA of the blob, followed by a few entries for the variants of the
+ * blob resized on demand, and the images are appended after the table.
+ * When the budget of the database is reached, the least recently used
+ * images are evicted; when the file reaches twice the budget, the images
+ * left are moved to the beginning of their region. An entry is written
+ * after its image, and cleared before its image is moved, so that an
+ * interrupted write only loses images, which are resized again.
+ *
+ * The entries of the images are linked in the order of their last use, so
+ * that the least recently used image is evicted without scanning the table.
+ * Opening the file only reads its header, and the entries of a blob are
+ * read when first used, like the metadata of do_open_lazy.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+// Number of resized resolutions, stored for each blob
+#define NB_CACHED_RES (NB_RES - 1)
+
+// Number of entries of each blob in the table of the cache file
+#define NB_CACHE_SLOTS (NB_CACHED_RES + MAX_CACHED_VARIANTS)
+
+// Index of the entry of the image of a blob in the table of the cache file
+#define CACHE_SLOT(blob, dim) ((blob) * NB_CACHE_SLOTS + ((dim) < RES_ORIG ? (dim) : (dim) - 1))
+
+// Index of the i-th entry of the variants of a blob in the table of the cache file
+#define VARIANT_SLOT(blob, i) ((blob) * NB_CACHE_SLOTS + NB_CACHED_RES + (i))
+
+// Number of entries of the table of the cache file
+#define NB_CACHE_ENTRIES(max_files) ((size_t) NB_CACHE_SLOTS * (max_files))
+
+// Position of the entry of an image in the cache file
+#define CACHE_ENTRY_OFFSET(slot) (sizeof(struct pict_cache_header) + (uint64_t) (slot) * sizeof(struct cached_image))
+
+// Position of the first image in the cache file
+#define CACHE_DATA_OFFSET(max_files) CACHE_ENTRY_OFFSET(NB_CACHE_ENTRIES(max_files))
+
+/**
+ * @brief Builds the name of the cache file of a database.
+ *
+ * @param db_filename The name of the database file
+ * @param cache_filename Buffer of FILENAME_MAX chars for the name
+ *
+ * @return Returns 0 in case of success
+ */
+static int get_cache_filename(const char* db_filename, char* cache_filename)
+{
+    if(snprintf(cache_filename, FILENAME_MAX, "%s%s", db_filename, CACHE_FILE_SUFFIX) >= FILENAME_MAX) {
+        return ERR_INVALID_FILENAME;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the header of the cache file.
+ *
+ * @param cache The cache
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_cache_header(const struct derivative_cache* cache)
+{
+    if((0 != fseek(cache->file, 0L, SEEK_SET)) ||
+       (1 != fwrite(&cache->header, sizeof(struct pict_cache_header), 1, cache->file))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the entry of an image in the table of the cache file.
+ *
+ * @param cache The cache
+ * @param slot The index of the entry
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_cache_entry(const struct derivative_cache* cache, size_t slot)
+{
+    if((0 != fseek(cache->file, CACHE_ENTRY_OFFSET(slot), SEEK_SET)) ||
+       (1 != fwrite(&cache->images[slot], sizeof(struct cached_image), 1, cache->file))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Marks the cache file as dirty before its first modification, so
+ * that it is rebuilt when opened again if it is not closed.
+ *
+ * @param cache The cache, opened for writing
+ *
+ * @return Returns 0 in case of success
+ */
+static int mark_cache_dirty(struct derivative_cache* cache)
+{
+    if(0 != cache->header.is_dirty) {
+        return 0;
+    }
+    cache->header.is_dirty = 1;
+    if((0 != write_cache_header(cache)) || (0 != fflush(cache->file))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets the entry of an image, after reading the entries of its blob
+ * if they are not read yet.
+ *
+ * @param cache The cache
+ * @param slot The index of the entry
+ *
+ * @return Returns the entry, NULL if it cannot be read
+ */
+static struct cached_image* get_cache_entry(struct derivative_cache* cache, size_t slot)
+{
+    const size_t blob = slot / NB_CACHE_SLOTS;
+    const uint64_t bit = UINT64_C(1) << (blob % VALID_WORD_BITS);
+    if(0 == (cache->loaded[blob / VALID_WORD_BITS] & bit)) {
+        if((0 != fseek(cache->file, CACHE_ENTRY_OFFSET(blob * NB_CACHE_SLOTS), SEEK_SET)) ||
+           (fread(&cache->images[blob * NB_CACHE_SLOTS], sizeof(struct cached_image), NB_CACHE_SLOTS,
+                  cache->file) != NB_CACHE_SLOTS)) {
+            return NULL;
+        }
+        cache->loaded[blob / VALID_WORD_BITS] |= bit;
+    }
+    return &cache->images[slot];
+}
+
+/**
+ * @brief Removes an image from the list of the cached images.
+ *
+ * @param cache The cache
+ * @param slot The index of the entry of the image, read and with an image
+ *
+ * @return Returns 0 in case of success
+ */
+static int unlink_cached_image(struct derivative_cache* cache, size_t slot)
+{
+    struct cached_image* image = &cache->images[slot];
+    struct cached_image* prev = (NO_CACHE_SLOT != image->prev) ? get_cache_entry(cache, image->prev) : NULL;
+    struct cached_image* next = (NO_CACHE_SLOT != image->next) ? get_cache_entry(cache, image->next) : NULL;
+    if(((NO_CACHE_SLOT != image->prev) && (NULL == prev)) || ((NO_CACHE_SLOT != image->next) && (NULL == next))) {
+        return ERR_IO;
+    }
+    int errorCode = 0;
+    if(NULL != prev) {
+        prev->next = image->next;
+        errorCode = write_cache_entry(cache, image->prev);
+    } else {
+        cache->header.oldest = image->next;
+    }
+    if(NULL != next) {
+        next->prev = image->prev;
+        errorCode = (0 != errorCode) ? errorCode : write_cache_entry(cache, image->next);
+    } else {
+        cache->header.newest = image->prev;
+    }
+    image->prev = NO_CACHE_SLOT;
+    image->next = NO_CACHE_SLOT;
+    return errorCode;
+}
+
+/**
+ * @brief Adds an image at the end of the list of the cached images, as the
+ * most recently used. Its entry is written by the caller.
+ *
+ * @param cache The cache
+ * @param slot The index of the entry of the image, read and not in the list
+ *
+ * @return Returns 0 in case of success
+ */
+static int link_cached_image(struct derivative_cache* cache, size_t slot)
+{
+    struct cached_image* image = &cache->images[slot];
+    const size_t newest = cache->header.newest;
+    image->prev = newest;
+    image->next = NO_CACHE_SLOT;
+    cache->header.newest = slot;
+    if(NO_CACHE_SLOT == newest) {
+        cache->header.oldest = slot;
+        return 0;
+    }
+    struct cached_image* last = get_cache_entry(cache, newest);
+    if(NULL == last) {
+        return ERR_IO;
+    }
+    last->next = slot;
+    return write_cache_entry(cache, newest);
+}
+
+/**
+ * @brief Writes an empty cache file: its header and a table without images.
+ *
+ * @param cache The cache, with its file opened for writing
+ * @param max_files The max number of picture of the database
+ *
+ * @return Returns 0 in case of success
+ */
+static int init_cache_file(struct derivative_cache* cache, uint32_t max_files)
+{
+    struct pict_cache_header* header = &cache->header;
+    memset(header, 0, sizeof(struct pict_cache_header));
+    strncpy(header->cat_txt, CACHE_CAT_TXT, MAX_DB_NAME);
+    header->max_files = max_files;
+    header->nb_cached_res = NB_CACHE_SLOTS;
+    header->end = CACHE_DATA_OFFSET(max_files);
+    header->oldest = NO_CACHE_SLOT;
+    header->newest = NO_CACHE_SLOT;
+    const size_t nb_images = NB_CACHE_ENTRIES(max_files);
+    memset(cache->images, 0, nb_images * sizeof(struct cached_image));
+    //The entries of a new file are all known
+    memset(cache->loaded, 0xff, NB_VALID_WORDS(max_files) * sizeof(uint64_t));
+    if((0 != write_cache_header(cache)) ||
+       (fwrite(cache->images, sizeof(struct cached_image), nb_images, cache->file) != nb_images)) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Compares the last uses of two cached images for qsort.
+ */
+static int cmp_image_last_used(const void* image_1, const void* image_2)
+{
+    const uint64_t last_used_1 = (*(const struct cached_image* const*) image_1)->last_used;
+    const uint64_t last_used_2 = (*(const struct cached_image* const*) image_2)->last_used;
+    return (last_used_1 > last_used_2) - (last_used_1 < last_used_2);
+}
+
+/**
+ * @brief Rebuilds the counters and the list of the cached images of a file
+ * not closed from its whole table, and writes them.
+ *
+ * @param cache The cache, with its header read
+ * @param max_files The max number of picture of the database
+ *
+ * @return Returns 0 in case of success
+ */
+static int repair_cache_file(struct derivative_cache* cache, uint32_t max_files)
+{
+    const size_t nb_images = NB_CACHE_ENTRIES(max_files);
+    if(fread(cache->images, sizeof(struct cached_image), nb_images, cache->file) != nb_images) {
+        return ERR_IO;
+    }
+    memset(cache->loaded, 0xff, NB_VALID_WORDS(max_files) * sizeof(uint64_t));
+    struct cached_image** images = calloc(nb_images, sizeof(struct cached_image*));
+    if(NULL == images) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    struct pict_cache_header* header = &cache->header;
+    header->used_bytes = 0;
+    header->end = CACHE_DATA_OFFSET(max_files);
+    header->clock = 0;
+    size_t nb_used = 0;
+    for(size_t slot = 0; slot < nb_images; ++slot) {
+        struct cached_image* image = &cache->images[slot];
+        if(0 != image->size) {
+            header->used_bytes += image->size;
+            header->end = (image->offset + image->size > header->end) ? image->offset + image->size : header->end;
+            header->clock = (image->last_used > header->clock) ? image->last_used : header->clock;
+            images[nb_used++] = image;
+        }
+    }
+    qsort(images, nb_used, sizeof(struct cached_image*), cmp_image_last_used);
+    header->oldest = NO_CACHE_SLOT;
+    header->newest = NO_CACHE_SLOT;
+    for(size_t i = 0; i < nb_used; ++i) {
+        images[i]->prev = (i > 0) ? (uint32_t) (images[i - 1] - cache->images) : NO_CACHE_SLOT;
+        images[i]->next = (i + 1 < nb_used) ? (uint32_t) (images[i + 1] - cache->images) : NO_CACHE_SLOT;
+    }
+    if(0 != nb_used) {
+        header->oldest = images[0] - cache->images;
+        header->newest = images[nb_used - 1] - cache->images;
+    }
+    free(images);
+    //The header is written last, as the one of a closed file
+    header->is_dirty = 0;
+    if((0 != fseek(cache->file, CACHE_ENTRY_OFFSET(0), SEEK_SET)) ||
+       (fwrite(cache->images, sizeof(struct cached_image), nb_images, cache->file) != nb_images) ||
+       (0 != write_cache_header(cache))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the header of a cache file, and rebuilds the file if it was
+ * not closed and it is opened for writing. The entries are read when first
+ * used (see get_cache_entry).
+ *
+ * @param cache The cache, with its file opened
+ * @param max_files The max number of picture of the database
+ *
+ * @return Returns 0 in case of success, ERR_IO if the file is not the cache
+ * of the database
+ */
+static int read_cache_file(struct derivative_cache* cache, uint32_t max_files)
+{
+    const struct pict_cache_header* header = &cache->header;
+    if((1 != fread(&cache->header, sizeof(struct pict_cache_header), 1, cache->file)) ||
+       (0 != strncmp(header->cat_txt, CACHE_CAT_TXT, MAX_DB_NAME)) || (header->max_files != max_files) ||
+       (header->nb_cached_res != NB_CACHE_SLOTS)) {
+        return ERR_IO;
+    }
+    //The list of a file opened read-only is not used
+    if((0 != header->is_dirty) && cache->writable) {
+        return repair_cache_file(cache, max_files);
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees a cache and closes its file.
+ *
+ * @param cache The cache
+ */
+static void free_derivative_cache(struct derivative_cache* cache)
+{
+    if(NULL != cache->file) {
+        fclose(cache->file);
+    }
+    free(cache->images);
+    free(cache->loaded);
+    free(cache);
+}
+
+/********************************************************************//**
+ * Opens the derivative cache of a database.
+ */
+int open_derivative_cache(struct pictdb_file* db_file, const char* db_filename, const char* open_mode)
+{
+    if((NULL == db_file) || (NULL == db_filename) || (NULL == open_mode)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    close_derivative_cache(db_file);
+    if(0 == DB_CACHE_BUDGET(&db_file->header)) {
+        return 0;
+    }
+    char cache_filename[FILENAME_MAX];
+    int errorCode = get_cache_filename(db_filename, cache_filename);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    struct derivative_cache* cache = calloc(1, sizeof(struct derivative_cache));
+    if(NULL == cache) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    //The pages of the table are only touched when its entries are read
+    const uint32_t max_files = db_file->header.max_files;
+    cache->images = calloc(NB_CACHE_ENTRIES(max_files), sizeof(struct cached_image));
+    cache->loaded = calloc(NB_VALID_WORDS(max_files), sizeof(uint64_t));
+    if((NULL == cache->images) || (NULL == cache->loaded)) {
+        free_derivative_cache(cache);
+        return ERR_OUT_OF_MEMORY;
+    }
+    cache->writable = (NULL != strchr(open_mode, '+')) || ('w' == open_mode[0]);
+
+    //The cache of a new database is always empty
+    if('w' != open_mode[0]) {
+        cache->file = fopen(cache_filename, cache->writable ? "rb+" : "rb");
+        if((NULL == cache->file) && (ENOENT != errno)) {
+            free_derivative_cache(cache);
+            return ERR_IO;
+        }
+    }
+    errorCode = (NULL != cache->file) ? read_cache_file(cache, max_files) : ERR_FILE_NOT_FOUND;
+    if((0 != errorCode) && cache->writable) {
+        //A missing cache, or the cache of another database, is started again
+        if(NULL != cache->file) {
+            fclose(cache->file);
+        }
+        cache->file = fopen(cache_filename, "wb+");
+        errorCode = (NULL != cache->file) ? init_cache_file(cache, max_files) : ERR_IO;
+    }
+    if(0 != errorCode) {
+        const int writable = cache->writable;
+        free_derivative_cache(cache);
+        //The originals of a database opened read-only are read without the cache
+        return writable ? errorCode : 0;
+    }
+    db_file->cache = cache;
+    return 0;
+}
+
+/********************************************************************//**
+ * Closes the derivative cache of a database.
+ */
+void close_derivative_cache(struct pictdb_file* db_file)
+{
+    struct derivative_cache* cache = db_file->cache;
+    if(NULL != cache) {
+        //A header not written leaves the file dirty, so it is rebuilt
+        if(cache->writable && (0 != cache->header.is_dirty)) {
+            cache->header.is_dirty = 0;
+            write_cache_header(cache);
+        }
+        free_derivative_cache(cache);
+        db_file->cache = NULL;
+    }
+}
+
+/********************************************************************//**
+ * Finds the resized image of a blob in the derivative cache.
+ */
+const struct cached_image* find_cached_image(const struct pictdb_file* db_file, size_t blob, size_t dim)
+{
+    if((NULL == db_file->cache) || (RES_ORIG == dim) || (dim >= NB_RES)) {
+        return NULL;
+    }
+    const struct cached_image* image = get_cache_entry(db_file->cache, CACHE_SLOT(blob, dim));
+    if((NULL == image) || (0 == image->size) || (0 != cmp_SHA(image->SHA, db_file->blobs[blob].SHA))) {
+        return NULL;
+    }
+    return image;
+}
+
+/********************************************************************//**
+ * Gets the size of the image of a picture.
+ */
+uint32_t get_pict_image_size(const struct pictdb_file* db_file, size_t index, size_t dim)
+{
+    if(IS_CACHED_RES(db_file, dim)) {
+        const struct cached_image* image = find_cached_image(db_file, db_file->metadata[index].blob, dim);
+        return (NULL != image) ? image->size : 0;
+    }
+    return get_pict_blob(db_file, index)->size[dim];
+}
+
+/********************************************************************//**
+ * Gets the position of the image of a picture.
+ */
+uint64_t get_pict_image_offset(const struct pictdb_file* db_file, size_t index, size_t dim)
+{
+    if(IS_CACHED_RES(db_file, dim)) {
+        const struct cached_image* image = find_cached_image(db_file, db_file->metadata[index].blob, dim);
+        return (NULL != image) ? image->offset : 0;
+    }
+    return get_pict_blob(db_file, index)->offset[dim];
+}
+
+/**
+ * @brief Reads the image of an entry of the cache and marks it as the most
+ * recently used.
+ *
+ * @param image_buffer Byte array that will contain the image
+ * @param cache The cache
+ * @param slot The index of the entry, read and with an image
+ *
+ * @return Returns 0 in case of success
+ */
+static int read_cache_slot(char** image_buffer, struct derivative_cache* cache, size_t slot)
+{
+    struct cached_image* image = &cache->images[slot];
+    if(0 != fseek(cache->file, image->offset, SEEK_SET)) {
+        return ERR_IO;
+    }
+    int errorCode = read_disk_image(image_buffer, image->size, cache->file);
+    if((0 == errorCode) && cache->writable) {
+        errorCode = mark_cache_dirty(cache);
+        if((0 == errorCode) && (slot != cache->header.newest)) {
+            errorCode = unlink_cached_image(cache, slot);
+            errorCode = (0 != errorCode) ? errorCode : link_cached_image(cache, slot);
+        }
+        if(0 == errorCode) {
+            image->last_used = ++cache->header.clock;
+            errorCode = write_cache_entry(cache, slot);
+        }
+        if(0 != errorCode) {
+            free(*image_buffer);
+            *image_buffer = NULL;
+        }
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Reads a resized image from the derivative cache.
+ */
+int read_cached_image(char** image_buffer, size_t blob, size_t dim, const struct pictdb_file* db_file)
+{
+    if(NULL == find_cached_image(db_file, blob, dim)) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    return read_cache_slot(image_buffer, db_file->cache, CACHE_SLOT(blob, dim));
+}
+
+/**
+ * @brief Finds the entry of a variant of a blob in the derivative cache.
+ *
+ * @param db_file The database, with the blob loaded
+ * @param blob The index of the blob
+ * @param variant The key of the variant
+ *
+ * @return Returns the index of the entry, NB_CACHE_SLOTS * max_files if the
+ * variant is not in the cache or if the entries of the blob cannot be read
+ */
+static size_t find_cached_variant(const struct pictdb_file* db_file, size_t blob, uint32_t variant)
+{
+    struct derivative_cache* cache = db_file->cache;
+    if((NULL != cache) && (NULL != get_cache_entry(cache, VARIANT_SLOT(blob, 0)))) {
+        for(size_t i = 0; i < MAX_CACHED_VARIANTS; ++i) {
+            const struct cached_image* image = &cache->images[VARIANT_SLOT(blob, i)];
+            if((0 != image->size) && (image->variant == variant) &&
+               (0 == cmp_SHA(image->SHA, db_file->blobs[blob].SHA))) {
+                return VARIANT_SLOT(blob, i);
+            }
+        }
+    }
+    return NB_CACHE_ENTRIES(db_file->header.max_files);
+}
+
+/********************************************************************//**
+ * Reads a variant of a picture from the derivative cache.
+ */
+int read_cached_variant(char** image_buffer, uint32_t* image_size, size_t blob, uint32_t variant,
+                        const struct pictdb_file* db_file)
+{
+    if((NULL == image_buffer) || (NULL == image_size) || (NULL == db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const size_t slot = find_cached_variant(db_file, blob, variant);
+    if(slot >= NB_CACHE_ENTRIES(db_file->header.max_files)) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    *image_size = db_file->cache->images[slot].size;
+    return read_cache_slot(image_buffer, db_file->cache, slot);
+}
+
+/**
+ * @brief Compares the positions of two cached images for qsort.
+ */
+static int cmp_image_offset(const void* image_1, const void* image_2)
+{
+    const uint64_t offset_1 = (*(const struct cached_image* const*) image_1)->offset;
+    const uint64_t offset_2 = (*(const struct cached_image* const*) image_2)->offset;
+    return (offset_1 > offset_2) - (offset_1 < offset_2);
+}
+
+/**
+ * @brief Moves the images of the cache file to the beginning of their
+ * region, in the order of their positions. Only the entries of the images
+ * in the list of the cached images are read.
+ *
+ * @param cache The cache
+ * @param max_files The max number of picture of the database
+ *
+ * @return Returns 0 in case of success
+ */
+static int compact_cache_file(struct derivative_cache* cache, uint32_t max_files)
+{
+    const size_t nb_images = NB_CACHE_ENTRIES(max_files);
+    struct cached_image** images = calloc(nb_images, sizeof(struct cached_image*));
+    if(NULL == images) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_used = 0;
+    for(size_t slot = cache->header.oldest; (NO_CACHE_SLOT != slot) && (nb_used < nb_images);
+        slot = images[nb_used++]->next) {
+        images[nb_used] = get_cache_entry(cache, slot);
+        if(NULL == images[nb_used]) {
+            free(images);
+            return ERR_IO;
+        }
+    }
+    qsort(images, nb_used, sizeof(struct cached_image*), cmp_image_offset);
+
+    int errorCode = 0;
+    uint64_t end = CACHE_DATA_OFFSET(max_files);
+    for(size_t i = 0; (i < nb_used) && (0 == errorCode); ++i) {
+        struct cached_image* image = images[i];
+        const size_t slot = image - cache->images;
+        const struct cached_image moved = *image;
+        if(moved.offset != end) {
+            char* image_buffer = NULL;
+            errorCode = (0 != fseek(cache->file, moved.offset, SEEK_SET)) ? ERR_IO :
+                        read_disk_image(&image_buffer, moved.size, cache->file);
+            //The entry is cleared while its image may be overwritten
+            if(0 == errorCode) {
+                image->size = 0;
+                errorCode = write_cache_entry(cache, slot);
+            }
+            if((0 == errorCode) && ((0 != fseek(cache->file, end, SEEK_SET)) ||
+                                    (0 != write_disk_image(image_buffer, moved.size, cache->file)))) {
+                errorCode = ERR_IO;
+            }
+            free(image_buffer);
+            if(0 == errorCode) {
+                *image = moved;
+                image->offset = end;
+                errorCode = write_cache_entry(cache, slot);
+            } else if(0 == image->size) {
+                cache->header.used_bytes -= moved.size;
+                unlink_cached_image(cache, slot);
+            }
+        }
+        end += moved.size;
+    }
+    free(images);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    cache->header.end = end;
+    return 0;
+}
+
+/**
+ * @brief Writes an image at the end of the cache file and its entry, as the
+ * most recently used.
+ *
+ * @param cache The cache
+ * @param image_buffer The image
+ * @param image_size The image size in bytes
+ * @param slot The index of the entry of the image, read
+ * @param SHA The hashcode of the blob of the image
+ * @param variant The key of the variant of the image, 0 for a resolution
+ * @param last_used The last use of the image
+ *
+ * @return Returns 0 in case of success
+ */
+static int append_cached_image(struct derivative_cache* cache, const char* image_buffer, uint32_t image_size,
+                               size_t slot, const unsigned char* SHA, uint32_t variant, uint64_t last_used)
+{
+    if((0 != fseek(cache->file, cache->header.end, SEEK_SET)) ||
+       (0 != write_disk_image(image_buffer, image_size, cache->file))) {
+        return ERR_IO;
+    }
+    //The old image of the entry is replaced once the new one is written
+    struct cached_image* image = &cache->images[slot];
+    int errorCode = 0;
+    if(0 != image->size) {
+        cache->header.used_bytes -= image->size;
+        image->size = 0;
+        errorCode = unlink_cached_image(cache, slot);
+    }
+    if(0 != errorCode) {
+        write_cache_entry(cache, slot);
+        return errorCode;
+    }
+    memcpy(image->SHA, SHA, SHA256_DIGEST_LENGTH);
+    image->size = image_size;
+    image->variant = variant;
+    image->offset = cache->header.end;
+    image->last_used = last_used;
+    cache->header.used_bytes += image_size;
+    cache->header.end += image_size;
+    cache->header.clock = (last_used > cache->header.clock) ? last_used : cache->header.clock;
+    errorCode = link_cached_image(cache, slot);
+    return (0 != errorCode) ? errorCode : write_cache_entry(cache, slot);
+}
+
+/**
+ * @brief Makes room for an image in the cache: evicts the least recently
+ * used images above the budget and compacts the file at twice the budget.
+ * The file is marked dirty first.
+ *
+ * @param cache The cache
+ * @param header The header of the database
+ * @param image_size The size of the image to write
+ * @param slot The index of the entry of the image, whose old image is replaced
+ *
+ * @return Returns 0 in case of success
+ */
+static int reserve_cached_image(struct derivative_cache* cache, const struct pictdb_header* header,
+                                uint32_t image_size, size_t slot)
+{
+    const uint64_t budget = DB_CACHE_BUDGET(header);
+    if(image_size > budget) {
+        return ERR_FULL_DATABASE;
+    }
+    const struct cached_image* image = get_cache_entry(cache, slot);
+    if(NULL == image) {
+        return ERR_IO;
+    }
+    int errorCode = mark_cache_dirty(cache);
+    while((0 == errorCode) && (cache->header.used_bytes - image->size + image_size > budget)) {
+        //The image replaced is not evicted
+        const size_t oldest = (cache->header.oldest != slot) ? cache->header.oldest : image->next;
+        if(NO_CACHE_SLOT == oldest) {
+            break;
+        }
+        struct cached_image* evicted = get_cache_entry(cache, oldest);
+        if(NULL == evicted) {
+            return ERR_IO;
+        }
+        cache->header.used_bytes -= evicted->size;
+        evicted->size = 0;
+        errorCode = unlink_cached_image(cache, oldest);
+        errorCode = (0 != errorCode) ? errorCode : write_cache_entry(cache, oldest);
+    }
+    if((0 == errorCode) && (cache->header.end + image_size > CACHE_DATA_OFFSET(header->max_files) + 2 * budget)) {
+        errorCode = compact_cache_file(cache, header->max_files);
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Writes a resized image in the derivative cache.
+ */
+int write_cached_image(const char* image_buffer, uint32_t image_size, size_t blob, size_t dim,
+                       const struct pictdb_file* db_file)
+{
+    if((NULL == image_buffer) || (NULL == db_file) || (RES_ORIG == dim) || (dim >= NB_RES)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct derivative_cache* cache = db_file->cache;
+    if((NULL == cache) || !cache->writable) {
+        return ERR_IO;
+    }
+    const size_t slot = CACHE_SLOT(blob, dim);
+    int errorCode = reserve_cached_image(cache, &db_file->header, image_size, slot);
+    if(0 == errorCode) {
+        errorCode = append_cached_image(cache, image_buffer, image_size, slot, db_file->blobs[blob].SHA, 0,
+                                        cache->header.clock + 1);
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Writes a variant of a picture in the derivative cache.
+ */
+int write_cached_variant(const char* image_buffer, uint32_t image_size, size_t blob, uint32_t variant,
+                         const struct pictdb_file* db_file)
+{
+    if((NULL == image_buffer) || (NULL == db_file) || (0 == variant)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct derivative_cache* cache = db_file->cache;
+    if((NULL == cache) || !cache->writable) {
+        return ERR_IO;
+    }
+    if(NULL == get_cache_entry(cache, VARIANT_SLOT(blob, 0))) {
+        return ERR_IO;
+    }
+    //The entry of the same variant, else a free one, else the least recently used
+    size_t slot = find_cached_variant(db_file, blob, variant);
+    if(slot >= NB_CACHE_ENTRIES(db_file->header.max_files)) {
+        slot = VARIANT_SLOT(blob, 0);
+        for(size_t i = 0; (i < MAX_CACHED_VARIANTS) && (0 != cache->images[slot].size); ++i) {
+            const struct cached_image* image = &cache->images[VARIANT_SLOT(blob, i)];
+            if((0 == image->size) || (image->last_used < cache->images[slot].last_used)) {
+                slot = VARIANT_SLOT(blob, i);
+            }
+        }
+    }
+    int errorCode = reserve_cached_image(cache, &db_file->header, image_size, slot);
+    if(0 == errorCode) {
+        errorCode = append_cached_image(cache, image_buffer, image_size, slot, db_file->blobs[blob].SHA, variant,
+                                        cache->header.clock + 1);
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Drops the resized images of a blob from the derivative cache.
+ */
+int drop_cached_images(const struct pictdb_file* db_file, size_t blob)
+{
+    struct derivative_cache* cache = db_file->cache;
+    if((NULL == cache) || !cache->writable) {
+        return 0;
+    }
+    if(NULL == get_cache_entry(cache, CACHE_SLOT(blob, 0))) {
+        return ERR_IO;
+    }
+    int errorCode = 0;
+    for(size_t slot = CACHE_SLOT(blob, 0); (slot < CACHE_SLOT(blob + 1, 0)) && (0 == errorCode); ++slot) {
+        if(0 != cache->images[slot].size) {
+            errorCode = mark_cache_dirty(cache);
+            cache->header.used_bytes -= cache->images[slot].size;
+            cache->images[slot].size = 0;
+            errorCode = (0 != errorCode) ? errorCode : unlink_cached_image(cache, slot);
+            errorCode = (0 != errorCode) ? errorCode : write_cache_entry(cache, slot);
+        }
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Copies a cached image to an entry of the derivative cache of
+ * another database.
+ *
+ * @param image The cached image
+ * @param db_file The database of the image
+ * @param new_db_file The other database
+ * @param new_blob The index of the blob of the copy in new_db_file, with its SHA
+ * @param new_slot The index of the entry of the copy
+ *
+ * @return Returns 0 in case of success
+ */
+static int copy_cached_image(const struct cached_image* image, const struct pictdb_file* db_file,
+                             const struct pictdb_file* new_db_file, size_t new_blob, size_t new_slot)
+{
+    struct derivative_cache* new_cache = new_db_file->cache;
+    char* image_buffer = NULL;
+    int errorCode = (0 != fseek(db_file->cache->file, image->offset, SEEK_SET)) ? ERR_IO :
+                    read_disk_image(&image_buffer, image->size, db_file->cache->file);
+    if(0 == errorCode) {
+        errorCode = reserve_cached_image(new_cache, &new_db_file->header, image->size, new_slot);
+    }
+    if(0 == errorCode) {
+        errorCode = append_cached_image(new_cache, image_buffer, image->size, new_slot,
+                                        new_db_file->blobs[new_blob].SHA, image->variant, image->last_used);
+    }
+    free(image_buffer);
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Copies the resized images of the copied blobs to the derivative cache of
+ * another database.
+ */
+int copy_cached_images(const struct pictdb_file* db_file, const struct pictdb_file* new_db_file,
+                       const size_t new_blobs[])
+{
+    struct derivative_cache* cache = db_file->cache;
+    //The list of a cache opened read-only is not rebuilt, so it is not used
+    if((NULL == new_db_file->cache) || (NULL == cache) || !cache->writable) {
+        return 0;
+    }
+    const size_t max_files = db_file->header.max_files;
+    int errorCode = 0;
+    size_t nb_copied = 0;
+    //The images are copied in the list order, so their order is kept
+    for(size_t slot = cache->header.oldest; (NO_CACHE_SLOT != slot) && (nb_copied < NB_CACHE_ENTRIES(max_files)) &&
+        (0 == errorCode); slot = cache->images[slot].next, ++nb_copied) {
+        const struct cached_image* image = get_cache_entry(cache, slot);
+        if(NULL == image) {
+            return ERR_IO;
+        }
+        const size_t blob = slot / NB_CACHE_SLOTS;
+        if((new_blobs[blob] < max_files) && (0 == cmp_SHA(image->SHA, db_file->blobs[blob].SHA))) {
+            errorCode = copy_cached_image(image, db_file, new_db_file, new_blobs[blob],
+                                          new_blobs[blob] * NB_CACHE_SLOTS + slot % NB_CACHE_SLOTS);
+        }
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Replaces the cache file of a database by the one of another database.
+ */
+int replace_derivative_cache(const char* db_filename, const char* tmpdb_filename)
+{
+    char cache_filename[FILENAME_MAX];
+    char tmp_cache_filename[FILENAME_MAX];
+    if((0 != get_cache_filename(db_filename, cache_filename)) ||
+       (0 != get_cache_filename(tmpdb_filename, tmp_cache_filename))) {
+        return ERR_INVALID_FILENAME;
+    }
+    if((0 != remove(cache_filename)) && (ENOENT != errno)) {
+        return ERR_IO;
+    }
+    return (0 != rename(tmp_cache_filename, cache_filename)) ? ERR_IO : 0;
+}
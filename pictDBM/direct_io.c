@@ -0,0 +1,83 @@
+/**
+ * @file direct_io.c
+ * @brief pictDB library: reads of the original images bypassing the page cache
+ *
+ * The images of an aligned database start and end at a multiple of its
+ * alignment, so they can be read with O_DIRECT (F_NOCACHE on macOS) into an
+ * aligned buffer. The originals served once do not evict the thumbnails and
+ * the small images read often from the page cache.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#define _GNU_SOURCE // for O_DIRECT, pread and posix_memalign
+
+#include "pictDB.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/********************************************************************//**
+ * Opens the file for the direct reads of the original images.
+ */
+int open_direct_reads(struct pictdb_file* db_file, const char* db_filename)
+{
+    if((NULL == db_file) || (NULL == db_filename)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    close_direct_reads(db_file);
+    if(DB_ALIGNMENT(&db_file->header) < MIN_ALIGNMENT) {
+        return 0;
+    }
+#if defined(O_DIRECT)
+    db_file->direct_fd = open(db_filename, O_RDONLY | O_DIRECT);
+    //tmpfs and some other file systems refuse O_DIRECT
+    if((-1 == db_file->direct_fd) && (EINVAL == errno)) {
+        return 0;
+    }
+    return (-1 == db_file->direct_fd) ? ERR_IO : 0;
+#elif defined(F_NOCACHE)
+    db_file->direct_fd = open(db_filename, O_RDONLY);
+    if(-1 == db_file->direct_fd) {
+        return ERR_IO;
+    }
+    if(-1 == fcntl(db_file->direct_fd, F_NOCACHE, 1)) {
+        close_direct_reads(db_file);
+    }
+    return 0;
+#else
+    return 0;
+#endif
+}
+
+/********************************************************************//**
+ * Reads an image with direct I/O.
+ */
+int read_direct_image(char** image_buffer, uint64_t offset, uint32_t image_size, const struct pictdb_file* db_file)
+{
+    const uint64_t alignment = DB_ALIGNMENT(&db_file->header);
+    const size_t size = ALIGN_UP((size_t) image_size, alignment);
+    void* buffer = NULL;
+    if(0 != posix_memalign(&buffer, alignment, size)) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    //The images written through fpdb may still be in its buffer
+    const ssize_t nb_read = (0 == fflush(db_file->fpdb)) ? pread(db_file->direct_fd, buffer, size, offset) : -1;
+    if((nb_read < 0) || ((size_t) nb_read < image_size)) {
+        free(buffer);
+        return ERR_IO;
+    }
+    *image_buffer = buffer;
+    return 0;
+}
+
+/********************************************************************//**
+ * Closes the file of the direct reads.
+ */
+void close_direct_reads(struct pictdb_file* db_file)
+{
+    if(-1 != db_file->direct_fd) {
+        close(db_file->direct_fd);
+        db_file->direct_fd = -1;
+    }
+}
@@ -22,5 +22,6 @@ const char * const ERROR_MESSAGES[] = {
     "Not implemented",
     "Existing picture ID",
     "Vips error",
+    "Unsupported database format version",
     "Debug"
 };
@@ -28,6 +28,7 @@ enum error_codes {
     NOT_IMPLEMENTED,
     ERR_DUPLICATE_ID,
     ERR_VIPS,
+    ERR_VERSION,
     ERR_DEBUG
 };
 
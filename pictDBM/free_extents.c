@@ -0,0 +1,279 @@
+/**
+ * @file free_extents.c
+ * @brief pictDB library: table of the free extents of the database file
+ *
+ * The images of the freed blobs and the old regions of the string heap and
+ * of the hash tables are added to the free extents, merged with the free
+ * extents next to them, and write_db_file_image writes a new image in the
+ * smallest free extent big enough, or at the end of the file if there is
+ * none. The images of an aligned database take their padding and start at
+ * the first aligned offset of the free extent. A free extent is written
+ * before its region is used and after its region is no more referenced, so
+ * that an interrupted write only leaves bytes unused until do_gbcollect.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+// Position of the table of the free extents in the database file
+#define EXTENT_TABLE_OFFSET(db_file) \
+    ((db_file)->blob_table.offset + BLOB_TABLE_SIZE((db_file)->header.max_files))
+
+/********************************************************************//**
+ * Reads the free extents.
+ */
+int read_free_extents(struct pictdb_file* db_file)
+{
+    const size_t nb_extents = db_file->blob_table.nb_extents;
+    const long position = ftell(db_file->fpdb);
+    if((-1 == position) || (0 != fseek(db_file->fpdb, EXTENT_TABLE_OFFSET(db_file), SEEK_SET)) ||
+       (fread(db_file->extents, sizeof(struct pict_extent), nb_extents, db_file->fpdb) != nb_extents) ||
+       (0 != fseek(db_file->fpdb, position, SEEK_SET))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the whole table of the free extents.
+ */
+int write_free_extents(const struct pictdb_file* db_file)
+{
+    //The whole capacity is written so that no picture is appended in it
+    const size_t capacity = EXTENT_TABLE_CAPACITY(db_file->header.max_files);
+    if((0 != fseek(db_file->fpdb, EXTENT_TABLE_OFFSET(db_file), SEEK_SET)) ||
+       (fwrite(db_file->extents, sizeof(struct pict_extent), capacity, db_file->fpdb) != capacity)) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes one free extent.
+ *
+ * @param db_file The database
+ * @param extent The index of the free extent
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_free_extent(const struct pictdb_file* db_file, size_t extent)
+{
+    if((0 != fseek(db_file->fpdb, EXTENT_TABLE_OFFSET(db_file) + extent * sizeof(struct pict_extent), SEEK_SET)) ||
+       (1 != fwrite(&db_file->extents[extent], sizeof(struct pict_extent), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes a free extent, replaced by the last one. The location of
+ * the blob table is written by the caller.
+ *
+ * @param db_file The database
+ * @param extent The index of the free extent
+ *
+ * @return Returns 0 in case of success
+ */
+static int remove_free_extent(struct pictdb_file* db_file, size_t extent)
+{
+    const size_t last = --db_file->blob_table.nb_extents;
+    if(extent == last) {
+        return 0;
+    }
+    db_file->extents[extent] = db_file->extents[last];
+    return write_free_extent(db_file, extent);
+}
+
+/**
+ * @brief Compares the offsets of two extents for qsort.
+ */
+static int cmp_extent_offset(const void* extent_1, const void* extent_2)
+{
+    const uint64_t offset_1 = ((const struct pict_extent*) extent_1)->offset;
+    const uint64_t offset_2 = ((const struct pict_extent*) extent_2)->offset;
+    return (offset_1 > offset_2) - (offset_1 < offset_2);
+}
+
+/**
+ * @brief Adds a region to an array of extents.
+ *
+ * @param extents The array
+ * @param nb_extents The number of extents of the array, incremented
+ * @param offset The position of the region
+ * @param size The size of the region
+ */
+static void append_extent(struct pict_extent* extents, size_t* nb_extents, uint64_t offset, uint64_t size)
+{
+    extents[*nb_extents].offset = offset;
+    extents[*nb_extents].size = size;
+    ++*nb_extents;
+}
+
+/********************************************************************//**
+ * Finds the free extents from the regions used by the tables and the blobs.
+ */
+int build_free_extents(struct pictdb_file* db_file)
+{
+    if((NULL == db_file) || (NULL == db_file->extents)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const size_t max_files = db_file->header.max_files;
+    struct pict_extent* used = calloc(EXTENT_TABLE_CAPACITY(max_files), sizeof(struct pict_extent));
+    if(NULL == used) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_used = 0;
+    append_extent(used, &nb_used, 0, ID_INDEX_OFFSET(max_files) + ID_INDEX_SIZE(max_files));
+    append_extent(used, &nb_used, db_file->blob_table.offset, BLOB_TABLE_AREA_SIZE(max_files));
+    append_extent(used, &nb_used, db_file->heap.offset, db_file->heap.capacity + HASH_INDEX_SIZE(db_file->nb_buckets));
+    append_extent(used, &nb_used, db_file->thumbs.offset, db_file->thumbs.capacity);
+    for(size_t blob = 0; blob < max_files; ++blob) {
+        if(IS_USED_BLOB(db_file, blob)) {
+            for(size_t res = 0; res < NB_RES; ++res) {
+                if(0 != db_file->blobs[blob].size[res]) {
+                    append_extent(used, &nb_used, db_file->blobs[blob].offset[res], db_file->blobs[blob].size[res]);
+                }
+            }
+        }
+    }
+    qsort(used, nb_used, sizeof(struct pict_extent), cmp_extent_offset);
+
+    //Each free extent is the gap before a used region
+    size_t nb_extents = 0;
+    uint64_t end = 0;
+    for(size_t i = 0; i < nb_used; ++i) {
+        if(used[i].offset > end) {
+            append_extent(db_file->extents, &nb_extents, end, used[i].offset - end);
+        }
+        if(used[i].offset + used[i].size > end) {
+            end = used[i].offset + used[i].size;
+        }
+    }
+    db_file->blob_table.nb_extents = nb_extents;
+    free(used);
+    return 0;
+}
+
+/**
+ * @brief Tells the size of a free extent usable by an image, which starts at
+ * a multiple of the alignment of the database.
+ *
+ * @param extent The free extent
+ * @param alignment The alignment of the database
+ *
+ * @return Returns the size from the first aligned offset, 0 if there is none
+ */
+static uint64_t aligned_extent_size(const struct pict_extent* extent, uint64_t alignment)
+{
+    const uint64_t start = ALIGN_UP(extent->offset, alignment);
+    return (start < extent->offset + extent->size) ? extent->offset + extent->size - start : 0;
+}
+
+/********************************************************************//**
+ * Takes the smallest free extent big enough.
+ */
+int take_free_extent(struct pictdb_file* db_file, uint64_t size, uint64_t* offset)
+{
+    if((NULL == db_file) || (NULL == offset)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    //The empty images are not placed
+    const size_t nb_extents = ((NULL != db_file->extents) && (0 != size)) ? db_file->blob_table.nb_extents : 0;
+    const uint64_t alignment = DB_ALIGNMENT(&db_file->header);
+    size_t best = nb_extents;
+    uint64_t best_size = 0;
+    for(size_t i = 0; (i < nb_extents) && (best_size != size); ++i) {
+        const uint64_t usable = aligned_extent_size(&db_file->extents[i], alignment);
+        if((usable >= size) && ((best == nb_extents) || (usable < best_size))) {
+            best = i;
+            best_size = usable;
+        }
+    }
+    if(best == nb_extents) {
+        return ERR_FULL_DATABASE;
+    }
+
+    //The bytes before the aligned offset stay unused until do_gbcollect
+    struct pict_extent* extent = &db_file->extents[best];
+    *offset = ALIGN_UP(extent->offset, alignment);
+    int errorCode = 0;
+    if(best_size == size) {
+        errorCode = remove_free_extent(db_file, best);
+    } else {
+        extent->size = best_size - size;
+        extent->offset = *offset + size;
+        errorCode = write_free_extent(db_file, best);
+    }
+    if(0 == errorCode) {
+        errorCode = write_blob_table_location(db_file);
+    }
+    db_file->header.dead_bytes -= (size < db_file->header.dead_bytes) ? size : db_file->header.dead_bytes;
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Adds a region to the free extents, merged with its neighbours.
+ */
+int add_free_extent(struct pictdb_file* db_file, uint64_t offset, uint64_t size)
+{
+    if(NULL == db_file) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if((0 == size) || (NULL == db_file->extents)) {
+        return 0;
+    }
+    const size_t nb_extents = db_file->blob_table.nb_extents;
+    struct pict_extent* extents = db_file->extents;
+    size_t before = nb_extents;
+    size_t after = nb_extents;
+    for(size_t i = 0; i < nb_extents; ++i) {
+        if(extents[i].offset + extents[i].size == offset) {
+            before = i;
+        } else if(extents[i].offset == offset + size) {
+            after = i;
+        }
+    }
+
+    int errorCode = 0;
+    if(before < nb_extents) {
+        extents[before].size += size + ((after < nb_extents) ? extents[after].size : 0);
+        errorCode = write_free_extent(db_file, before);
+        if((0 == errorCode) && (after < nb_extents)) {
+            errorCode = remove_free_extent(db_file, after);
+        }
+    } else if(after < nb_extents) {
+        extents[after].offset = offset;
+        extents[after].size += size;
+        errorCode = write_free_extent(db_file, after);
+    } else if(nb_extents < EXTENT_TABLE_CAPACITY(db_file->header.max_files)) {
+        extents[nb_extents].offset = offset;
+        extents[nb_extents].size = size;
+        errorCode = write_free_extent(db_file, nb_extents);
+        ++db_file->blob_table.nb_extents;
+    } else {
+        //The region stays unused until do_gbcollect
+        return 0;
+    }
+    return (0 != errorCode) ? errorCode : write_blob_table_location(db_file);
+}
+
+/********************************************************************//**
+ * Adds the images of a blob no more referenced to the free extents.
+ */
+int free_blob_images(struct pictdb_file* db_file, size_t blob)
+{
+    if((NULL == db_file) || (blob >= db_file->header.max_files)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const struct pict_blob* content = &db_file->blobs[blob];
+    const uint64_t alignment = DB_ALIGNMENT(&db_file->header);
+    int errorCode = 0;
+    for(size_t res = 0; (res < NB_RES) && (0 == errorCode); ++res) {
+        //The padding of an aligned image is freed with it
+        if((0 != content->size[res]) && !IS_IN_THUMB_REGION(db_file, content->offset[res])) {
+            errorCode = add_free_extent(db_file, content->offset[res], ALIGN_UP(content->size[res], alignment));
+        }
+    }
+    return errorCode;
+}
@@ -0,0 +1,356 @@
+/**
+ * @file hash_index.c
+ * @brief pictDB library: hash tables of the pictures' IDs and SHAs
+ *
+ * The tables are stored after the string heap and updated bucket by bucket
+ * by do_insert and do_delete, so that finding a picture by its ID or a blob
+ * by its content never scans the metadata, even right after do_open_lazy. The
+ * buckets are removed by moving back the following buckets of their probe
+ * sequence, so that the tables never contain tombstones.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+#define ID_TABLE 0  // Table of the hashes of the IDs
+#define SHA_TABLE 1 // Table of the first bytes of the SHAs of the used blobs
+
+/**
+ * @brief Hashes the content of a picture with the first bytes of its SHA.
+ *
+ * @param SHA The SHA of the picture
+ *
+ * @return Returns the hash
+ */
+static uint32_t hash_SHA(const unsigned char* SHA)
+{
+    uint32_t hash = 0;
+    memcpy(&hash, SHA, sizeof(uint32_t));
+    return hash;
+}
+
+/**
+ * @brief Position of the hash tables in the database file.
+ *
+ * @param db_file The database
+ *
+ * @return Returns the offset of the pict_hash_index
+ */
+static uint64_t hash_index_offset(const struct pictdb_file* db_file)
+{
+    return db_file->heap.offset + db_file->heap.capacity;
+}
+
+/********************************************************************//**
+ * Smallest power of 2 greater or equal to n.
+ */
+uint32_t next_power_of_2(uint32_t n)
+{
+    uint32_t power = 1;
+    while(power < n) {
+        power *= 2;
+    }
+    return power;
+}
+
+/**
+ * @brief Writes the header of the hash tables with the version of the database.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_hash_index_header(const struct pictdb_file* db_file)
+{
+    const struct pict_hash_index hash_index = {db_file->header.db_version, db_file->nb_buckets};
+    if((0 != fseek(db_file->fpdb, hash_index_offset(db_file), SEEK_SET)) ||
+       (1 != fwrite(&hash_index, sizeof(struct pict_hash_index), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes one bucket of a hash table.
+ *
+ * @param db_file The database
+ * @param table The table (ID_TABLE or SHA_TABLE)
+ * @param position The position of the bucket in the table
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_bucket(const struct pictdb_file* db_file, size_t table, uint32_t position)
+{
+    const size_t bucket = table * db_file->nb_buckets + position;
+    const uint64_t offset = hash_index_offset(db_file) + sizeof(struct pict_hash_index) + bucket * sizeof(struct hash_bucket);
+    if((0 != fseek(db_file->fpdb, offset, SEEK_SET)) ||
+       (1 != fwrite(&db_file->buckets[bucket], sizeof(struct hash_bucket), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds a key to a hash table, in the first empty bucket of its probe
+ * sequence. The tables are at most half full, so there is always one.
+ *
+ * @param buckets The buckets of the table
+ * @param nb_buckets The number of buckets of the table
+ * @param hash The hash of the key
+ * @param index The index of the picture's metadata (of the blob for SHA_TABLE)
+ *
+ * @return Returns the position of the bucket
+ */
+static uint32_t insert_bucket(struct hash_bucket* buckets, uint32_t nb_buckets, uint32_t hash, size_t index)
+{
+    const uint32_t mask = nb_buckets - 1;
+    uint32_t position = hash & mask;
+    while(0 != buckets[position].index) {
+        position = (position + 1) & mask;
+    }
+    buckets[position].hash = hash;
+    buckets[position].index = index + 1;
+    return position;
+}
+
+/**
+ * @brief Removes the bucket of a picture or of a blob from a hash table and
+ * writes the modified buckets.
+ *
+ * @param db_file The database
+ * @param table The table (ID_TABLE or SHA_TABLE)
+ * @param hash The hash of the key
+ * @param index The index of the picture's metadata (of the blob for SHA_TABLE)
+ *
+ * @return Returns 0 in case of success
+ */
+static int remove_bucket(struct pictdb_file* db_file, size_t table, uint32_t hash, size_t index)
+{
+    struct hash_bucket* buckets = &db_file->buckets[table * db_file->nb_buckets];
+    const uint32_t mask = db_file->nb_buckets - 1;
+    uint32_t hole = hash & mask;
+    while((0 != buckets[hole].index) && (index + 1 != buckets[hole].index)) {
+        hole = (hole + 1) & mask;
+    }
+    if(0 == buckets[hole].index) {
+        return 0;
+    }
+    //A bucket can fill the hole if its probe sequence starts at or before the hole
+    int errorCode = 0;
+    for(uint32_t next = (hole + 1) & mask; (0 != buckets[next].index) && (0 == errorCode); next = (next + 1) & mask) {
+        const uint32_t home = buckets[next].hash & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            buckets[hole] = buckets[next];
+            errorCode = write_bucket(db_file, table, hole);
+            hole = next;
+        }
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    buckets[hole].hash = 0;
+    buckets[hole].index = 0;
+    return write_bucket(db_file, table, hole);
+}
+
+/**
+ * @brief Finds the valid picture or the used blob of a probe sequence whose
+ * key is the one searched.
+ *
+ * @param db_file The database
+ * @param table The table (ID_TABLE or SHA_TABLE)
+ * @param hash The hash of the key
+ * @param key The key (the ID or the SHA)
+ * @param index Pointer to store the index of the picture or of the blob, max_files if there is none
+ *
+ * @return Returns 0 in case of success
+ */
+static int find_match(const struct pictdb_file* db_file, size_t table, uint32_t hash, const void* key, size_t* index)
+{
+    const size_t max_files = db_file->header.max_files;
+    const struct hash_bucket* buckets = &db_file->buckets[table * db_file->nb_buckets];
+    const uint32_t mask = db_file->nb_buckets - 1;
+    *index = max_files;
+    //An empty bucket ends the probe sequence
+    for(uint32_t probe = 0; (probe < db_file->nb_buckets) && (0 != buckets[(hash + probe) & mask].index); ++probe) {
+        const struct hash_bucket* bucket = &buckets[(hash + probe) & mask];
+        const size_t i = bucket->index - 1;
+        if((bucket->hash != hash) || (i >= max_files)) {
+            continue;
+        }
+        int errorCode = 0;
+        int found = 0;
+        if(ID_TABLE == table) {
+            if(IS_VALID_INDEX(db_file, i)) {
+                errorCode = load_one_metadata(db_file, i);
+                found = (0 == errorCode) && (0 == strcmp(get_pict_id(db_file, i), key));
+            }
+        } else if(IS_USED_BLOB(db_file, i)) {
+            errorCode = load_blob(db_file, i);
+            found = (0 == errorCode) && (0 == cmp_SHA(db_file->blobs[i].SHA, key));
+        }
+        if(0 != errorCode) {
+            return errorCode;
+        }
+        if(found) {
+            *index = i;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Reads the hash tables if they match the header.
+ */
+int read_hash_index(struct pictdb_file* db_file)
+{
+    const uint32_t nb_buckets = HASH_INDEX_BUCKETS(db_file->header.max_files);
+    struct pict_hash_index hash_index;
+    //Tables not written completely or older than the metadata are rebuilt
+    if((0 != fseek(db_file->fpdb, hash_index_offset(db_file), SEEK_SET)) ||
+       (1 != fread(&hash_index, sizeof(struct pict_hash_index), 1, db_file->fpdb)) ||
+       (hash_index.db_version != db_file->header.db_version) || (hash_index.nb_buckets != nb_buckets)) {
+        return 0;
+    }
+    db_file->buckets = calloc(2 * (size_t) nb_buckets, sizeof(struct hash_bucket));
+    if(NULL == db_file->buckets) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if(fread(db_file->buckets, sizeof(struct hash_bucket), 2 * (size_t) nb_buckets, db_file->fpdb) != 2 * (size_t) nb_buckets) {
+        free_hash_index(db_file);
+        return 0;
+    }
+    db_file->nb_buckets = nb_buckets;
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the hash tables after the region of the string heap.
+ */
+int write_hash_index(const struct pictdb_file* db_file)
+{
+    const size_t nb_buckets = 2 * (size_t) db_file->nb_buckets;
+    //The version is written last: the tables are only used once complete
+    if((0 != fseek(db_file->fpdb, hash_index_offset(db_file) + sizeof(struct pict_hash_index), SEEK_SET)) ||
+       (fwrite(db_file->buckets, sizeof(struct hash_bucket), nb_buckets, db_file->fpdb) != nb_buckets)) {
+        return ERR_IO;
+    }
+    return write_hash_index_header(db_file);
+}
+
+/********************************************************************//**
+ * Allocates and fills the hash tables from the metadata columns and the blobs.
+ */
+int build_hash_index(struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    const uint32_t nb_buckets = HASH_INDEX_BUCKETS(max_files);
+    free_hash_index(db_file);
+    db_file->buckets = calloc(2 * (size_t) nb_buckets, sizeof(struct hash_bucket));
+    if(NULL == db_file->buckets) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_file->nb_buckets = nb_buckets;
+    for(size_t i = next_valid_index(db_file, 0); i < max_files; i = next_valid_index(db_file, i + 1)) {
+        (void) insert_bucket(db_file->buckets, nb_buckets, db_file->columns.id_hash[i], i);
+    }
+    for(size_t blob = 0; blob < max_files; ++blob) {
+        if(IS_USED_BLOB(db_file, blob)) {
+            insert_blob_SHA(db_file, blob);
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Frees the hash tables.
+ */
+void free_hash_index(struct pictdb_file* db_file)
+{
+    free(db_file->buckets);
+    db_file->buckets = NULL;
+    db_file->nb_buckets = 0;
+}
+
+/********************************************************************//**
+ * Adds a used blob to the hash table of the SHAs in memory.
+ */
+void insert_blob_SHA(struct pictdb_file* db_file, size_t blob)
+{
+    (void) insert_bucket(&db_file->buckets[db_file->nb_buckets], db_file->nb_buckets,
+                         hash_SHA(db_file->blobs[blob].SHA), blob);
+}
+
+/********************************************************************//**
+ * Adds a picture to the hash tables.
+ */
+int add_to_hash_index(struct pictdb_file* db_file, size_t index)
+{
+    if((NULL == db_file) || (NULL == db_file->buckets) || (index >= db_file->header.max_files)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint32_t nb_buckets = db_file->nb_buckets;
+    const uint32_t id_position = insert_bucket(db_file->buckets, nb_buckets,
+                                 hash_pict_id(get_pict_id(db_file, index)), index);
+    if(0 != write_bucket(db_file, ID_TABLE, id_position)) {
+        return ERR_IO;
+    }
+    //A blob already referenced is already in the table of the SHAs
+    const size_t blob = db_file->metadata[index].blob;
+    if(1 == db_file->blobs[blob].refcount) {
+        const uint32_t SHA_position = insert_bucket(&db_file->buckets[nb_buckets], nb_buckets,
+                                      hash_SHA(db_file->blobs[blob].SHA), blob);
+        if(0 != write_bucket(db_file, SHA_TABLE, SHA_position)) {
+            return ERR_IO;
+        }
+    }
+    return write_hash_index_header(db_file);
+}
+
+/********************************************************************//**
+ * Removes a picture from the hash tables.
+ */
+int remove_from_hash_index(struct pictdb_file* db_file, size_t index)
+{
+    if((NULL == db_file) || (NULL == db_file->buckets) || (index >= db_file->header.max_files)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    //The ID of a deleted picture stays in its metadata, the SHA of a free blob in the blob
+    int errorCode = remove_bucket(db_file, ID_TABLE, hash_pict_id(get_pict_id(db_file, index)), index);
+    const size_t blob = db_file->metadata[index].blob;
+    if((0 == errorCode) && (0 == db_file->blobs[blob].refcount)) {
+        errorCode = remove_bucket(db_file, SHA_TABLE, hash_SHA(db_file->blobs[blob].SHA), blob);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    return write_hash_index_header(db_file);
+}
+
+/********************************************************************//**
+ * Finds the used blob having a given SHA.
+ */
+int find_blob(const struct pictdb_file* db_file, const unsigned char* SHA, size_t* blob)
+{
+    if((NULL == db_file) || (NULL == SHA) || (NULL == blob)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return find_match(db_file, SHA_TABLE, hash_SHA(SHA), SHA, blob);
+}
+
+/********************************************************************//**
+ * Finds a valid picture with the hash table of the IDs.
+ */
+int find_pict_id(const struct pictdb_file* db_file, const char* pictID, size_t* index)
+{
+    if((NULL == db_file) || (NULL == pictID) || (NULL == index)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const int errorCode = find_match(db_file, ID_TABLE, hash_pict_id(pictID), pictID, index);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    return (*index < db_file->header.max_files) ? 0 : ERR_FILE_NOT_FOUND;
+}
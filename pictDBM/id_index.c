@@ -0,0 +1,273 @@
+/**
+ * @file id_index.c
+ * @brief pictDB library: index of the IDs and lazy reading of the metadata
+ *
+ * The index stored after the metadata is a copy of the columns valid and
+ * id_hash, kept up to date by write_db_file_one_metadata, followed by the
+ * bitset of the used blobs, kept up to date by write_db_file_blob. It is all
+ * that next_valid_index and first_empty_index need, so do_open_lazy only
+ * reads it with the hash tables (see hash_index.c) and the metadata and the
+ * blobs are read when first used.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+#define LOAD_CHUNK 1024 // Number of metadata or blobs read at once by load_metadata
+
+/********************************************************************//**
+ * Reads the string heap, the index of the IDs and the hash tables.
+ */
+int init_metadata_pager(struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    int errorCode = read_pict_id_heap(db_file);
+    if(0 == errorCode) {
+        errorCode = read_blob_table(db_file, 1);
+    }
+    if(0 == errorCode) {
+        errorCode = read_thumb_region(db_file);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    //The pages of the metadata are only touched when the metadata are read
+    db_file->metadata = calloc(max_files, sizeof(struct pict_metadata));
+    db_file->pager = calloc(1, sizeof(struct metadata_pager));
+    if((NULL == db_file->metadata) || (NULL == db_file->pager)) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_file->pager->loaded = calloc(NB_VALID_WORDS(max_files), sizeof(uint64_t));
+    db_file->pager->loaded_blobs = calloc(NB_VALID_WORDS(max_files), sizeof(uint64_t));
+    if((NULL == db_file->pager->loaded) || (NULL == db_file->pager->loaded_blobs)) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    errorCode = alloc_metadata_columns(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    const size_t nb_words = NB_VALID_WORDS(max_files);
+    if((0 != fseek(db_file->fpdb, ID_INDEX_OFFSET(max_files), SEEK_SET)) ||
+       (fread(db_file->columns.valid, sizeof(uint64_t), nb_words, db_file->fpdb) != nb_words) ||
+       (fread(db_file->columns.id_hash, sizeof(uint32_t), max_files, db_file->fpdb) != max_files) ||
+       (fread(db_file->used_blobs, sizeof(uint64_t), nb_words, db_file->fpdb) != nb_words)) {
+        return ERR_IO;
+    }
+
+    //An index not written completely does not count the pictures of the header
+    size_t nb_valid = 0;
+    size_t nb_blobs = 0;
+    for(size_t word = 0; word < nb_words; ++word) {
+        nb_valid += __builtin_popcountll(db_file->columns.valid[word]);
+        nb_blobs += __builtin_popcountll(db_file->used_blobs[word]);
+    }
+    if((nb_valid == db_file->header.num_files) && (nb_blobs == db_file->blob_table.nb_blobs)) {
+        errorCode = read_hash_index(db_file);
+        if((0 != errorCode) || (NULL != db_file->buckets)) {
+            return errorCode;
+        }
+    }
+    //The index or the hash tables do not match the header
+    free(db_file->metadata);
+    db_file->metadata = NULL;
+    free_pict_id_heap(db_file);
+    free_blob_table(db_file);
+    free_metadata_columns(db_file);
+    free_metadata_pager(db_file);
+    return 0;
+}
+
+/********************************************************************//**
+ * Frees the state of the metadata read lazily.
+ */
+void free_metadata_pager(struct pictdb_file* db_file)
+{
+    if(NULL != db_file->pager) {
+        free(db_file->pager->loaded);
+        free(db_file->pager->loaded_blobs);
+        free(db_file->pager);
+        db_file->pager = NULL;
+    }
+}
+
+/********************************************************************//**
+ * Reads one metadata if it was not read yet.
+ */
+int load_one_metadata(const struct pictdb_file* db_file, size_t index)
+{
+    struct metadata_pager* pager = db_file->pager;
+    if((NULL == pager) || (pager->complete)) {
+        return 0;
+    }
+    if(index >= db_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint64_t bit = UINT64_C(1) << (index % VALID_WORD_BITS);
+    if(0 != (pager->loaded[index / VALID_WORD_BITS] & bit)) {
+        return 0;
+    }
+    struct pict_metadata* metadata = &db_file->metadata[index];
+    if((0 != fseek(db_file->fpdb, METADATA_OFFSET + index * sizeof(struct pict_metadata), SEEK_SET)) ||
+       (1 != fread(metadata, sizeof(struct pict_metadata), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    int errorCode = check_pict_id(db_file, metadata);
+    if(0 == errorCode) {
+        errorCode = check_pict_blob(db_file, metadata);
+    }
+    if((0 == errorCode) && (NON_EMPTY == metadata->is_valid)) {
+        errorCode = load_blob(db_file, metadata->blob);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    pager->loaded[index / VALID_WORD_BITS] |= bit;
+    update_metadata_columns(db_file, index);
+    return 0;
+}
+
+/********************************************************************//**
+ * Reads one blob if it was not read yet.
+ */
+int load_blob(const struct pictdb_file* db_file, size_t blob)
+{
+    struct metadata_pager* pager = db_file->pager;
+    if((NULL == pager) || (pager->complete)) {
+        return 0;
+    }
+    if(blob >= db_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint64_t bit = UINT64_C(1) << (blob % VALID_WORD_BITS);
+    if(0 != (pager->loaded_blobs[blob / VALID_WORD_BITS] & bit)) {
+        return 0;
+    }
+    if((0 != fseek(db_file->fpdb, db_file->blob_table.offset + blob * sizeof(struct pict_blob), SEEK_SET)) ||
+       (1 != fread(&db_file->blobs[blob], sizeof(struct pict_blob), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    pager->loaded_blobs[blob / VALID_WORD_BITS] |= bit;
+    return 0;
+}
+
+/**
+ * @brief Reads all the blobs not read yet, so that the blobs of all the
+ * metadata are in memory once they are read.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+static int load_blobs(const struct pictdb_file* db_file)
+{
+    struct metadata_pager* pager = db_file->pager;
+    const size_t max_files = db_file->header.max_files;
+    struct pict_blob* chunk = calloc(LOAD_CHUNK, sizeof(struct pict_blob));
+    if(NULL == chunk) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int errorCode = 0;
+    if(0 != fseek(db_file->fpdb, db_file->blob_table.offset, SEEK_SET)) {
+        errorCode = ERR_IO;
+    }
+    for(size_t start = 0; (start < max_files) && (0 == errorCode); start += LOAD_CHUNK) {
+        const size_t nb_blobs = max_files - start < LOAD_CHUNK ? max_files - start : LOAD_CHUNK;
+        if(fread(chunk, sizeof(struct pict_blob), nb_blobs, db_file->fpdb) != nb_blobs) {
+            errorCode = ERR_IO;
+        }
+        //The blobs already read may have been modified in memory
+        for(size_t i = 0; (i < nb_blobs) && (0 == errorCode); ++i) {
+            const size_t blob = start + i;
+            const uint64_t bit = UINT64_C(1) << (blob % VALID_WORD_BITS);
+            if(0 == (pager->loaded_blobs[blob / VALID_WORD_BITS] & bit)) {
+                db_file->blobs[blob] = chunk[i];
+                pager->loaded_blobs[blob / VALID_WORD_BITS] |= bit;
+            }
+        }
+    }
+    free(chunk);
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Reads all the metadata not read yet.
+ */
+int load_metadata(const struct pictdb_file* db_file)
+{
+    struct metadata_pager* pager = db_file->pager;
+    if((NULL == pager) || (pager->complete)) {
+        return 0;
+    }
+    const size_t max_files = db_file->header.max_files;
+    int errorCode = load_blobs(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    struct pict_metadata* chunk = calloc(LOAD_CHUNK, sizeof(struct pict_metadata));
+    if(NULL == chunk) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if(0 != fseek(db_file->fpdb, METADATA_OFFSET, SEEK_SET)) {
+        errorCode = ERR_IO;
+    }
+    for(size_t start = 0; (start < max_files) && (0 == errorCode); start += LOAD_CHUNK) {
+        const size_t nb_metadata = max_files - start < LOAD_CHUNK ? max_files - start : LOAD_CHUNK;
+        if(fread(chunk, sizeof(struct pict_metadata), nb_metadata, db_file->fpdb) != nb_metadata) {
+            errorCode = ERR_IO;
+        }
+        //The metadata already read may have been modified in memory
+        for(size_t i = 0; (i < nb_metadata) && (0 == errorCode); ++i) {
+            const size_t index = start + i;
+            const uint64_t bit = UINT64_C(1) << (index % VALID_WORD_BITS);
+            if(0 == (pager->loaded[index / VALID_WORD_BITS] & bit)) {
+                db_file->metadata[index] = chunk[i];
+                errorCode = check_pict_id(db_file, &db_file->metadata[index]);
+                if(0 == errorCode) {
+                    errorCode = check_pict_blob(db_file, &db_file->metadata[index]);
+                }
+                pager->loaded[index / VALID_WORD_BITS] |= bit;
+                update_metadata_columns(db_file, index);
+            }
+        }
+    }
+    free(chunk);
+    if(0 == errorCode) {
+        pager->complete = 1;
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Writes the whole index of the IDs.
+ */
+int write_id_index(const struct pictdb_file* db_file)
+{
+    const size_t max_files = db_file->header.max_files;
+    const size_t nb_words = NB_VALID_WORDS(max_files);
+    if((0 != fseek(db_file->fpdb, ID_INDEX_OFFSET(max_files), SEEK_SET)) ||
+       (fwrite(db_file->columns.valid, sizeof(uint64_t), nb_words, db_file->fpdb) != nb_words) ||
+       (fwrite(db_file->columns.id_hash, sizeof(uint32_t), max_files, db_file->fpdb) != max_files) ||
+       (fwrite(db_file->used_blobs, sizeof(uint64_t), nb_words, db_file->fpdb) != nb_words)) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the entry of one metadata in the index of the IDs.
+ */
+int write_id_index_entry(const struct pictdb_file* db_file, size_t index)
+{
+    const size_t max_files = db_file->header.max_files;
+    const uint64_t offset = ID_INDEX_OFFSET(max_files);
+    const size_t word = index / VALID_WORD_BITS;
+    if((0 != fseek(db_file->fpdb, offset + word * sizeof(uint64_t), SEEK_SET)) ||
+       (1 != fwrite(&db_file->columns.valid[word], sizeof(uint64_t), 1, db_file->fpdb)) ||
+       (0 != fseek(db_file->fpdb, offset + NB_VALID_WORDS(max_files) * sizeof(uint64_t) + index * sizeof(uint32_t), SEEK_SET)) ||
+       (1 != fwrite(&db_file->columns.id_hash[index], sizeof(uint32_t), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
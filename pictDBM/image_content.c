@@ -6,55 +6,10 @@
  */
 
 #include "image_content.h"
-
-/**
- * @brief Get the index of all image that have the same content of the image at metadata[index] and updates it if needed
- *
- * @param index_tab Pointer to an array that will contain all the index's of duplicate image
- * @param db_file The database
- * @param original The original image in VIPS format
- *
- * @return Returns the scaling ratio
- */
-static int get_dup_index_and_update(size_t** index_tab, size_t* size_tab, const struct pictdb_file* db_file, const size_t index)
-{
-    size_t size_tab_max = 10;
-    *index_tab = calloc(size_tab_max, sizeof(size_t));
-    if(NULL == *index_tab) {
-        return ERR_OUT_OF_MEMORY;
-    }
-    (*index_tab)[0] = index;
-    *size_tab = 1;
-    unsigned char* SHA = db_file->metadata[index].SHA;
-    for(size_t i = 0; i < db_file->header.max_files; ++i) {
-        if(i != index && NON_EMPTY == db_file->metadata[i].is_valid) {
-            if(0 == cmp_SHA(db_file->metadata[i].SHA, SHA)) {
-                if(*size_tab >= size_tab_max) {
-                    *index_tab = realloc(*index_tab, 2*size_tab_max*sizeof(size_t));
-                    size_tab_max*= 2;
-                    if(NULL == *index_tab) {
-                        return ERR_OUT_OF_MEMORY;
-                    }
-                }
-                (*index_tab)[*size_tab] = i;
-                ++(*size_tab);
-            }
-        }
-    }
-    //Updates the metadata at index if needed
-    if(*size_tab > 1) {
-        if(db_file->metadata[index].size[RES_SMALL] != db_file->metadata[(*index_tab)[1]].size[RES_SMALL]) {
-            db_file->metadata[index].size[RES_SMALL] = db_file->metadata[(*index_tab)[1]].size[RES_SMALL];
-            db_file->metadata[index].offset[RES_SMALL] = db_file->metadata[(*index_tab)[1]].offset[RES_SMALL];
-        }
-        if(db_file->metadata[index].size[RES_THUMB] != db_file->metadata[(*index_tab)[1]].size[RES_THUMB]) {
-            db_file->metadata[index].size[RES_THUMB] = db_file->metadata[(*index_tab)[1]].size[RES_THUMB];
-            db_file->metadata[index].offset[RES_THUMB] = db_file->metadata[(*index_tab)[1]].offset[RES_THUMB];
-        }
-    }
-    return 0;
-}
-
+#include "metrics.h"
+#include "pictDBM_tools.h"
+#include <errno.h>
+#include "trace.h"
 
 /**
  * @brief Computes the scaling ratio from the original image to the image in the desired dimension
@@ -67,37 +22,19 @@ static int get_dup_index_and_update(size_t** index_tab, size_t* size_tab, const
  */
 static const double compute_scaling_ratio(const size_t dim, const struct pictdb_file* db_file, const VipsImage* original)
 {
-    double h_ratio;
-    double v_ratio;
-    switch(dim) {
-    case RES_THUMB:
-        h_ratio = (double) db_file->header.res_resized[DIM_X_THUMB];
-        v_ratio = (double) db_file->header.res_resized[DIM_Y_THUMB];
-        break;
-    case RES_SMALL:
-        h_ratio = (double) db_file->header.res_resized[DIM_X_SMALL];
-        v_ratio = (double) db_file->header.res_resized[DIM_Y_SMALL];
-        break;
-    }
+    const uint16_t* res = db_file->resolutions.resolutions[dim].res;
+    double h_ratio = (double) res[DIM_X_ORIG];
+    double v_ratio = (double) res[DIM_Y_ORIG];
     h_ratio /= (double) original->Xsize;
     v_ratio /= (double) original->Ysize;
     const double ratio = h_ratio > v_ratio ? v_ratio : h_ratio;
     return ratio;
 }
 
-/**
- * @brief Resize and save into a buffer the image
- *
- * @param buff A buffer containing the original image
- * @param index The image's index in metadatas
- * @param dim Internal code representing the desired dimension
- * @param db_file The database
- * @param outBuffer Pointer to a buffer that will contains the resized image, allocated by VIPS
- * @param newSizeAfterResize Pointer to a size that will contain the size of the resized image
- *
- * @return Returns 0 in case of success
+/********************************************************************//**
+ * Resize and save into a buffer the image
  */
-static int resize_and_save_image(void* buff, size_t index, size_t dim, const struct pictdb_file* db_file, void** outBuffer, size_t* newSizeAfterResize)
+int resize_and_save_image(void* buff, size_t index, size_t dim, const struct pictdb_file* db_file, void** outBuffer, size_t* newSizeAfterResize)
 {
     VipsImage* original;
     // some place to do the job
@@ -105,7 +42,10 @@ static int resize_and_save_image(void* buff, size_t index, size_t dim, const str
     // we want 1 new images
     VipsImage** newImage = (VipsImage**) vips_object_local_array(process, 1);
 
-    if(0 != vips_jpegload_buffer(buff, db_file->metadata[index].size[RES_ORIG], &original, NULL)) {
+    TRACE_BEGIN(load_span, "vips_jpegload_buffer");
+    const int load_result = vips_jpegload_buffer(buff, get_pict_blob(db_file, index)->size[RES_ORIG], &original, NULL);
+    TRACE_END(load_span);
+    if(0 != load_result) {
         g_object_unref(process);
         return ERR_VIPS;
     }
@@ -114,22 +54,20 @@ static int resize_and_save_image(void* buff, size_t index, size_t dim, const str
     const double ratio = compute_scaling_ratio(dim, db_file, original);
 
     //Resizes the picture
-    if(0 != vips_resize(original, &newImage[0], ratio, NULL)) {
+    TRACE_BEGIN(resize_span, "vips_resize");
+    const int resize_result = vips_resize(original, &newImage[0], ratio, NULL);
+    TRACE_END(resize_span);
+    if(0 != resize_result) {
         g_object_unref(process);
         return ERR_VIPS;
     }
 
     //Save the resized picture into a buffer in memory
-    *outBuffer = NULL;
-    if(0 != vips_jpegsave_buffer(newImage[0], outBuffer, newSizeAfterResize, NULL)) {
-        if(NULL != *outBuffer) {
-            g_free(*outBuffer);
-        }
-        g_object_unref(process);
-        return ERR_VIPS;
-    }
+    //(VIPS is lazy: the decoding and resizing are actually done here)
+    const int errorCode = save_image_buffer(newImage[0], FORMAT_JPEG, &db_file->resolutions.resolutions[dim].encoding,
+                                            outBuffer, newSizeAfterResize);
     g_object_unref(process);
-    return 0;
+    return errorCode;
 }
 
 /********************************************************************//**
@@ -140,8 +78,6 @@ size_t lazily_resize(size_t dim, struct pictdb_file* db_file, size_t index)
     //Test parameters
     if(RES_ORIG == dim) {
         return 0;
-    } else if((RES_THUMB != dim) && (RES_SMALL != dim)) {
-        return ERR_RESOLUTIONS;
     }
 
     //In this project, pictDBM, we made the decision to return the error
@@ -152,34 +88,29 @@ size_t lazily_resize(size_t dim, struct pictdb_file* db_file, size_t index)
     if(NULL == db_file) {
         return ERR_INVALID_ARGUMENT;
     }
+    if(!IS_DB_RES(db_file, dim)) {
+        return ERR_RESOLUTIONS;
+    }
 
     if((index > db_file->header.num_files) && (EMPTY == db_file->metadata[index].is_valid)) {
         return ERR_INVALID_ARGUMENT;
     }
 
-    int errorCode = 0;
-    size_t* index_tab = NULL;
-    size_t size_tab = 0;
-    errorCode = get_dup_index_and_update(&index_tab, &size_tab, db_file, index);
-    if(0 != errorCode) {
-        return errorCode;
-    }
-
-    //Test if the image exists in the wanted dimension
-    if(0 != db_file->metadata[index].size[dim]) {
-        if(index_tab != NULL) {
-            free(index_tab);
-        }
+    //Test if the image exists in the wanted dimension, for the picture or one of its duplicates
+    //The concurrent resizes of a missing image are not coalesced: the server
+    //handles its requests one at a time, so a second read finds the image
+    //stored by the first one, and do_pregen lists each blob once
+    if(0 != get_pict_image_size(db_file, index, dim)) {
         return 0;
     }
 
+    //Only the actual resizes are recorded in the metrics
+    const double start = metrics_now();
+
     //Load the original picture in memory
     char* buff = NULL;
-    errorCode = read_db_file_image(&buff, index, RES_ORIG, db_file);
+    int errorCode = read_db_file_image(&buff, index, RES_ORIG, db_file);
     if(0 != errorCode) {
-        if(index_tab != NULL) {
-            free(index_tab);
-        }
         return errorCode;
     }
     //resizing the image
@@ -189,42 +120,119 @@ size_t lazily_resize(size_t dim, struct pictdb_file* db_file, size_t index)
     errorCode = resize_and_save_image(buff, index, dim, db_file, &outBuffer, &newSizeAfterResize);
     free(buff);
     if(0 != errorCode) {
-        if(index_tab != NULL) {
-            free(index_tab);
-        }
         if(NULL != outBuffer) {
             g_free(outBuffer);
         }
         return errorCode;
     }
-    //write image at the end of the file
+    errorCode = store_resized_image(outBuffer, newSizeAfterResize, index, dim, db_file);
+    g_free(outBuffer);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    metrics_observe(OP_LAZILY_RESIZE, start);
+    return 0;
+}
+
+/********************************************************************//**
+ * Stores a resized image of a picture and updates its blob.
+ */
+int store_resized_image(const void* image_buffer, size_t image_size, size_t index, size_t dim,
+                        struct pictdb_file* db_file)
+{
+    const size_t blob = db_file->metadata[index].blob;
+    //write the image in the derivative cache, else the thumbnail in its region
+    //and the other resized images at the end of the file
+    if(IS_CACHED_RES(db_file, dim)) {
+        return write_cached_image(image_buffer, image_size, blob, dim, db_file);
+    }
     long offset = 0;
-    errorCode = write_db_file_image(outBuffer, newSizeAfterResize, &offset, db_file);
+    int errorCode = 0;
+    if(RES_THUMB == dim) {
+        errorCode = write_db_file_thumb(image_buffer, image_size, &offset, db_file);
+    } else {
+        errorCode = write_db_file_image(image_buffer, image_size, &offset, db_file);
+    }
     if(0 != errorCode) {
-        if(index_tab != NULL) {
-            free(index_tab);
-        }
-        g_free(outBuffer);
         return ERR_IO;
     }
 
-    //Update datas on memory
-    for(size_t i = 0; i < size_tab; ++i) {
-        db_file->metadata[index_tab[i]].size[dim] = newSizeAfterResize;
-        db_file->metadata[index_tab[i]].offset[dim] = offset;
-        if(0 != write_db_file_one_metadata(db_file, index_tab[i])) {
-            if(index_tab != NULL) {
-                free(index_tab);
-            }
-            g_free(outBuffer);
-            return ERR_IO;
-        }
+    //Update datas on memory: the duplicates share the blob
+    db_file->blobs[blob].size[dim] = image_size;
+    db_file->blobs[blob].offset[dim] = offset;
+    db_file->header.live_bytes += image_size;
+    if((0 != write_db_file_blob(db_file, blob)) || (0 != write_db_file_header(db_file))) {
+        return ERR_IO;
     }
+    return 0;
+}
 
-    if(index_tab != NULL) {
-        free(index_tab);
+// Tells for each format if VIPS failed to save an image in it
+static int format_failed[NB_FORMATS] = {0};
+
+// Chroma subsampling modes of VIPS, indexed by the subsample of the encodings
+static const VipsForeignJpegSubsample SUBSAMPLE_MODES[NB_SUBSAMPLE] = {
+    VIPS_FOREIGN_JPEG_SUBSAMPLE_AUTO, VIPS_FOREIGN_JPEG_SUBSAMPLE_ON, VIPS_FOREIGN_JPEG_SUBSAMPLE_OFF
+};
+
+/********************************************************************//**
+ * Tells if VIPS can save the images in a format.
+ */
+int is_format_supported(int format)
+{
+    if((format < 0) || (format >= NB_FORMATS) || format_failed[format]) {
+        return 0;
+    }
+    switch(format) {
+    case FORMAT_WEBP:
+        return 0 != vips_type_find("VipsOperation", "webpsave_buffer");
+    case FORMAT_AVIF:
+        return 0 != vips_type_find("VipsOperation", "heifsave_buffer");
+    default:
+        return 1;
+    }
+}
+
+/********************************************************************//**
+ * Saves an image into a buffer in memory in a format.
+ */
+int save_image_buffer(VipsImage* image, int format, const struct pict_encoding* encoding,
+                      void** image_buffer, size_t* image_size)
+{
+    *image_buffer = NULL;
+    const int strip = 0 != (encoding->flags & ENCODING_STRIP);
+    int save_result = 0;
+    if(FORMAT_WEBP == format) {
+        TRACE_BEGIN(save_span, "vips_webpsave_buffer");
+        save_result = vips_webpsave_buffer(image, image_buffer, image_size,
+                                           "Q", (int) encoding->quality, "strip", strip, NULL);
+        TRACE_END(save_span);
+    } else if(FORMAT_AVIF == format) {
+        //AVIF is HEIF with the AV1 codec
+        TRACE_BEGIN(save_span, "vips_heifsave_buffer");
+        save_result = vips_heifsave_buffer(image, image_buffer, image_size, "Q", (int) encoding->quality,
+                                           "strip", strip, "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1, NULL);
+        TRACE_END(save_span);
+    } else {
+        TRACE_BEGIN(save_span, "vips_jpegsave_buffer");
+        save_result = vips_jpegsave_buffer(image, image_buffer, image_size, "Q", (int) encoding->quality,
+                                           "interlace", 0 != (encoding->flags & ENCODING_PROGRESSIVE),
+                                           "strip", strip,
+                                           "optimize_coding", 0 != (encoding->flags & ENCODING_OPTIMIZE),
+                                           "subsample_mode", SUBSAMPLE_MODES[encoding->subsample], NULL);
+        TRACE_END(save_span);
+    }
+    if(0 != save_result) {
+        if(NULL != *image_buffer) {
+            g_free(*image_buffer);
+            *image_buffer = NULL;
+        }
+        //A saver can exist without its encoder, e.g. HEIF without AV1
+        if(FORMAT_JPEG != format) {
+            format_failed[format] = 1;
+        }
+        return ERR_VIPS;
     }
-    g_free(outBuffer);
     return 0;
 }
 
@@ -243,3 +251,47 @@ int get_resolution(uint32_t* height         ,
     g_object_unref(image);
     return 0;
 }
+
+/********************************************************************//**
+ * Initialises the settings of VIPS with the default values.
+ */
+void init_vips_settings(struct vips_settings* settings)
+{
+    settings->cache_mem = DEFAULT_VIPS_CACHE_MEM;
+    settings->cache_ops = DEFAULT_VIPS_CACHE_OPS;
+    settings->concurrency = DEFAULT_VIPS_CONCURRENCY;
+}
+
+/********************************************************************//**
+ * Parses one option of the settings of VIPS.
+ */
+int parse_vips_option(const char* option, const char* value, struct vips_settings* settings)
+{
+    if((NULL == option) || (NULL == value) || (NULL == settings)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint32_t number = atouint32(value);
+    if((0 == number) && (ERANGE == errno)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(!strcmp(VIPS_OPTION_PREFIX "cache_mem", option) && (number <= MAX_VIPS_CACHE_MEM)) {
+        settings->cache_mem = number;
+    } else if(!strcmp(VIPS_OPTION_PREFIX "cache_ops", option) && (number <= MAX_VIPS_CACHE_OPS)) {
+        settings->cache_ops = number;
+    } else if(!strcmp(VIPS_OPTION_PREFIX "concurrency", option) && (number <= MAX_VIPS_CONCURRENCY)) {
+        settings->concurrency = number;
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Applies the settings to VIPS.
+ */
+void apply_vips_settings(const struct vips_settings* settings)
+{
+    vips_cache_set_max_mem((size_t) settings->cache_mem << 20);
+    vips_cache_set_max((int) settings->cache_ops);
+    vips_concurrency_set((int) settings->concurrency);
+}
@@ -10,6 +10,58 @@
 #include <vips/vips.h>
 #include "pictDB.h"
 #include "dedup.h"
+
+// Settings of VIPS for the resizes: each image is resized once, so few
+// operations are worth caching, and one thread per operation is enough
+// for the small images (the workers of pregen resize in parallel)
+#define DEFAULT_VIPS_CACHE_MEM 32 // Default max. memory of the operation cache of VIPS (in MB)
+#define DEFAULT_VIPS_CACHE_OPS 100 // Default max. number of operations in the cache of VIPS
+#define DEFAULT_VIPS_CONCURRENCY 1 // Default number of threads of each VIPS operation
+#define MAX_VIPS_CACHE_MEM 4096 // Max. memory of the operation cache of VIPS (in MB)
+#define MAX_VIPS_CACHE_OPS 100000 // Max. number of operations in the cache of VIPS
+#define MAX_VIPS_CONCURRENCY 64 // Max. number of threads of each VIPS operation
+#define VIPS_OPTION_PREFIX "-vips_" // Prefix of the options of the VIPS settings
+
+/**
+ * @brief Structure representing the settings of VIPS
+ *
+ * cache_mem Max. memory of the operation cache (in MB), 0 disables the cache
+ * cache_ops Max. number of operations in the cache, 0 disables the cache
+ * concurrency Number of threads of each operation, 0 for the default of VIPS
+ */
+struct vips_settings {
+    uint32_t cache_mem;
+    uint32_t cache_ops;
+    uint32_t concurrency;
+};
+
+/**
+ * @brief Initialises the settings of VIPS with the default values.
+ *
+ * @param settings The settings
+ */
+void init_vips_settings(struct vips_settings* settings);
+
+/**
+ * @brief Parses one option of the settings of VIPS: -vips_cache_mem <MB>,
+ * -vips_cache_ops <N> or -vips_concurrency <N>.
+ *
+ * @param option The option, starting with VIPS_OPTION_PREFIX
+ * @param value The value of the option
+ * @param settings The settings to update
+ *
+ * @return Returns 0 in case of success, ERR_INVALID_ARGUMENT if the option
+ * or its value is invalid
+ */
+int parse_vips_option(const char* option, const char* value, struct vips_settings* settings);
+
+/**
+ * @brief Applies the settings to VIPS, initialised before.
+ *
+ * @param settings The settings
+ */
+void apply_vips_settings(const struct vips_settings* settings);
+
 /**
  * @brief Resizes the image specified by index into the specified dimension
  *
@@ -21,6 +73,65 @@
  */
 size_t lazily_resize(size_t dim, struct pictdb_file* db_file, size_t index);
 
+/**
+ * @brief Resizes an original image into a dimension and saves it into a
+ * buffer in memory. Only reads the resolutions and the blob of the picture,
+ * so it can run while another thread stores images.
+ *
+ * @param buff A buffer containing the original image
+ * @param index The image's index in metadatas
+ * @param dim Internal code representing the desired dimension
+ * @param db_file The database
+ * @param outBuffer Pointer to a buffer that will contains the resized image, allocated by VIPS
+ * @param newSizeAfterResize Pointer to a size that will contain the size of the resized image
+ *
+ * @return Returns 0 in case of success
+ */
+int resize_and_save_image(void* buff, size_t index, size_t dim, const struct pictdb_file* db_file,
+                          void** outBuffer, size_t* newSizeAfterResize);
+
+/**
+ * @brief Stores a resized image of a picture: in the derivative cache, else
+ * in the thumbnail region or at the end of the file, and updates the blob
+ * shared by the duplicates.
+ *
+ * @param image_buffer The resized image
+ * @param image_size The size of the resized image
+ * @param index The image's index in metadatas
+ * @param dim Internal code representing the dimension of the image
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int store_resized_image(const void* image_buffer, size_t image_size, size_t index, size_t dim,
+                        struct pictdb_file* db_file);
+
+/**
+ * @brief Tells if VIPS can save the images in a format: JPEG always, WebP
+ * and AVIF if VIPS was built with them and did not fail to save in them.
+ *
+ * @param format FORMAT_JPEG, FORMAT_WEBP or FORMAT_AVIF
+ *
+ * @return Returns non zero if the format is supported
+ */
+int is_format_supported(int format);
+
+/**
+ * @brief Saves an image into a buffer in memory in a format. A format that
+ * fails is no more supported (see is_format_supported).
+ *
+ * @param image The image to save
+ * @param format FORMAT_JPEG, FORMAT_WEBP or FORMAT_AVIF
+ * @param encoding The encoding of the image (only its quality and
+ * ENCODING_STRIP for WebP and AVIF)
+ * @param image_buffer Pointer to the buffer of the saved image, allocated by VIPS
+ * @param image_size Pointer to the size of the saved image
+ *
+ * @return Returns 0 in case of success, ERR_VIPS otherwise
+ */
+int save_image_buffer(VipsImage* image, int format, const struct pict_encoding* encoding,
+                      void** image_buffer, size_t* image_size);
+
 /**
  * @brief Gets the picture's width and height using the VIPS library and
  * stocks it in the height and width parameters
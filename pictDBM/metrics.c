@@ -0,0 +1,254 @@
+/**
+ * @file metrics.c
+ * @brief pictDB library: counters and latency histograms implementation
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "metrics.h"
+#include <stdarg.h>
+#include <vips/vips.h> // for the memory of VIPS
+
+#define NB_LATENCY_BUCKETS 10
+
+#define ATOMIC_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static const char* const ROUTE_NAMES[NB_ROUTES] = {
+    "/pictDB/list",
+    "/pictDB/read",
+    "/pictDB/read_batch",
+    "/pictDB/insert",
+    "/pictDB/delete",
+    "/pictDB/sprite",
+    "/pictDB/sprite_map",
+    "/metrics",
+    "/pictDB/trace",
+    "static"
+};
+
+static const char* const OP_NAMES[NB_OPS] = {
+    "do_read",
+    "do_insert",
+    "do_delete",
+    "lazily_resize",
+    "do_gbcollect",
+    "do_read_variant"
+};
+
+// Upper bounds (in seconds) of the latency buckets, the last one is +Inf
+static const double LATENCY_BUCKETS[NB_LATENCY_BUCKETS] = {
+    0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 5.0
+};
+
+/**
+ * @brief Latency histogram of one operation
+ *
+ * buckets Number of observations per bucket (not cumulative)
+ * sum_us Sum of all the observations in microseconds
+ */
+struct latency_histogram {
+    uint64_t buckets[NB_LATENCY_BUCKETS + 1];
+    uint64_t sum_us;
+};
+
+static uint64_t requests[NB_ROUTES];
+static uint64_t errors;
+static uint64_t bytes_served;
+static int64_t open_connections;
+static struct latency_histogram histograms[NB_OPS];
+
+/********************************************************************//**
+ * Counts one request on a route.
+ */
+void metrics_count_request(enum metrics_route route)
+{
+    if(route < NB_ROUTES) {
+        ATOMIC_ADD(requests[route], 1);
+    }
+}
+
+/********************************************************************//**
+ * Counts one request answered with an error.
+ */
+void metrics_count_error(void)
+{
+    ATOMIC_ADD(errors, 1);
+}
+
+/********************************************************************//**
+ * Records the duration of one operation.
+ */
+void metrics_observe(enum metrics_op op, double start)
+{
+    if(op >= NB_OPS) {
+        return;
+    }
+    const double seconds = metrics_now() - start;
+    size_t bucket = 0;
+    while((bucket < NB_LATENCY_BUCKETS) && (seconds > LATENCY_BUCKETS[bucket])) {
+        ++bucket;
+    }
+    ATOMIC_ADD(histograms[op].buckets[bucket], 1);
+    ATOMIC_ADD(histograms[op].sum_us, (uint64_t)(seconds * 1e6));
+}
+
+/********************************************************************//**
+ * Adds bytes to the number of bytes served.
+ */
+void metrics_add_bytes_served(size_t bytes)
+{
+    ATOMIC_ADD(bytes_served, bytes);
+}
+
+/********************************************************************//**
+ * Updates the number of open connections.
+ */
+void metrics_update_connections(int delta)
+{
+    ATOMIC_ADD(open_connections, delta);
+}
+
+/**
+ * @brief Growing string used to format the metrics
+ *
+ * text The string
+ * len Length of the string
+ * capacity Allocated size of text
+ * error Set if an allocation failed
+ */
+struct text_buffer {
+    char* text;
+    size_t len;
+    size_t capacity;
+    int error;
+};
+
+/**
+ * @brief Appends formatted text at the end of a text buffer.
+ *
+ * @param buffer The text buffer
+ * @param format printf-like format
+ */
+static void append(struct text_buffer* buffer, const char* format, ...)
+{
+    if(buffer->error) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buffer->text + buffer->len, buffer->capacity - buffer->len, format, ap);
+    va_end(ap);
+    if(len < 0) {
+        buffer->error = ERR_IO;
+        return;
+    }
+    if((size_t) len >= buffer->capacity - buffer->len) {
+        const size_t capacity = 2 * (buffer->len + len + 1);
+        char* text = realloc(buffer->text, capacity);
+        if(NULL == text) {
+            buffer->error = ERR_OUT_OF_MEMORY;
+            return;
+        }
+        buffer->text = text;
+        buffer->capacity = capacity;
+        va_start(ap, format);
+        vsnprintf(buffer->text + buffer->len, buffer->capacity - buffer->len, format, ap);
+        va_end(ap);
+    }
+    buffer->len += len;
+}
+
+/**
+ * @brief Appends the histogram of one operation in the Prometheus format.
+ *
+ * @param buffer The text buffer
+ * @param op The operation
+ */
+static void append_histogram(struct text_buffer* buffer, enum metrics_op op)
+{
+    uint64_t count = 0;
+    for(size_t i = 0; i < NB_LATENCY_BUCKETS; ++i) {
+        count += ATOMIC_LOAD(histograms[op].buckets[i]);
+        append(buffer, "pictdb_operation_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+               OP_NAMES[op], LATENCY_BUCKETS[i], count);
+    }
+    count += ATOMIC_LOAD(histograms[op].buckets[NB_LATENCY_BUCKETS]);
+    append(buffer, "pictdb_operation_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", OP_NAMES[op], count);
+    append(buffer, "pictdb_operation_duration_seconds_sum{op=\"%s\"} %.6f\n", OP_NAMES[op],
+           (double) ATOMIC_LOAD(histograms[op].sum_us) / 1e6);
+    append(buffer, "pictdb_operation_duration_seconds_count{op=\"%s\"} %" PRIu64 "\n", OP_NAMES[op], count);
+}
+
+/********************************************************************//**
+ * Formats all the metrics in the Prometheus text format.
+ */
+const char* metrics_format(const struct pictdb_file* db_file)
+{
+    if(NULL == db_file) {
+        return NULL;
+    }
+    struct text_buffer buffer = {NULL, 0, 4096, 0};
+    buffer.text = calloc(buffer.capacity, sizeof(char));
+    if(NULL == buffer.text) {
+        return NULL;
+    }
+
+    append(&buffer, "# HELP pictdb_http_requests_total Number of HTTP requests per route.\n");
+    append(&buffer, "# TYPE pictdb_http_requests_total counter\n");
+    for(size_t i = 0; i < NB_ROUTES; ++i) {
+        append(&buffer, "pictdb_http_requests_total{route=\"%s\"} %" PRIu64 "\n", ROUTE_NAMES[i], ATOMIC_LOAD(requests[i]));
+    }
+    append(&buffer, "# HELP pictdb_http_errors_total Number of HTTP requests answered with an error.\n");
+    append(&buffer, "# TYPE pictdb_http_errors_total counter\n");
+    append(&buffer, "pictdb_http_errors_total %" PRIu64 "\n", ATOMIC_LOAD(errors));
+
+    append(&buffer, "# HELP pictdb_operation_duration_seconds Latency of the pictDB operations.\n");
+    append(&buffer, "# TYPE pictdb_operation_duration_seconds histogram\n");
+    for(size_t i = 0; i < NB_OPS; ++i) {
+        append_histogram(&buffer, i);
+    }
+
+    append(&buffer, "# HELP pictdb_bytes_served_total Number of bytes sent to the clients.\n");
+    append(&buffer, "# TYPE pictdb_bytes_served_total counter\n");
+    append(&buffer, "pictdb_bytes_served_total %" PRIu64 "\n", ATOMIC_LOAD(bytes_served));
+    append(&buffer, "# HELP pictdb_open_connections Number of open client connections.\n");
+    append(&buffer, "# TYPE pictdb_open_connections gauge\n");
+    append(&buffer, "pictdb_open_connections %" PRId64 "\n", ATOMIC_LOAD(open_connections));
+    append(&buffer, "# HELP pictdb_vips_memory_bytes Memory allocated by VIPS, with its operation cache.\n");
+    append(&buffer, "# TYPE pictdb_vips_memory_bytes gauge\n");
+    append(&buffer, "pictdb_vips_memory_bytes %zu\n", vips_tracked_get_mem());
+    append(&buffer, "# HELP pictdb_vips_memory_highwater_bytes Max. memory allocated by VIPS since the start.\n");
+    append(&buffer, "# TYPE pictdb_vips_memory_highwater_bytes gauge\n");
+    append(&buffer, "pictdb_vips_memory_highwater_bytes %zu\n", vips_tracked_get_mem_highwater());
+
+    uint64_t file_size = 0;
+    uint64_t dead_bytes = 0;
+    if(0 != get_db_usage(db_file, &file_size, &dead_bytes)) {
+        buffer.error = ERR_IO;
+    }
+    append(&buffer, "# HELP pictdb_db_version Version of the database.\n");
+    append(&buffer, "# TYPE pictdb_db_version gauge\n");
+    append(&buffer, "pictdb_db_version %" PRIu32 "\n", db_file->header.db_version);
+    append(&buffer, "# HELP pictdb_num_files Number of pictures in the database.\n");
+    append(&buffer, "# TYPE pictdb_num_files gauge\n");
+    append(&buffer, "pictdb_num_files %" PRIu32 "\n", db_file->header.num_files);
+    append(&buffer, "# HELP pictdb_max_files Max. number of pictures in the database.\n");
+    append(&buffer, "# TYPE pictdb_max_files gauge\n");
+    append(&buffer, "pictdb_max_files %" PRIu32 "\n", db_file->header.max_files);
+    append(&buffer, "# HELP pictdb_file_size_bytes Size of the database file.\n");
+    append(&buffer, "# TYPE pictdb_file_size_bytes gauge\n");
+    append(&buffer, "pictdb_file_size_bytes %" PRIu64 "\n", file_size);
+    append(&buffer, "# HELP pictdb_dead_bytes Bytes of the database file used by no picture.\n");
+    append(&buffer, "# TYPE pictdb_dead_bytes gauge\n");
+    append(&buffer, "pictdb_dead_bytes %" PRIu64 "\n", dead_bytes);
+    append(&buffer, "# HELP pictdb_live_bytes Bytes of the images of the pictures.\n");
+    append(&buffer, "# TYPE pictdb_live_bytes gauge\n");
+    append(&buffer, "pictdb_live_bytes %" PRIu64 "\n", db_file->header.live_bytes);
+
+    if(buffer.error) {
+        free(buffer.text);
+        return NULL;
+    }
+    return buffer.text;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file metrics.h
+ * @brief pictDB library: counters and latency histograms.
+ *
+ * All the counters are updated with relaxed atomic operations so that they
+ * can be maintained on every request at a negligible cost. They are
+ * exported in the Prometheus text format by metrics_format.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+#ifndef PICTDBPRJ_METRICS_H
+#define PICTDBPRJ_METRICS_H
+
+#include "pictDB.h"
+#include "metrics_clock.h"
+
+/**
+ * @brief Routes of pictDB_server counted by the metrics
+ */
+enum metrics_route {
+    ROUTE_LIST,
+    ROUTE_READ,
+    ROUTE_READ_BATCH,
+    ROUTE_INSERT,
+    ROUTE_DELETE,
+    ROUTE_SPRITE,
+    ROUTE_SPRITE_MAP,
+    ROUTE_METRICS,
+    ROUTE_TRACE,
+    ROUTE_STATIC,
+    NB_ROUTES
+};
+
+/**
+ * @brief Operations whose latency is recorded in a histogram
+ */
+enum metrics_op {
+    OP_DO_READ,
+    OP_DO_INSERT,
+    OP_DO_DELETE,
+    OP_LAZILY_RESIZE,
+    OP_DO_GBCOLLECT,
+    OP_DO_READ_VARIANT,
+    NB_OPS
+};
+
+/**
+ * @brief Counts one request on a route.
+ *
+ * @param route The route of the request.
+ */
+void metrics_count_request(enum metrics_route route);
+
+/**
+ * @brief Counts one request answered with an error.
+ */
+void metrics_count_error(void);
+
+/**
+ * @brief Records the duration of one operation in its histogram.
+ *
+ * @param op The operation.
+ * @param start The time at which the operation started (from metrics_now).
+ */
+void metrics_observe(enum metrics_op op, double start);
+
+/**
+ * @brief Adds bytes to the number of bytes served.
+ *
+ * @param bytes The number of bytes sent.
+ */
+void metrics_add_bytes_served(size_t bytes);
+
+/**
+ * @brief Updates the number of open connections.
+ *
+ * @param delta +1 when a connection is opened, -1 when it is closed.
+ */
+void metrics_update_connections(int delta);
+
+/**
+ * @brief Formats all the metrics, and the statistics of the database,
+ * in the Prometheus text format.
+ *
+ * @param db_file The database.
+ *
+ * @return Returns a string to be freed by the caller, NULL in case of error.
+ */
+const char* metrics_format(const struct pictdb_file* db_file);
+
+#endif //PICTDBPRJ_METRICS_H
@@ -0,0 +1,23 @@
+/**
+ * @file metrics_clock.c
+ * @brief pictDB library: monotonic clock of the metrics implementation
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+
+#include "metrics_clock.h"
+#include <time.h>
+
+/********************************************************************//**
+ * Monotonic clock in seconds.
+ */
+double metrics_now(void)
+{
+    struct timespec now;
+    if(0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+        return 0.0;
+    }
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
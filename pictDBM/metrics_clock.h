@@ -0,0 +1,20 @@
+/**
+ * @file metrics_clock.h
+ * @brief pictDB library: monotonic clock of the metrics.
+ *
+ * Kept apart from the counters so that the tools measuring durations
+ * (such as pictDB_load) do not depend on the database code.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+#ifndef PICTDBPRJ_METRICS_CLOCK_H
+#define PICTDBPRJ_METRICS_CLOCK_H
+
+/**
+ * @brief Gets the time of a monotonic clock.
+ *
+ * @return Returns the time in seconds.
+ */
+double metrics_now(void);
+
+#endif //PICTDBPRJ_METRICS_CLOCK_H
@@ -5,11 +5,35 @@
  * Defines the format of the data structures that will be stored on the disk
  * and provides interface functions.
  *
- * The picture database starts with exactly one header structure
- * followed by exactly pictdb_header.max_files metadata
- * structures. The actual content is not defined by these structures
+ * The picture database starts with exactly one header structure,
+ * followed by the location of the string heap containing the pictures' IDs,
+ * by the location of the blob table, by the location of the region of the
+ * thumbnails (see pict_thumb_region), by exactly pictdb_header.max_files
+ * metadata structures and by the index of the IDs (see ID_INDEX_OFFSET). The
+ * string heap is followed by the hash tables of the IDs and of the SHAs (see
+ * pict_hash_index). The actual content is not defined by these structures
  * because it should be stored as raw bytes appended at the end of the
- * database file and addressed by offsets in the metadata structure.
+ * database file and addressed by offsets in the blob table, whose blobs are
+ * shared by the pictures with the same content (see pict_blob). The regions
+ * of the file used by nothing anymore are written again by the new images
+ * (see pict_extent). The free extents are followed by the table of the
+ * resolutions of the database (see pict_resolution_table).
+ *
+ * Databases of an older format version are converted in memory when opened
+ * read-only and migrated in place when opened for writing (see do_migrate).
+ * Databases of format version 1 have no string heap and their metadata
+ * contain the IDs (see pict_metadata_v1); those of format versions 2 to 4
+ * have no blob table and their metadata contain the content of the picture
+ * (see pict_metadata_v2); those of format versions 1 to 5 have a header
+ * without the live and dead bytes, those of format versions 1 to 6 have
+ * no table of the free extents, those of format versions 1 to 7 have no
+ * region of the thumbnails, those of format versions 1 to 8 have no
+ * named resolutions (see pict_blob_v5) and those of format versions 1 to 9
+ * have no encoding of the resized images (see pict_resolution_v9).
+ *
+ * The resized images of a database created with a derivative cache are not
+ * stored in the database file but in a cache file next to it, bounded by a
+ * budget (see pict_cache_header).
  *
  * @author Mia Primorac
  * @date 2 Nov 2015
@@ -24,6 +48,7 @@
 #include "error.h" /* not needed here, but provides it as required by
                     * all functions of this lib.
                     */
+#include "scan.h" // for scan_nonzero_word
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint32_t, uint64_t
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
@@ -33,26 +58,126 @@
 #include <stdlib.h>
 
 #define CAT_TXT "EPFL PictDB binary"
+#define CACHE_CAT_TXT "EPFL PictDB derivative cache 2" // 2: list of the images in the table
+#define CACHE_FILE_SUFFIX ".cache" // Suffix of the name of the cache file of a database
+#define JOURNAL_FILE_SUFFIX ".migrate" // Suffix of the name of the journal of a migration
 
 /* constraints */
 #define MAX_DB_NAME 31  // Max. size of a PictDB name
 #define MAX_PIC_ID 127  // Max. size of a picture id
 #define DEFAULT_MAX_FILES 10 // Default value of max_files
 #define MAX_MAX_FILES 100000 // Max. value of max_files
+#define DEFAULT_ID_HEAP_SIZE 16 // Bytes reserved per picture ID in a new string heap
+#define MIN_THUMB_REGION_SIZE (64 * 1024) // Min. capacity of the region of the thumbnails
 #define DEFAULT_THUMB 64 // Default thumbnail size
 #define MAX_THUMB 128 // Max. thumbnail size
 #define DEFAULT_SMALL 256 // Default small size
 #define MAX_SMALL 512 // Max. small size
+#define MAX_RES_NAME 11 // Max. size of the name of a resolution
+#define MAX_NAMED_RES 2048 // Max. size of the images of a named resolution
+#define MIN_ALIGNMENT 512 // Min. alignment of the images, the size of a disk sector
+#define MAX_ALIGNMENT (1 << 20) // Max. alignment of the images
+#define MIN_CACHE_SIZE (UINT64_C(1) << 20) // Min. budget of a derivative cache
+#define MAX_CACHE_SIZE (UINT64_C(1) << 40) // Max. budget of a derivative cache
+
+/* For format_version in pictdb_header */
+#define PICTDB_FORMAT_V1 1 // IDs in the metadata (0 in the files created before the version existed)
+#define PICTDB_FORMAT_V2 2 // IDs in a string heap
+#define PICTDB_FORMAT_V3 3 // Index of the IDs after the metadata
+#define PICTDB_FORMAT_V4 4 // Hash tables of the IDs and of the SHAs after the string heap
+#define PICTDB_FORMAT_V5 5 // Blob table shared by the pictures with the same content
+#define PICTDB_FORMAT_V6 6 // Live and dead bytes counted in the header
+#define PICTDB_FORMAT_V7 7 // Table of the free extents after the blob table
+#define PICTDB_FORMAT_V8 8 // Region of the thumbnails after the location of the blob table
+#define PICTDB_FORMAT_V9 9 // Named resolutions in a table after the free extents
+#define PICTDB_FORMAT_V10 10 // Encoding of the resized images in the table of the resolutions
+#define PICTDB_FORMAT_VERSION PICTDB_FORMAT_V10 // Format of the new databases
+
+/* For features in pictdb_header: a file using a feature unknown to the
+ * library is not opened */
+#define PICTDB_FEATURE_ALIGNED UINT64_C(0x1) // The images start at a multiple of the alignment
+#define PICTDB_ALIGNMENT_SHIFT 8 // Position of the log2 of the alignment in the features
+#define PICTDB_ALIGNMENT_MASK (UINT64_C(0x3F) << PICTDB_ALIGNMENT_SHIFT)
+#define PICTDB_FEATURE_DERIVATIVE_CACHE UINT64_C(0x2) // The resized images are in a cache file
+#define PICTDB_CACHE_SHIFT 16 // Position of the log2 of the budget of the cache in the features
+#define PICTDB_CACHE_MASK (UINT64_C(0x3F) << PICTDB_CACHE_SHIFT)
+#define PICTDB_KNOWN_FEATURES (PICTDB_FEATURE_ALIGNED | PICTDB_ALIGNMENT_MASK | \
+                               PICTDB_FEATURE_DERIVATIVE_CACHE | PICTDB_CACHE_MASK) // Bitmask of the features known by the library
+
+/* The images of an aligned database start at a multiple of its alignment and
+ * are padded up to the next one, so that they can be read with direct I/O.
+ * The thumbnails of the region are packed: only the originals are read so */
+#define DB_ALIGNMENT(header) \
+    ((0 != ((header)->features & PICTDB_FEATURE_ALIGNED)) ? \
+     (UINT64_C(1) << (((header)->features & PICTDB_ALIGNMENT_MASK) >> PICTDB_ALIGNMENT_SHIFT)) : UINT64_C(1))
+#define ALIGN_UP(value, alignment) (((value) + (alignment) - 1) / (alignment) * (alignment))
+
+// Max. size of the images of the derivative cache of a database, 0 if it has none
+#define DB_CACHE_BUDGET(header) \
+    ((0 != ((header)->features & PICTDB_FEATURE_DERIVATIVE_CACHE)) ? \
+     (UINT64_C(1) << (((header)->features & PICTDB_CACHE_MASK) >> PICTDB_CACHE_SHIFT)) : UINT64_C(0))
+// Test if the images of a resolution are in the derivative cache instead of the database file
+#define IS_CACHED_RES(db_file, dim) \
+    ((RES_ORIG != (dim)) && (0 != ((db_file)->header.features & PICTDB_FEATURE_DERIVATIVE_CACHE)))
+// Test if the variants of the pictures can be written in the derivative cache of a database
+#define CAN_CACHE_VARIANTS(db_file) ((NULL != (db_file)->cache) && (db_file)->cache->writable)
+
+/* For valid in metadata_columns */
+#define VALID_WORD_BITS 64 // Number of bits per word of the bitset
+#define NB_VALID_WORDS(max_files) (((max_files) + VALID_WORD_BITS - 1) / VALID_WORD_BITS)
+#define IS_VALID_INDEX(db_file, i) \
+    (0 != ((db_file)->columns.valid[(i) / VALID_WORD_BITS] & (UINT64_C(1) << ((i) % VALID_WORD_BITS))))
+#define IS_USED_BLOB(db_file, b) \
+    (0 != ((db_file)->used_blobs[(b) / VALID_WORD_BITS] & (UINT64_C(1) << ((b) % VALID_WORD_BITS))))
 
 /* For is_valid in pictdb_metadata */
 #define EMPTY 0
 #define NON_EMPTY 1
 
-// pictDB library internal codes for different picture resolutions.
+// pictDB library internal codes for different picture resolutions. The
+// named resolutions of a database follow them (see pict_resolution_table).
 #define RES_THUMB 0
 #define RES_SMALL 1
 #define RES_ORIG  2
-#define NB_RES    3
+#define NB_DEFAULT_RES 3 // Number of resolutions of every database
+#define NB_RES    6 // Max. number of resolutions of a database
+
+// Test if a resolution is one of those of a database
+#define IS_DB_RES(db_file, dim) ((dim) < (db_file)->resolutions.nb_res)
+
+/* For flags in pict_encoding */
+#define ENCODING_PROGRESSIVE 0x1 // Interlaced, displayed while it is loaded
+#define ENCODING_STRIP 0x2 // Without the metadata of the original (EXIF, ICC profile...)
+#define ENCODING_OPTIMIZE 0x4 // Optimized Huffman tables: smaller, for a little more CPU
+#define ENCODING_KNOWN_FLAGS (ENCODING_PROGRESSIVE | ENCODING_STRIP | ENCODING_OPTIMIZE)
+
+/* For subsample in pict_encoding */
+#define SUBSAMPLE_AUTO 0 // Chroma subsampled below quality 90, as VIPS does
+#define SUBSAMPLE_ON   1 // Chroma subsampled (4:2:0)
+#define SUBSAMPLE_OFF  2 // Full chroma (4:4:4)
+#define NB_SUBSAMPLE   3
+
+#define DEFAULT_QUALITY 75 // Default quality of the resized images, the one of VIPS
+#define DEFAULT_ENCODING_FLAGS ENCODING_OPTIMIZE // Default flags of the resized images
+
+// Ways to resize a picture into the box of a variant (see do_read_variant)
+#define FIT_CONTAIN 0 // Inside the box, keeping the aspect ratio
+#define FIT_COVER   1 // Filling the box, keeping the aspect ratio, cropped at the centre
+#define FIT_FILL    2 // Stretched to the box
+#define NB_FIT      3
+#define MAX_VARIANT_RES 2048 // Max. size of the box of a variant
+#define MAX_CACHED_VARIANTS 6 // Max. number of variants of each blob in the derivative cache
+#define NO_CACHE_SLOT UINT32_MAX // Index of no entry in the list of the cached images
+
+// Formats of the images served, the stored images being JPEG
+#define FORMAT_JPEG 0
+#define FORMAT_WEBP 1
+#define FORMAT_AVIF 2
+#define NB_FORMATS  3
+
+// Key of a variant in the derivative cache, never 0 since the box is not empty
+#define VARIANT_KEY(width, height, fit, format) \
+    (((uint32_t) (format) << 26) | ((uint32_t) (fit) << 24) | ((uint32_t) (width) << 12) | (uint32_t) (height))
 
 // accessor for x and y dimensions for different picture dimensions.
 #define NB_DIM	    2 // number of dimension for the images (x and y)
@@ -78,22 +203,271 @@ extern "C" {
  * num_files Number of picture in database
  * max_files Max number of picture the database can contain
  * res_resized Pictures dimension for thumbnail and small
- * unused_32 Unused yet
- * unused_64 Unused yet
+ * format_version Version of the format of the file (see PICTDB_FORMAT_V1)
+ * features Bitmask of the optional parts of the format used by the file
+ * (see PICTDB_FEATURE_ALIGNED and PICTDB_FEATURE_DERIVATIVE_CACHE)
+ * live_bytes Size of the images of the used blobs
+ * dead_bytes Size of the regions of the file used by nothing anymore (images
+ * of the freed blobs, old locations of the string heap and of the hash
+ * tables), reclaimed by do_gbcollect
 */
 struct pictdb_header {
     char db_name[MAX_DB_NAME + 1];
     uint32_t db_version;
     uint32_t num_files;
     uint32_t max_files;
-    uint16_t res_resized[NB_DIM * (NB_RES - 1)];
+    uint16_t res_resized[NB_DIM * (NB_DEFAULT_RES - 1)];
+    uint32_t format_version;
+    uint64_t features;
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+};
+
+/**
+ * @brief Structure representing the string heap containing the pictures' IDs,
+ * stored right after the header. Each ID is followed by a '\0' and the
+ * first byte of the heap is a '\0' (the ID of the empty metadata).
+ *
+ * offset Position of the heap in the database file
+ * size Number of bytes used in the heap
+ * capacity Number of bytes reserved for the heap in the database file
+ */
+struct pict_id_heap {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+/**
+ * @brief Structure representing the location of the region of the
+ * thumbnails, stored right after the location of the blob table. The
+ * thumbnails are packed in it in the order they are written, which is the
+ * order of the pictures once garbage collected, so that the thumbnails of a
+ * page are read at once (see read_thumb_span). The thumbnails of the freed
+ * blobs stay in it until the database is garbage collected.
+ *
+ * offset Position of the region in the database file
+ * size Number of bytes used in the region
+ * capacity Number of bytes reserved for the region in the database file (0
+ * if the database has no region yet)
+ */
+struct pict_thumb_region {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t capacity;
+};
+
+/**
+ * @brief Structure representing the location of the blob table, stored right
+ * after the location of the string heap. The table has max_files pict_blob,
+ * since each valid picture references one blob, and is followed by the table
+ * of the free extents (see EXTENT_TABLE_CAPACITY).
+ *
+ * offset Position of the table in the database file
+ * nb_blobs Number of blobs referenced by at least one picture
+ * nb_extents Number of free extents at the beginning of their table
+ */
+struct pict_blob_table {
+    uint64_t offset;
+    uint32_t nb_blobs;
+    uint32_t nb_extents;
+};
+
+/**
+ * @brief Structure representing a region of the database file used by
+ * nothing anymore (images of the freed blobs, old locations of the string
+ * heap and of the hash tables), where a new image can be written. The free
+ * extents next to each other are merged.
+ *
+ * offset Position of the region in the database file
+ * size Size of the region
+ */
+struct pict_extent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+ * @brief Structure representing how the images of a resolution are encoded
+ * when they are resized. The quality also applies to the WebP and AVIF
+ * variants (see do_read_format).
+ *
+ * quality Quality factor, from 1 to 100
+ * flags ENCODING_PROGRESSIVE, ENCODING_STRIP and ENCODING_OPTIMIZE
+ * subsample Chroma subsampling (SUBSAMPLE_AUTO, SUBSAMPLE_ON or SUBSAMPLE_OFF)
+ * unused_8 Unused yet
+ */
+struct pict_encoding {
+    uint8_t quality;
+    uint8_t flags;
+    uint8_t subsample;
+    uint8_t unused_8;
+};
+
+/**
+ * @brief Structure representing a resolution of the images of a database.
+ *
+ * name Name of the resolution, as given to resolution_atoi
+ * res Max. dimensions of the resized images (0 for the originals)
+ * encoding Encoding of the resized images (for the originals, the encoding
+ * of the variants bigger than the other resolutions)
+ */
+struct pict_resolution {
+    char name[MAX_RES_NAME + 1];
+    uint16_t res[NB_DIM];
+    struct pict_encoding encoding;
+};
+
+/**
+ * @brief Structure representing the resolutions of a database, stored right
+ * after the table of the free extents. The first NB_DEFAULT_RES are the
+ * thumbnails, the small images (with the dimensions of
+ * pictdb_header.res_resized) and the originals; the named resolutions given
+ * to do_create follow them. Each blob has one image per resolution.
+ *
+ * nb_res Number of resolutions, between NB_DEFAULT_RES and NB_RES
+ * unused_32 Unused yet
+ * resolutions The resolutions, indexed by their internal codes
+ */
+struct pict_resolution_table {
+    uint32_t nb_res;
+    uint32_t unused_32;
+    struct pict_resolution resolutions[NB_RES];
+};
+
+/**
+ * @brief Structure representing a resolution in format version 9, without
+ * the encoding of its images
+ *
+ * name Name of the resolution
+ * res Max. dimensions of the resized images (0 for the originals)
+ */
+struct pict_resolution_v9 {
+    char name[MAX_RES_NAME + 1];
+    uint16_t res[NB_DIM];
+};
+
+/**
+ * @brief Structure representing the resolutions of a database in format
+ * version 9, stored at the same position
+ *
+ * nb_res Number of resolutions, between NB_DEFAULT_RES and NB_RES
+ * unused_32 Unused yet
+ * resolutions The resolutions, indexed by their internal codes
+ */
+struct pict_resolution_table_v9 {
+    uint32_t nb_res;
     uint32_t unused_32;
-    uint64_t unused_64;
+    struct pict_resolution_v9 resolutions[NB_RES];
+};
+
+/**
+ * @brief Structure representing the header of the hash tables of the
+ * pictures' IDs and SHAs, stored right after the region of the string heap
+ * (at heap.offset + heap.capacity) and followed by the table of the IDs then
+ * by the table of the SHAs, of nb_buckets hash_bucket each. The tables are
+ * only used if db_version is the one of the database header: they are
+ * rebuilt from the metadata otherwise.
+ *
+ * db_version Database's version when the tables were last written
+ * nb_buckets Number of buckets of each table (see HASH_INDEX_BUCKETS)
+ */
+struct pict_hash_index {
+    uint32_t db_version;
+    uint32_t nb_buckets;
+};
+
+/**
+ * @brief Structure representing a bucket of the hash tables (open addressing
+ * with linear probing)
+ *
+ * hash Hash of the key (see hash_pict_id), or first bytes of the SHA
+ * index Index of the picture's metadata (of the blob for the table of the
+ * SHAs) plus one (0 for an empty bucket)
+ */
+struct hash_bucket {
+    uint32_t hash;
+    uint32_t index;
 };
 
 /**
  * @brief Structure representing a picture's metadata
  *
+ * id_offset Position of the picture's ID in the string heap
+ * id_length Length of the picture's ID
+ * is_valid Indicates if the picture is still used (value NON_EMPTY) or has been deleted (value EMPTY)
+ * blob Index of the picture's content in the blob table
+*/
+struct pict_metadata {
+    uint32_t id_offset;
+    uint16_t id_length;
+    uint16_t is_valid;
+    uint32_t blob;
+};
+
+/**
+ * @brief Structure representing the content of a picture, shared by all the
+ * pictures with the same SHA. A deleted picture only decrements refcount:
+ * the images of the blob become unused when it reaches 0.
+ *
+ * SHA Picture's hashcode
+ * res_orig Original picture's dimension
+ * size Memory size (in bytes) of the picture with different dimension
+ * refcount Number of valid pictures referencing the blob (0 for a free blob)
+ * offset Positions of the picture with different dimension in the database file
+*/
+struct pict_blob {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[NB_DIM];
+    uint32_t size[NB_RES];
+    uint32_t refcount;
+    uint64_t offset[NB_RES];
+};
+
+/**
+ * @brief Structure representing a blob in format versions 5 to 8, with the
+ * images of the default resolutions only
+ *
+ * SHA Picture's hashcode
+ * res_orig Original picture's dimension
+ * size Memory size (in bytes) of the picture with different dimension
+ * refcount Number of valid pictures referencing the blob (0 for a free blob)
+ * offset Positions of the picture with different dimension in the database file
+*/
+struct pict_blob_v5 {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[NB_DIM];
+    uint32_t size[NB_DEFAULT_RES];
+    uint32_t refcount;
+    uint64_t offset[NB_DEFAULT_RES];
+};
+
+/**
+ * @brief Structure representing a picture's metadata in format versions 2 to 4
+ *
+ * id_offset Position of the picture's ID in the string heap
+ * id_length Length of the picture's ID
+ * is_valid Indicates if the picture is still used (value NON_EMPTY) or has been deleted (value EMPTY)
+ * SHA Picture's hashcode
+ * res_orig Original picture's dimension
+ * size Memory size (in bytes) of the picture with different dimension
+ * unused_32 Unused yet
+ * offset Positions of the picture with different dimension in the database file
+*/
+struct pict_metadata_v2 {
+    uint32_t id_offset;
+    uint16_t id_length;
+    uint16_t is_valid;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[NB_DIM];
+    uint32_t size[NB_DEFAULT_RES];
+    uint32_t unused_32;
+    uint64_t offset[NB_DEFAULT_RES];
+};
+
+/**
+ * @brief Structure representing a picture's metadata in format version 1
+ *
  * pict_id Unique picture's ID
  * SHA Picture's hashcode
  * res_orig Original picture's dimension
@@ -102,29 +476,207 @@ struct pictdb_header {
  * is_valid Indicates if the picture is still used (value NON_EMPTY) or has been deleted (value EMPTY)
  * unused_16 Unused yet
 */
-struct pict_metadata {
+struct pict_metadata_v1 {
     char pict_id[MAX_PIC_ID + 1];
     unsigned char SHA[SHA256_DIGEST_LENGTH];
     uint32_t res_orig[NB_DIM];
-    uint32_t size[NB_RES];
-    uint64_t offset[NB_RES];
+    uint32_t size[NB_DEFAULT_RES];
+    uint64_t offset[NB_DEFAULT_RES];
     uint16_t is_valid;
     uint16_t unused_16;
 };
 
+/**
+ * @brief Structure representing the header of the cache file of the resized
+ * images of a database (named after it with CACHE_FILE_SUFFIX), followed by
+ * NB_RES - 1 + MAX_CACHED_VARIANTS cached_image per blob, one per resolution
+ * but RES_ORIG in the order of the resolutions then the variants, and by the
+ * images. The images of the freed blobs are dropped and the least recently
+ * used images are evicted when the budget of the database is reached (see
+ * DB_CACHE_BUDGET): their regions are written again once the images are
+ * compacted. The cache is not needed to read the originals, so a backup of
+ * the database file alone is enough.
+ *
+ * The cached images are linked from the least to the most recently used
+ * through their entries. The counters and the ends of the list are only
+ * written when the file is closed: a file not closed is marked dirty, and
+ * its counters and its list are rebuilt from the whole table when it is
+ * opened again.
+ *
+ * cat_txt Text identifying the file (CACHE_CAT_TXT)
+ * max_files Max number of picture of the database
+ * nb_cached_res Number of cached_image per blob (NB_RES - 1 + MAX_CACHED_VARIANTS)
+ * is_dirty Nonzero while the file is opened for writing and modified
+ * used_bytes Size of the cached images
+ * end Position after the last image of the file
+ * clock Number of images written or read, counted from the greatest last_used
+ * oldest Index of the entry of the least recently used image (NO_CACHE_SLOT if none)
+ * newest Index of the entry of the most recently used image (NO_CACHE_SLOT if none)
+ */
+struct pict_cache_header {
+    char cat_txt[MAX_DB_NAME + 1];
+    uint32_t max_files;
+    uint32_t nb_cached_res;
+    uint32_t is_dirty;
+    uint32_t unused_32;
+    uint64_t used_bytes;
+    uint64_t end;
+    uint64_t clock;
+    uint32_t oldest;
+    uint32_t newest;
+};
+
+/**
+ * @brief Structure representing a resized image of the cache file. The image
+ * is only used if SHA is the one of its blob: it is resized again otherwise.
+ *
+ * SHA Hashcode of the blob of the image
+ * size Size of the image (0 if there is none)
+ * variant Key of the variant of the image (see VARIANT_KEY), 0 for a resolution
+ * offset Position of the image in the cache file
+ * last_used Value of the clock of the cache when the image was last read
+ * prev Index of the entry of the image used just before (NO_CACHE_SLOT if none)
+ * next Index of the entry of the image used just after (NO_CACHE_SLOT if none)
+ */
+struct cached_image {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t size;
+    uint32_t variant;
+    uint64_t offset;
+    uint64_t last_used;
+    uint32_t prev;
+    uint32_t next;
+};
+
+/**
+ * @brief State of the opened cache file of a database. The entries of a blob
+ * are read from the file when first used.
+ *
+ * file The cache file
+ * header The header of the file, with the counters of the cache
+ * images Table of the cached images, NB_RES - 1 + MAX_CACHED_VARIANTS per blob
+ * loaded Bitset of the blobs whose entries are read, one bit per blob
+ * writable Tells if the file is opened for writing
+ */
+struct derivative_cache {
+    FILE* file;
+    struct pict_cache_header header;
+    struct cached_image* images;
+    uint64_t* loaded;
+    int writable;
+};
+
+/**
+ * @brief Structure-of-arrays copy of the fields of the metadata used by
+ * the scans of the whole table, so that they only touch the bytes they need.
+ * Built from the metadata when the database is opened or created and kept
+ * up to date by write_db_file_one_metadata.
+ *
+ * valid Bitset of the valid pictures, one bit per metadata
+ * id_hash Hash of each picture's ID (see hash_pict_id)
+ */
+struct metadata_columns {
+    uint64_t* valid;
+    uint32_t* id_hash;
+};
+
+/**
+ * @brief State of the metadata of a database opened by do_open_lazy, which
+ * are read from the file when first used.
+ *
+ * loaded Bitset of the metadata already read, one bit per metadata
+ * loaded_blobs Bitset of the blobs already read, one bit per blob
+ * complete Tells if all the metadata and their columns have been read
+ */
+struct metadata_pager {
+    uint64_t* loaded;
+    uint64_t* loaded_blobs;
+    int complete;
+};
+
 /**
  * @brief Structure representing a PictDB
  *
  * fpdb Indicates the file containing the data (on disk)
  * header Database's header
+ * heap Location of the string heap
+ * ids Content of the string heap (heap.capacity bytes)
+ * blob_table Location of the blob table
+ * thumbs Location of the region of the thumbnails
+ * resolutions Table of the resolutions, set by the caller of do_create
  * metadata Metadata of the picture in the database
+ * blobs Content of the blob table (max_files blobs)
+ * used_blobs Bitset of the blobs referenced by a valid picture
+ * extents Free extents of the file (blob_table.nb_extents extents)
+ * direct_fd Descriptor of the file for the direct reads of the original
+ * images (-1 if they are read through fpdb, see open_direct_reads)
+ * cache Cache file of the resized images (NULL if the database has none or
+ * if it is missing from a database opened read-only)
+ * columns Copy of the metadata used by the scans
+ * pager State of the metadata read lazily (NULL when they are all loaded)
+ * nb_buckets Number of buckets of each hash table
+ * buckets Hash tables of the IDs and of the SHAs (2 * nb_buckets buckets)
  */
 struct pictdb_file {
     FILE* fpdb;
     struct pictdb_header header;
+    struct pict_id_heap heap;
+    char* ids;
+    struct pict_blob_table blob_table;
+    struct pict_thumb_region thumbs;
+    struct pict_resolution_table resolutions;
     struct pict_metadata* metadata;
+    struct pict_blob* blobs;
+    uint64_t* used_blobs;
+    struct pict_extent* extents;
+    int direct_fd;
+    struct derivative_cache* cache;
+    struct metadata_columns columns;
+    struct metadata_pager* pager;
+    uint32_t nb_buckets;
+    struct hash_bucket* buckets;
 };
 
+// Position of the location of the region of the thumbnails in the database file
+#define THUMB_REGION_LOCATION_OFFSET \
+    (sizeof(struct pictdb_header) + sizeof(struct pict_id_heap) + sizeof(struct pict_blob_table))
+
+// Position of the metadata in the database file
+#define METADATA_OFFSET (THUMB_REGION_LOCATION_OFFSET + sizeof(struct pict_thumb_region))
+
+// Test if an offset is in the region of the thumbnails
+#define IS_IN_THUMB_REGION(db_file, off) \
+    (((off) >= (db_file)->thumbs.offset) && ((off) < (db_file)->thumbs.offset + (db_file)->thumbs.capacity))
+
+/* The index of the IDs follows the metadata: the bitset of the valid pictures
+ * (NB_VALID_WORDS words), the hash of each picture's ID (max_files hashes),
+ * as in metadata_columns, then the bitset of the used blobs */
+#define ID_INDEX_OFFSET(max_files) (METADATA_OFFSET + (uint64_t) (max_files) * sizeof(struct pict_metadata))
+#define USED_BLOBS_OFFSET(max_files) \
+    (ID_INDEX_OFFSET(max_files) + (uint64_t) NB_VALID_WORDS(max_files) * sizeof(uint64_t) + \
+     (uint64_t) (max_files) * sizeof(uint32_t))
+#define ID_INDEX_SIZE(max_files) \
+    (2 * (uint64_t) NB_VALID_WORDS(max_files) * sizeof(uint64_t) + (uint64_t) (max_files) * sizeof(uint32_t))
+
+// Size of the blob table in the database file
+#define BLOB_TABLE_SIZE(max_files) ((uint64_t) (max_files) * sizeof(struct pict_blob))
+
+/* Each free extent follows a used region (an image, the beginning of the file
+ * up to the index of the IDs, the blob table with the free extents and the
+ * resolutions, the string heap with the hash tables or the region of the thumbnails), since
+ * they are merged */
+#define EXTENT_TABLE_CAPACITY(max_files) (NB_RES * (uint64_t) (max_files) + 4)
+#define EXTENT_TABLE_SIZE(max_files) (EXTENT_TABLE_CAPACITY(max_files) * sizeof(struct pict_extent))
+
+// Size of the blob table with the free extents and the resolutions that follow it
+#define BLOB_TABLE_AREA_SIZE(max_files) \
+    (BLOB_TABLE_SIZE(max_files) + EXTENT_TABLE_SIZE(max_files) + sizeof(struct pict_resolution_table))
+
+/* The hash tables are at most half full, so that the probe sequences stay short */
+#define HASH_INDEX_BUCKETS(max_files) (2 * next_power_of_2(max_files))
+#define HASH_INDEX_SIZE(nb_buckets) \
+    (sizeof(struct pict_hash_index) + 2 * (uint64_t) (nb_buckets) * sizeof(struct hash_bucket))
+
 /**
  * @brief Enum representing the output mode for do_list
  *
@@ -140,15 +692,21 @@ enum do_list_mode {
  * @brief Prints database header informations.
  *
  * @param header The header to be displayed.
+ * @param resolutions The resolutions of the database, whose named
+ * resolutions are displayed with the header.
  */
-void print_header(const struct pictdb_header* header);
+void print_header(const struct pictdb_header* header, const struct pict_resolution_table* resolutions);
 
 /**
  * @brief Prints picture metadata informations.
  *
  * @param metadata The metadata of one picture.
+ * @param blob The content of the picture.
+ * @param pict_id The ID of the picture.
+ * @param resolutions The resolutions of the database.
  */
-void print_metadata(const struct pict_metadata* metadata);
+void print_metadata(const struct pict_metadata* metadata, const struct pict_blob* blob, const char* pict_id,
+                    const struct pict_resolution_table* resolutions);
 
 /**
  * @brief Displays (on stdout) pictDB metadata.
@@ -162,12 +720,71 @@ const char* do_list(const struct pictdb_file* myfile, enum do_list_mode mode);
  *        preallocated empty metadata array to database file.
  *
  * @param db_filename The name of the file to create.
- * @param db_file In memory structure with header and metadata
+ * @param db_file In memory structure with header and metadata, whose
+ *        features and resolutions are set by the caller (see set_alignment,
+ *        set_derivative_cache, init_resolution_table and add_resolution)
  *
  * @return Returns 0 if it succeded or a corresponding error code
  */
 int do_create(const char* db_filename, struct pictdb_file* db_file);
 
+/**
+ * @brief Sets the alignment of the images of a database to create.
+ *
+ * @param header The header of the database
+ * @param alignment A power of 2 between MIN_ALIGNMENT and MAX_ALIGNMENT
+ *
+ * @return Returns 0 in case of success
+ */
+int set_alignment(struct pictdb_header* header, uint32_t alignment);
+
+/**
+ * @brief Sets the budget of the derivative cache of a database to create.
+ *
+ * @param header The header of the database
+ * @param budget A power of 2 between MIN_CACHE_SIZE and MAX_CACHE_SIZE
+ *
+ * @return Returns 0 in case of success
+ */
+int set_derivative_cache(struct pictdb_header* header, uint64_t budget);
+
+/**
+ * @brief Initialises the table of the resolutions of a database with the
+ * resolutions of every database, the dimensions of the thumbnails and of
+ * the small images being those of its header, and the default encoding
+ * (DEFAULT_QUALITY and DEFAULT_ENCODING_FLAGS).
+ *
+ * @param db_file The database, with header.res_resized set
+ */
+void init_resolution_table(struct pictdb_file* db_file);
+
+/**
+ * @brief Adds a named resolution to a database to create, after
+ * init_resolution_table.
+ *
+ * @param db_file The database
+ * @param name The name of the resolution, at most MAX_RES_NAME chars
+ * @param res_x The max. width of the images, at most MAX_NAMED_RES
+ * @param res_y The max. height of the images, at most MAX_NAMED_RES
+ *
+ * @return Returns 0 in case of success, ERR_RESOLUTIONS if the resolution
+ * is invalid, already named or if the table is full
+ */
+int add_resolution(struct pictdb_file* db_file, const char* name, uint16_t res_x, uint16_t res_y);
+
+/**
+ * @brief Sets the encoding of the resized images of a resolution of a
+ * database to create, after init_resolution_table and add_resolution.
+ *
+ * @param db_file The database
+ * @param res The resolution
+ * @param encoding The encoding, with a quality from 1 to 100
+ *
+ * @return Returns 0 in case of success, ERR_RESOLUTIONS if the database has
+ * no such resolution, ERR_INVALID_ARGUMENT if the encoding is invalid
+ */
+int set_encoding(struct pictdb_file* db_file, size_t res, const struct pict_encoding* encoding);
+
 /**
  * @brief Opens a file, reads the header & the metadatas
  *				 and checks that there were no problem.
@@ -180,6 +797,22 @@ int do_create(const char* db_filename, struct pictdb_file* db_file);
  */
 int do_open(const char* db_filename, const char* open_mode, struct pictdb_file* db_file);
 
+/**
+ * @brief Opens a file and only reads the header, the string heap and the
+ * index of the IDs: the metadata are read when first used (see
+ * load_one_metadata and load_metadata), so that the time to open the file
+ * does not depend on max_files. Falls back to do_open for the files of an
+ * older format opened read-only, or when the index or the hash tables do
+ * not match the header.
+ *
+ * @param db_filename The name of the file to read.
+ * @param open_mode The type of opening on the file.
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 if it succeded or a corresponding error code
+ */
+int do_open_lazy(const char* db_filename, const char* open_mode, struct pictdb_file* db_file);
+
 /**
 * @brief Closes a file and free the metadatas
 *
@@ -200,13 +833,29 @@ void do_close(struct pictdb_file* db_file);
 int do_delete(const char* pictID, struct pictdb_file* db_file);
 
 /**
- * @brief Transform a string in one of the resolution constants
+ * @brief Transform a string in one of the resolutions of a database: the
+ * name of a resolution of its table, "thumbnail" or "original"
  *
  * @param resolution The string specifying the wanted resolution
+ * @param db_file The database, with its table of the resolutions
+ *
+ * @return Returns the resolution constants corresponding to the string, -1
+ * if the database has no such resolution
+ */
+int resolution_atoi(const char* resolution, const struct pictdb_file* db_file);
+
+/**
+ * @brief Finds the smallest resized resolution of a database whose images
+ * fill the given dimensions, so that a client does not read an original
+ * bigger than what it displays.
+ *
+ * @param db_file The database, with its table of the resolutions
+ * @param width The width to fill
+ * @param height The height to fill
  *
- * @return Returns the resolution constants corresponding to the string
+ * @return Returns the resolution, RES_ORIG if none is big enough
  */
-int resolution_atoi(const char* resolution);
+size_t fit_resolution(const struct pictdb_file* db_file, uint32_t width, uint32_t height);
 
 /**
  * @brief Read an image from the pictDB and save it to the buffer if it
@@ -223,6 +872,91 @@ int resolution_atoi(const char* resolution);
  */
 int do_read(const char* pictID, size_t dim, char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file);
 
+/**
+ * @brief Transform a string in a way to fit a picture in a box: "contain",
+ * "cover" or "fill"
+ *
+ * @param fit The string specifying the wanted fit
+ *
+ * @return Returns the fit constant corresponding to the string, -1 if none
+ */
+int fit_atoi(const char* fit);
+
+/**
+ * @brief Rounds the box of a variant up to the next of a few sizes, so that
+ * close requests share their images. A missing dimension (0) only stays
+ * unbounded when the picture is contained in the box.
+ *
+ * @param width Pointer to the width of the box, rounded
+ * @param height Pointer to the height of the box, rounded
+ * @param fit FIT_CONTAIN, FIT_COVER or FIT_FILL
+ *
+ * @return Returns 0 in case of success, ERR_INVALID_ARGUMENT if the box is
+ * empty or bigger than MAX_VARIANT_RES
+ */
+int quantize_variant(uint32_t* width, uint32_t* height, int fit);
+
+/**
+ * @brief Read a picture resized to a box from the pictDB. The box is
+ * quantized (see quantize_variant) and the image is read from the derivative
+ * cache of the database, or resized from the original and written in it.
+ * Without a cache, the image is resized at each read.
+ *
+ * @param pictID picture ID
+ * @param width The width of the box (0 if only the height is given)
+ * @param height The height of the box (0 if only the width is given)
+ * @param fit FIT_CONTAIN, FIT_COVER or FIT_FILL
+ * @param format FORMAT_JPEG, FORMAT_WEBP or FORMAT_AVIF
+ * @param image_buffer address of a byte array (that will contain the picture)
+ * @param image_size address of a unsigned 32bit int that will containe the picture's size
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 in case of succes
+ */
+int do_read_variant(const char* pictID, uint32_t width, uint32_t height, int fit, int format,
+                    char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file);
+
+/**
+ * @brief Read a picture in a resolution of the pictDB and in another format
+ * than JPEG. The image is resized from the original into the box of the
+ * resolution, and kept in the derivative cache as a variant of the picture:
+ * only the databases with a cache opened for writing serve other formats
+ * (see CAN_CACHE_VARIANTS). The JPEG images and the originals are read with
+ * do_read.
+ *
+ * @param pictID picture ID
+ * @param dim Internal code corresponding to the dimension we want
+ * @param format FORMAT_JPEG, FORMAT_WEBP or FORMAT_AVIF
+ * @param image_buffer address of a byte array (that will contain the picture)
+ * @param image_size address of a unsigned 32bit int that will containe the picture's size
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 in case of succes, ERR_INVALID_ARGUMENT if the database
+ * cannot keep the image
+ */
+int do_read_format(const char* pictID, size_t dim, int format,
+                   char** image_buffer, uint32_t* image_size, struct pictdb_file* db_file);
+
+/**
+ * @brief Read several images in the same dimension from the pictDB.
+ * All IDs are resolved in one pass over the metadata and the images are
+ * read in the order of their offset in the file. Missing resized images
+ * are created with lazily_resize. The images of the derivative cache are
+ * read in the order of the IDs instead, each one right after it is created,
+ * since creating the next ones may evict it.
+ *
+ * @param pictIDs Array of nb_ids picture IDs
+ * @param nb_ids Number of requested pictures
+ * @param dim Internal code corresponding to the dimension we want
+ * @param image_buffers Array of nb_ids byte arrays that will contain the pictures
+ * (NULL for an unknown picture ID)
+ * @param image_sizes Array of nb_ids sizes (0 for an unknown picture ID)
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 in case of succes
+ */
+int do_read_batch(const char* pictIDs[], size_t nb_ids, size_t dim, char* image_buffers[], uint32_t image_sizes[], struct pictdb_file* db_file);
+
 /**
  * @brief Add a new image to a given database
  *
@@ -248,29 +982,380 @@ int do_insert(const char* image, size_t size, const char* id, struct pictdb_file
 int do_gbcollect(struct pictdb_file* db_file, const char* db_filename, const char* tmpdb_filename);
 
 /**
- * @brief Reads an image from the disk.
+ * @brief Tells if the database should be garbage collected: if its dead
+ * bytes are at least min_dead_bytes and dead_ratio of its file.
  *
- * @param image_buffer Byte array that will contain the picture
- * @param image_size Picture's size
- * @param f The file to read the picture, already opened and with the file
- * position indicator to the correct place
+ * @param db_file The database
+ * @param dead_ratio The ratio of dead bytes from which to collect
+ * @param min_dead_bytes The number of dead bytes from which to collect
  *
- * @return Returns 0 in case of success
+ * @return Returns 1 if do_gbcollect should be called, 0 otherwise
  */
-int read_disk_image(char** image_buffer, const uint32_t image_size, FILE* f);
+int needs_gbcollect(const struct pictdb_file* db_file, double dead_ratio, uint64_t min_dead_bytes);
 
 /**
- * @brief Reads an image from a db_file
- *
- * @param image_buffer Byte array that will contain the picture
- * @param index Index of the picture in the db_file
- * @param dim Internal code corresponding to the dimension we want
- * @param db_file The database
+ * @brief Function called by the migrations after each chunk of metadata.
  *
- * @return Returns 0 in case of success
+ * @param from_version The format version the file is migrated from
+ * @param to_version The format version the file is migrated to
+ * @param done The number of metadata processed
+ * @param total The number of metadata to process
+ */
+typedef void (*migration_progress)(uint32_t from_version, uint32_t to_version, size_t done, size_t total);
+
+/**
+ * @brief Upgrades a database in place to the current format version. The
+ * metadata are streamed by chunks, so the memory used does not depend on the
+ * size of the database (except for the IDs, the blob table and the hash
+ * tables). An interrupted migration is undone by recover_migration, which
+ * is called first.
+ *
+ * @param db_filename The name of the database
+ * @param progress The function called after each chunk (can be NULL)
+ * @param from_version Pointer to store the format version before the migration
+ *
+ * @return Returns 0 in case of success, ERR_VERSION if the file is of a
+ * version or uses features unknown to the library
+ */
+int do_migrate(const char* db_filename, migration_progress progress, uint32_t* from_version);
+
+/**
+ * @brief Upgrades an opened database in place to the current format version.
+ * Only the header has to be loaded; the file position indicator is left
+ * right after the header. The beginning of the file overwritten in place is
+ * first saved in a journal (named after the database with
+ * JOURNAL_FILE_SUFFIX), copied back if the migration fails and removed once
+ * the header of the new format is written.
+ *
+ * @param db_file The database
+ * @param db_filename The name of the database
+ * @param progress The function called after each chunk (can be NULL)
+ *
+ * @return Returns 0 in case of success
+ */
+int migrate_db_file(struct pictdb_file* db_file, const char* db_filename, migration_progress progress);
+
+/**
+ * @brief Undoes the interrupted migration of a database: the bytes saved in
+ * its journal are copied back and the journal is removed. A journal left
+ * before the database was modified is only removed.
+ *
+ * @param db_filename The name of the database
+ * @param open_mode The mode the database is about to be opened with
+ *
+ * @return Returns 0 in case of success or without journal, ERR_IO if the
+ * database must be restored but the mode is read-only
+ */
+int recover_migration(const char* db_filename, const char* open_mode);
+
+/**
+ * @brief Reads the string heap and the metadata of a database of an older
+ * format version and converts them in memory, without modifying the file.
+ * The file position indicator must be right after the header.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int read_old_metadata(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the string heap, the blob table and all the metadata of a
+ * database of the current format (the index of the IDs is not read). The file position
+ * indicator must be right after the header.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int read_db_file_metadata(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the string heap, the index of the IDs and the hash tables of a
+ * database for do_open_lazy, and allocates its metadata, its blobs and its
+ * columns. Leaves db_file->pager NULL if the index or the hash tables do
+ * not match the header. The file
+ * position indicator must be right after the header.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int init_metadata_pager(struct pictdb_file* db_file);
+
+/**
+ * @brief Frees the state of the metadata read lazily.
+ *
+ * @param db_file The database
+ */
+void free_metadata_pager(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads one metadata and its blob from the file if they were not read
+ * yet. Only the fields of the index (valid bitset and hashes of the IDs) are
+ * known before for a database opened by do_open_lazy.
+ *
+ * @param db_file The database
+ * @param index The index of the metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int load_one_metadata(const struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Reads all the metadata and blobs not read yet and fills the columns.
+ * Called by the functions walking the whole table.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int load_metadata(const struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the whole index of the IDs from the metadata columns and the
+ * bitset of the used blobs.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_id_index(const struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the entry of one metadata in the index of the IDs.
+ *
+ * @param db_file The database
+ * @param index The index of the metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int write_id_index_entry(const struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Tells if the library can open a database.
+ *
+ * @param header The header of the database
+ *
+ * @return Returns 0 if it can, ERR_VERSION otherwise
+ */
+int check_format(const struct pictdb_header* header);
+
+/**
+ * @brief Reads an image from the disk.
+ *
+ * @param image_buffer Byte array that will contain the picture
+ * @param image_size Picture's size
+ * @param f The file to read the picture, already opened and with the file
+ * position indicator to the correct place
+ *
+ * @return Returns 0 in case of success
+ */
+int read_disk_image(char** image_buffer, const uint32_t image_size, FILE* f);
+
+/**
+ * @brief Reads an image from a db_file, or from its derivative cache
+ *
+ * @param image_buffer Byte array that will contain the picture
+ * @param index Index of the picture in the db_file
+ * @param dim Internal code corresponding to the dimension we want
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
  */
 int read_db_file_image(char** image_buffer, const size_t index, const size_t dim, const struct pictdb_file* db_file);
 
+/**
+ * @brief Opens the file of an aligned database again for the reads of the
+ * original images, which bypass the page cache so that they do not evict the
+ * resized images. Does nothing if the database is not aligned or if its file
+ * system does not support direct I/O.
+ *
+ * @param db_file The opened database
+ * @param db_filename The name of its file
+ *
+ * @return Returns 0 in case of success
+ */
+int open_direct_reads(struct pictdb_file* db_file, const char* db_filename);
+
+/**
+ * @brief Reads an image with direct I/O, in a buffer aligned like the
+ * database.
+ *
+ * @param image_buffer Byte array that will contain the picture
+ * @param offset The offset of the image, aligned
+ * @param image_size The image size in bytes
+ * @param db_file The database, opened by open_direct_reads
+ *
+ * @return Returns 0 in case of success
+ */
+int read_direct_image(char** image_buffer, uint64_t offset, uint32_t image_size, const struct pictdb_file* db_file);
+
+/**
+ * @brief Closes the file opened by open_direct_reads.
+ *
+ * @param db_file The database
+ */
+void close_direct_reads(struct pictdb_file* db_file);
+
+/**
+ * @brief Opens the derivative cache of a database, in the mode of the
+ * database. The cache file is created if it is missing, or if it is not the
+ * one of the database, unless the database is opened read-only. Does nothing
+ * if the database has no derivative cache. Only the header of the file is
+ * read, but for a file not closed, whose table is read to rebuild it.
+ *
+ * @param db_file The opened database
+ * @param db_filename The name of its file
+ * @param open_mode The mode in which the database is opened
+ *
+ * @return Returns 0 in case of success
+ */
+int open_derivative_cache(struct pictdb_file* db_file, const char* db_filename, const char* open_mode);
+
+/**
+ * @brief Closes the derivative cache of a database, after writing its
+ * counters in the header of the file.
+ *
+ * @param db_file The database
+ */
+void close_derivative_cache(struct pictdb_file* db_file);
+
+/**
+ * @brief Finds the resized image of a blob in the derivative cache.
+ *
+ * @param db_file The database, with the blob loaded
+ * @param blob The index of the blob
+ * @param dim RES_THUMB or RES_SMALL
+ *
+ * @return Returns the cached image, NULL if it is not in the cache
+ */
+const struct cached_image* find_cached_image(const struct pictdb_file* db_file, size_t blob, size_t dim);
+
+/**
+ * @brief Gets the size of the image of a picture, in the database file or
+ * in its derivative cache (see IS_CACHED_RES).
+ *
+ * @param db_file The database, with the picture's metadata and blob loaded
+ * @param index The index of the picture's metadata
+ * @param dim Internal code corresponding to the dimension we want
+ *
+ * @return Returns the size of the image, 0 if it does not exist
+ */
+uint32_t get_pict_image_size(const struct pictdb_file* db_file, size_t index, size_t dim);
+
+/**
+ * @brief Gets the position of the image of a picture, in the database file
+ * or in its derivative cache (see IS_CACHED_RES).
+ *
+ * @param db_file The database, with the picture's metadata and blob loaded
+ * @param index The index of the picture's metadata
+ * @param dim Internal code corresponding to the dimension we want
+ *
+ * @return Returns the position of the image, 0 if it does not exist
+ */
+uint64_t get_pict_image_offset(const struct pictdb_file* db_file, size_t index, size_t dim);
+
+/**
+ * @brief Reads a resized image from the derivative cache and marks it as the
+ * most recently used.
+ *
+ * @param image_buffer Byte array that will contain the picture
+ * @param blob The index of the blob
+ * @param dim RES_THUMB or RES_SMALL
+ * @param db_file The database, with the blob loaded
+ *
+ * @return Returns 0 in case of success, ERR_FILE_NOT_FOUND if the image is not
+ * in the cache
+ */
+int read_cached_image(char** image_buffer, size_t blob, size_t dim, const struct pictdb_file* db_file);
+
+/**
+ * @brief Writes a resized image in the derivative cache, after evicting the
+ * least recently used images if the budget would be exceeded. The images
+ * are compacted when the file reaches twice the budget.
+ *
+ * @param image_buffer The image to write
+ * @param image_size The image size in bytes
+ * @param blob The index of the blob, with its SHA
+ * @param dim RES_THUMB or RES_SMALL
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success, ERR_FULL_DATABASE if the image is
+ * bigger than the budget
+ */
+int write_cached_image(const char* image_buffer, uint32_t image_size, size_t blob, size_t dim,
+                       const struct pictdb_file* db_file);
+
+/**
+ * @brief Reads a variant of a picture from the derivative cache and marks it
+ * as the most recently used.
+ *
+ * @param image_buffer Byte array that will contain the picture
+ * @param image_size Pointer to the size of the image
+ * @param blob The index of the blob
+ * @param variant The key of the variant (see VARIANT_KEY)
+ * @param db_file The database, with the blob loaded
+ *
+ * @return Returns 0 in case of success, ERR_FILE_NOT_FOUND if the variant is
+ * not in the cache
+ */
+int read_cached_variant(char** image_buffer, uint32_t* image_size, size_t blob, uint32_t variant,
+                        const struct pictdb_file* db_file);
+
+/**
+ * @brief Writes a variant of a picture in the derivative cache, in place of
+ * the least recently used variant of its blob if they are all taken.
+ *
+ * @param image_buffer The image to write
+ * @param image_size The image size in bytes
+ * @param blob The index of the blob, with its SHA
+ * @param variant The key of the variant (see VARIANT_KEY)
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success, ERR_FULL_DATABASE if the image is
+ * bigger than the budget
+ */
+int write_cached_variant(const char* image_buffer, uint32_t image_size, size_t blob, uint32_t variant,
+                         const struct pictdb_file* db_file);
+
+/**
+ * @brief Drops the resized images of a blob no more referenced from the
+ * derivative cache.
+ *
+ * @param db_file The database
+ * @param blob The index of the blob
+ *
+ * @return Returns 0 in case of success
+ */
+int drop_cached_images(const struct pictdb_file* db_file, size_t blob);
+
+/**
+ * @brief Copies the resized images and the variants of the copied blobs to
+ * the derivative cache of another database, from the least to the most
+ * recently used, with their last use.
+ *
+ * @param db_file The database, opened for writing, with all its blobs loaded
+ * @param new_db_file The other database
+ * @param new_blobs The index in new_db_file of the copy of each blob of
+ * db_file, with its SHA (max_files if the blob is not copied)
+ *
+ * @return Returns 0 in case of success
+ */
+int copy_cached_images(const struct pictdb_file* db_file, const struct pictdb_file* new_db_file,
+                       const size_t new_blobs[]);
+
+/**
+ * @brief Replaces the cache file of a database by the one of another
+ * database, renamed.
+ *
+ * @param db_filename The name of the database file
+ * @param tmpdb_filename The name of the other database file
+ *
+ * @return Returns 0 in case of success
+ */
+int replace_derivative_cache(const char* db_filename, const char* tmpdb_filename);
+
 /**
  * @brief Gets the size of an image (in bytes).
  *
@@ -282,7 +1367,9 @@ int read_db_file_image(char** image_buffer, const size_t index, const size_t dim
 int get_image_size(FILE* image, long* size);
 
 /**
- * @brief Write an image at the end of a db_file and store the offset at which the image is
+ * @brief Write an image in the smallest free extent big enough of a db_file, or at its end,
+ * and store the offset at which the image is. The image of an aligned database is padded
+ * up to the next multiple of its alignment
  *
  * @param image_buffer The image to add
  * @param image_size The image size in bytes
@@ -325,7 +1412,7 @@ int get_image_index(const char* pictID, size_t* index, const struct pictdb_file*
 int write_db_file_header(const struct pictdb_file* db_file);
 
 /**
- * @brief Write one metadata on the database file
+ * @brief Write one metadata and its entry of the index of the IDs on the database file
  *
  * @param db_file The database
  * @param index The index of the metadata to write
@@ -335,14 +1422,593 @@ int write_db_file_header(const struct pictdb_file* db_file);
 int write_db_file_one_metadata(const struct pictdb_file* db_file, size_t index);
 
 /**
- * @brief Compares two SHA-hash
+ * @brief Gets the size of the database file and the number of bytes of this
+ * file used by nothing anymore, counted in the header.
  *
- * @param SHA_1 The first SHA-hash.
- * @param SHA_2 The second SHA-hash.
+ * @param db_file The database
+ * @param file_size Pointer to store the size of the file
+ * @param dead_bytes Pointer to store the number of unused bytes
  *
- * @return Returns 0 if both SHAs are the same.
+ * @return Returns 0 in case of success
  */
-int cmp_SHA(const unsigned char* SHA_1, const unsigned char* SHA_2);
+int get_db_usage(const struct pictdb_file* db_file, uint64_t* file_size, uint64_t* dead_bytes);
+
+/**
+ * @brief Counts again the live and dead bytes of the header from the used
+ * blobs: the dead bytes are the bytes of the file used neither by the
+ * header, the metadata, the index of the IDs, the blob table, the string
+ * heap, the hash tables nor a used blob.
+ *
+ * @param db_file The database, with all its blobs loaded
+ *
+ * @return Returns 0 in case of success
+ */
+int count_db_usage(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the hash tables of the IDs and of the SHAs. Leaves
+ * db_file->buckets NULL if they cannot be read or do not match the header.
+ *
+ * @param db_file The database, with its string heap loaded
+ *
+ * @return Returns 0 in case of success
+ */
+int read_hash_index(struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the hash tables of the IDs and of the SHAs after the region
+ * of the string heap, with the version of the database.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_hash_index(const struct pictdb_file* db_file);
+
+/**
+ * @brief Allocates the hash tables of the IDs and of the SHAs and fills
+ * them from the metadata columns and the used blobs.
+ *
+ * @param db_file The database, with all its metadata and blobs loaded
+ *
+ * @return Returns 0 in case of success
+ */
+int build_hash_index(struct pictdb_file* db_file);
+
+/**
+ * @brief Frees the hash tables of the IDs and of the SHAs.
+ *
+ * @param db_file The database
+ */
+void free_hash_index(struct pictdb_file* db_file);
+
+/**
+ * @brief Adds a picture to the hash table of the IDs, and its blob to the
+ * one of the SHAs if the picture is its only reference. Writes the modified
+ * buckets and the version of the database.
+ *
+ * @param db_file The database
+ * @param index The index of the picture's metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int add_to_hash_index(struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Removes a picture from the hash table of the IDs, and its blob from
+ * the one of the SHAs if it is no more referenced (see release_blob). Writes
+ * the modified buckets and the version of the database.
+ *
+ * @param db_file The database
+ * @param index The index of the picture's metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int remove_from_hash_index(struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Adds a used blob to the hash table of the SHAs in memory only (used
+ * by the migrations, which write the whole tables at the end).
+ *
+ * @param db_file The database
+ * @param blob The index of the blob
+ */
+void insert_blob_SHA(struct pictdb_file* db_file, size_t blob);
+
+/**
+ * @brief Finds the used blob with a given SHA with the hash table of the
+ * SHAs, reading the candidates if the database is opened lazily.
+ *
+ * @param db_file The database
+ * @param SHA The SHA searched
+ * @param blob Pointer to store the index of the blob, max_files if there is none
+ *
+ * @return Returns 0 in case of success
+ */
+int find_blob(const struct pictdb_file* db_file, const unsigned char* SHA, size_t* blob);
+
+/**
+ * @brief Finds a valid picture with the hash table of the IDs, reading
+ * the metadata of the candidates if the database is opened lazily.
+ *
+ * @param db_file The database
+ * @param pictID The picture's ID
+ * @param index Pointer to store the index of the picture
+ *
+ * @return Returns 0 in case of success, ERR_FILE_NOT_FOUND if there is no
+ * such picture
+ */
+int find_pict_id(const struct pictdb_file* db_file, const char* pictID, size_t* index);
+
+/**
+ * @brief Gets the smallest power of 2 greater or equal to a number.
+ *
+ * @param n The number
+ *
+ * @return Returns the power of 2 (1 for 0)
+ */
+uint32_t next_power_of_2(uint32_t n);
+
+/**
+ * @brief Allocates the metadata columns of a database, filled with zeros.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int alloc_metadata_columns(struct pictdb_file* db_file);
+
+/**
+ * @brief Allocates the metadata columns of a database and fills them from
+ * its metadata.
+ *
+ * @param db_file The database, with its metadata already loaded
+ *
+ * @return Returns 0 in case of success
+ */
+int build_metadata_columns(struct pictdb_file* db_file);
+
+/**
+ * @brief Frees the metadata columns of a database.
+ *
+ * @param db_file The database
+ */
+void free_metadata_columns(struct pictdb_file* db_file);
+
+/**
+ * @brief Copies one metadata into the metadata columns.
+ *
+ * @param db_file The database
+ * @param index The index of the metadata
+ */
+void update_metadata_columns(const struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Gets the index of the first empty metadata.
+ *
+ * @param db_file The database
+ *
+ * @return Returns the index, or max_files if the database is full
+ */
+size_t first_empty_index(const struct pictdb_file* db_file);
+
+/**
+ * @brief Hashes a picture ID (32 bits FNV-1a).
+ *
+ * @param pictID The picture ID
+ *
+ * @return Returns the hash
+ */
+uint32_t hash_pict_id(const char* pictID);
+
+/**
+ * @brief Gets the ID of a picture from the string heap.
+ *
+ * @param db_file The database
+ * @param index The index of the picture's metadata
+ *
+ * @return Returns the ID ("" for an empty metadata)
+ */
+const char* get_pict_id(const struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Allocates an empty string heap located right after the blob table.
+ *
+ * @param db_file The database
+ * @param capacity The number of bytes to reserve for the heap
+ *
+ * @return Returns 0 in case of success
+ */
+int init_pict_id_heap(struct pictdb_file* db_file, uint32_t capacity);
+
+/**
+ * @brief Tests if the ID of a metadata read from the file is in the string
+ * heap. The ID of an empty metadata is reset to the empty ID instead.
+ *
+ * @param db_file The database, with its string heap loaded
+ * @param metadata The metadata
+ *
+ * @return Returns 0 in case of success, ERR_IO if the ID of a valid picture
+ * is not in the heap
+ */
+int check_pict_id(const struct pictdb_file* db_file, struct pict_metadata* metadata);
+
+/**
+ * @brief Frees the content of the string heap.
+ *
+ * @param db_file The database
+ */
+void free_pict_id_heap(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the location and the content of the string heap. The file
+ * position indicator must be right after the header.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int read_pict_id_heap(struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the location and the whole region of the string heap.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_pict_id_heap(const struct pictdb_file* db_file);
+
+/**
+ * @brief Adds an ID at the end of the string heap and references it in
+ * a metadata that is not necessarily in db_file->metadata (used by the
+ * migrations, which convert the metadata by chunks).
+ *
+ * @param db_file The database
+ * @param pictID The ID (truncated to MAX_PIC_ID characters)
+ * @param metadata The metadata referencing the ID
+ *
+ * @return Returns 0 in case of success
+ */
+int append_pict_id(struct pictdb_file* db_file, const char* pictID, struct pict_metadata* metadata);
+
+/**
+ * @brief Adds the ID of a picture at the end of the string heap and
+ * references it in the picture's metadata. If the heap is full, it is
+ * moved with twice its capacity at the end of the database file.
+ * The ID is written on disk by write_pict_id.
+ *
+ * @param db_file The database
+ * @param index The index of the picture's metadata
+ * @param pictID The ID (truncated to MAX_PIC_ID characters)
+ *
+ * @return Returns 0 in case of success
+ */
+int set_pict_id(struct pictdb_file* db_file, size_t index, const char* pictID);
+
+/**
+ * @brief Removes the ID added by set_pict_id when the picture could not
+ * be inserted.
+ *
+ * @param db_file The database
+ * @param index The index of the picture's metadata
+ */
+void cancel_pict_id(struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Writes the ID of a picture and the size of the string heap on disk.
+ *
+ * @param db_file The database
+ * @param index The index of the picture's metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int write_pict_id(const struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Allocates an empty blob table, without free extents, located right
+ * after the index of the IDs.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int init_blob_table(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the location of the blob table and allocates its content. The
+ * blobs and the bitset of the used blobs are read and checked unless the
+ * database is opened lazily (see load_blob and init_metadata_pager), the
+ * free extents and the resolutions are always read. The file position indicator must be right
+ * after the location of the string heap.
+ *
+ * @param db_file The database
+ * @param lazy Tells if the blobs are read when first used
+ *
+ * @return Returns 0 in case of success
+ */
+int read_blob_table(struct pictdb_file* db_file, int lazy);
+
+/**
+ * @brief Frees the content of the blob table and the free extents.
+ *
+ * @param db_file The database
+ */
+void free_blob_table(struct pictdb_file* db_file);
+
+/**
+ * @brief Reads one blob from the file if it was not read yet by a database
+ * opened by do_open_lazy.
+ *
+ * @param db_file The database
+ * @param blob The index of the blob
+ *
+ * @return Returns 0 in case of success
+ */
+int load_blob(const struct pictdb_file* db_file, size_t blob);
+
+/**
+ * @brief Tests if a valid metadata read from the file references a used blob.
+ *
+ * @param db_file The database
+ * @param metadata The metadata
+ *
+ * @return Returns 0 in case of success, ERR_IO otherwise
+ */
+int check_pict_blob(const struct pictdb_file* db_file, const struct pict_metadata* metadata);
+
+/**
+ * @brief Takes a free blob, filled with zeros and referenced once.
+ *
+ * @param db_file The database
+ * @param blob Pointer to store the index of the blob
+ *
+ * @return Returns 0 in case of success, ERR_FULL_DATABASE if every blob is used
+ */
+int new_blob(struct pictdb_file* db_file, size_t* blob);
+
+/**
+ * @brief Removes a reference to a blob, which becomes free when it is no
+ * more referenced. Its content stays in memory until it is used again.
+ *
+ * @param db_file The database
+ * @param blob The index of the blob
+ */
+void release_blob(struct pictdb_file* db_file, size_t blob);
+
+/**
+ * @brief Writes the location and all the blobs of the blob table, the free
+ * extents and the resolutions.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_blob_table(const struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the table of the resolutions, which follows the free
+ * extents. The file position indicator is kept.
+ *
+ * @param db_file The database, with the location of its blob table
+ *
+ * @return Returns 0 in case of success, ERR_IO if the table is invalid
+ */
+int read_resolution_table(struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the table of the resolutions.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_resolution_table(const struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the location of the blob table, with its numbers of used
+ * blobs and of free extents.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_blob_table_location(const struct pictdb_file* db_file);
+
+/**
+ * @brief Writes one blob, its bit of the used blobs in the index of the IDs
+ * and the location of the blob table.
+ *
+ * @param db_file The database
+ * @param blob The index of the blob
+ *
+ * @return Returns 0 in case of success
+ */
+int write_db_file_blob(const struct pictdb_file* db_file, size_t blob);
+
+/**
+ * @brief Reads the free extents, located after the blob table.
+ *
+ * @param db_file The database, with the location of its blob table read
+ *
+ * @return Returns 0 in case of success
+ */
+int read_free_extents(struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the whole table of the free extents.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_free_extents(const struct pictdb_file* db_file);
+
+/**
+ * @brief Finds the free extents of the database from the regions used by
+ * its tables and its used blobs: every other region before the end of these
+ * regions is free.
+ *
+ * @param db_file The database, with all its blobs loaded and its tables
+ * located
+ *
+ * @return Returns 0 in case of success
+ */
+int build_free_extents(struct pictdb_file* db_file);
+
+/**
+ * @brief Takes the smallest free extent big enough for size bytes from its
+ * first offset aligned like the database (see DB_ALIGNMENT), whose remainder
+ * stays free, and writes the free extents changed before the
+ * region is used. The dead bytes of the header are decreased.
+ *
+ * @param db_file The database
+ * @param size The number of bytes to place
+ * @param offset Pointer to store the position of the region
+ *
+ * @return Returns 0 in case of success, ERR_FULL_DATABASE if no free extent
+ * is big enough
+ */
+int take_free_extent(struct pictdb_file* db_file, uint64_t size, uint64_t* offset);
+
+/**
+ * @brief Adds a region used by nothing anymore to the free extents, merged
+ * with the free extents next to it, and writes the free extents changed. The
+ * region stays unused if the table is full. The dead bytes of the header are
+ * counted by the caller.
+ *
+ * @param db_file The database
+ * @param offset The position of the region
+ * @param size The size of the region
+ *
+ * @return Returns 0 in case of success
+ */
+int add_free_extent(struct pictdb_file* db_file, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Adds the images of a blob no more referenced to the free extents,
+ * except its thumbnail if it is in the region of the thumbnails.
+ *
+ * @param db_file The database
+ * @param blob The index of the blob
+ *
+ * @return Returns 0 in case of success
+ */
+int free_blob_images(struct pictdb_file* db_file, size_t blob);
+
+/**
+ * @brief Reads the location of the region of the thumbnails. The file
+ * position indicator must be right after the location of the blob table.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int read_thumb_region(struct pictdb_file* db_file);
+
+/**
+ * @brief Writes the location of the region of the thumbnails.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_thumb_region_location(const struct pictdb_file* db_file);
+
+/**
+ * @brief Moves the region of the thumbnails with its content to a free
+ * extent or at the end of the file, with a new capacity, and updates the
+ * offsets of the thumbnails in the blob table. The old region is freed.
+ *
+ * @param db_file The database
+ * @param capacity The new capacity, at least the size of the region
+ *
+ * @return Returns 0 in case of success
+ */
+int reserve_thumb_region(struct pictdb_file* db_file, uint64_t capacity);
+
+/**
+ * @brief Writes a thumbnail at the end of the region of the thumbnails,
+ * which grows if it is full, and stores the offset at which it is.
+ *
+ * @param image_buffer The thumbnail to add
+ * @param image_size The thumbnail size in bytes
+ * @param offset The offset at which the thumbnail is written
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int write_db_file_thumb(const char* image_buffer, const uint32_t image_size, long* offset, struct pictdb_file* db_file);
+
+/**
+ * @brief Reads the thumbnails of several pictures at once, if they are all
+ * in the region of the thumbnails and close to each other.
+ *
+ * @param indexes The indexes of the pictures, whose thumbnails exist
+ * @param nb_pict The number of pictures
+ * @param span Pointer to the buffer read, NULL if the thumbnails have to be
+ * read one by one
+ * @param thumbs Array of nb_pict pointers to the thumbnails in the buffer
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+int read_thumb_span(const size_t indexes[], size_t nb_pict, char** span, char* thumbs[],
+                    const struct pictdb_file* db_file);
+
+/**
+ * @brief Compares two SHA-hash
+ *
+ * @param SHA_1 The first SHA-hash.
+ * @param SHA_2 The second SHA-hash.
+ *
+ * @return Returns 0 if both SHAs are the same.
+ */
+int cmp_SHA(const unsigned char* SHA_1, const unsigned char* SHA_2);
+
+/**
+ * @brief Gets the index of the first valid picture at or after index,
+ * skipping the empty metadata by words of 64. Inlined since all the scans of
+ * the metadata call it once per valid picture.
+ *
+ * @param db_file The database
+ * @param index The index to start from
+ *
+ * @return Returns the index, or max_files if there is none
+ */
+static inline size_t next_valid_index(const struct pictdb_file* db_file, size_t index)
+{
+    const size_t max_files = db_file->header.max_files;
+    if(index >= max_files) {
+        return max_files;
+    }
+    const uint64_t* valid = db_file->columns.valid;
+    size_t word = index / VALID_WORD_BITS;
+    //Clears the bits before index in the first word
+    uint64_t bits = valid[word] & (~UINT64_C(0) << (index % VALID_WORD_BITS));
+    if(0 == bits) {
+        //Skips the empty words with the vectorized kernel
+        word = scan_nonzero_word(valid, word + 1, NB_VALID_WORDS(max_files));
+        if(word >= NB_VALID_WORDS(max_files)) {
+            return max_files;
+        }
+        bits = valid[word];
+    }
+    return word * VALID_WORD_BITS + __builtin_ctzll(bits);
+}
+
+/**
+ * @brief Gets the content of a picture.
+ *
+ * @param db_file The database, with the picture's metadata and blob loaded
+ * @param index The index of the picture's metadata
+ *
+ * @return Returns the blob referenced by the metadata
+ */
+static inline struct pict_blob* get_pict_blob(const struct pictdb_file* db_file, size_t index)
+{
+    return &db_file->blobs[db_file->metadata[index].blob];
+}
 
 #ifdef __cplusplus
 }
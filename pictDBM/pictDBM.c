@@ -14,8 +14,11 @@
 #include "pictDB.h"
 #include "image_content.h"
 #include "pictDBM_tools.h"
+#include "sprite.h"
+#include "pregen.h"
+#include "metrics.h"
 
-#define N_COMMANDS 7 // Number of commands available, useful for array.
+#define N_COMMANDS 10 // Number of commands available, useful for array.
 
 typedef int (*command)(int args, char *argv[]);
 
@@ -41,37 +44,71 @@ static void next_arg(int* args, char** argv[])
  * @brief Utility function to create the picture name :
  * 		original_prefix + resolution_suffix + '.jpg'
  * 	with : - original_prefix = pictID
- * 		   - resolution_suffix = '_orig', '_small' or '_thumb'
+ * 		   - resolution_suffix = '_' + name of the resolution ('_orig',
+ * 		     '_small', '_thumb' or a named resolution of the database)
  *
  * @param pictID Picture ID
  * @param dim Internal code corresponding to the dimension we want
+ * @param db_file The database, with its resolutions
  *
  * @return The generated picture name
  */
-static char* create_name(const char* pictID, size_t dim)
+static char* create_name(const char* pictID, size_t dim, const struct pictdb_file* db_file)
 {
     const char* ext = ".jpeg";
-    char* resolution_suffix;
-    switch(dim) {
-    case RES_ORIG:
-        resolution_suffix = "_orig";
-        break;
-    case RES_SMALL:
-        resolution_suffix = "_small";
-        break;
-    case RES_THUMB:
-        resolution_suffix = "_thumb";
-        break;
-    }
-    size_t str_size = strlen(pictID) + strlen(ext) + strlen(resolution_suffix);
+    const char* resolution_name = db_file->resolutions.resolutions[dim].name;
+    size_t str_size = strlen(pictID) + strlen(ext) + 1 + strlen(resolution_name);
     char* c = calloc(str_size + 1, sizeof(char));
     strncpy(c, pictID, strlen(pictID)+1);
-    strncat(c, resolution_suffix, strlen(resolution_suffix)+1);
+    strncat(c, "_", 2);
+    strncat(c, resolution_name, strlen(resolution_name)+1);
     strncat(c, ext, strlen(ext));
     c[str_size] = '\0';
     return c;
 }
 
+/**
+ * @brief Parses the encoding of the resized images of a resolution.
+ *
+ * @param quality The quality, from 1 to 100
+ * @param options The options, separated by commas: progressive, strip,
+ * optimize, 420 and 444, or none
+ * @param encoding The parsed encoding
+ *
+ * @return Returns 0 in case of success, ERR_INVALID_ARGUMENT otherwise
+ */
+static int parse_encoding(const char* quality, const char* options, struct pict_encoding* encoding)
+{
+    const uint16_t value = atouint16(quality);
+    if((0 == value) || (value > 100) || (strlen(options) >= FILENAME_MAX)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(encoding, 0, sizeof(struct pict_encoding));
+    encoding->quality = (uint8_t) value;
+    encoding->subsample = SUBSAMPLE_AUTO;
+    if(!strcmp("none", options)) {
+        return 0;
+    }
+    char buffer[FILENAME_MAX];
+    memcpy(buffer, options, strlen(options) + 1); // the length is checked above
+    for(char* option = strtok(buffer, ","); NULL != option; option = strtok(NULL, ",")) {
+        if(!strcmp("progressive", option)) {
+            encoding->flags |= ENCODING_PROGRESSIVE;
+        } else if(!strcmp("strip", option)) {
+            encoding->flags |= ENCODING_STRIP;
+        } else if(!strcmp("optimize", option)) {
+            encoding->flags |= ENCODING_OPTIMIZE;
+        } else if(!strcmp("420", option) && (SUBSAMPLE_AUTO == encoding->subsample)) {
+            encoding->subsample = SUBSAMPLE_ON;
+        } else if(!strcmp("444", option) && (SUBSAMPLE_AUTO == encoding->subsample)) {
+            encoding->subsample = SUBSAMPLE_OFF;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    return 0;
+}
+
 /********************************************************************//**
 ** Opens pictDB file and calls do_list command.
 ************************************************************************/
@@ -112,6 +149,14 @@ int do_create_cmd(int args, char *argv[])
         uint16_t thumb_resY = DEFAULT_THUMB;
         uint16_t small_resX = DEFAULT_SMALL;
         uint16_t small_resY = DEFAULT_SMALL;
+        uint32_t alignment = 0;
+        uint32_t cache_mb = 0;
+        const char* res_names[NB_RES - NB_DEFAULT_RES];
+        uint16_t res_dims[NB_DIM * (NB_RES - NB_DEFAULT_RES)];
+        size_t nb_named_res = 0;
+        const char* encoding_names[NB_RES];
+        struct pict_encoding encodings[NB_RES];
+        size_t nb_encodings = 0;
 
         // Look for optional arguments.
         //atouint16/32 can return 0 if an error occurs and
@@ -159,6 +204,56 @@ int do_create_cmd(int args, char *argv[])
                         return ERR_RESOLUTIONS;
                     }
                 }
+            } else if(!strcmp("-align", argv[0])) {
+                if(args < 2) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                } else {
+                    next_arg(&args, &argv);
+                    alignment = atouint32(argv[0]);
+                    if(alignment == 0) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                }
+            } else if(!strcmp("-cache", argv[0])) {
+                if(args < 2) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                } else {
+                    next_arg(&args, &argv);
+                    cache_mb = atouint32(argv[0]);
+                    if(cache_mb == 0) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                }
+            } else if(!strcmp("-res", argv[0])) {
+                if(args < 4) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                } else if(nb_named_res == NB_RES - NB_DEFAULT_RES) {
+                    return ERR_RESOLUTIONS;
+                } else {
+                    next_arg(&args, &argv);
+                    res_names[nb_named_res] = argv[0];
+                    for(size_t dim = 0; dim < NB_DIM; ++dim) {
+                        next_arg(&args, &argv);
+                        res_dims[NB_DIM * nb_named_res + dim] = atouint16(argv[0]);
+                    }
+                    ++nb_named_res;
+                }
+            } else if(!strcmp("-jpeg", argv[0])) {
+                if(args < 4) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                } else if(nb_encodings == NB_RES) {
+                    return ERR_INVALID_ARGUMENT;
+                } else {
+                    next_arg(&args, &argv);
+                    encoding_names[nb_encodings] = argv[0];
+                    next_arg(&args, &argv);
+                    const char* quality = argv[0];
+                    next_arg(&args, &argv);
+                    if(0 != parse_encoding(quality, argv[0], &encodings[nb_encodings])) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                    ++nb_encodings;
+                }
             } else {
                 return ERR_INVALID_ARGUMENT;
             }
@@ -171,15 +266,41 @@ int do_create_cmd(int args, char *argv[])
         db_file.header.res_resized[DIM_Y_THUMB] = thumb_resY;
         db_file.header.res_resized[DIM_X_SMALL] = small_resX;
         db_file.header.res_resized[DIM_Y_SMALL] = small_resY;
+        db_file.header.features = 0;
 
-        puts("Create");
         int errorCode = 0; //0 means no error
+        if((0 != alignment) && (0 != set_alignment(&db_file.header, alignment))) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if((0 != cache_mb) && (0 != set_derivative_cache(&db_file.header, (uint64_t) cache_mb * 1024 * 1024))) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        init_resolution_table(&db_file);
+        for(size_t i = 0; i < nb_named_res; ++i) {
+            errorCode = add_resolution(&db_file, res_names[i], res_dims[NB_DIM * i + DIM_X_ORIG],
+                                       res_dims[NB_DIM * i + DIM_Y_ORIG]);
+            if(0 != errorCode) {
+                return errorCode;
+            }
+        }
+        //The encodings are set once all the resolutions are named
+        for(size_t i = 0; i < nb_encodings; ++i) {
+            const int res = resolution_atoi(encoding_names[i], &db_file);
+            if(-1 == res) {
+                return ERR_RESOLUTIONS;
+            }
+            errorCode = set_encoding(&db_file, res, &encodings[i]);
+            if(0 != errorCode) {
+                return errorCode;
+            }
+        }
+        puts("Create");
         errorCode = do_create(db_filename, &db_file);
         if(errorCode != 0) {
             return errorCode;
         }
         printf("%d item(s) written\n", db_file.header.max_files + 1);
-        print_header(&db_file.header);
+        print_header(&db_file.header, &db_file.resolutions);
         do_close(&db_file);
         return errorCode;
     }
@@ -190,7 +311,14 @@ int do_create_cmd(int args, char *argv[])
 *********************************************************************** */
 int help(int args, char *argv[])
 {
-    puts("pictDBM [COMMAND] [ARGUMENTS]");
+    puts("pictDBM [VIPS OPTIONS] [COMMAND] [ARGUMENTS]");
+    puts("  VIPS options are:");
+    puts("      -vips_cache_mem <MB>: max. memory of the operation cache of VIPS.");
+    puts("                            default value is 32, 0 disables the cache");
+    puts("      -vips_cache_ops <N>: max. number of operations in the cache of VIPS.");
+    puts("                           default value is 100, 0 disables the cache");
+    puts("      -vips_concurrency <N>: number of threads of each VIPS operation.");
+    puts("                             default value is 1, 0 for the number of processors");
     puts("  help: displays this help.");
     puts("  list <dbfilename>: list pictDB content.");
     puts("  create <dbfilename>: create a new pictDB.");
@@ -204,12 +332,37 @@ int help(int args, char *argv[])
     puts("          -small_res <X_RES> <Y_RES>: resolution for small images.");
     puts("                                      default value is 256x256");
     puts("                                      maximum value is 512x512");
-    puts("  read <dbfilename> <pictID> [original|orig|thumbnail|thumb|small]:");
+    puts("          -align <BYTES>: alignment of the images, for the direct reads of the server.");
+    puts("                          a power of 2 from 512 to 1048576, e.g. 4096");
+    puts("          -cache <MB>: size of the cache file <dbfilename>.cache of the resized");
+    puts("                       images, which are not stored in the pictDB then.");
+    puts("                       a power of 2 from 1 to 1048576, e.g. 256");
+    puts("          -res <NAME> <X_RES> <Y_RES>: other resolution of the images, read by its name.");
+    puts("                                       at most 3 resolutions, of at most 2048x2048");
+    puts("          -jpeg <NAME> <QUALITY> <OPTIONS>: encoding of the images resized in a resolution.");
+    puts("                                            quality from 1 to 100, default value is 75");
+    puts("                                            options are none or some of progressive,strip,");
+    puts("                                            optimize and 420|444, default value is optimize");
+    puts("  read <dbfilename> <pictID> [original|orig|thumbnail|thumb|small|<NAME>]:");
     puts("      read an image from the pictDB and save it to a file.");
     puts("      default resolution is \"original\".");
     puts("  insert <dbfilename> <pictID> <filename>: insert a new image in the pictDB.");
     puts("  delete <dbfilename> <pictID>: delete picture pictID from pictDB.");
     puts("  gc <dbfilename> <tmp dbfilename>: performs garbage collecting on pictDB. Requires a temporary filename for copying the pictDB.");
+    puts("  sprite <dbfilename> <page>: composite the thumbnails of a page of pictures");
+    puts("      into sprite_<page>.jpeg, with their coordinates in sprite_<page>.json.");
+    puts("      options are:");
+    puts("          -page_size <N>: number of pictures per page.");
+    puts("                          default value is 100");
+    puts("                          maximum value is 1000");
+    puts("  migrate <dbfilename>: upgrades pictDB in place to the current format version.");
+    puts("      an interrupted migration is undone the next time pictDB is modified.");
+    puts("  pregen <dbfilename> [thumb|small|<NAME>|all]: creates the missing resized images");
+    puts("      of all the pictures, in all the resolutions by default.");
+    puts("      options are:");
+    puts("          -j <N>: number of workers resizing the images.");
+    puts("                  default value is 4");
+    puts("                  maximum value is 64");
     return 0;
 }
 
@@ -232,7 +385,7 @@ int do_delete_cmd(int args, char *argv[])
 
         struct pictdb_file db_file;
         int errorCode = 0; //0 means no error
-        errorCode = do_open(db_filename, "rb+", &db_file);
+        errorCode = do_open_lazy(db_filename, "rb+", &db_file);
         if(errorCode != 0) {
             return errorCode;
         }
@@ -263,10 +416,19 @@ int do_read_cmd(int args, char *argv[])
         if(pictIDSize > MAX_PIC_ID || pictIDSize == 0) {
             return ERR_INVALID_PICID;
         }
+        struct pictdb_file db_file;
+        int errorCode = 0; //0 means no error
+        errorCode = do_open_lazy(db_filename, "rb+", &db_file);
+        if(errorCode != 0) {
+            return errorCode;
+        }
+
+        //The named resolutions are those of the database
         size_t dim = 0;
         if(args  == 4) {
-            int dim_ = resolution_atoi(argv[3]);
+            int dim_ = resolution_atoi(argv[3], &db_file);
             if(-1 == dim_) {
+                do_close(&db_file);
                 return ERR_INVALID_ARGUMENT;
             }
             dim = (size_t) dim_;
@@ -274,13 +436,6 @@ int do_read_cmd(int args, char *argv[])
             dim = RES_ORIG;
         }
 
-        struct pictdb_file db_file;
-        int errorCode = 0; //0 means no error
-        errorCode = do_open(db_filename, "rb+", &db_file);
-        if(errorCode != 0) {
-            return errorCode;
-        }
-
         char* image_buffer = NULL;
         uint32_t image_size = 0;
         errorCode = do_read(pictID, dim, &image_buffer, &image_size, &db_file);
@@ -288,7 +443,7 @@ int do_read_cmd(int args, char *argv[])
             do_close(&db_file);
             return errorCode;
         }
-        const char* name = create_name(pictID, dim);
+        const char* name = create_name(pictID, dim, &db_file);
 
         FILE* image = NULL;
         image = fopen(name, "wb");
@@ -340,6 +495,134 @@ int do_gc_cmd(int args, char *argv[])
     }
 }
 
+/**
+ * @brief Displays the progress of a migration.
+ *
+ * @param from_version The format version the file is migrated from
+ * @param to_version The format version the file is migrated to
+ * @param done The number of metadata processed
+ * @param total The number of metadata to process
+ */
+static void print_migration_progress(uint32_t from_version, uint32_t to_version, size_t done, size_t total)
+{
+    printf("\rmigrating from version %" PRIu32 " to %" PRIu32 ": %3zu%%", from_version, to_version,
+           0 == total ? (size_t) 100 : 100 * done / total);
+    if(done == total) {
+        putchar('\n');
+    }
+    fflush(stdout);
+}
+
+/********************************************************************//**
+** Upgrades the database to the current format version.
+************************************************************************/
+int do_migrate_cmd(int args, char *argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    } else {
+        const char* db_filename = argv[1];
+        TEST_FILENAME(db_filename);
+
+        uint32_t from_version = 0;
+        const int errorCode = do_migrate(db_filename, print_migration_progress, &from_version);
+        if(0 == errorCode) {
+            if(PICTDB_FORMAT_VERSION == from_version) {
+                printf("pictDB already at format version %d\n", PICTDB_FORMAT_VERSION);
+            } else {
+                printf("pictDB migrated to format version %d\n", PICTDB_FORMAT_VERSION);
+            }
+        }
+        return errorCode;
+    }
+}
+
+/**
+ * @brief Displays the progress of a pre-generation, at each percent.
+ *
+ * @param done The number of images stored
+ * @param total The number of images to create
+ * @param seconds The time elapsed since the beginning
+ */
+static void print_pregen_progress(size_t done, size_t total, double seconds)
+{
+    if((done == total) || (100 * done / total != 100 * (done - 1) / total)) {
+        printf("\rpregenerating: %zu/%zu images, %.1f images/s", done, total,
+               seconds > 0.0 ? (double) done / seconds : 0.0);
+        fflush(stdout);
+    }
+}
+
+/********************************************************************//**
+** Creates the missing resized images of all the pictures.
+************************************************************************/
+int do_pregen_cmd(int args, char *argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    } else {
+        next_arg(&args, &argv); // Skip command.
+
+        const char* db_filename = argv[0];
+        TEST_FILENAME(db_filename);
+
+        const char* resolution = "all";
+        if((args > 1) && ('-' != argv[1][0])) {
+            next_arg(&args, &argv);
+            resolution = argv[0];
+        }
+        size_t nb_workers = DEFAULT_PREGEN_WORKERS;
+        while(args > 1) {
+            next_arg(&args, &argv);
+            if(!strcmp("-j", argv[0])) {
+                if(args < 2) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                } else {
+                    next_arg(&args, &argv);
+                    nb_workers = atouint16(argv[0]);
+                    if(nb_workers == 0 || nb_workers > MAX_PREGEN_WORKERS) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                }
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+        }
+
+        struct pictdb_file db_file;
+        int errorCode = do_open(db_filename, "rb+", &db_file);
+        if(errorCode != 0) {
+            return errorCode;
+        }
+        size_t dims[NB_RES];
+        size_t nb_dims = 0;
+        if(!strcmp("all", resolution)) {
+            for(; nb_dims < db_file.resolutions.nb_res; ++nb_dims) {
+                dims[nb_dims] = nb_dims;
+            }
+        } else {
+            const int dim = resolution_atoi(resolution, &db_file);
+            if(-1 == dim) {
+                do_close(&db_file);
+                return ERR_RESOLUTIONS;
+            }
+            dims[nb_dims++] = (size_t) dim;
+        }
+
+        const double start = metrics_now();
+        size_t nb_created = 0;
+        errorCode = do_pregen(dims, nb_dims, nb_workers, print_pregen_progress, &nb_created, &db_file);
+        const double seconds = metrics_now() - start;
+        do_close(&db_file);
+        if(0 != nb_created) {
+            putchar('\n');
+        }
+        printf("%zu resized image(s) created in %.2f s (%.1f images/s)\n", nb_created, seconds,
+               seconds > 0.0 ? (double) nb_created / seconds : 0.0);
+        return errorCode;
+    }
+}
+
 /********************************************************************//**
 ** Insert a picture in the database.
 ************************************************************************/
@@ -385,7 +668,7 @@ int do_insert_cmd(int args, char *argv[])
 
         // Inserts the image in the database "db_filename".
         struct pictdb_file db_file;
-        err_code = do_open(db_filename, "rb+", &db_file);
+        err_code = do_open_lazy(db_filename, "rb+", &db_file);
         if(0 != err_code) {
             free(image);
             image = NULL;
@@ -407,6 +690,110 @@ int do_insert_cmd(int args, char *argv[])
     }
 }
 
+/********************************************************************//**
+** Creates the sprite of one page of thumbnails and its coordinate map.
+************************************************************************/
+int do_sprite_cmd(int args, char *argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    } else {
+        next_arg(&args, &argv); // Skip command.
+
+        const char* db_filename = argv[0];
+        TEST_FILENAME(db_filename);
+
+        next_arg(&args, &argv);
+        const uint32_t page = atouint32(argv[0]);
+        if(0 == page && ERANGE == errno) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        uint32_t page_size = DEFAULT_SPRITE_PAGE_SIZE;
+        while(args > 1) {
+            next_arg(&args, &argv);
+            if(!strcmp("-page_size", argv[0])) {
+                if(args < 2) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                } else {
+                    next_arg(&args, &argv);
+                    page_size = atouint32(argv[0]);
+                    if(page_size == 0 || page_size > MAX_SPRITE_PAGE_SIZE) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                }
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+        }
+
+        struct pictdb_file db_file;
+        int errorCode = 0; //0 means no error
+        errorCode = do_open_lazy(db_filename, "rb+", &db_file);
+        if(errorCode != 0) {
+            return errorCode;
+        }
+
+        struct pict_sprite sprite;
+        errorCode = do_sprite(page, page_size, &sprite, &db_file);
+        do_close(&db_file);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+
+        char name[FILENAME_MAX];
+        snprintf(name, sizeof(name), "sprite_%" PRIu32 ".jpeg", page);
+        FILE* f = fopen(name, "wb");
+        if(NULL == f) {
+            free_sprite(&sprite);
+            return ERR_IO;
+        }
+        errorCode = write_disk_image(sprite.image, sprite.image_size, f);
+        fclose(f);
+
+        snprintf(name, sizeof(name), "sprite_%" PRIu32 ".json", page);
+        f = fopen(name, "w");
+        if((0 == errorCode) && (NULL == f)) {
+            errorCode = ERR_IO;
+        } else if(0 == errorCode) {
+            if(EOF == fputs(sprite.map, f)) {
+                errorCode = ERR_IO;
+            }
+            fclose(f);
+        }
+        free_sprite(&sprite);
+        return errorCode;
+    }
+}
+
+/**
+ * @brief Parses the settings of VIPS given before the command, and applies
+ * them (or the default values).
+ *
+ * @param args Pointer to number of arguments
+ * @param argv Pointer on arguments, moved to the command
+ *
+ * @return Returns 0 in case of success
+ */
+static int set_vips_options(int* args, char** argv[])
+{
+    struct vips_settings settings;
+    init_vips_settings(&settings);
+    while((*args > 0) && !strncmp(VIPS_OPTION_PREFIX, (*argv)[0], strlen(VIPS_OPTION_PREFIX))) {
+        if(*args < 2) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        const int errorCode = parse_vips_option((*argv)[0], (*argv)[1], &settings);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+        next_arg(args, argv);
+        next_arg(args, argv);
+    }
+    apply_vips_settings(&settings);
+    return 0;
+}
+
 /********************************************************************//**
 ** MAIN
 ************************************************************************/
@@ -419,19 +806,25 @@ int main(int args, char* argv[])
         {"delete", do_delete_cmd},
         {"insert", do_insert_cmd},
         {"read", do_read_cmd},
-        {"gc", do_gc_cmd}
+        {"gc", do_gc_cmd},
+        {"sprite", do_sprite_cmd},
+        {"migrate", do_migrate_cmd},
+        {"pregen", do_pregen_cmd}
     };
 
     int ret = 0;
 
     if(VIPS_INIT(argv[0])) {
         ret = ERR_VIPS;
-    } else if (args < 2) {
-        ret = ERR_NOT_ENOUGH_ARGUMENTS;
     } else {
         next_arg(&args, &argv); // skips command call name
+        ret = set_vips_options(&args, &argv);
+    }
+    if((0 == ret) && (args < 1)) {
+        ret = ERR_NOT_ENOUGH_ARGUMENTS;
+    } else if(0 == ret) {
         size_t i = 0;
-        while(strcmp(commands[i].name, argv[0]) != 0 && i < N_COMMANDS) {
+        while(i < N_COMMANDS && strcmp(commands[i].name, argv[0]) != 0) {
             ++i;
         }
         if(i < N_COMMANDS) {
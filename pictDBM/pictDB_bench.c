@@ -0,0 +1,644 @@
+/**
+ * @file pictDB_bench.c
+ * @brief pictDB Benchmark: measures the core pictDB operations.
+ *
+ * Generates a synthetic database of configurable size and ratio of
+ * duplicated pictures, then measures do_insert, do_open (eager and lazy), get_image_index,
+ * do_read in each resolution, do_list (JSON), do_delete and do_gbcollect,
+ * and the kernels and hash tables replacing the original metadata loops.
+ * Each result is printed on stdout as one JSON object per line, followed
+ * by the memory used by VIPS with the settings given, to compare them.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+#include "image_content.h"
+#include "metrics.h"
+#include "pictDBM_tools.h"
+#include "scan.h"
+
+#define DEFAULT_BENCH_PICTURES 1000 // Default number of pictures
+#define DEFAULT_BENCH_DUP 10 // Default percentage of duplicated pictures
+#define DEFAULT_BENCH_WIDTH 320 // Default width of the generated pictures
+#define DEFAULT_BENCH_HEIGHT 240 // Default height of the generated pictures
+#define BENCH_REPEAT 20 // Number of runs of the operations on the whole database
+#define BENCH_DELETE_RATIO 10 // One picture out of BENCH_DELETE_RATIO is deleted
+#define BENCH_SCAN_REPEAT 200 // Number of runs of the metadata scans
+#define BENCH_MISSING_ID "bench_missing_id"
+#define BENCH_DB "bench.db"
+#define BENCH_TMP_DB "bench_tmp.db"
+
+/**
+ * @brief Configuration of the benchmark
+ *
+ * nb_pictures Number of pictures in the database
+ * dup_percent Percentage of pictures having the content of another one
+ * width Width of the generated pictures
+ * height Height of the generated pictures
+ * db_filename Name of the database file
+ */
+struct bench_config {
+    uint32_t nb_pictures;
+    uint32_t dup_percent;
+    uint16_t width;
+    uint16_t height;
+    const char* db_filename;
+};
+
+/**
+ * @brief Synthetic pictures of the benchmark
+ *
+ * buffers JPEG content of the distinct pictures
+ * sizes Size of each distinct picture
+ * nb_distinct Number of distinct pictures
+ * content Index in buffers of the content of each picture of the database
+ * ids ID of each picture of the database
+ */
+struct bench_pictures {
+    void** buffers;
+    size_t* sizes;
+    size_t nb_distinct;
+    size_t* content;
+    char (*ids)[MAX_PIC_ID + 1];
+};
+
+/**
+ * @brief qsort comparator for doubles
+ */
+static int cmp_double(const void* a, const void* b)
+{
+    const double da = *(const double*) a;
+    const double db = *(const double*) b;
+    return (da > db) - (da < db);
+}
+
+/**
+ * @brief Gets a percentile of sorted samples
+ */
+static double percentile(const double* sorted, size_t count, double p)
+{
+    return sorted[(size_t)(p * (count - 1) + 0.5)];
+}
+
+/**
+ * @brief Prints the throughput and latency of one operation as a JSON line
+ *
+ * @param op Name of the operation
+ * @param samples Duration (in seconds) of each run of the operation (sorted by this function)
+ * @param count Number of samples
+ */
+static void report(const char* op, double* samples, size_t count)
+{
+    if(0 == count) {
+        return;
+    }
+    qsort(samples, count, sizeof(double), cmp_double);
+    double total = 0.0;
+    for(size_t i = 0; i < count; ++i) {
+        total += samples[i];
+    }
+    printf("{\"op\": \"%s\", \"count\": %zu, \"total_s\": %.6f, \"ops_per_s\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}\n",
+           op, count, total, total > 0.0 ? count / total : 0.0,
+           percentile(samples, count, 0.50) * 1e6, percentile(samples, count, 0.99) * 1e6);
+    fflush(stdout);
+}
+
+/**
+ * @brief Generates a JPEG picture of random content
+ *
+ * @param width Width of the picture
+ * @param height Height of the picture
+ * @param buffer Pointer to the JPEG content, allocated by VIPS
+ * @param size Pointer to the size of the content
+ *
+ * @return Returns 0 in case of success
+ */
+static int generate_picture(int width, int height, void** buffer, size_t* size)
+{
+    VipsImage* image = NULL;
+    if(0 != vips_gaussnoise(&image, width, height, NULL)) {
+        return ERR_VIPS;
+    }
+    *buffer = NULL;
+    const int errorCode = vips_jpegsave_buffer(image, buffer, size, NULL) ? ERR_VIPS : 0;
+    g_object_unref(image);
+    return errorCode;
+}
+
+/**
+ * @brief Frees the synthetic pictures
+ */
+static void free_pictures(struct bench_pictures* pictures)
+{
+    if(NULL != pictures->buffers) {
+        for(size_t i = 0; i < pictures->nb_distinct; ++i) {
+            g_free(pictures->buffers[i]);
+        }
+    }
+    free(pictures->buffers);
+    free(pictures->sizes);
+    free(pictures->content);
+    free(pictures->ids);
+}
+
+/**
+ * @brief Generates the synthetic pictures, dup_percent of them having
+ * the content of a previous picture
+ *
+ * @param config Configuration of the benchmark
+ * @param pictures The pictures to generate
+ *
+ * @return Returns 0 in case of success
+ */
+static int generate_pictures(const struct bench_config* config, struct bench_pictures* pictures)
+{
+    const size_t n = config->nb_pictures;
+    pictures->nb_distinct = 0;
+    pictures->buffers = calloc(n, sizeof(void*));
+    pictures->sizes = calloc(n, sizeof(size_t));
+    pictures->content = calloc(n, sizeof(size_t));
+    pictures->ids = calloc(n, sizeof(*pictures->ids));
+    if((NULL == pictures->buffers) || (NULL == pictures->sizes) || (NULL == pictures->content) || (NULL == pictures->ids)) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(size_t i = 0; i < n; ++i) {
+        snprintf(pictures->ids[i], MAX_PIC_ID + 1, "pict_%zu", i);
+        if((pictures->nb_distinct > 0) && ((uint32_t)(rand() % 100) < config->dup_percent)) {
+            pictures->content[i] = rand() % pictures->nb_distinct;
+        } else {
+            const size_t k = pictures->nb_distinct;
+            int errorCode = generate_picture(config->width, config->height, &pictures->buffers[k], &pictures->sizes[k]);
+            if(0 != errorCode) {
+                return errorCode;
+            }
+            pictures->content[i] = k;
+            ++pictures->nb_distinct;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates the database and inserts all the pictures
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_insert(const struct bench_config* config, const struct bench_pictures* pictures)
+{
+    struct pictdb_file db_file;
+    db_file.header.max_files = config->nb_pictures;
+    db_file.header.res_resized[DIM_X_THUMB] = DEFAULT_THUMB;
+    db_file.header.res_resized[DIM_Y_THUMB] = DEFAULT_THUMB;
+    db_file.header.res_resized[DIM_X_SMALL] = DEFAULT_SMALL;
+    db_file.header.res_resized[DIM_Y_SMALL] = DEFAULT_SMALL;
+    db_file.header.features = 0;
+    init_resolution_table(&db_file);
+    int errorCode = do_create(config->db_filename, &db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    double* samples = calloc(config->nb_pictures, sizeof(double));
+    if(NULL == samples) {
+        do_close(&db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(size_t i = 0; (i < config->nb_pictures) && (0 == errorCode); ++i) {
+        const size_t k = pictures->content[i];
+        const double start = metrics_now();
+        errorCode = do_insert(pictures->buffers[k], pictures->sizes[k], pictures->ids[i], &db_file);
+        samples[i] = metrics_now() - start;
+    }
+    do_close(&db_file);
+    if(0 == errorCode) {
+        report("do_insert", samples, config->nb_pictures);
+    }
+    free(samples);
+    return errorCode;
+}
+
+/**
+ * @brief Measures do_open and do_open_lazy (the file is closed between two runs)
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_open(const struct bench_config* config)
+{
+    double samples[BENCH_REPEAT];
+    double lazy_samples[BENCH_REPEAT];
+    for(size_t i = 0; i < BENCH_REPEAT; ++i) {
+        struct pictdb_file db_file;
+        double start = metrics_now();
+        int errorCode = do_open(config->db_filename, "rb", &db_file);
+        samples[i] = metrics_now() - start;
+        if(0 != errorCode) {
+            return errorCode;
+        }
+        do_close(&db_file);
+
+        start = metrics_now();
+        errorCode = do_open_lazy(config->db_filename, "rb", &db_file);
+        lazy_samples[i] = metrics_now() - start;
+        if(0 != errorCode) {
+            return errorCode;
+        }
+        do_close(&db_file);
+    }
+    report("do_open", samples, BENCH_REPEAT);
+    report("do_open_lazy", lazy_samples, BENCH_REPEAT);
+    return 0;
+}
+
+/**
+ * @brief Measures get_image_index for all the pictures in random order
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_index(const struct bench_config* config, const struct bench_pictures* pictures, struct pictdb_file* db_file)
+{
+    const size_t n = config->nb_pictures;
+    double* samples = calloc(n, sizeof(double));
+    size_t* order = calloc(n, sizeof(size_t));
+    if((NULL == samples) || (NULL == order)) {
+        free(samples);
+        free(order);
+        return ERR_OUT_OF_MEMORY;
+    }
+    //Fisher-Yates shuffle
+    for(size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    for(size_t i = n - 1; i > 0; --i) {
+        const size_t j = rand() % (i + 1);
+        const size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    int errorCode = 0;
+    for(size_t i = 0; (i < n) && (0 == errorCode); ++i) {
+        size_t index = 0;
+        const double start = metrics_now();
+        errorCode = get_image_index(pictures->ids[order[i]], &index, db_file);
+        samples[i] = metrics_now() - start;
+    }
+    if(0 == errorCode) {
+        report("get_image_index", samples, n);
+    }
+    free(samples);
+    free(order);
+    return errorCode;
+}
+
+/**
+ * @brief Measures do_read of all the pictures in one resolution
+ *
+ * @param op Name of the operation in the report
+ * @param dim Internal code of the resolution
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_read(const char* op, size_t dim, const struct bench_config* config,
+                      const struct bench_pictures* pictures, struct pictdb_file* db_file)
+{
+    double* samples = calloc(config->nb_pictures, sizeof(double));
+    if(NULL == samples) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int errorCode = 0;
+    for(size_t i = 0; (i < config->nb_pictures) && (0 == errorCode); ++i) {
+        char* image_buffer = NULL;
+        uint32_t image_size = 0;
+        const double start = metrics_now();
+        errorCode = do_read(pictures->ids[i], dim, &image_buffer, &image_size, db_file);
+        samples[i] = metrics_now() - start;
+        if(0 == errorCode) {
+            free(image_buffer);
+        }
+    }
+    if(0 == errorCode) {
+        report(op, samples, config->nb_pictures);
+    }
+    free(samples);
+    return errorCode;
+}
+
+/**
+ * @brief Measures do_list in JSON mode
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_list(const struct pictdb_file* db_file)
+{
+    double samples[BENCH_REPEAT];
+    for(size_t i = 0; i < BENCH_REPEAT; ++i) {
+        const double start = metrics_now();
+        const char* list = do_list(db_file, JSON);
+        samples[i] = metrics_now() - start;
+        if(NULL == list) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        free((void*) list);
+    }
+    report("do_list_json", samples, BENCH_REPEAT);
+    return 0;
+}
+
+/**
+ * @brief Original loop of do_list: counts the valid metadata
+ */
+static size_t loop_valid(const struct pictdb_file* db_file)
+{
+    size_t count = 0;
+    for(size_t i = 0; i < db_file->header.max_files; ++i) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Original loop of do_name_and_content_dedup for a new picture
+ *
+ * @return Returns the number of pictures with the same ID or SHA
+ */
+static size_t loop_dedup(const char* id, const unsigned char* SHA, const struct pictdb_file* db_file)
+{
+    size_t count = 0;
+    for(size_t i = 0; i < db_file->header.max_files; ++i) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            if(strcmp(get_pict_id(db_file, i), id) == 0) {
+                ++count;
+            } else if(cmp_SHA(get_pict_blob(db_file, i)->SHA, SHA) == 0) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Counts the valid metadata with the kernels
+ */
+static size_t scan_valid(const struct pictdb_file* db_file)
+{
+    size_t count = 0;
+    for(size_t i = next_valid_index(db_file, 0); i < db_file->header.max_files; i = next_valid_index(db_file, i + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+/**
+ * @brief Lookups of do_name_and_content_dedup in the hash tables
+ *
+ * @return Returns the number of pictures with the same ID or SHA
+ */
+static size_t index_dedup(const char* id, const unsigned char* SHA, const struct pictdb_file* db_file)
+{
+    size_t count = 0;
+    size_t index = 0;
+    if(0 == find_pict_id(db_file, id, &index)) {
+        ++count;
+    }
+    size_t blob = 0;
+    if((0 == find_blob(db_file, SHA, &blob)) && (blob < db_file->header.max_files)) {
+        count += db_file->blobs[blob].refcount;
+    }
+    return count;
+}
+
+/**
+ * @brief Measures one scan of the whole metadata BENCH_SCAN_REPEAT times
+ *
+ * @param op Name of the measure
+ * @param dedup Measures the dedup scan if set, the scan of the valid metadata otherwise
+ * @param original Measures the original loop if set, the kernels or the
+ *        hash tables otherwise
+ *
+ * @return Returns the result of the scan
+ */
+static size_t bench_one_scan(const char* op, int dedup, int original, const struct pictdb_file* db_file)
+{
+    //A new picture: neither its ID nor its SHA are in the database
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    memset(SHA, 0xA5, SHA256_DIGEST_LENGTH);
+
+    double samples[BENCH_SCAN_REPEAT];
+    size_t result = 0;
+    for(size_t i = 0; i < BENCH_SCAN_REPEAT; ++i) {
+        const double start = metrics_now();
+        if(dedup) {
+            result = original ? loop_dedup(BENCH_MISSING_ID, SHA, db_file) : index_dedup(BENCH_MISSING_ID, SHA, db_file);
+        } else {
+            result = original ? loop_valid(db_file) : scan_valid(db_file);
+        }
+        samples[i] = metrics_now() - start;
+    }
+    report(op, samples, BENCH_SCAN_REPEAT);
+    return result;
+}
+
+/**
+ * @brief Measures the original loops of db_list.c and dedup.c, the
+ *        lookups in the hash tables and the kernels of each instruction
+ *        set supported by the processor
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_scan(const struct pictdb_file* db_file)
+{
+    const enum scan_isa default_isa = scan_get_isa();
+    const size_t nb_valid = bench_one_scan("scan_valid_original", 0, 1, db_file);
+    const size_t nb_dup = bench_one_scan("scan_dedup_original", 1, 1, db_file);
+    int errorCode = (bench_one_scan("scan_dedup_index", 1, 0, db_file) != nb_dup) ? ERR_INVALID_ARGUMENT : 0;
+    for(enum scan_isa isa = SCAN_SCALAR; (isa < NB_SCAN_ISAS) && (0 == errorCode); ++isa) {
+        if(0 == scan_set_isa(isa)) {
+            char op[64];
+            snprintf(op, sizeof(op), "scan_valid_%s", scan_isa_name(isa));
+            if(bench_one_scan(op, 0, 0, db_file) != nb_valid) {
+                errorCode = ERR_INVALID_ARGUMENT;
+            }
+        }
+    }
+    (void) scan_set_isa(default_isa);
+    return errorCode;
+}
+
+/**
+ * @brief Measures do_delete on one picture out of BENCH_DELETE_RATIO
+ *
+ * @return Returns 0 in case of success
+ */
+static int bench_delete(const struct bench_config* config, const struct bench_pictures* pictures, struct pictdb_file* db_file)
+{
+    double* samples = calloc(config->nb_pictures / BENCH_DELETE_RATIO + 1, sizeof(double));
+    if(NULL == samples) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int errorCode = 0;
+    size_t count = 0;
+    for(size_t i = 0; (i < config->nb_pictures) && (0 == errorCode); i += BENCH_DELETE_RATIO) {
+        const double start = metrics_now();
+        errorCode = do_delete(pictures->ids[i], db_file);
+        samples[count] = metrics_now() - start;
+        ++count;
+    }
+    if(0 == errorCode) {
+        report("do_delete", samples, count);
+    }
+    free(samples);
+    return errorCode;
+}
+
+/**
+ * @brief Runs all the measures on the generated database
+ *
+ * @return Returns 0 in case of success
+ */
+static int run_bench(const struct bench_config* config, const struct bench_pictures* pictures)
+{
+    int errorCode = bench_insert(config, pictures);
+    if(0 == errorCode) {
+        errorCode = bench_open(config);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    struct pictdb_file db_file;
+    errorCode = do_open(config->db_filename, "rb+", &db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    errorCode = bench_index(config, pictures, &db_file);
+    if(0 == errorCode) {
+        errorCode = bench_read("do_read_orig", RES_ORIG, config, pictures, &db_file);
+    }
+    //The first read of a resized picture creates it
+    if(0 == errorCode) {
+        errorCode = bench_read("do_read_thumb_cold", RES_THUMB, config, pictures, &db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = bench_read("do_read_thumb", RES_THUMB, config, pictures, &db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = bench_read("do_read_small_cold", RES_SMALL, config, pictures, &db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = bench_read("do_read_small", RES_SMALL, config, pictures, &db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = bench_list(&db_file);
+    }
+    if(0 == errorCode) {
+        errorCode = bench_delete(config, pictures, &db_file);
+    }
+    //The scans are measured with the holes left by do_delete
+    if(0 == errorCode) {
+        errorCode = bench_scan(&db_file);
+    }
+    if(0 == errorCode) {
+        double sample = 0.0;
+        const double start = metrics_now();
+        errorCode = do_gbcollect(&db_file, config->db_filename, BENCH_TMP_DB);
+        sample = metrics_now() - start;
+        if(0 == errorCode) {
+            report("do_gbcollect", &sample, 1);
+        }
+    }
+    do_close(&db_file);
+    return errorCode;
+}
+
+/**
+ * @brief Displays the usage of the benchmark
+ */
+static void help(void)
+{
+    puts("pictDB_bench [OPTIONS]");
+    puts("  -n <N>: number of pictures in the database (default 1000, max 100000).");
+    puts("  -dup <PERCENT>: percentage of duplicated pictures (default 10).");
+    puts("  -size <X_RES> <Y_RES>: resolution of the generated pictures (default 320x240).");
+    puts("  -db <dbfilename>: database file to create (default bench.db).");
+    puts("  -seed <SEED>: seed of the random generator (default 1).");
+    puts("  -vips_cache_mem <MB>: max. memory of the operation cache of VIPS (default 32).");
+    puts("  -vips_cache_ops <N>: max. number of operations in the cache of VIPS (default 100).");
+    puts("  -vips_concurrency <N>: number of threads of each VIPS operation (default 1).");
+}
+
+/********************************************************************//**
+** MAIN
+************************************************************************/
+int main(int args, char* argv[])
+{
+    struct bench_config config = {
+        DEFAULT_BENCH_PICTURES, DEFAULT_BENCH_DUP,
+        DEFAULT_BENCH_WIDTH, DEFAULT_BENCH_HEIGHT, BENCH_DB
+    };
+    uint32_t seed = 1;
+    struct vips_settings settings;
+    init_vips_settings(&settings);
+
+    int ret = 0;
+    for(int i = 1; (i < args) && (0 == ret); ++i) {
+        if(!strcmp("-n", argv[i]) && (i + 1 < args)) {
+            config.nb_pictures = atouint32(argv[++i]);
+            if(0 == config.nb_pictures || config.nb_pictures > MAX_MAX_FILES) {
+                ret = ERR_MAX_FILES;
+            }
+        } else if(!strcmp("-dup", argv[i]) && (i + 1 < args)) {
+            config.dup_percent = atouint32(argv[++i]);
+            if(config.dup_percent > 100) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else if(!strcmp("-size", argv[i]) && (i + 2 < args)) {
+            config.width = atouint16(argv[++i]);
+            config.height = atouint16(argv[++i]);
+            if(0 == config.width || 0 == config.height) {
+                ret = ERR_RESOLUTIONS;
+            }
+        } else if(!strcmp("-db", argv[i]) && (i + 1 < args)) {
+            config.db_filename = argv[++i];
+        } else if(!strcmp("-seed", argv[i]) && (i + 1 < args)) {
+            seed = atouint32(argv[++i]);
+        } else if(!strncmp(VIPS_OPTION_PREFIX, argv[i], strlen(VIPS_OPTION_PREFIX)) && (i + 1 < args)) {
+            ret = parse_vips_option(argv[i], argv[i + 1], &settings);
+            ++i;
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    if(0 == ret && VIPS_INIT(argv[0])) {
+        ret = ERR_VIPS;
+    } else if(0 == ret) {
+        srand(seed);
+        apply_vips_settings(&settings);
+        printf("{\"config\": {\"pictures\": %" PRIu32 ", \"dup_percent\": %" PRIu32 ", \"width\": %" PRIu16
+               ", \"height\": %" PRIu16 ", \"seed\": %" PRIu32 ", \"vips_cache_mem_mb\": %" PRIu32
+               ", \"vips_cache_ops\": %" PRIu32 ", \"vips_concurrency\": %" PRIu32 "}}\n",
+               config.nb_pictures, config.dup_percent, config.width, config.height, seed,
+               settings.cache_mem, settings.cache_ops, settings.concurrency);
+        struct bench_pictures pictures = {NULL, NULL, 0, NULL, NULL};
+        ret = generate_pictures(&config, &pictures);
+        if(0 == ret) {
+            ret = run_bench(&config, &pictures);
+        }
+        //The operation cache of VIPS is kept until the end
+        if(0 == ret) {
+            printf("{\"vips\": {\"memory_bytes\": %zu, \"memory_highwater_bytes\": %zu}}\n",
+                   vips_tracked_get_mem(), vips_tracked_get_mem_highwater());
+        }
+        free_pictures(&pictures);
+        vips_shutdown();
+    }
+
+    if(ret) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+        help();
+    }
+    return ret;
+}
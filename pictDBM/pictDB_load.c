@@ -0,0 +1,558 @@
+/**
+ * @file pictDB_load.c
+ * @brief pictDB Load generator: end-to-end benchmark of pictDB_server.
+ *
+ * Keeps a number of concurrent connections busy with a mix of
+ * /pictDB/read (thumbnail, small and original resolutions, pictures chosen
+ * with a Zipf popularity), /pictDB/insert and /pictDB/list requests, then
+ * reports the requests per second, latency percentiles and error rate of
+ * each kind of request, one JSON object per line.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "../libmongoose/mongoose.h"
+#include "pictDB.h"
+#include "metrics_clock.h"
+#include "pictDBM_tools.h"
+#include <json-c/json.h>
+#include <math.h>
+
+#define DEFAULT_LOAD_ADDRESS "localhost:8000"
+#define DEFAULT_LOAD_CONNECTIONS 32 // Default number of concurrent connections
+#define MAX_LOAD_CONNECTIONS 1000 // Max. number of concurrent connections
+#define DEFAULT_LOAD_REQUESTS 10000 // Default number of requests
+#define DEFAULT_LOAD_ZIPF 1.0 // Default exponent of the Zipf popularity
+#define LOAD_BOUNDARY "pictDBloadBoundary"
+
+/**
+ * @brief Kinds of requests sent to the server
+ */
+enum load_kind {
+    LOAD_READ_THUMB,
+    LOAD_READ_SMALL,
+    LOAD_READ_ORIG,
+    LOAD_INSERT,
+    LOAD_LIST,
+    NB_LOAD_KINDS
+};
+
+static const char* const LOAD_KIND_NAMES[NB_LOAD_KINDS] = {
+    "read_thumb", "read_small", "read_orig", "insert", "list"
+};
+
+/**
+ * @brief Configuration of the load
+ *
+ * address Address of the server (host:port)
+ * connections Number of concurrent connections
+ * nb_requests Total number of requests
+ * mix Percentage of each kind of request
+ * zipf Exponent of the Zipf popularity of the pictures
+ * image_filename JPEG file sent by the insert requests
+ */
+struct load_config {
+    const char* address;
+    uint32_t connections;
+    uint32_t nb_requests;
+    uint32_t mix[NB_LOAD_KINDS];
+    double zipf;
+    const char* image_filename;
+};
+
+/**
+ * @brief Request in flight on one connection
+ *
+ * kind Kind of the request
+ * start Time at which the request was sent
+ * done Set when the reply has been received
+ */
+struct load_request {
+    enum load_kind kind;
+    double start;
+    int done;
+};
+
+/**
+ * @brief State of the load
+ *
+ * ids IDs of the pictures in the database
+ * cdf Cumulative Zipf distribution over ids
+ * nb_ids Number of IDs
+ * image Content of the JPEG file to insert
+ * image_size Size of image
+ * sent Number of requests sent
+ * in_flight Number of requests in flight
+ * samples Latency of the successful requests of each kind
+ * nb_samples Number of samples of each kind
+ * errors Number of failed requests of each kind
+ * list_reply Body of the reply to the initial list request
+ * running Set while the load is running
+ */
+struct load_state {
+    char** ids;
+    double* cdf;
+    size_t nb_ids;
+    char* image;
+    long image_size;
+    uint32_t sent;
+    uint32_t in_flight;
+    double* samples[NB_LOAD_KINDS];
+    size_t nb_samples[NB_LOAD_KINDS];
+    size_t errors[NB_LOAD_KINDS];
+    char* list_reply;
+    int running;
+};
+
+static struct load_config config;
+static struct load_state state;
+
+static void send_next_request(struct mg_mgr* mgr);
+
+/**
+ * @brief Ends the request of a connection, counts an error if no reply
+ *        was received, then starts the next request.
+ */
+static void finish_request(struct mg_connection* nc)
+{
+    struct load_request* request = nc->user_data;
+    if(NULL == request) {
+        return;
+    }
+    if(!request->done) {
+        ++state.errors[request->kind];
+    }
+    free(request);
+    nc->user_data = NULL;
+    --state.in_flight;
+    if(state.running) {
+        send_next_request(nc->mgr);
+    }
+}
+
+/**
+ * @brief Handles the events of a client connection: records the latency
+ *        of the reply, or an error if the connection closes without reply,
+ *        then starts the next request.
+ */
+static void load_handler(struct mg_connection* nc, int ev, void* event_data)
+{
+    struct load_request* request = nc->user_data;
+    switch(ev) {
+    case MG_EV_CONNECT:
+        //A failed connection is closed without MG_EV_CLOSE
+        if(0 != *(int*) event_data) {
+            finish_request(nc);
+        }
+        break;
+    case MG_EV_HTTP_REPLY: {
+        struct http_message* hm = (struct http_message*) event_data;
+        const double latency = metrics_now() - request->start;
+        request->done = 1;
+        if(hm->resp_code >= 200 && hm->resp_code < 400) {
+            state.samples[request->kind][state.nb_samples[request->kind]] = latency;
+            ++state.nb_samples[request->kind];
+        } else {
+            ++state.errors[request->kind];
+        }
+        if(!state.running && NULL == state.list_reply) {
+            state.list_reply = calloc(hm->body.len + 1, sizeof(char));
+            if(NULL != state.list_reply) {
+                memcpy(state.list_reply, hm->body.p, hm->body.len);
+            }
+        }
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        break;
+    }
+    case MG_EV_CLOSE:
+        finish_request(nc);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Chooses a picture ID following the Zipf popularity
+ */
+static const char* choose_id(void)
+{
+    const double u = rand() / (RAND_MAX + 1.0);
+    size_t low = 0;
+    size_t high = state.nb_ids - 1;
+    while(low < high) {
+        const size_t middle = (low + high) / 2;
+        if(state.cdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return state.ids[low];
+}
+
+/**
+ * @brief Chooses the kind of the next request following the mix
+ */
+static enum load_kind choose_kind(void)
+{
+    uint32_t total = 0;
+    for(size_t i = 0; i < NB_LOAD_KINDS; ++i) {
+        total += config.mix[i];
+    }
+    uint32_t r = rand() % total;
+    size_t kind = 0;
+    while(r >= config.mix[kind]) {
+        r -= config.mix[kind];
+        ++kind;
+    }
+    return kind;
+}
+
+/**
+ * @brief Opens a connection and sends one request
+ *
+ * @param mgr The mongoose manager
+ * @param kind Kind of the request
+ *
+ * @return Returns 0 in case of success
+ */
+static int send_request(struct mg_mgr* mgr, enum load_kind kind)
+{
+    struct load_request* request = calloc(1, sizeof(struct load_request));
+    if(NULL == request) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    struct mg_connection* nc = mg_connect(mgr, config.address, load_handler);
+    if(NULL == nc) {
+        free(request);
+        return ERR_IO;
+    }
+    mg_set_protocol_http_websocket(nc);
+    request->kind = kind;
+    request->start = metrics_now();
+    nc->user_data = request;
+    ++state.in_flight;
+
+    switch(kind) {
+    case LOAD_READ_THUMB:
+    case LOAD_READ_SMALL:
+    case LOAD_READ_ORIG:
+        mg_printf(nc, "GET /pictDB/read?res=%s&pict_id=%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                  LOAD_READ_THUMB == kind ? "thumb" : (LOAD_READ_SMALL == kind ? "small" : "orig"),
+                  choose_id(), config.address);
+        break;
+    case LOAD_INSERT: {
+        char header[256 + MAX_PIC_ID];
+        const int header_len = snprintf(header, sizeof(header),
+                                        "--" LOAD_BOUNDARY "\r\n"
+                                        "Content-Disposition: form-data; name=\"up_file\"; filename=\"load_%" PRIu32 "_%d\"\r\n"
+                                        "Content-Type: image/jpeg\r\n\r\n", state.sent, rand());
+        const char* footer = "\r\n--" LOAD_BOUNDARY "--\r\n";
+        mg_printf(nc, "POST /pictDB/insert HTTP/1.1\r\nHost: %s\r\n"
+                  "Content-Type: multipart/form-data; boundary=" LOAD_BOUNDARY "\r\n"
+                  "Content-Length: %zu\r\n\r\n",
+                  config.address, header_len + state.image_size + strlen(footer));
+        mg_send(nc, header, header_len);
+        mg_send(nc, state.image, state.image_size);
+        mg_send(nc, footer, strlen(footer));
+        break;
+    }
+    case LOAD_LIST:
+    default:
+        mg_printf(nc, "GET /pictDB/list HTTP/1.1\r\nHost: %s\r\n\r\n", config.address);
+        break;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends the next request of the load if there is one left
+ */
+static void send_next_request(struct mg_mgr* mgr)
+{
+    if(state.sent < config.nb_requests) {
+        const enum load_kind kind = choose_kind();
+        ++state.sent;
+        if(0 != send_request(mgr, kind)) {
+            ++state.errors[kind];
+        }
+    }
+}
+
+/**
+ * @brief Gets the IDs of the pictures with a list request and builds
+ *        their Zipf distribution (the first listed picture is the most popular)
+ *
+ * @param mgr The mongoose manager
+ *
+ * @return Returns 0 in case of success
+ */
+static int load_ids(struct mg_mgr* mgr)
+{
+    int errorCode = send_request(mgr, LOAD_LIST);
+    while(0 == errorCode && state.in_flight > 0) {
+        mg_mgr_poll(mgr, 100);
+    }
+    if(0 != errorCode || NULL == state.list_reply) {
+        return ERR_IO;
+    }
+    //The initial list request is not part of the measures
+    state.nb_samples[LOAD_LIST] = 0;
+
+    json_object* jobj = json_tokener_parse(state.list_reply);
+    json_object* pictures = NULL;
+    if(NULL == jobj || !json_object_object_get_ex(jobj, "Pictures", &pictures)) {
+        //The server answers with a message when the database is empty
+        if(NULL != jobj) {
+            json_object_put(jobj);
+        }
+        return ERR_FILE_NOT_FOUND;
+    }
+    state.nb_ids = json_object_array_length(pictures);
+    if(0 == state.nb_ids) {
+        json_object_put(jobj);
+        return ERR_FILE_NOT_FOUND;
+    }
+    state.ids = calloc(state.nb_ids, sizeof(char*));
+    state.cdf = calloc(state.nb_ids, sizeof(double));
+    if(NULL == state.ids || NULL == state.cdf) {
+        json_object_put(jobj);
+        return ERR_OUT_OF_MEMORY;
+    }
+    double total = 0.0;
+    for(size_t i = 0; i < state.nb_ids; ++i) {
+        const char* id = json_object_get_string(json_object_array_get_idx(pictures, i));
+        state.ids[i] = calloc(strlen(id) + 1, sizeof(char));
+        if(NULL == state.ids[i]) {
+            json_object_put(jobj);
+            return ERR_OUT_OF_MEMORY;
+        }
+        strcpy(state.ids[i], id);
+        total += 1.0 / pow((double)(i + 1), config.zipf);
+        state.cdf[i] = total;
+    }
+    for(size_t i = 0; i < state.nb_ids; ++i) {
+        state.cdf[i] /= total;
+    }
+    json_object_put(jobj);
+    return 0;
+}
+
+/**
+ * @brief qsort comparator for doubles
+ */
+static int cmp_double(const void* a, const void* b)
+{
+    const double da = *(const double*) a;
+    const double db = *(const double*) b;
+    return (da > db) - (da < db);
+}
+
+/**
+ * @brief Prints the results of one kind of request as a JSON line
+ *
+ * @param name Name of the kind of request
+ * @param samples Latencies of the successful requests (sorted by this function)
+ * @param count Number of successful requests
+ * @param errors Number of failed requests
+ * @param duration Duration of the whole load
+ */
+static void report(const char* name, double* samples, size_t count, size_t errors, double duration)
+{
+    if(0 == count + errors) {
+        return;
+    }
+    qsort(samples, count, sizeof(double), cmp_double);
+    printf("{\"requests\": \"%s\", \"count\": %zu, \"errors\": %zu, \"error_rate\": %.4f, \"rps\": %.1f",
+           name, count + errors, errors, (double) errors / (count + errors), (count + errors) / duration);
+    if(count > 0) {
+        printf(", \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+               samples[(size_t)(0.50 * (count - 1) + 0.5)] * 1e3, samples[(size_t)(0.90 * (count - 1) + 0.5)] * 1e3,
+               samples[(size_t)(0.99 * (count - 1) + 0.5)] * 1e3, samples[count - 1] * 1e3);
+    }
+    printf("}\n");
+}
+
+/**
+ * @brief Runs the load and prints the results
+ *
+ * @return Returns 0 in case of success
+ */
+static int run_load(void)
+{
+    for(size_t i = 0; i < NB_LOAD_KINDS; ++i) {
+        state.samples[i] = calloc(config.nb_requests + 1, sizeof(double));
+        if(NULL == state.samples[i]) {
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr, NULL);
+    int errorCode = load_ids(&mgr);
+    if(ERR_FILE_NOT_FOUND == errorCode && 0 == config.mix[LOAD_READ_THUMB] + config.mix[LOAD_READ_SMALL] + config.mix[LOAD_READ_ORIG]) {
+        //Reads are not needed
+        errorCode = 0;
+    }
+    if(0 != errorCode) {
+        mg_mgr_free(&mgr);
+        return errorCode;
+    }
+
+    const double start = metrics_now();
+    state.running = 1;
+    for(uint32_t i = 0; i < config.connections; ++i) {
+        send_next_request(&mgr);
+    }
+    while(state.in_flight > 0) {
+        mg_mgr_poll(&mgr, 10);
+    }
+    const double duration = metrics_now() - start;
+    mg_mgr_free(&mgr);
+
+    size_t total = 0;
+    size_t total_errors = 0;
+    for(size_t i = 0; i < NB_LOAD_KINDS; ++i) {
+        report(LOAD_KIND_NAMES[i], state.samples[i], state.nb_samples[i], state.errors[i], duration);
+        total += state.nb_samples[i] + state.errors[i];
+        total_errors += state.errors[i];
+    }
+    printf("{\"requests\": \"all\", \"count\": %zu, \"errors\": %zu, \"error_rate\": %.4f, \"rps\": %.1f, \"duration_s\": %.3f}\n",
+           total, total_errors, total > 0 ? (double) total_errors / total : 0.0, total / duration, duration);
+    return 0;
+}
+
+/**
+ * @brief Frees the state of the load
+ */
+static void free_state(void)
+{
+    for(size_t i = 0; (NULL != state.ids) && (i < state.nb_ids); ++i) {
+        free(state.ids[i]);
+    }
+    free(state.ids);
+    free(state.cdf);
+    free(state.image);
+    free(state.list_reply);
+    for(size_t i = 0; i < NB_LOAD_KINDS; ++i) {
+        free(state.samples[i]);
+    }
+}
+
+/**
+ * @brief Reads the JPEG file sent by the insert requests
+ *
+ * @return Returns 0 in case of success
+ */
+static int load_image(void)
+{
+    FILE* f = fopen(config.image_filename, "rb");
+    if(NULL == f) {
+        return ERR_IO;
+    }
+    int errorCode = 0;
+    if((0 != fseek(f, 0L, SEEK_END)) || (-1 == (state.image_size = ftell(f))) || (0 != fseek(f, 0L, SEEK_SET))) {
+        errorCode = ERR_IO;
+    } else if(NULL == (state.image = calloc(state.image_size, sizeof(char)))) {
+        errorCode = ERR_OUT_OF_MEMORY;
+    } else if(fread(state.image, state.image_size, 1, f) != 1) {
+        errorCode = ERR_IO;
+    }
+    fclose(f);
+    return errorCode;
+}
+
+/**
+ * @brief Displays the usage of the load generator
+ */
+static void help(void)
+{
+    puts("pictDB_load [OPTIONS]");
+    puts("  -addr <HOST:PORT>: address of pictDB_server (default localhost:8000).");
+    puts("  -c <N>: number of concurrent connections (default 32, max 1000).");
+    puts("  -n <N>: total number of requests (default 10000).");
+    puts("  -mix <THUMB> <SMALL> <ORIG>: percentage of reads in each resolution (default 70 25 5).");
+    puts("  -insert <PERCENT> <filename>: percentage of inserts of the JPEG file filename (default 0).");
+    puts("  -list <PERCENT>: percentage of list requests (default 0).");
+    puts("  -zipf <S>: exponent of the Zipf popularity of the pictures (default 1.0).");
+    puts("  -seed <SEED>: seed of the random generator (default 1).");
+}
+
+/********************************************************************//**
+** MAIN
+************************************************************************/
+int main(int args, char* argv[])
+{
+    config.address = DEFAULT_LOAD_ADDRESS;
+    config.connections = DEFAULT_LOAD_CONNECTIONS;
+    config.nb_requests = DEFAULT_LOAD_REQUESTS;
+    config.mix[LOAD_READ_THUMB] = 70;
+    config.mix[LOAD_READ_SMALL] = 25;
+    config.mix[LOAD_READ_ORIG] = 5;
+    config.zipf = DEFAULT_LOAD_ZIPF;
+    uint32_t seed = 1;
+
+    int ret = 0;
+    for(int i = 1; (i < args) && (0 == ret); ++i) {
+        if(!strcmp("-addr", argv[i]) && (i + 1 < args)) {
+            config.address = argv[++i];
+        } else if(!strcmp("-c", argv[i]) && (i + 1 < args)) {
+            config.connections = atouint32(argv[++i]);
+            if(0 == config.connections || config.connections > MAX_LOAD_CONNECTIONS) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else if(!strcmp("-n", argv[i]) && (i + 1 < args)) {
+            config.nb_requests = atouint32(argv[++i]);
+            if(0 == config.nb_requests) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else if(!strcmp("-mix", argv[i]) && (i + 3 < args)) {
+            config.mix[LOAD_READ_THUMB] = atouint32(argv[++i]);
+            config.mix[LOAD_READ_SMALL] = atouint32(argv[++i]);
+            config.mix[LOAD_READ_ORIG] = atouint32(argv[++i]);
+        } else if(!strcmp("-insert", argv[i]) && (i + 2 < args)) {
+            config.mix[LOAD_INSERT] = atouint32(argv[++i]);
+            config.image_filename = argv[++i];
+        } else if(!strcmp("-list", argv[i]) && (i + 1 < args)) {
+            config.mix[LOAD_LIST] = atouint32(argv[++i]);
+        } else if(!strcmp("-zipf", argv[i]) && (i + 1 < args)) {
+            char* end = NULL;
+            config.zipf = strtod(argv[++i], &end);
+            if(*end != '\0' || config.zipf < 0.0) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else if(!strcmp("-seed", argv[i]) && (i + 1 < args)) {
+            seed = atouint32(argv[++i]);
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+    uint32_t total_mix = 0;
+    for(size_t i = 0; i < NB_LOAD_KINDS; ++i) {
+        total_mix += config.mix[i];
+    }
+    if(0 == ret && 0 == total_mix) {
+        ret = ERR_INVALID_ARGUMENT;
+    }
+    if(0 == ret && config.mix[LOAD_INSERT] > 0) {
+        ret = load_image();
+    }
+
+    if(0 == ret) {
+        srand(seed);
+        printf("{\"config\": {\"address\": \"%s\", \"connections\": %" PRIu32 ", \"requests\": %" PRIu32
+               ", \"mix\": [%" PRIu32 ", %" PRIu32 ", %" PRIu32 ", %" PRIu32 ", %" PRIu32 "], \"zipf\": %.2f}}\n",
+               config.address, config.connections, config.nb_requests,
+               config.mix[LOAD_READ_THUMB], config.mix[LOAD_READ_SMALL], config.mix[LOAD_READ_ORIG],
+               config.mix[LOAD_INSERT], config.mix[LOAD_LIST], config.zipf);
+        ret = run_load();
+    }
+    free_state();
+
+    if(ret) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+        help();
+    }
+    return ret;
+}
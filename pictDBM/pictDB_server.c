@@ -9,12 +9,32 @@
 #include "error.h"
 #include "pictDB.h"
 #include "image_content.h"
+#include "metrics.h"
+#include "pictDBM_tools.h"
+#include "sprite.h"
+#include "trace.h"
 
-#define MAX_QUERY_PARAM 5
+#define MAX_QUERY_PARAM 9
+#define SPRITE_CACHE_SIZE 16 // Number of sprites kept in memory
+#define MAX_BATCH_IDS 256 // Max. number of pictures read by one read_batch call
+#define FIT_RESOLUTION NB_FIT // Fit of a box served by a resolution of the database, not resized
+#define FIT_RESOLUTION_NAME "resolution"
+#define TRACE_FILENAME "pictDB_trace.json" // File written on SIGUSR1 when tracing
+#define GC_IDLE_TIME 30.0 // Seconds without request before the database can be garbage collected
+#define GC_DEFAULT_DEAD_PERCENT 50 // Percentage of dead bytes of the file from which it is garbage collected
+#define GC_MIN_DEAD_BYTES (1 << 20) // Number of dead bytes from which the database is garbage collected
+#define GC_TMP_SUFFIX ".gc" // Suffix of the name of the temporary database of the garbage collection
 
 static const char* http_port = "8000";
 static struct mg_serve_http_opts server_opts;
 static int sig_received = 0;
+static struct pict_sprite sprite_cache[SPRITE_CACHE_SIZE];
+static double last_request_time = 0;
+static int gc_checked = 0;
+static uint32_t gc_checked_version = 0;
+
+// MIME types of the formats of the images, indexed by their codes
+static const char* const FORMAT_MIME_TYPES[NB_FORMATS] = {"image/jpeg", "image/webp", "image/avif"};
 
 static void signal_handler(int sig_num)
 {
@@ -22,6 +42,32 @@ static void signal_handler(int sig_num)
     sig_received = sig_num;
 }
 
+#ifdef PICTDB_TRACE
+static int trace_requested = 0;
+
+static void trace_signal_handler(int sig_num)
+{
+    signal(sig_num, trace_signal_handler);
+    trace_requested = 1;
+}
+
+/**
+ * @brief Writes the recorded spans in TRACE_FILENAME.
+ */
+static void dump_trace_file(void)
+{
+    FILE* f = fopen(TRACE_FILENAME, "w");
+    if(NULL == f || 0 != trace_dump(f)) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ERR_IO]);
+    } else {
+        printf("Trace written in %s\n", TRACE_FILENAME);
+    }
+    if(NULL != f) {
+        fclose(f);
+    }
+}
+#endif
+
 /**
  * @brief Query_string parser
  *
@@ -58,6 +104,7 @@ void split(char* result[], char* tmp, const char* src, const char* delim, size_t
  */
 void mg_error(struct mg_connection* nc, int error)
 {
+    metrics_count_error();
     mg_printf(nc, "HTTP/1.1 500 %s\r\n", ERROR_MESSAGES[error]);
     mg_printf(nc, "Content-Length: %d\r\n\r\n", 0);
     nc->flags |= MG_F_SEND_AND_CLOSE;
@@ -86,16 +133,76 @@ static void handle_list_call(struct mg_connection* nc)
 }
 
 /**
- * @brief get the ID and res (if it exists) in the query_string
+ * @brief Handles metrics call on server, send http message with all
+ *        the metrics in the Prometheus text format.
+ *
+ * @param nc The mongoose connection.
+ */
+static void handle_metrics_call(struct mg_connection* nc)
+{
+    const char* metrics = metrics_format(nc->mgr->user_data);
+    if(metrics == NULL) {
+        mg_error(nc, ERR_IO);
+    } else {
+        size_t size = strlen(metrics);
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n");
+        mg_printf(nc, "Content-Type: text/plain; version=0.0.4\r\n");
+        mg_printf(nc, "Content-Length: %zu\r\n\r\n", size);
+        mg_send(nc, metrics, size);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        free((void*)metrics);
+    }
+}
+
+#ifdef PICTDB_TRACE
+/**
+ * @brief Handles trace call on server, send http message with the
+ *        recorded spans in the Chrome trace format.
+ *
+ * @param nc The mongoose connection.
+ */
+static void handle_trace_call(struct mg_connection* nc)
+{
+    FILE* f = tmpfile();
+    if(NULL == f) {
+        mg_error(nc, ERR_IO);
+        return;
+    }
+    char* trace = NULL;
+    long size = 0;
+    int errCode = trace_dump(f);
+    if(0 == errCode) {
+        errCode = get_image_size(f, &size);
+    }
+    if(0 == errCode) {
+        errCode = read_disk_image(&trace, size, f);
+    }
+    fclose(f);
+    if(0 != errCode) {
+        mg_error(nc, errCode);
+    } else {
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n");
+        mg_printf(nc, "Content-Type: application/json\r\n");
+        mg_printf(nc, "Content-Length: %ld\r\n\r\n", size);
+        mg_send(nc, trace, size);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        free(trace);
+    }
+}
+#endif
+
+/**
+ * @brief get the ID and res (if it exists) in the query_string.
  *
  * @param query_string The mg_string containing the query to parse
+ * @param db_file The database, with its resolutions
  * @param res Pointer to the resolution that will be set if res is found
  * @param id Pointer to the id that will be set if id is found
  */
-static void get_ID_and_RES(struct mg_str query_string, int* res, char** id)
+static void get_ID_and_RES(struct mg_str query_string, const struct pictdb_file* db_file, int* res, char** id)
 {
     // Get image ID and wanted resolution using split function.
-    char* result[MAX_QUERY_PARAM] = {NULL, NULL, NULL, NULL, NULL};
+    char* result[MAX_QUERY_PARAM] = {NULL};
     char tmp[(MAX_PIC_ID + 1) * MAX_QUERY_PARAM] = "";
 
     split(result, tmp, query_string.p, "&=", query_string.len);
@@ -103,7 +210,7 @@ static void get_ID_and_RES(struct mg_str query_string, int* res, char** id)
     for(size_t i = 0; i < MAX_QUERY_PARAM; ++i) {
         if(result[i] != NULL) {
             if(!strcmp(result[i], "res") && (i < MAX_QUERY_PARAM-1) && (NULL != result[i+1])) {
-                *res = resolution_atoi(result[i+1]);
+                *res = resolution_atoi(result[i+1], db_file);
             } else if(!strcmp(result[i], "pict_id") && (i < MAX_QUERY_PARAM-1) && (NULL != result[i+1])) {
                 size_t len = strlen(result[i+1]);
                 *id = calloc(len + 1, sizeof(char));
@@ -117,10 +224,107 @@ static void get_ID_and_RES(struct mg_str query_string, int* res, char** id)
     }
 }
 
+/**
+ * @brief Gets the box of a variant (w, h and fit) in the query_string. The
+ * fit is one of the library (contain, cover or fill), which resizes the
+ * picture to the box, or "resolution", which serves the smallest resolution
+ * of the database filling the box (see fit_resolution) without resizing it.
+ *
+ * @param query_string The mg_string containing the query to parse
+ * @param width Pointer to the width of the box, 0 if w is not found
+ * @param height Pointer to the height of the box, 0 if h is not found
+ * @param fit Pointer to the fit, FIT_CONTAIN if fit is not found, -1 if it is unknown
+ *
+ * @return Returns non zero if the query asks for a variant
+ */
+static int get_variant(const struct mg_str* query_string, uint32_t* width, uint32_t* height, int* fit)
+{
+    char width_str[11] = "";
+    char height_str[11] = "";
+    char fit_str[MAX_RES_NAME + 1] = "";
+    const int has_width = mg_get_http_var(query_string, "w", width_str, sizeof(width_str)) > 0;
+    const int has_height = mg_get_http_var(query_string, "h", height_str, sizeof(height_str)) > 0;
+    const int has_fit = mg_get_http_var(query_string, "fit", fit_str, sizeof(fit_str)) > 0;
+    *width = has_width ? atouint32(width_str) : 0;
+    *height = has_height ? atouint32(height_str) : 0;
+    *fit = !has_fit ? FIT_CONTAIN : !strcmp(FIT_RESOLUTION_NAME, fit_str) ? FIT_RESOLUTION : fit_atoi(fit_str);
+    return has_width || has_height || has_fit;
+}
+
+/**
+ * @brief Tells if the Accept header of a request accepts a media type, named
+ *        explicitly with a non zero quality: the wildcards are not enough
+ *        for the formats other than JPEG.
+ *
+ * @param accept The Accept header
+ * @param type The media type
+ *
+ * @return Returns non zero if the media type is accepted
+ */
+static int accepts_type(const struct mg_str* accept, const char* type)
+{
+    const size_t type_len = strlen(type);
+    const char* end = accept->p + accept->len;
+    for(const char* range = accept->p; range < end; ++range) {
+        while((range < end) && (' ' == *range)) {
+            ++range;
+        }
+        const char* range_end = range;
+        while((range_end < end) && (',' != *range_end)) {
+            ++range_end;
+        }
+        const char* params = range;
+        while((params < range_end) && (';' != *params) && (' ' != *params)) {
+            ++params;
+        }
+        if(((size_t)(params - range) == type_len) && (0 == strncmp(range, type, type_len))) {
+            //The quality is the only parameter of a media range given by the browsers
+            char quality[16] = "";
+            for(const char* q = params; q + 2 < range_end; ++q) {
+                if(0 == strncmp(q, "q=", 2)) {
+                    const size_t len = (size_t)(range_end - q - 2) < sizeof(quality) - 1 ?
+                                       (size_t)(range_end - q - 2) : sizeof(quality) - 1;
+                    strncpy(quality, q + 2, len);
+                    quality[len] = '\0';
+                    return strtod(quality, NULL) > 0;
+                }
+            }
+            return 1;
+        }
+        range = range_end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Chooses the format of the images sent for a request: the most
+ *        compact one accepted by the client and saved by VIPS.
+ *
+ * @param hm The http message of the request.
+ *
+ * @return Returns FORMAT_AVIF, FORMAT_WEBP or FORMAT_JPEG.
+ */
+static int negotiate_format(struct http_message* hm)
+{
+    const struct mg_str* accept = mg_get_http_header(hm, "Accept");
+    for(int format = NB_FORMATS - 1; (NULL != accept) && (format > FORMAT_JPEG); --format) {
+        if(is_format_supported(format) && accepts_type(accept, FORMAT_MIME_TYPES[format])) {
+            return format;
+        }
+    }
+    return FORMAT_JPEG;
+}
 
 /**
  * @brief Handles read call on server, splits http query using split function,
- *        reads and sends the image using do_read.
+ *        reads and sends the image using do_read, or do_read_variant if
+ *        the query gives a box (w, h and fit) instead of a resolution.
+ *        The query gives either res or a box, not both, and a box needs
+ *        w or h (see get_variant).
+ *        The resized images are sent in the format negotiated with the
+ *        Accept header (see negotiate_format) if the database can keep
+ *        them in its derivative cache (see do_read_format), the originals
+ *        as they were inserted.
  *
  * @param nc The mongoose connection.
  * @param hm The http message relative to the event.
@@ -130,7 +334,15 @@ static void handle_read_call(struct mg_connection* nc, struct http_message* hm)
     // Get image ID and wanted resolution using split function.
     int res = -1;
     char* id = NULL;
-    get_ID_and_RES(hm->query_string, &res, &id);
+    get_ID_and_RES(hm->query_string, nc->mgr->user_data, &res, &id);
+    uint32_t width = 0;
+    uint32_t height = 0;
+    int fit = FIT_CONTAIN;
+    const int box = get_variant(&hm->query_string, &width, &height, &fit);
+    const int variant = box && (FIT_RESOLUTION != fit);
+    //res is checked by its presence, so that an unknown name is not replaced by the box
+    char res_name[MAX_RES_NAME + 1] = "";
+    const int has_res = -1 != mg_get_http_var(&hm->query_string, "res", res_name, sizeof(res_name));
 
     // Check pict ID and res, then reads the image using do_read.
     // If all went well send response with image to browser.
@@ -141,22 +353,38 @@ static void handle_read_call(struct mg_connection* nc, struct http_message* hm)
         if(pictIDSize > MAX_PIC_ID || pictIDSize == 0) {
             free(id);
             mg_error(nc, ERR_INVALID_PICID);
-        } else if(res == -1) {
+        } else if(box ? (has_res || (fit == -1) || ((0 == width) && (0 == height))) : (res == -1)) {
             free(id);
             mg_error(nc, ERR_INVALID_ARGUMENT);
         } else {
             char* image_buffer = NULL;
             uint32_t image_size = 0;
-            int errCode = do_read(id, res, &image_buffer, &image_size, nc->mgr->user_data);
+            struct pictdb_file* db_file = nc->mgr->user_data;
+            if(FIT_RESOLUTION == fit) {
+                res = (int) fit_resolution(db_file, width, height);
+            }
+            const int negotiated = variant || ((RES_ORIG != res) && CAN_CACHE_VARIANTS(db_file));
+            int format = FORMAT_JPEG;
+            int errCode = 0;
+            //A format that VIPS fails to save is not negotiated any more
+            do {
+                format = negotiated ? negotiate_format(hm) : FORMAT_JPEG;
+                errCode = variant ?
+                          do_read_variant(id, width, height, fit, format, &image_buffer, &image_size, db_file) :
+                          do_read_format(id, res, format, &image_buffer, &image_size, db_file);
+            } while((ERR_VIPS == errCode) && !is_format_supported(format));
             free(id);
             id = NULL;
             if(0 != errCode) {
                 mg_error(nc, errCode);
             } else {
                 mg_printf(nc, "HTTP/1.1 200 OK\r\n");
-                mg_printf(nc, "Content-Type: image/jpeg\r\n");
+                mg_printf(nc, "Content-Type: %s\r\n", FORMAT_MIME_TYPES[format]);
+                mg_printf(nc, "Vary: Accept\r\n");
                 mg_printf(nc, "Content-Length: %u\r\n\r\n", image_size);
+                TRACE_BEGIN(span, "mg_send");
                 mg_send(nc, image_buffer, image_size);
+                TRACE_END(span);
                 nc->flags |= MG_F_SEND_AND_CLOSE;
                 free(image_buffer);
             }
@@ -164,6 +392,167 @@ static void handle_read_call(struct mg_connection* nc, struct http_message* hm)
     }
 }
 
+/**
+ * @brief Sends a 32 bits unsigned integer in network byte order.
+ *
+ * @param nc The mongoose connection.
+ * @param value The value to send.
+ */
+static void mg_send_uint32(struct mg_connection* nc, uint32_t value)
+{
+    const unsigned char bytes[4] = {
+        (unsigned char)(value >> 24), (unsigned char)(value >> 16),
+        (unsigned char)(value >> 8), (unsigned char) value
+    };
+    mg_send(nc, bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Handles read_batch call on server: the resolution is given in the
+ *        query string and the pict_ids in the POST body, one per line.
+ *        Reads all the images using do_read_batch and sends them in one
+ *        response where each picture is sent as:
+ *        ID length (4 bytes), ID, image size (4 bytes, 0 if not found), image.
+ *        Lengths are in network byte order. A batch of more than
+ *        MAX_BATCH_IDS pictures, or a request other than a POST, is refused.
+ *
+ * @param nc The mongoose connection.
+ * @param hm The http message relative to the event.
+ */
+static void handle_read_batch_call(struct mg_connection* nc, struct http_message* hm)
+{
+    //The IDs are only read from the body of a POST
+    if(0 != mg_vcmp(&hm->method, "POST")) {
+        mg_error(nc, ERR_INVALID_COMMAND);
+        return;
+    }
+    int res = -1;
+    char* id = NULL;
+    get_ID_and_RES(hm->query_string, nc->mgr->user_data, &res, &id);
+    free(id);
+    id = NULL;
+    if(res == -1) {
+        mg_error(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    // Copy the body to split it line by line
+    char* body = calloc(hm->body.len + 1, sizeof(char));
+    if(NULL == body) {
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    memcpy(body, hm->body.p, hm->body.len);
+    size_t nb_ids = 1;
+    for(size_t i = 0; i < hm->body.len; ++i) {
+        if('\n' == body[i]) {
+            ++nb_ids;
+        }
+    }
+    //The blank lines are skipped, the batch may still fit
+    if(nb_ids > MAX_BATCH_IDS) {
+        nb_ids = MAX_BATCH_IDS;
+    }
+    const char** ids = calloc(nb_ids, sizeof(char*));
+    char** image_buffers = calloc(nb_ids, sizeof(char*));
+    uint32_t* image_sizes = calloc(nb_ids, sizeof(uint32_t));
+    if((NULL == ids) || (NULL == image_buffers) || (NULL == image_sizes)) {
+        free(ids);
+        free(image_buffers);
+        free(image_sizes);
+        free(body);
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+
+    int errCode = 0;
+    nb_ids = 0;
+    for(char* line = strtok(body, "\r\n"); (NULL != line) && (0 == errCode); line = strtok(NULL, "\r\n")) {
+        if(strlen(line) > MAX_PIC_ID) {
+            errCode = ERR_INVALID_PICID;
+        } else if(nb_ids >= MAX_BATCH_IDS) {
+            errCode = ERR_INVALID_ARGUMENT;
+        } else {
+            ids[nb_ids] = line;
+            ++nb_ids;
+        }
+    }
+
+    if(0 == errCode) {
+        errCode = do_read_batch(ids, nb_ids, res, image_buffers, image_sizes, nc->mgr->user_data);
+    }
+    if(0 != errCode) {
+        mg_error(nc, errCode);
+    } else {
+        size_t content_length = 0;
+        for(size_t i = 0; i < nb_ids; ++i) {
+            content_length += 2 * sizeof(uint32_t) + strlen(ids[i]) + image_sizes[i];
+        }
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n");
+        mg_printf(nc, "Content-Type: application/octet-stream\r\n");
+        mg_printf(nc, "Content-Length: %zu\r\n\r\n", content_length);
+        TRACE_BEGIN(span, "mg_send");
+        for(size_t i = 0; i < nb_ids; ++i) {
+            mg_send_uint32(nc, strlen(ids[i]));
+            mg_send(nc, ids[i], strlen(ids[i]));
+            mg_send_uint32(nc, image_sizes[i]);
+            if(NULL != image_buffers[i]) {
+                mg_send(nc, image_buffers[i], image_sizes[i]);
+                free(image_buffers[i]);
+            }
+        }
+        TRACE_END(span);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+    free(ids);
+    free(image_buffers);
+    free(image_sizes);
+    free(body);
+}
+
+/**
+ * @brief Handles sprite and sprite_map calls on server: gets the sprite of the
+ *        page given in the query string from the cache (regenerated if the
+ *        database changed) and sends either the JPEG sprite or its JSON map.
+ *
+ * @param nc The mongoose connection.
+ * @param hm The http message relative to the event.
+ * @param send_map Sends the JSON map if non zero, the JPEG sprite otherwise.
+ */
+static void handle_sprite_call(struct mg_connection* nc, struct http_message* hm, int send_map)
+{
+    char page_str[11] = "";
+    if(mg_get_http_var(&hm->query_string, "page", page_str, sizeof(page_str)) <= 0) {
+        mg_error(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
+    const uint32_t page = atouint32(page_str);
+    if(0 == page && ERANGE == errno) {
+        mg_error(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    const struct pict_sprite* sprite = NULL;
+    int errCode = get_cached_sprite(sprite_cache, SPRITE_CACHE_SIZE, page, DEFAULT_SPRITE_PAGE_SIZE,
+                                    &sprite, nc->mgr->user_data);
+    if(0 != errCode) {
+        mg_error(nc, errCode);
+    } else if(send_map) {
+        size_t size = strlen(sprite->map);
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n");
+        mg_printf(nc, "Content-Type: application/json\r\n");
+        mg_printf(nc, "Content-Length: %zu\r\n\r\n", size);
+        mg_send(nc, sprite->map, size);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    } else {
+        mg_printf(nc, "HTTP/1.1 200 OK\r\n");
+        mg_printf(nc, "Content-Type: image/jpeg\r\n");
+        mg_printf(nc, "Content-Length: %zu\r\n\r\n", sprite->image_size);
+        mg_send(nc, sprite->image, sprite->image_size);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+}
+
 /**
  * @brief Handles insert call on server, retrieve image name and content within the POST
  * information using mg_parse_multipart and then call do_insert to add the image into the
@@ -206,7 +595,7 @@ static void handle_delete_call(struct mg_connection* nc, struct http_message* hm
 {
     int res = -1;
     char* id = NULL;
-    get_ID_and_RES(hm->query_string, &res, &id);
+    get_ID_and_RES(hm->query_string, nc->mgr->user_data, &res, &id);
 
     // Check pict ID, then reads the image using do_read.
     // If all went well send response with image to browser.
@@ -233,23 +622,117 @@ static void handle_delete_call(struct mg_connection* nc, struct http_message* hm
     }
 }
 
+/**
+ * @brief Garbage collects the database once the server is idle for
+ * GC_IDLE_TIME, if its dead bytes reach the threshold, then opens it again.
+ * The dead bytes are checked once per version of the database.
+ *
+ * @param mgr The mongoose manager, whose user data is the database.
+ * @param db_filename The name of the database.
+ * @param dead_percent The percentage of dead bytes of the file from which
+ *        the database is garbage collected, 0 to never collect it.
+ *
+ * @return Returns 0 in case of success
+ */
+static int collect_when_idle(struct mg_mgr* mgr, const char* db_filename, uint32_t dead_percent)
+{
+    struct pictdb_file* db_file = mgr->user_data;
+    if((0 == dead_percent) || (metrics_now() - last_request_time < GC_IDLE_TIME) ||
+       (gc_checked && (gc_checked_version == db_file->header.db_version))) {
+        return 0;
+    }
+    gc_checked = 1;
+    gc_checked_version = db_file->header.db_version;
+    if(!needs_gbcollect(db_file, dead_percent / 100.0, GC_MIN_DEAD_BYTES)) {
+        return 0;
+    }
+
+    char tmpdb_filename[FILENAME_MAX];
+    if(snprintf(tmpdb_filename, sizeof(tmpdb_filename), "%s%s", db_filename, GC_TMP_SUFFIX) >=
+       (int) sizeof(tmpdb_filename)) {
+        return ERR_INVALID_FILENAME;
+    }
+    int errorCode = do_gbcollect(db_file, db_filename, tmpdb_filename);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    //The indexes of the pictures changed: the sprites are generated again
+    for(size_t i = 0; i < SPRITE_CACHE_SIZE; ++i) {
+        free_sprite(&sprite_cache[i]);
+    }
+    do_close(db_file);
+    errorCode = do_open_lazy(db_filename, "rb+", db_file);
+    if(0 == errorCode) {
+        errorCode = open_direct_reads(db_file, db_filename);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    gc_checked_version = db_file->header.db_version;
+    printf("Garbage collected %s\n", db_filename);
+    return 0;
+}
+
 static void ev_handler(struct mg_connection* nc, int ev, void* event_data)
 {
     struct http_message* hm = (struct http_message*) event_data;
     switch(ev) {
-    case MG_EV_HTTP_REQUEST:
+    case MG_EV_ACCEPT:
+        metrics_update_connections(1);
+        break;
+    case MG_EV_CLOSE:
+        // The listening connection is closed too when the server stops
+        if(NULL != nc->listener) {
+            metrics_update_connections(-1);
+        }
+        break;
+    case MG_EV_SEND: {
+        // Mongoose gives -1 when the send failed or would block
+        const int sent = *(int*) event_data;
+        if(sent > 0) {
+            metrics_add_bytes_served((size_t) sent);
+        }
+        break;
+    }
+    case MG_EV_HTTP_REQUEST: {
+        TRACE_BEGIN(span, "http_request");
+        last_request_time = metrics_now();
         if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
+            metrics_count_request(ROUTE_LIST);
             handle_list_call(nc);
         } else if(mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
+            metrics_count_request(ROUTE_READ);
             handle_read_call(nc, hm);
+        } else if(mg_vcmp(&hm->uri, "/pictDB/read_batch") == 0) {
+            metrics_count_request(ROUTE_READ_BATCH);
+            handle_read_batch_call(nc, hm);
+        } else if(mg_vcmp(&hm->uri, "/pictDB/sprite") == 0) {
+            metrics_count_request(ROUTE_SPRITE);
+            handle_sprite_call(nc, hm, 0);
+        } else if(mg_vcmp(&hm->uri, "/pictDB/sprite_map") == 0) {
+            metrics_count_request(ROUTE_SPRITE_MAP);
+            handle_sprite_call(nc, hm, 1);
         } else if(mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
+            metrics_count_request(ROUTE_INSERT);
             handle_insert_call(nc, hm);
         } else if(mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
+            metrics_count_request(ROUTE_DELETE);
             handle_delete_call(nc, hm);
+        } else if(mg_vcmp(&hm->uri, "/metrics") == 0) {
+            metrics_count_request(ROUTE_METRICS);
+            handle_metrics_call(nc);
+#ifdef PICTDB_TRACE
+        } else if(mg_vcmp(&hm->uri, "/pictDB/trace") == 0) {
+            metrics_count_request(ROUTE_TRACE);
+            handle_trace_call(nc);
+#endif
         } else {
+            metrics_count_request(ROUTE_STATIC);
             mg_serve_http(nc, hm, server_opts); /* Serve static content */
         }
+        TRACE_END(span);
         break;
+    }
     default:
         break;
     }
@@ -258,11 +741,28 @@ static void ev_handler(struct mg_connection* nc, int ev, void* event_data)
 int main(int args, char* argv[])
 {
     int ret = 0;
-    if(args != 2) {
+    uint32_t dead_percent = GC_DEFAULT_DEAD_PERCENT;
+    //The settings of VIPS follow the percentage of dead bytes
+    struct vips_settings settings;
+    init_vips_settings(&settings);
+    int arg = 2;
+    if((arg < args) && strncmp(VIPS_OPTION_PREFIX, argv[arg], strlen(VIPS_OPTION_PREFIX))) {
+        if(((0 == (dead_percent = atouint32(argv[arg]))) && (ERANGE == errno)) || (dead_percent > 100)) {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+        ++arg;
+    }
+    for(; (0 == ret) && (arg < args); arg += 2) {
+        ret = (arg + 1 < args) ? parse_vips_option(argv[arg], argv[arg + 1], &settings) : ERR_INVALID_ARGUMENT;
+    }
+
+    if((args < 2) || (0 != ret)) {
         ret = ERR_INVALID_ARGUMENT;
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
     } else if(VIPS_INIT(argv[0])) {
         ret = ERR_VIPS;
     } else {
+        apply_vips_settings(&settings);
         // Skip program name
         argv++;
         args--;
@@ -271,18 +771,28 @@ int main(int args, char* argv[])
         char* db_filename = argv[0];
         TEST_FILENAME(db_filename);
         struct pictdb_file db_file;
-        ret = do_open(db_filename, "rb+", &db_file);
+        ret = do_open_lazy(db_filename, "rb+", &db_file);
+        //The original images of an aligned database are read without the page cache
+        if(0 == ret) {
+            ret = open_direct_reads(&db_file, db_filename);
+            if(0 != ret) {
+                do_close(&db_file);
+            }
+        }
         if(0 != ret) {
             vips_shutdown();
             fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
         } else {
-            print_header(&db_file.header);
+            print_header(&db_file.header, &db_file.resolutions);
 
             // Server part:
             struct mg_mgr mgr;
             struct mg_connection* nc;
             signal(SIGTERM, signal_handler);
             signal(SIGINT, signal_handler);
+#ifdef PICTDB_TRACE
+            signal(SIGUSR1, trace_signal_handler);
+#endif
             mg_mgr_init(&mgr, &db_file);
 
             nc = mg_bind(&mgr, http_port, ev_handler);
@@ -298,13 +808,33 @@ int main(int args, char* argv[])
             server_opts.document_root = ".";  // Serve current directory
             printf("Starting PictDB_server on port %s\n", http_port);
 
+            last_request_time = metrics_now();
             while (!sig_received) {
                 mg_mgr_poll(&mgr, 1000);
+                ret = collect_when_idle(&mgr, db_filename, dead_percent);
+                if(0 != ret) {
+                    fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+                    //The database is closed if it could not be opened again
+                    if(NULL == db_file.fpdb) {
+                        break;
+                    }
+                    ret = 0;
+                }
+#ifdef PICTDB_TRACE
+                if(trace_requested) {
+                    trace_requested = 0;
+                    dump_trace_file();
+                }
+#endif
+            }
+            for(size_t i = 0; i < SPRITE_CACHE_SIZE; ++i) {
+                free_sprite(&sprite_cache[i]);
             }
             do_close(&db_file);
             mg_mgr_free(&mgr);
             vips_shutdown();
-            return 0;
+            return ret;
         }
     }
+    return ret;
 }
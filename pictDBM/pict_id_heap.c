@@ -0,0 +1,233 @@
+/**
+ * @file pict_id_heap.c
+ * @brief pictDB library: string heap of the pictures' IDs
+ *
+ * The IDs are only appended to the heap: the IDs of the deleted pictures
+ * stay in it until the database is garbage collected.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+/********************************************************************//**
+ * ID of a picture.
+ */
+const char* get_pict_id(const struct pictdb_file* db_file, size_t index)
+{
+    return &db_file->ids[db_file->metadata[index].id_offset];
+}
+
+/********************************************************************//**
+ * Allocates an empty string heap located right after the table of the free
+ * extents.
+ */
+int init_pict_id_heap(struct pictdb_file* db_file, uint32_t capacity)
+{
+    if((NULL == db_file) || (0 == capacity)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    db_file->ids = calloc(capacity, sizeof(char));
+    if(NULL == db_file->ids) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_file->heap.offset = db_file->blob_table.offset + BLOB_TABLE_AREA_SIZE(db_file->header.max_files);
+    //The first byte is the ID of the empty metadata
+    db_file->heap.size = 1;
+    db_file->heap.capacity = capacity;
+    return 0;
+}
+
+/********************************************************************//**
+ * Tests if the ID of a metadata read from the file is in the string heap.
+ */
+int check_pict_id(const struct pictdb_file* db_file, struct pict_metadata* metadata)
+{
+    if(((uint64_t) metadata->id_offset + metadata->id_length >= db_file->heap.size) ||
+       ('\0' != db_file->ids[metadata->id_offset + metadata->id_length])) {
+        if(NON_EMPTY == metadata->is_valid) {
+            return ERR_IO;
+        }
+        metadata->id_offset = 0;
+        metadata->id_length = 0;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Frees the content of the string heap.
+ */
+void free_pict_id_heap(struct pictdb_file* db_file)
+{
+    free(db_file->ids);
+    db_file->ids = NULL;
+}
+
+/********************************************************************//**
+ * Reads the location and the content of the string heap.
+ */
+int read_pict_id_heap(struct pictdb_file* db_file)
+{
+    if(1 != fread(&db_file->heap, sizeof(struct pict_id_heap), 1, db_file->fpdb)) {
+        return ERR_IO;
+    }
+    if((0 == db_file->heap.size) || (db_file->heap.size > db_file->heap.capacity)) {
+        return ERR_IO;
+    }
+    db_file->ids = calloc(db_file->heap.capacity, sizeof(char));
+    if(NULL == db_file->ids) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const long position = ftell(db_file->fpdb);
+    if((-1 == position) || (0 != fseek(db_file->fpdb, db_file->heap.offset, SEEK_SET)) ||
+       (1 != fread(db_file->ids, db_file->heap.size, 1, db_file->fpdb)) ||
+       (0 != fseek(db_file->fpdb, position, SEEK_SET))) {
+        free_pict_id_heap(db_file);
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the location of the string heap.
+ *
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+static int write_heap_location(const struct pictdb_file* db_file)
+{
+    if(0 != fseek(db_file->fpdb, sizeof(struct pictdb_header), SEEK_SET)) {
+        return ERR_IO;
+    }
+    if(1 != fwrite(&db_file->heap, sizeof(struct pict_id_heap), 1, db_file->fpdb)) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the location and the whole region of the string heap.
+ */
+int write_pict_id_heap(const struct pictdb_file* db_file)
+{
+    //The whole capacity is written so that no picture is appended in it
+    if((0 != fseek(db_file->fpdb, db_file->heap.offset, SEEK_SET)) ||
+       (1 != fwrite(db_file->ids, db_file->heap.capacity, 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return write_heap_location(db_file);
+}
+
+/**
+ * @brief Moves the string heap and the hash tables at the end of the
+ * database file with a bigger capacity.
+ *
+ * @param db_file The database
+ * @param capacity The new capacity
+ *
+ * @return Returns 0 in case of success
+ */
+static int grow_pict_id_heap(struct pictdb_file* db_file, uint32_t capacity)
+{
+    char* ids = realloc(db_file->ids, capacity);
+    if(NULL == ids) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memset(&ids[db_file->heap.capacity], 0, capacity - db_file->heap.capacity);
+    db_file->ids = ids;
+
+    if(0 != fseek(db_file->fpdb, 0L, SEEK_END)) {
+        return ERR_IO;
+    }
+    const long offset = ftell(db_file->fpdb);
+    if(-1 == offset) {
+        return ERR_IO;
+    }
+    const struct pict_id_heap old_heap = db_file->heap;
+    db_file->heap.offset = offset;
+    db_file->heap.capacity = capacity;
+    //The hash tables follow the heap: they are written before its new location
+    int errorCode = (NULL != db_file->buckets) ? write_hash_index(db_file) : 0;
+    if(0 == errorCode) {
+        errorCode = write_pict_id_heap(db_file);
+    }
+    if(0 != errorCode) {
+        db_file->heap = old_heap;
+        return errorCode;
+    }
+    //The old region of the heap and of the hash tables is written again by the new images
+    const uint64_t old_size = old_heap.capacity + ((NULL != db_file->buckets) ? HASH_INDEX_SIZE(db_file->nb_buckets) : 0);
+    db_file->header.dead_bytes += old_size;
+    return add_free_extent(db_file, old_heap.offset, old_size);
+}
+
+/********************************************************************//**
+ * Adds an ID at the end of the string heap.
+ */
+int append_pict_id(struct pictdb_file* db_file, const char* pictID, struct pict_metadata* metadata)
+{
+    if((NULL == db_file) || (NULL == pictID) || (NULL == metadata)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    size_t length = 0;
+    while((length < MAX_PIC_ID) && ('\0' != pictID[length])) {
+        ++length;
+    }
+    const uint64_t size = (uint64_t) db_file->heap.size + length + 1;
+    if(size > UINT32_MAX) {
+        return ERR_FULL_DATABASE;
+    }
+    if(size > db_file->heap.capacity) {
+        uint64_t capacity = 2 * (uint64_t) db_file->heap.capacity;
+        if(capacity > UINT32_MAX) {
+            capacity = UINT32_MAX;
+        }
+        const int errorCode = grow_pict_id_heap(db_file, capacity > size ? capacity : size);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+    }
+    memcpy(&db_file->ids[db_file->heap.size], pictID, length);
+    db_file->ids[db_file->heap.size + length] = '\0';
+    metadata->id_offset = db_file->heap.size;
+    metadata->id_length = length;
+    db_file->heap.size = size;
+    return 0;
+}
+
+/********************************************************************//**
+ * Adds the ID of a picture at the end of the string heap.
+ */
+int set_pict_id(struct pictdb_file* db_file, size_t index, const char* pictID)
+{
+    if((NULL == db_file) || (index >= db_file->header.max_files)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return append_pict_id(db_file, pictID, &db_file->metadata[index]);
+}
+
+/********************************************************************//**
+ * Removes the ID added by set_pict_id.
+ */
+void cancel_pict_id(struct pictdb_file* db_file, size_t index)
+{
+    if(db_file->metadata[index].id_offset + db_file->metadata[index].id_length + 1 == db_file->heap.size) {
+        db_file->heap.size = db_file->metadata[index].id_offset;
+    }
+    db_file->metadata[index].id_offset = 0;
+    db_file->metadata[index].id_length = 0;
+}
+
+/********************************************************************//**
+ * Writes the ID of a picture and the size of the string heap.
+ */
+int write_pict_id(const struct pictdb_file* db_file, size_t index)
+{
+    const struct pict_metadata* metadata = &db_file->metadata[index];
+    if((0 != fseek(db_file->fpdb, db_file->heap.offset + metadata->id_offset, SEEK_SET)) ||
+       (1 != fwrite(&db_file->ids[metadata->id_offset], metadata->id_length + 1, 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return write_heap_location(db_file);
+}
@@ -0,0 +1,405 @@
+/**
+ * @file pregen.c
+ * @brief pictDB library: do_pregen implementation
+ *
+ * The workers take the blobs to resize one at a time, read their original
+ * and resize it with VIPS into each missing resolution; the resized images
+ * are queued to the calling thread, the only one writing in the database.
+ * The queue is bounded so that the memory used does not depend on the
+ * number of pictures when the disk is slower than the workers.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#define _POSIX_C_SOURCE 200809L // for the POSIX threads
+
+#include "pregen.h"
+#include "image_content.h"
+#include "metrics.h"
+#include "trace.h"
+#include <pthread.h>
+
+#define PREGEN_QUEUE_PER_WORKER 2 // Max. number of resized images queued per worker
+
+/**
+ * @brief One blob to resize
+ *
+ * index Index of a picture referencing the blob
+ * dims Bitset of the resolutions to create
+ * offset Offset of the original image, the blobs are read in this order
+ */
+struct pregen_job {
+    size_t index;
+    uint32_t dims;
+    uint64_t offset;
+};
+
+/**
+ * @brief One resized image waiting to be stored
+ *
+ * index Index of a picture referencing the blob
+ * dim Resolution of the image
+ * buffer The image, allocated by VIPS
+ * size The size of the image
+ * start Time at which its resize started (from metrics_now)
+ * next Next image of the queue
+ */
+struct pregen_image {
+    size_t index;
+    size_t dim;
+    void* buffer;
+    size_t size;
+    double start;
+    struct pregen_image* next;
+};
+
+/**
+ * @brief State shared by the workers and the appender
+ *
+ * lock Protects the jobs, the queue, nb_running and errorCode
+ * io_lock Serializes the accesses to the database file
+ * ready Signaled when an image is queued or a worker ends
+ * room Signaled when an image is dequeued or the workers must stop
+ * jobs The blobs to resize
+ * nb_jobs The number of blobs to resize
+ * next_job Index of the next blob to resize
+ * first First image of the queue, NULL if it is empty
+ * last Last image of the queue
+ * nb_queued Number of images in the queue
+ * max_queued Max. number of images in the queue
+ * nb_running Number of workers not ended yet
+ * errorCode First error, which stops the workers
+ * db_file The database
+ */
+struct pregen_pool {
+    pthread_mutex_t lock;
+    pthread_mutex_t io_lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    struct pregen_job* jobs;
+    size_t nb_jobs;
+    size_t next_job;
+    struct pregen_image* first;
+    struct pregen_image* last;
+    size_t nb_queued;
+    size_t max_queued;
+    size_t nb_running;
+    int errorCode;
+    struct pictdb_file* db_file;
+};
+
+/**
+ * @brief qsort comparator ordering the jobs by offset of their original
+ */
+static int cmp_job_offset(const void* a, const void* b)
+{
+    const uint64_t offset_a = ((const struct pregen_job*) a)->offset;
+    const uint64_t offset_b = ((const struct pregen_job*) b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/**
+ * @brief Frees a resized image and its buffer
+ */
+static void free_pregen_image(struct pregen_image* image)
+{
+    if(NULL != image->buffer) {
+        g_free(image->buffer);
+    }
+    free(image);
+}
+
+/**
+ * @brief Lists the blobs with missing images in the wanted resolutions, in
+ * the order of their originals in the file.
+ *
+ * @param wanted Bitset of the wanted resolutions
+ * @param pool The pool, whose jobs are allocated and filled
+ * @param total Pointer to store the number of images to create
+ *
+ * @return Returns 0 in case of success
+ */
+static int list_jobs(uint32_t wanted, struct pregen_pool* pool, size_t* total)
+{
+    const struct pictdb_file* db_file = pool->db_file;
+    const size_t max_files = db_file->header.max_files;
+    pool->jobs = calloc(max_files, sizeof(struct pregen_job));
+    //Tells for each blob if it is already listed, for the duplicates
+    uint8_t* listed = calloc(max_files, sizeof(uint8_t));
+    if((NULL == pool->jobs) || (NULL == listed)) {
+        free(listed);
+        return ERR_OUT_OF_MEMORY;
+    }
+    *total = 0;
+    for(size_t index = next_valid_index(db_file, 0); index < max_files; index = next_valid_index(db_file, index + 1)) {
+        const size_t blob = db_file->metadata[index].blob;
+        if(0 != listed[blob]) {
+            continue;
+        }
+        listed[blob] = 1;
+        struct pregen_job* job = &pool->jobs[pool->nb_jobs];
+        job->index = index;
+        job->offset = db_file->blobs[blob].offset[RES_ORIG];
+        for(size_t dim = 0; dim < db_file->resolutions.nb_res; ++dim) {
+            if((0 != (wanted & (UINT32_C(1) << dim))) && (0 == get_pict_image_size(db_file, index, dim))) {
+                job->dims |= UINT32_C(1) << dim;
+                ++*total;
+            }
+        }
+        if(0 != job->dims) {
+            ++pool->nb_jobs;
+        }
+    }
+    free(listed);
+    qsort(pool->jobs, pool->nb_jobs, sizeof(struct pregen_job), cmp_job_offset);
+    return 0;
+}
+
+/**
+ * @brief Records the first error of the workers or the appender and wakes
+ * up the workers waiting for room in the queue. The lock must be held.
+ */
+static void stop_pool(struct pregen_pool* pool, int errorCode)
+{
+    if(0 == pool->errorCode) {
+        pool->errorCode = errorCode;
+    }
+    pthread_cond_broadcast(&pool->room);
+}
+
+/**
+ * @brief Queues a resized image for the appender, waiting for room in the
+ * queue. The image is freed if the workers are stopped.
+ *
+ * @param pool The pool
+ * @param image The resized image
+ *
+ * @return Returns 0 in case of success, the error stopping the workers otherwise
+ */
+static int queue_image(struct pregen_pool* pool, struct pregen_image* image)
+{
+    pthread_mutex_lock(&pool->lock);
+    while((0 == pool->errorCode) && (pool->nb_queued >= pool->max_queued)) {
+        pthread_cond_wait(&pool->room, &pool->lock);
+    }
+    const int errorCode = pool->errorCode;
+    if(0 == errorCode) {
+        if(NULL == pool->first) {
+            pool->first = image;
+        } else {
+            pool->last->next = image;
+        }
+        pool->last = image;
+        ++pool->nb_queued;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if(0 != errorCode) {
+        free_pregen_image(image);
+    }
+    return errorCode;
+}
+
+/**
+ * @brief Reads the original of a blob once and queues its images resized
+ * into each resolution of the job.
+ *
+ * @param pool The pool
+ * @param job The blob to resize
+ *
+ * @return Returns 0 in case of success
+ */
+static int resize_job(struct pregen_pool* pool, const struct pregen_job* job)
+{
+    double start = metrics_now();
+    char* original = NULL;
+    pthread_mutex_lock(&pool->io_lock);
+    int errorCode = read_db_file_image(&original, job->index, RES_ORIG, pool->db_file);
+    pthread_mutex_unlock(&pool->io_lock);
+    for(size_t dim = 0; (dim < NB_RES) && (0 == errorCode); ++dim) {
+        if(0 == (job->dims & (UINT32_C(1) << dim))) {
+            continue;
+        }
+        struct pregen_image* image = calloc(1, sizeof(struct pregen_image));
+        if(NULL == image) {
+            errorCode = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        image->index = job->index;
+        image->dim = dim;
+        image->start = start;
+        //Only the resize runs without a lock
+        errorCode = resize_and_save_image(original, job->index, dim, pool->db_file, &image->buffer, &image->size);
+        if(0 == errorCode) {
+            errorCode = queue_image(pool, image);
+        } else {
+            free_pregen_image(image);
+        }
+        start = metrics_now();
+    }
+    free(original);
+    return errorCode;
+}
+
+/**
+ * @brief Main function of the workers: resizes the blobs of the jobs left
+ * until there is none or an error occurs.
+ *
+ * @param arg The pool
+ *
+ * @return Returns NULL
+ */
+static void* pregen_worker(void* arg)
+{
+    struct pregen_pool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while((0 == pool->errorCode) && (pool->next_job < pool->nb_jobs)) {
+        const struct pregen_job* job = &pool->jobs[pool->next_job];
+        ++pool->next_job;
+        pthread_mutex_unlock(&pool->lock);
+        const int errorCode = resize_job(pool, job);
+        pthread_mutex_lock(&pool->lock);
+        if(0 != errorCode) {
+            stop_pool(pool, errorCode);
+        }
+    }
+    --pool->nb_running;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    //Frees the buffers kept by VIPS for this thread
+    vips_thread_shutdown();
+    return NULL;
+}
+
+/**
+ * @brief Stores the resized images queued by the workers until they have
+ * all ended. After an error, the images queued are only freed.
+ *
+ * @param pool The pool
+ * @param total The number of images to create
+ * @param progress The function called after each stored image (can be NULL)
+ * @param nb_created Pointer to store the number of images created
+ */
+static void append_images(struct pregen_pool* pool, size_t total, pregen_progress progress, size_t* nb_created)
+{
+    const double start = metrics_now();
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        while((NULL == pool->first) && (0 != pool->nb_running)) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        struct pregen_image* image = pool->first;
+        if(NULL != image) {
+            pool->first = image->next;
+            --pool->nb_queued;
+            pthread_cond_signal(&pool->room);
+        }
+        const int stopped = 0 != pool->errorCode;
+        pthread_mutex_unlock(&pool->lock);
+        if(NULL == image) {
+            return;
+        }
+
+        if(!stopped) {
+            pthread_mutex_lock(&pool->io_lock);
+            const int errorCode = store_resized_image(image->buffer, image->size, image->index, image->dim, pool->db_file);
+            pthread_mutex_unlock(&pool->io_lock);
+            if(0 != errorCode) {
+                pthread_mutex_lock(&pool->lock);
+                stop_pool(pool, errorCode);
+                pthread_mutex_unlock(&pool->lock);
+            } else {
+                ++*nb_created;
+                metrics_observe(OP_LAZILY_RESIZE, image->start);
+                if(NULL != progress) {
+                    progress(*nb_created, total, metrics_now() - start);
+                }
+            }
+        }
+        free_pregen_image(image);
+    }
+}
+
+/**
+ * @brief Creates the missing resized images with a pool of workers, see
+ * do_pregen.
+ */
+static int pregenerate(const size_t dims[], size_t nb_dims, size_t nb_workers, pregen_progress progress,
+                       size_t* nb_created, struct pictdb_file* db_file)
+{
+    if((NULL == dims) || (NULL == nb_created) || (NULL == db_file) ||
+       (0 == nb_workers) || (nb_workers > MAX_PREGEN_WORKERS)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *nb_created = 0;
+    uint32_t wanted = 0;
+    for(size_t i = 0; i < nb_dims; ++i) {
+        if(!IS_DB_RES(db_file, dims[i])) {
+            return ERR_RESOLUTIONS;
+        }
+        if(RES_ORIG != dims[i]) {
+            wanted |= UINT32_C(1) << dims[i];
+        }
+    }
+    int errorCode = load_metadata(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    struct pregen_pool pool;
+    memset(&pool, 0, sizeof(struct pregen_pool));
+    pool.db_file = db_file;
+    size_t total = 0;
+    errorCode = list_jobs(wanted, &pool, &total);
+    if((0 != errorCode) || (0 == pool.nb_jobs)) {
+        free(pool.jobs);
+        return errorCode;
+    }
+    if(nb_workers > pool.nb_jobs) {
+        nb_workers = pool.nb_jobs;
+    }
+    pool.max_queued = PREGEN_QUEUE_PER_WORKER * nb_workers;
+    pool.nb_running = nb_workers;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_mutex_init(&pool.io_lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.room, NULL);
+
+    pthread_t workers[MAX_PREGEN_WORKERS];
+    size_t nb_started = 0;
+    for(; nb_started < nb_workers; ++nb_started) {
+        if(0 != pthread_create(&workers[nb_started], NULL, pregen_worker, &pool)) {
+            break;
+        }
+    }
+    //The workers that could not be started are not waited for
+    pthread_mutex_lock(&pool.lock);
+    pool.nb_running -= nb_workers - nb_started;
+    if(0 == nb_started) {
+        pool.errorCode = ERR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    append_images(&pool, total, progress, nb_created);
+    for(size_t i = 0; i < nb_started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.ready);
+    pthread_mutex_destroy(&pool.io_lock);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.jobs);
+    return pool.errorCode;
+}
+
+/********************************************************************//**
+ * Creates the missing resized images of all the pictures.
+ */
+int do_pregen(const size_t dims[], size_t nb_dims, size_t nb_workers, pregen_progress progress,
+              size_t* nb_created, struct pictdb_file* db_file)
+{
+    TRACE_BEGIN(span, "do_pregen");
+    const int errorCode = pregenerate(dims, nb_dims, nb_workers, progress, nb_created, db_file);
+    TRACE_END(span);
+    return errorCode;
+}
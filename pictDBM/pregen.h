@@ -0,0 +1,47 @@
+/**
+ * @file pregen.h
+ * @brief pictDB library: pre-generation of the resized images.
+ *
+ * After a bulk import, the resized images are all missing and would be
+ * created one by one on their first read. The pre-generation creates them
+ * in advance with a pool of workers resizing with VIPS in parallel, while
+ * a single appender (the calling thread) stores them in the database.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+#ifndef PICTDBPRJ_PREGEN_H
+#define PICTDBPRJ_PREGEN_H
+
+#include "pictDB.h"
+
+#define DEFAULT_PREGEN_WORKERS 4 // Default number of workers resizing the images
+#define MAX_PREGEN_WORKERS 64 // Max. number of workers resizing the images
+
+/**
+ * @brief Function called by the pre-generation after each stored image.
+ *
+ * @param done The number of images stored
+ * @param total The number of images to create
+ * @param seconds The time elapsed since the beginning
+ */
+typedef void (*pregen_progress)(size_t done, size_t total, double seconds);
+
+/**
+ * @brief Creates the missing resized images of all the pictures in some
+ * resolutions. Each blob is resized once for its duplicates, its original
+ * being read once for all the resolutions. The workers stop at the first
+ * error, the images already stored are kept.
+ *
+ * @param dims The resolutions to create (RES_ORIG is ignored)
+ * @param nb_dims The number of resolutions
+ * @param nb_workers The number of workers, from 1 to MAX_PREGEN_WORKERS
+ * @param progress The function called after each stored image (can be NULL)
+ * @param nb_created Pointer to store the number of images created
+ * @param db_file The database, opened for writing
+ *
+ * @return Returns 0 in case of success
+ */
+int do_pregen(const size_t dims[], size_t nb_dims, size_t nb_workers, pregen_progress progress,
+              size_t* nb_created, struct pictdb_file* db_file);
+
+#endif //PICTDBPRJ_PREGEN_H
@@ -0,0 +1,182 @@
+/**
+ * @file resolutions.c
+ * @brief pictDB library: table of the resolutions of the images
+ *
+ * Every database has the thumbnails, the small images and the originals;
+ * the other resolutions are named when the database is created, and each
+ * blob has an image for each of them, resized when first read and encoded
+ * as set for its resolution. The table follows the free extents, so that
+ * it is moved with the blob table and its size does not move the metadata
+ * of the older format versions.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+
+// Position of the table of the resolutions in the database file
+#define RESOLUTION_TABLE_OFFSET(db_file) \
+    ((db_file)->blob_table.offset + BLOB_TABLE_SIZE((db_file)->header.max_files) + \
+     EXTENT_TABLE_SIZE((db_file)->header.max_files))
+
+// Names of the resolutions of every database, indexed by their internal codes
+static const char* const DEFAULT_RES_NAMES[NB_DEFAULT_RES] = {"thumb", "small", "orig"};
+
+/********************************************************************//**
+ * Initialises the table with the resolutions of every database.
+ */
+void init_resolution_table(struct pictdb_file* db_file)
+{
+    struct pict_resolution_table* table = &db_file->resolutions;
+    memset(table, 0, sizeof(struct pict_resolution_table));
+    table->nb_res = NB_DEFAULT_RES;
+    for(size_t res = 0; res < NB_DEFAULT_RES; ++res) {
+        strncpy(table->resolutions[res].name, DEFAULT_RES_NAMES[res], MAX_RES_NAME);
+    }
+    //The named resolutions keep the encoding set here
+    for(size_t res = 0; res < NB_RES; ++res) {
+        table->resolutions[res].encoding.quality = DEFAULT_QUALITY;
+        table->resolutions[res].encoding.flags = DEFAULT_ENCODING_FLAGS;
+        table->resolutions[res].encoding.subsample = SUBSAMPLE_AUTO;
+    }
+    table->resolutions[RES_THUMB].res[DIM_X_ORIG] = db_file->header.res_resized[DIM_X_THUMB];
+    table->resolutions[RES_THUMB].res[DIM_Y_ORIG] = db_file->header.res_resized[DIM_Y_THUMB];
+    table->resolutions[RES_SMALL].res[DIM_X_ORIG] = db_file->header.res_resized[DIM_X_SMALL];
+    table->resolutions[RES_SMALL].res[DIM_Y_ORIG] = db_file->header.res_resized[DIM_Y_SMALL];
+}
+
+/********************************************************************//**
+ * Adds a named resolution to a database to create.
+ */
+int add_resolution(struct pictdb_file* db_file, const char* name, uint16_t res_x, uint16_t res_y)
+{
+    if((NULL == db_file) || (NULL == name)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct pict_resolution_table* table = &db_file->resolutions;
+    const size_t length = strlen(name);
+    if((table->nb_res >= NB_RES) || (0 == length) || (length > MAX_RES_NAME) ||
+       (0 == res_x) || (res_x > MAX_NAMED_RES) || (0 == res_y) || (res_y > MAX_NAMED_RES) ||
+       (-1 != resolution_atoi(name, db_file))) {
+        return ERR_RESOLUTIONS;
+    }
+    struct pict_resolution* resolution = &table->resolutions[table->nb_res];
+    memset(resolution->name, 0, sizeof(resolution->name));
+    strncpy(resolution->name, name, MAX_RES_NAME);
+    resolution->res[DIM_X_ORIG] = res_x;
+    resolution->res[DIM_Y_ORIG] = res_y;
+    ++table->nb_res;
+    return 0;
+}
+
+/**
+ * @brief Tells if an encoding is valid.
+ *
+ * @param encoding The encoding
+ *
+ * @return Returns non zero if the encoding is valid
+ */
+static int is_valid_encoding(const struct pict_encoding* encoding)
+{
+    return (encoding->quality >= 1) && (encoding->quality <= 100) &&
+           (0 == (encoding->flags & ~ENCODING_KNOWN_FLAGS)) && (encoding->subsample < NB_SUBSAMPLE);
+}
+
+/********************************************************************//**
+ * Sets the encoding of the resized images of a resolution.
+ */
+int set_encoding(struct pictdb_file* db_file, size_t res, const struct pict_encoding* encoding)
+{
+    if((NULL == db_file) || (NULL == encoding)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(!IS_DB_RES(db_file, res)) {
+        return ERR_RESOLUTIONS;
+    }
+    if(!is_valid_encoding(encoding)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    db_file->resolutions.resolutions[res].encoding = *encoding;
+    db_file->resolutions.resolutions[res].encoding.unused_8 = 0;
+    return 0;
+}
+
+/********************************************************************//**
+ * Reads the table of the resolutions.
+ */
+int read_resolution_table(struct pictdb_file* db_file)
+{
+    struct pict_resolution_table* table = &db_file->resolutions;
+    const long position = ftell(db_file->fpdb);
+    if((-1 == position) || (0 != fseek(db_file->fpdb, RESOLUTION_TABLE_OFFSET(db_file), SEEK_SET)) ||
+       (1 != fread(table, sizeof(struct pict_resolution_table), 1, db_file->fpdb)) ||
+       (0 != fseek(db_file->fpdb, position, SEEK_SET))) {
+        return ERR_IO;
+    }
+    if((table->nb_res < NB_DEFAULT_RES) || (table->nb_res > NB_RES)) {
+        return ERR_IO;
+    }
+    //The names are compared by resolution_atoi
+    for(size_t res = 0; res < NB_RES; ++res) {
+        table->resolutions[res].name[MAX_RES_NAME] = '\0';
+    }
+    for(size_t res = 0; res < table->nb_res; ++res) {
+        if(!is_valid_encoding(&table->resolutions[res].encoding)) {
+            return ERR_IO;
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the table of the resolutions.
+ */
+int write_resolution_table(const struct pictdb_file* db_file)
+{
+    if((0 != fseek(db_file->fpdb, RESOLUTION_TABLE_OFFSET(db_file), SEEK_SET)) ||
+       (1 != fwrite(&db_file->resolutions, sizeof(struct pict_resolution_table), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Converts a string into the wanted resolution.
+ */
+int resolution_atoi(const char* resolution, const struct pictdb_file* db_file)
+{
+    if((NULL == resolution) || (NULL == db_file)) {
+        return -1;
+    }
+    if(strcmp(resolution, "thumbnail") == 0) {
+        return RES_THUMB;
+    } else if(strcmp(resolution, "original") == 0) {
+        return RES_ORIG;
+    }
+    const struct pict_resolution_table* table = &db_file->resolutions;
+    for(size_t res = 0; res < table->nb_res; ++res) {
+        if(strcmp(resolution, table->resolutions[res].name) == 0) {
+            return (int) res;
+        }
+    }
+    return -1;
+}
+
+/********************************************************************//**
+ * Finds the smallest resolution whose images fill the given dimensions.
+ */
+size_t fit_resolution(const struct pictdb_file* db_file, uint32_t width, uint32_t height)
+{
+    const struct pict_resolution_table* table = &db_file->resolutions;
+    size_t best = RES_ORIG;
+    uint64_t best_area = UINT64_MAX;
+    for(size_t res = 0; res < table->nb_res; ++res) {
+        const uint16_t* dims = table->resolutions[res].res;
+        const uint64_t area = (uint64_t) dims[DIM_X_ORIG] * dims[DIM_Y_ORIG];
+        if((RES_ORIG != res) && (dims[DIM_X_ORIG] >= width) && (dims[DIM_Y_ORIG] >= height) && (area < best_area)) {
+            best = res;
+            best_area = area;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file scan.c
+ * @brief pictDB library: vectorized kernels implementation
+ *
+ * The SSE2 and AVX2 versions are compiled with the target attribute, so
+ * the rest of the library does not depend on the compilation flags, and
+ * only exist on x86 processors.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "scan.h"
+#include "pictDB.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Versions of the kernels for one instruction set
+ */
+struct scan_kernels {
+    size_t (*nonzero_word)(const uint64_t* words, size_t start, size_t end);
+};
+
+static const char* const ISA_NAMES[NB_SCAN_ISAS] = {
+    "scalar", "sse2", "avx2"
+};
+
+/********************************************************************//**
+ * Scalar kernels.
+ */
+static size_t nonzero_word_scalar(const uint64_t* words, size_t start, size_t end)
+{
+    while((start < end) && (0 == words[start])) {
+        ++start;
+    }
+    return start;
+}
+
+#ifdef SCAN_X86
+/********************************************************************//**
+ * SSE2 kernels: 2 words per instruction.
+ */
+__attribute__((target("sse2")))
+static size_t nonzero_word_sse2(const uint64_t* words, size_t start, size_t end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for(; start + 2 <= end; start += 2) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) &words[start]);
+        if(0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi32(v, zero))) {
+            break;
+        }
+    }
+    return nonzero_word_scalar(words, start, end);
+}
+
+/********************************************************************//**
+ * AVX2 kernels: 4 words per instruction.
+ */
+__attribute__((target("avx2")))
+static size_t nonzero_word_avx2(const uint64_t* words, size_t start, size_t end)
+{
+    for(; start + 4 <= end; start += 4) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*) &words[start]);
+        if(!_mm256_testz_si256(v, v)) {
+            break;
+        }
+    }
+    return nonzero_word_scalar(words, start, end);
+}
+#endif
+
+static const struct scan_kernels KERNELS[NB_SCAN_ISAS] = {
+    {nonzero_word_scalar},
+#ifdef SCAN_X86
+    {nonzero_word_sse2},
+    {nonzero_word_avx2}
+#else
+    {NULL},
+    {NULL}
+#endif
+};
+
+// Kernels in use, chosen at the first call
+static const struct scan_kernels* kernels = NULL;
+static enum scan_isa current_isa = SCAN_SCALAR;
+
+/**
+ * @brief Tells if the processor supports an instruction set.
+ */
+static int is_supported(enum scan_isa isa)
+{
+    switch(isa) {
+    case SCAN_SCALAR:
+        return 1;
+#ifdef SCAN_X86
+    case SCAN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case SCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Gets the kernels in use, choosing the fastest ones at the first call.
+ */
+static const struct scan_kernels* get_kernels(void)
+{
+    if(NULL == kernels) {
+        enum scan_isa isa = NB_SCAN_ISAS - 1;
+        while(!is_supported(isa)) {
+            --isa;
+        }
+        current_isa = isa;
+        kernels = &KERNELS[isa];
+    }
+    return kernels;
+}
+
+/********************************************************************//**
+ * Chooses the instruction set of the kernels.
+ */
+int scan_set_isa(enum scan_isa isa)
+{
+    if((isa >= NB_SCAN_ISAS) || !is_supported(isa)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    current_isa = isa;
+    kernels = &KERNELS[isa];
+    return 0;
+}
+
+/********************************************************************//**
+ * Gets the instruction set used by the kernels.
+ */
+enum scan_isa scan_get_isa(void)
+{
+    (void) get_kernels();
+    return current_isa;
+}
+
+/********************************************************************//**
+ * Gets the name of an instruction set.
+ */
+const char* scan_isa_name(enum scan_isa isa)
+{
+    return isa < NB_SCAN_ISAS ? ISA_NAMES[isa] : "unknown";
+}
+
+/********************************************************************//**
+ * Finds the first non-zero word of a bitset.
+ */
+size_t scan_nonzero_word(const uint64_t* words, size_t start, size_t end)
+{
+    return get_kernels()->nonzero_word(words, start, end);
+}
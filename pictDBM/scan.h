@@ -0,0 +1,64 @@
+/**
+ * @file scan.h
+ * @brief pictDB library: vectorized kernels scanning the metadata columns.
+ *
+ * Each kernel exists in a scalar, an SSE2 and an AVX2 version. The fastest
+ * version supported by the processor is chosen at the first call; the
+ * others can be forced with scan_set_isa (used by the benchmark).
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+#ifndef PICTDBPRJ_SCAN_H
+#define PICTDBPRJ_SCAN_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+/**
+ * @brief Instruction sets of the kernels
+ */
+enum scan_isa {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+    NB_SCAN_ISAS
+};
+
+/**
+ * @brief Chooses the instruction set of the kernels.
+ *
+ * @param isa The instruction set.
+ *
+ * @return Returns 0 in case of success, ERR_INVALID_ARGUMENT if the
+ * processor does not support it.
+ */
+int scan_set_isa(enum scan_isa isa);
+
+/**
+ * @brief Gets the instruction set used by the kernels.
+ *
+ * @return Returns the instruction set.
+ */
+enum scan_isa scan_get_isa(void);
+
+/**
+ * @brief Gets the name of an instruction set.
+ *
+ * @param isa The instruction set.
+ *
+ * @return Returns the name ("scalar", "sse2" or "avx2").
+ */
+const char* scan_isa_name(enum scan_isa isa);
+
+/**
+ * @brief Finds the first non-zero word of a bitset.
+ *
+ * @param words The bitset.
+ * @param start The first word to test.
+ * @param end The number of words of the bitset.
+ *
+ * @return Returns the index of the word, or end if there is none.
+ */
+size_t scan_nonzero_word(const uint64_t* words, size_t start, size_t end);
+
+#endif //PICTDBPRJ_SCAN_H
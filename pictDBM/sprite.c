@@ -0,0 +1,224 @@
+/**
+ * @file sprite.c
+ * @brief pictDB library: sprite sheets implementation
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "sprite.h"
+#include "image_content.h"
+#include <json-c/json.h>
+
+/**
+ * @brief Gets the indexes of the pictures of one page, in the order of do_list
+ *
+ * @param page Index of the page of pictures
+ * @param page_size Number of pictures per page
+ * @param indexes Array of page_size indexes to fill
+ * @param db_file The database
+ *
+ * @return Returns the number of pictures in the page
+ */
+static size_t get_page_indexes(uint32_t page, uint32_t page_size, size_t* indexes, const struct pictdb_file* db_file)
+{
+    const size_t first = (size_t) page * page_size;
+    size_t nb_valid = 0;
+    size_t nb_in_page = 0;
+    for(size_t i = next_valid_index(db_file, 0); (i < db_file->header.max_files) && (nb_in_page < page_size);
+        i = next_valid_index(db_file, i + 1)) {
+        if(nb_valid >= first) {
+            indexes[nb_in_page] = i;
+            ++nb_in_page;
+        }
+        ++nb_valid;
+    }
+    return nb_in_page;
+}
+
+/**
+ * @brief Creates the JSON coordinate map of a sprite
+ *
+ * @param pic_array JSON array of the thumbnails' coordinates (owned by the map afterwards)
+ * @param columns Number of thumbnails per row
+ * @param sprite The sprite
+ * @param db_file The database
+ *
+ * @return Returns 0 in case of success
+ */
+static int create_sprite_map(json_object* pic_array, int columns, struct pict_sprite* sprite, const struct pictdb_file* db_file)
+{
+    json_object* jobj = json_object_new_object();
+    json_object_object_add(jobj, "db_version", json_object_new_int64(sprite->db_version));
+    json_object_object_add(jobj, "page", json_object_new_int64(sprite->page));
+    json_object_object_add(jobj, "tile_width", json_object_new_int(db_file->header.res_resized[DIM_X_THUMB]));
+    json_object_object_add(jobj, "tile_height", json_object_new_int(db_file->header.res_resized[DIM_Y_THUMB]));
+    json_object_object_add(jobj, "columns", json_object_new_int(columns));
+    json_object_object_add(jobj, "Pictures", pic_array);
+    const char* s = json_object_to_json_string(jobj);
+    //copy the string bound to the json object in an other string
+    sprite->map = calloc(strlen(s) + 1, sizeof(char));
+    if(NULL != sprite->map) {
+        strcpy(sprite->map, s);
+    }
+    //free the json object
+    json_object_put(jobj);
+    return NULL == sprite->map ? ERR_OUT_OF_MEMORY : 0;
+}
+
+/********************************************************************//**
+ * Composites the thumbnails of one page of pictures into a sprite.
+ */
+int do_sprite(uint32_t page, uint32_t page_size, struct pict_sprite* sprite, struct pictdb_file* db_file)
+{
+    //In this project, pictDBM, we made the decision to return the error
+    //ERR_INVALID_ARGUMENT because we did not found a better one and
+    //because this error should not occur since the argument are already
+    //tested before the call of this function. But if this function is used
+    //in an other library, the argument should be tested
+    if((NULL == sprite) || (NULL == db_file) || (0 == page_size) || (page_size > MAX_SPRITE_PAGE_SIZE)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    sprite->db_version = db_file->header.db_version;
+    sprite->page = page;
+    sprite->page_size = page_size;
+    sprite->image = NULL;
+    sprite->image_size = 0;
+    sprite->map = NULL;
+
+    size_t* indexes = calloc(page_size, sizeof(size_t));
+    if(NULL == indexes) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const size_t nb_pict = get_page_indexes(page, page_size, indexes, db_file);
+    if(0 == nb_pict) {
+        free(indexes);
+        return ERR_INVALID_ARGUMENT;
+    }
+    for(size_t i = 0; i < nb_pict; ++i) {
+        const int errorCode = load_one_metadata(db_file, indexes[i]);
+        if(0 != errorCode) {
+            free(indexes);
+            return errorCode;
+        }
+    }
+    //The thumbnails must stay in memory until the sprite is saved
+    char** thumbs = calloc(nb_pict, sizeof(char*));
+    if(NULL == thumbs) {
+        free(indexes);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // some place to do the job
+    VipsObject* process = VIPS_OBJECT(vips_image_new());
+    // we want one thumbnail and one tile per picture, plus the sprite
+    VipsImage** images = (VipsImage**) vips_object_local_array(process, 2 * nb_pict + 1);
+    VipsImage** tiles = images + nb_pict;
+    VipsImage** result = images + 2 * nb_pict;
+
+    const int tile_width = db_file->header.res_resized[DIM_X_THUMB];
+    const int tile_height = db_file->header.res_resized[DIM_Y_THUMB];
+    const int columns = nb_pict < SPRITE_COLUMNS ? (int) nb_pict : SPRITE_COLUMNS;
+    json_object* pic_array = json_object_new_array();
+
+    int errorCode = 0;
+    for(size_t i = 0; (i < nb_pict) && (0 == errorCode); ++i) {
+        errorCode = lazily_resize(RES_THUMB, db_file, indexes[i]);
+    }
+    //The thumbnails packed in their region are read at once
+    char* span = NULL;
+    if(0 == errorCode) {
+        errorCode = read_thumb_span(indexes, nb_pict, &span, thumbs, db_file);
+    }
+    for(size_t i = 0; (i < nb_pict) && (0 == errorCode); ++i) {
+        const size_t index = indexes[i];
+        if(NULL == span) {
+            errorCode = read_db_file_image(&thumbs[i], index, RES_THUMB, db_file);
+            if(0 != errorCode) {
+                thumbs[i] = NULL;
+            }
+        }
+        if((0 == errorCode) && (0 != vips_jpegload_buffer(thumbs[i], get_pict_image_size(db_file, index, RES_THUMB), &images[i], NULL))) {
+            errorCode = ERR_VIPS;
+        }
+        //Each thumbnail is placed in the top left corner of its tile
+        if((0 == errorCode) && (0 != vips_embed(images[i], &tiles[i], 0, 0, tile_width, tile_height, NULL))) {
+            errorCode = ERR_VIPS;
+        }
+        if(0 == errorCode) {
+            json_object* pic = json_object_new_object();
+            json_object_object_add(pic, "pict_id", json_object_new_string(get_pict_id(db_file, index)));
+            json_object_object_add(pic, "x", json_object_new_int((int)(i % columns) * tile_width));
+            json_object_object_add(pic, "y", json_object_new_int((int)(i / columns) * tile_height));
+            json_object_object_add(pic, "width", json_object_new_int(images[i]->Xsize));
+            json_object_object_add(pic, "height", json_object_new_int(images[i]->Ysize));
+            json_object_array_add(pic_array, pic);
+        }
+    }
+
+    //Joins the tiles and saves the sprite into a buffer in memory
+    if((0 == errorCode) && (0 != vips_arrayjoin(tiles, result, nb_pict, "across", columns, NULL))) {
+        errorCode = ERR_VIPS;
+    }
+    if((0 == errorCode) && (0 != vips_jpegsave_buffer(*result, &sprite->image, &sprite->image_size, NULL))) {
+        errorCode = ERR_VIPS;
+    }
+    if(0 == errorCode) {
+        errorCode = create_sprite_map(pic_array, columns, sprite, db_file);
+    } else {
+        json_object_put(pic_array);
+    }
+
+    g_object_unref(process);
+    if(NULL == span) {
+        for(size_t i = 0; i < nb_pict; ++i) {
+            free(thumbs[i]);
+        }
+    }
+    free(span);
+    free(thumbs);
+    free(indexes);
+    if(0 != errorCode) {
+        free_sprite(sprite);
+    }
+    return errorCode;
+}
+
+/********************************************************************//**
+ * Gets a sprite from the cache, regenerating it if it is out of date.
+ */
+int get_cached_sprite(struct pict_sprite cache[], size_t cache_size, uint32_t page, uint32_t page_size,
+                      const struct pict_sprite** sprite, struct pictdb_file* db_file)
+{
+    if((NULL == cache) || (0 == cache_size) || (NULL == sprite) || (NULL == db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct pict_sprite* cached = &cache[page % cache_size];
+    if((NULL == cached->image) || (cached->db_version != db_file->header.db_version)
+       || (cached->page != page) || (cached->page_size != page_size)) {
+        struct pict_sprite fresh;
+        int errorCode = do_sprite(page, page_size, &fresh, db_file);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+        free_sprite(cached);
+        *cached = fresh;
+    }
+    *sprite = cached;
+    return 0;
+}
+
+/********************************************************************//**
+ * Frees the content of a sprite.
+ */
+void free_sprite(struct pict_sprite* sprite)
+{
+    if(NULL != sprite) {
+        if(NULL != sprite->image) {
+            g_free(sprite->image);
+            sprite->image = NULL;
+        }
+        free(sprite->map);
+        sprite->map = NULL;
+        sprite->image_size = 0;
+    }
+}
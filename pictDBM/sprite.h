@@ -0,0 +1,76 @@
+/**
+ * @file sprite.h
+ * @brief pictDB library: sprite sheets of thumbnails.
+ *
+ * A sprite sheet is a single JPEG image containing the thumbnails of one
+ * page of pictures, with a JSON map giving the position of each thumbnail.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+#ifndef PICTDBPRJ_SPRITE_H
+#define PICTDBPRJ_SPRITE_H
+
+#include "pictDB.h"
+
+#define DEFAULT_SPRITE_PAGE_SIZE 100 // Default number of thumbnails per sprite
+#define MAX_SPRITE_PAGE_SIZE 1000 // Max. number of thumbnails per sprite
+#define SPRITE_COLUMNS 10 // Max. number of thumbnails per row of a sprite
+
+/**
+ * @brief Structure representing a sprite sheet
+ *
+ * db_version Database's version when the sprite was generated
+ * page Index of the page of pictures
+ * page_size Number of pictures per page
+ * image The sprite in JPEG format
+ * image_size Size of the sprite (in bytes)
+ * map JSON coordinate map of the thumbnails in the sprite
+ */
+struct pict_sprite {
+    uint32_t db_version;
+    uint32_t page;
+    uint32_t page_size;
+    void* image;
+    size_t image_size;
+    char* map;
+};
+
+/**
+ * @brief Composites the thumbnails of one page of pictures into a sprite.
+ * The pictures are taken in the order of do_list. Missing thumbnails are
+ * created with lazily_resize. Each thumbnail uses a tile of the size of
+ * header.res_resized for thumbnails.
+ *
+ * @param page Index of the page of pictures
+ * @param page_size Number of pictures per page
+ * @param sprite The sprite to fill, to be freed with free_sprite
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int do_sprite(uint32_t page, uint32_t page_size, struct pict_sprite* sprite, struct pictdb_file* db_file);
+
+/**
+ * @brief Gets a sprite from a cache, regenerating it if it is missing or
+ * if the database's version changed since it was generated.
+ *
+ * @param cache Array of cache_size sprites (zero-initialized at first use)
+ * @param cache_size Number of sprites in the cache
+ * @param page Index of the page of pictures
+ * @param page_size Number of pictures per page
+ * @param sprite Pointer that will point to the sprite in the cache
+ * @param db_file In memory structure with header and metadata
+ *
+ * @return Returns 0 in case of success
+ */
+int get_cached_sprite(struct pict_sprite cache[], size_t cache_size, uint32_t page, uint32_t page_size,
+                      const struct pict_sprite** sprite, struct pictdb_file* db_file);
+
+/**
+ * @brief Frees the content of a sprite
+ *
+ * @param sprite The sprite
+ */
+void free_sprite(struct pict_sprite* sprite);
+
+#endif //PICTDBPRJ_SPRITE_H
@@ -0,0 +1,211 @@
+/**
+ * @file thumb_region.c
+ * @brief pictDB library: region of the thumbnails
+ *
+ * The thumbnails written by lazily_resize and do_gbcollect are appended to
+ * one region of the file, which is moved with a doubled capacity when it is
+ * full, like the string heap. do_gbcollect copies them in the order of the
+ * pictures, so the thumbnails of a page are next to each other and the whole
+ * set of the thumbnails stays small enough for the page cache.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "pictDB.h"
+#include "trace.h"
+
+#define THUMB_SPAN_SLACK (64 * 1024) // Bytes of other thumbnails read at most with those of a page
+
+/********************************************************************//**
+ * Reads the location of the region of the thumbnails.
+ */
+int read_thumb_region(struct pictdb_file* db_file)
+{
+    if(1 != fread(&db_file->thumbs, sizeof(struct pict_thumb_region), 1, db_file->fpdb)) {
+        return ERR_IO;
+    }
+    if(db_file->thumbs.size > db_file->thumbs.capacity) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Writes the location of the region of the thumbnails.
+ */
+int write_thumb_region_location(const struct pictdb_file* db_file)
+{
+    if((0 != fseek(db_file->fpdb, THUMB_REGION_LOCATION_OFFSET, SEEK_SET)) ||
+       (1 != fwrite(&db_file->thumbs, sizeof(struct pict_thumb_region), 1, db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies the used part of the region of the thumbnails to a new
+ * region and ends the file after it if needed.
+ *
+ * @param db_file The database
+ * @param offset The position of the new region
+ * @param capacity The capacity of the new region
+ *
+ * @return Returns 0 in case of success
+ */
+static int copy_thumb_region(const struct pictdb_file* db_file, uint64_t offset, uint64_t capacity)
+{
+    const struct pict_thumb_region* region = &db_file->thumbs;
+    char* content = NULL;
+    if(0 != region->size) {
+        content = malloc(region->size);
+        if(NULL == content) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        if((0 != fseek(db_file->fpdb, region->offset, SEEK_SET)) ||
+           (1 != fread(content, region->size, 1, db_file->fpdb)) ||
+           (0 != fseek(db_file->fpdb, offset, SEEK_SET)) ||
+           (1 != fwrite(content, region->size, 1, db_file->fpdb))) {
+            free(content);
+            return ERR_IO;
+        }
+        free(content);
+    }
+    //The last byte is written so that no picture is appended in the region
+    if((0 != fseek(db_file->fpdb, offset + capacity - 1, SEEK_SET)) || (EOF == fputc('\0', db_file->fpdb))) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Moves the region of the thumbnails with a new capacity.
+ */
+int reserve_thumb_region(struct pictdb_file* db_file, uint64_t capacity)
+{
+    if((NULL == db_file) || (0 == capacity) || (capacity < db_file->thumbs.size)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    //The offsets of the thumbnails are changed in all the blobs
+    int errorCode = load_metadata(db_file);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    uint64_t offset = 0;
+    errorCode = take_free_extent(db_file, capacity, &offset);
+    if(ERR_FULL_DATABASE == errorCode) {
+        long end = 0;
+        if((0 != fseek(db_file->fpdb, 0L, SEEK_END)) || (-1 == (end = ftell(db_file->fpdb)))) {
+            return ERR_IO;
+        }
+        offset = end;
+        errorCode = 0;
+    }
+    if(0 == errorCode) {
+        errorCode = copy_thumb_region(db_file, offset, capacity);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+
+    const struct pict_thumb_region old_region = db_file->thumbs;
+    for(size_t blob = 0; blob < db_file->header.max_files; ++blob) {
+        struct pict_blob* content = &db_file->blobs[blob];
+        if(IS_USED_BLOB(db_file, blob) && (0 != content->size[RES_THUMB]) &&
+           IS_IN_THUMB_REGION(db_file, content->offset[RES_THUMB])) {
+            content->offset[RES_THUMB] = content->offset[RES_THUMB] - old_region.offset + offset;
+        }
+    }
+    db_file->thumbs.offset = offset;
+    db_file->thumbs.capacity = capacity;
+    //The blobs reference the new region before its location is written
+    errorCode = write_blob_table(db_file);
+    if(0 == errorCode) {
+        errorCode = write_thumb_region_location(db_file);
+    }
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    //The old region is written again by the new images
+    db_file->header.dead_bytes += old_region.capacity;
+    return add_free_extent(db_file, old_region.offset, old_region.capacity);
+}
+
+/********************************************************************//**
+ * Writes a thumbnail at the end of the region of the thumbnails.
+ */
+int write_db_file_thumb(const char* image_buffer, const uint32_t image_size, long* offset, struct pictdb_file* db_file)
+{
+    struct pict_thumb_region* region = &db_file->thumbs;
+    if(region->size + image_size > region->capacity) {
+        uint64_t capacity = 2 * region->capacity;
+        if(capacity < MIN_THUMB_REGION_SIZE) {
+            capacity = MIN_THUMB_REGION_SIZE;
+        }
+        if(capacity < region->size + image_size) {
+            capacity = region->size + image_size;
+        }
+        const int errorCode = reserve_thumb_region(db_file, capacity);
+        if(0 != errorCode) {
+            return errorCode;
+        }
+    }
+    *offset = region->offset + region->size;
+    if(0 != fseek(db_file->fpdb, *offset, SEEK_SET)) {
+        return ERR_IO;
+    }
+    TRACE_BEGIN(span, "write_db_file_thumb:fwrite");
+    const int errorCode = write_disk_image(image_buffer, image_size, db_file->fpdb);
+    TRACE_END(span);
+    if(0 != errorCode) {
+        return errorCode;
+    }
+    region->size += image_size;
+    return write_thumb_region_location(db_file);
+}
+
+/********************************************************************//**
+ * Reads the thumbnails of several pictures at once.
+ */
+int read_thumb_span(const size_t indexes[], size_t nb_pict, char** span, char* thumbs[],
+                    const struct pictdb_file* db_file)
+{
+    if((NULL == indexes) || (NULL == span) || (NULL == thumbs) || (NULL == db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *span = NULL;
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+    uint64_t total = 0;
+    for(size_t i = 0; i < nb_pict; ++i) {
+        const struct pict_blob* content = get_pict_blob(db_file, indexes[i]);
+        const uint64_t offset = content->offset[RES_THUMB];
+        if((0 == content->size[RES_THUMB]) || !IS_IN_THUMB_REGION(db_file, offset)) {
+            return 0;
+        }
+        start = (offset < start) ? offset : start;
+        end = (offset + content->size[RES_THUMB] > end) ? offset + content->size[RES_THUMB] : end;
+        total += content->size[RES_THUMB];
+    }
+    //The thumbnails scattered in the region are read one by one
+    if((0 == nb_pict) || (end - start > 2 * total + THUMB_SPAN_SLACK)) {
+        return 0;
+    }
+
+    *span = malloc(end - start);
+    if(NULL == *span) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    TRACE_BEGIN(read_span, "read_thumb_span:fread");
+    const int read_failed = (0 != fseek(db_file->fpdb, start, SEEK_SET)) ||
+                            (1 != fread(*span, end - start, 1, db_file->fpdb));
+    TRACE_END(read_span);
+    if(read_failed) {
+        free(*span);
+        *span = NULL;
+        return ERR_IO;
+    }
+    for(size_t i = 0; i < nb_pict; ++i) {
+        thumbs[i] = *span + (get_pict_blob(db_file, indexes[i])->offset[RES_THUMB] - start);
+    }
+    return 0;
+}
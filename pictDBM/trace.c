@@ -0,0 +1,96 @@
+/**
+ * @file trace.c
+ * @brief pictDB library: latency tracing implementation
+ *
+ * Only compiled when tracing is enabled (make TRACE=1).
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+
+#include "trace.h"
+
+/**
+ * @brief Structure representing a recorded span
+ *
+ * seq Number of the span + 1, used to detect spans being overwritten
+ * name Name of the span
+ * start Time at which the span started (in seconds)
+ * end Time at which the span ended (in seconds)
+ * tid Identifier of the thread that recorded the span
+ */
+struct trace_event {
+    uint64_t seq;
+    const char* name;
+    double start;
+    double end;
+    uint32_t tid;
+};
+
+static struct trace_event events[TRACE_BUFFER_SIZE];
+static uint64_t next_event;
+static uint32_t next_tid;
+static __thread uint32_t thread_id;
+
+/**
+ * @brief Gets a small identifier for the calling thread.
+ *
+ * @return Returns the identifier (starting at 1).
+ */
+static uint32_t get_thread_id(void)
+{
+    if(0 == thread_id) {
+        thread_id = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+    }
+    return thread_id;
+}
+
+/********************************************************************//**
+ * Records a span in the ring buffer.
+ */
+void trace_record(const struct trace_span* span)
+{
+    const double end = metrics_now();
+    //Each writer reserves its own slot, no lock is needed
+    const uint64_t n = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+    struct trace_event* event = &events[n & (TRACE_BUFFER_SIZE - 1)];
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->name = span->name;
+    event->start = span->start;
+    event->end = end;
+    event->tid = get_thread_id();
+    __atomic_store_n(&event->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+/********************************************************************//**
+ * Writes the recorded spans in the Chrome trace JSON format.
+ */
+int trace_dump(FILE* f)
+{
+    if(NULL == f) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint64_t last = __atomic_load_n(&next_event, __ATOMIC_ACQUIRE);
+    const uint64_t first = last > TRACE_BUFFER_SIZE ? last - TRACE_BUFFER_SIZE : 0;
+
+    fprintf(f, "{\"traceEvents\":[");
+    int is_first = 1;
+    for(uint64_t n = first; n < last; ++n) {
+        const struct trace_event* event = &events[n & (TRACE_BUFFER_SIZE - 1)];
+        if(__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != n + 1) {
+            continue;
+        }
+        const struct trace_event copy = *event;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        //Skips the span if it was overwritten while being copied
+        if(__atomic_load_n(&event->seq, __ATOMIC_RELAXED) != n + 1) {
+            continue;
+        }
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%" PRIu32 "}",
+                is_first ? "" : ",", copy.name, copy.start * 1e6, (copy.end - copy.start) * 1e6, copy.tid);
+        is_first = 0;
+    }
+    fprintf(f, "\n]}\n");
+    return ferror(f) ? ERR_IO : 0;
+}
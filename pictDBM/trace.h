@@ -0,0 +1,59 @@
+/**
+ * @file trace.h
+ * @brief pictDB library: latency tracing.
+ *
+ * Spans are opened with TRACE_BEGIN and recorded with TRACE_END into a
+ * lock-free ring buffer that can be dumped in the Chrome trace format
+ * (chrome://tracing). Tracing is enabled by compiling with PICTDB_TRACE
+ * (make TRACE=1); otherwise the macros expand to nothing.
+ *
+ * @author Alexis Montavon and Dorian Laforest
+ */
+#ifndef PICTDBPRJ_TRACE_H
+#define PICTDBPRJ_TRACE_H
+
+#ifdef PICTDB_TRACE
+
+#include <stdio.h> // for FILE
+#include "metrics.h" // for metrics_now
+
+#define TRACE_BUFFER_SIZE 65536 // Number of spans kept, must be a power of 2
+
+/**
+ * @brief Structure representing an open span
+ *
+ * name Name of the span (must be a string literal)
+ * start Time at which the span started (from metrics_now)
+ */
+struct trace_span {
+    const char* name;
+    double start;
+};
+
+#define TRACE_BEGIN(span, span_name) struct trace_span span = {span_name, metrics_now()}
+#define TRACE_END(span) trace_record(&span)
+
+/**
+ * @brief Records a span in the ring buffer, overwriting the oldest one if full.
+ *
+ * @param span The span, ending now.
+ */
+void trace_record(const struct trace_span* span);
+
+/**
+ * @brief Writes the spans of the ring buffer in the Chrome trace JSON format.
+ *
+ * @param f The file to write in.
+ *
+ * @return Returns 0 in case of success
+ */
+int trace_dump(FILE* f);
+
+#else
+
+#define TRACE_BEGIN(span, span_name) do { } while(0)
+#define TRACE_END(span) do { } while(0)
+
+#endif //PICTDB_TRACE
+
+#endif //PICTDBPRJ_TRACE_H